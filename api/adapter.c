@@ -158,10 +158,26 @@ VOID AdapterCleanupOrphanedDevices(VOID)
             continue;
         }
         ULONG Status, Code;
-        if (CM_Get_DevNode_Status(&Status, &Code, DevInfoData.DevInst, 0) == CR_SUCCESS && !(Status & DN_HAS_PROBLEM))
+        CONFIGRET ConfigRet = CM_Get_DevNode_Status(&Status, &Code, DevInfoData.DevInst, 0);
+        if (ConfigRet == CR_SUCCESS && !(Status & DN_HAS_PROBLEM))
             continue;
 
+        /* Pooled adapters are disabled on purpose, for as long as the process holding them is around. */
         DEVPROPTYPE PropType;
+        OWNING_PROCESS OwningProcess;
+        if (ConfigRet == CR_SUCCESS && Code == CM_PROB_DISABLED &&
+            SetupDiGetDevicePropertyW(
+                DevInfo,
+                &DevInfoData,
+                &DEVPKEY_Wintun_OwningProcess,
+                &PropType,
+                (PBYTE)&OwningProcess,
+                sizeof(OwningProcess),
+                NULL,
+                0) &&
+            PropType == DEVPROP_TYPE_BINARY && !ProcessIsStale(&OwningProcess))
+            continue;
+
         WCHAR Name[MAX_ADAPTER_NAME] = L"<unknown>";
         SetupDiGetDevicePropertyW(
             DevInfo,
@@ -405,10 +421,180 @@ AdapterGetDeviceObjectFileName(LPCWSTR InstanceId)
     return Interfaces;
 }
 
+/* Index of adapter names to device instance IDs, so that opening an adapter need not walk every network device. An
+ * entry is only a hint: it is checked against the device before use, and the whole index is dropped whenever a
+ * network interface goes away. The index lasts as long as the module, its entries going with the module heap. */
+#define ADAPTER_INDEX_BUCKETS 256
+
+typedef struct _ADAPTER_INDEX_ENTRY
+{
+    struct _ADAPTER_INDEX_ENTRY *Next;
+    WCHAR Name[MAX_ADAPTER_NAME];
+    WCHAR DevInstanceID[MAX_DEVICE_ID_LEN];
+} ADAPTER_INDEX_ENTRY;
+
+static SRWLOCK AdapterIndexLock = SRWLOCK_INIT;
+static ADAPTER_INDEX_ENTRY *AdapterIndex[ADAPTER_INDEX_BUCKETS];
+#if NTDDI_VERSION > NTDDI_WIN7
+static HCMNOTIFICATION AdapterIndexNotification;
+#endif
+
+static DWORD
+AdapterIndexHash(_In_z_ LPCWSTR Name)
+{
+    /* Names compare case insensitively, so they hash that way too. */
+    DWORD Hash = 2166136261U;
+    for (; *Name; ++Name)
+        Hash = (Hash ^ towupper(*Name)) * 16777619U;
+    return Hash % ADAPTER_INDEX_BUCKETS;
+}
+
+static VOID
+AdapterIndexClear(VOID)
+{
+    AcquireSRWLockExclusive(&AdapterIndexLock);
+    for (DWORD i = 0; i < ADAPTER_INDEX_BUCKETS; ++i)
+    {
+        while (AdapterIndex[i])
+        {
+            ADAPTER_INDEX_ENTRY *Entry = AdapterIndex[i];
+            AdapterIndex[i] = Entry->Next;
+            Free(Entry);
+        }
+    }
+    ReleaseSRWLockExclusive(&AdapterIndexLock);
+}
+
+#if NTDDI_VERSION > NTDDI_WIN7
+static DWORD CALLBACK
+AdapterIndexNotificationCallback(
+    _In_ HCMNOTIFICATION Notify,
+    _In_opt_ PVOID Context,
+    _In_ CM_NOTIFY_ACTION Action,
+    _In_reads_bytes_(EventDataSize) PCM_NOTIFY_EVENT_DATA EventData,
+    _In_ DWORD EventDataSize)
+{
+    if (Action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL)
+        AdapterIndexClear();
+    return ERROR_SUCCESS;
+}
+#endif
+
+static VOID
+AdapterIndexInsert(_In_z_ LPCWSTR Name, _In_z_ LPCWSTR DevInstanceID)
+{
+#if NTDDI_VERSION > NTDDI_WIN7
+    /* Without notifications the index still works, as entries are checked before use, but it would collect stale
+     * entries. The notification is never unregistered, as that waits for callbacks in flight, which would deadlock
+     * under the loader lock in DllMain. The module is pinned instead, so the callback cannot outlive its code. */
+    if (!AdapterIndexNotification)
+    {
+        CM_NOTIFY_FILTER Filter = { .cbSize = sizeof(Filter),
+                                    .FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE,
+                                    .u.DeviceInterface.ClassGuid = GUID_DEVINTERFACE_NET };
+        HMODULE Module;
+        HCMNOTIFICATION Notification;
+        if (!GetModuleHandleExW(
+                GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+                (LPCWSTR)AdapterIndexNotificationCallback,
+                &Module) ||
+            CM_Register_Notification(&Filter, NULL, AdapterIndexNotificationCallback, &Notification) != CR_SUCCESS)
+            return;
+        if (InterlockedCompareExchangePointer(&AdapterIndexNotification, Notification, NULL))
+            CM_Unregister_Notification(Notification);
+    }
+#endif
+    ADAPTER_INDEX_ENTRY *NewEntry = Zalloc(sizeof(*NewEntry));
+    if (!NewEntry)
+        return;
+    wcsncpy_s(NewEntry->Name, _countof(NewEntry->Name), Name, _TRUNCATE);
+    wcsncpy_s(NewEntry->DevInstanceID, _countof(NewEntry->DevInstanceID), DevInstanceID, _TRUNCATE);
+    DWORD Bucket = AdapterIndexHash(NewEntry->Name);
+    AcquireSRWLockExclusive(&AdapterIndexLock);
+    for (ADAPTER_INDEX_ENTRY **Entry = &AdapterIndex[Bucket]; *Entry; Entry = &(*Entry)->Next)
+    {
+        if (!_wcsicmp((*Entry)->Name, NewEntry->Name))
+        {
+            ADAPTER_INDEX_ENTRY *OldEntry = *Entry;
+            *Entry = OldEntry->Next;
+            Free(OldEntry);
+            break;
+        }
+    }
+    NewEntry->Next = AdapterIndex[Bucket];
+    AdapterIndex[Bucket] = NewEntry;
+    ReleaseSRWLockExclusive(&AdapterIndexLock);
+}
+
+_Must_inspect_result_
+static _Return_type_success_(return != FALSE)
+BOOL
+AdapterIndexLookup(_In_z_ LPCWSTR Name, _Out_writes_z_(MAX_DEVICE_ID_LEN) LPWSTR DevInstanceID)
+{
+    BOOL Found = FALSE;
+    AcquireSRWLockShared(&AdapterIndexLock);
+    for (ADAPTER_INDEX_ENTRY *Entry = AdapterIndex[AdapterIndexHash(Name)]; Entry; Entry = Entry->Next)
+    {
+        if (!_wcsicmp(Entry->Name, Name))
+        {
+            wcsncpy_s(DevInstanceID, MAX_DEVICE_ID_LEN, Entry->DevInstanceID, _TRUNCATE);
+            Found = TRUE;
+            break;
+        }
+    }
+    ReleaseSRWLockShared(&AdapterIndexLock);
+    return Found;
+}
+
+_Must_inspect_result_
+static BOOL
+AdapterNameMatches(_In_ HDEVINFO DevInfo, _In_ SP_DEVINFO_DATA *DevInfoData, _In_z_ LPCWSTR Name)
+{
+    DEVPROPTYPE PropType;
+    WCHAR OtherName[MAX_ADAPTER_NAME];
+    return SetupDiGetDevicePropertyW(
+               DevInfo,
+               DevInfoData,
+               &DEVPKEY_Wintun_Name,
+               &PropType,
+               (PBYTE)OtherName,
+               MAX_ADAPTER_NAME * sizeof(OtherName[0]),
+               NULL,
+               0) &&
+           PropType == DEVPROP_TYPE_STRING && !_wcsicmp(Name, OtherName);
+}
+
+/* Opens the device an index entry points to, if it is still present and still has that name. */
+_Must_inspect_result_
+static _Return_type_success_(return != INVALID_HANDLE_VALUE)
+HDEVINFO
+OpenIndexedAdapter(
+    _In_z_ LPCWSTR Name,
+    _Out_writes_z_(MAX_DEVICE_ID_LEN) LPWSTR DevInstanceID,
+    _Out_ SP_DEVINFO_DATA *DevInfoData)
+{
+    DEVINST DevInst;
+    if (!AdapterIndexLookup(Name, DevInstanceID) ||
+        CM_Locate_DevNodeW(&DevInst, DevInstanceID, CM_LOCATE_DEVNODE_NORMAL) != CR_SUCCESS)
+        return INVALID_HANDLE_VALUE;
+    HDEVINFO DevInfo = SetupDiCreateDeviceInfoListExW(&GUID_DEVCLASS_NET, NULL, NULL, NULL);
+    if (DevInfo == INVALID_HANDLE_VALUE)
+        return INVALID_HANDLE_VALUE;
+    DevInfoData->cbSize = sizeof(*DevInfoData);
+    if (!SetupDiOpenDeviceInfoW(DevInfo, DevInstanceID, NULL, 0, DevInfoData) ||
+        !AdapterNameMatches(DevInfo, DevInfoData, Name))
+    {
+        SetupDiDestroyDeviceInfoList(DevInfo);
+        return INVALID_HANDLE_VALUE;
+    }
+    return DevInfo;
+}
+
 typedef struct _WAIT_FOR_INTERFACE_CTX
 {
     HANDLE Event;
     DWORD LastError;
+    HDEVQUERY Query;
 } WAIT_FOR_INTERFACE_CTX;
 
 static VOID WINAPI
@@ -435,14 +621,13 @@ WaitForInterfaceCallback(
     SetEvent(Ctx->Event);
 }
 
+/* Starts watching for the network interface of the device to show up, so that many devices may be waited for at
+ * once. Must be followed by EndWaitForInterface on success. */
 _Must_inspect_result_
 static _Return_type_success_(return != FALSE)
 BOOL
-WaitForInterface(_In_ WCHAR *InstanceId)
+BeginWaitForInterface(_In_ WCHAR *InstanceId, _Out_ WAIT_FOR_INTERFACE_CTX *Ctx)
 {
-    if (IsWindows7)
-        return TRUE;
-
     DWORD LastError = ERROR_SUCCESS;
     static const DEVPROP_BOOLEAN DevPropTrue = DEVPROP_TRUE;
     const DEVPROP_FILTER_EXPRESSION Filters[] = { { .Operator = DEVPROP_OPERATOR_EQUALS_IGNORE_CASE,
@@ -464,13 +649,13 @@ WaitForInterface(_In_ WCHAR *InstanceId)
                                                     .Property.Type = DEVPROP_TYPE_GUID,
                                                     .Property.Buffer = (PVOID)&GUID_DEVINTERFACE_NET,
                                                     .Property.BufferSize = sizeof(GUID_DEVINTERFACE_NET) } };
-    WAIT_FOR_INTERFACE_CTX Ctx = { .Event = CreateEventW(NULL, FALSE, FALSE, NULL) };
-    if (!Ctx.Event)
+    Ctx->LastError = ERROR_SUCCESS;
+    Ctx->Event = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (!Ctx->Event)
     {
         LastError = LOG_LAST_ERROR(L"Failed to create event");
         goto cleanup;
     }
-    HDEVQUERY Query;
     HRESULT HRet = DevCreateObjectQuery(
         DevObjectTypeDeviceInterface,
         DevQueryFlagUpdateResults,
@@ -479,14 +664,27 @@ WaitForInterface(_In_ WCHAR *InstanceId)
         _countof(Filters),
         Filters,
         WaitForInterfaceCallback,
-        &Ctx,
-        &Query);
+        Ctx,
+        &Ctx->Query);
     if (FAILED(HRet))
     {
         LastError = LOG_ERROR(HRet, L"Failed to create device query");
         goto cleanupEvent;
     }
-    LastError = WaitForSingleObject(Ctx.Event, 15000);
+    return TRUE;
+cleanupEvent:
+    CloseHandle(Ctx->Event);
+cleanup:
+    SetLastError(LastError);
+    return FALSE;
+}
+
+_Must_inspect_result_
+static _Return_type_success_(return != FALSE)
+BOOL
+EndWaitForInterface(_Inout_ WAIT_FOR_INTERFACE_CTX *Ctx, _In_ DWORD Milliseconds)
+{
+    DWORD LastError = WaitForSingleObject(Ctx->Event, Milliseconds);
     if (LastError != WAIT_OBJECT_0)
     {
         if (LastError == WAIT_FAILED)
@@ -495,17 +693,29 @@ WaitForInterface(_In_ WCHAR *InstanceId)
             LastError = LOG_ERROR(LastError, L"Timed out waiting for device query");
         goto cleanupQuery;
     }
-    LastError = Ctx.LastError;
+    LastError = Ctx->LastError;
     if (LastError != ERROR_SUCCESS)
         LastError = LOG_ERROR(LastError, L"Failed to get enabled device");
 cleanupQuery:
-    DevCloseObjectQuery(Query);
-cleanupEvent:
-    CloseHandle(Ctx.Event);
-cleanup:
+    DevCloseObjectQuery(Ctx->Query);
+    CloseHandle(Ctx->Event);
     return RET_ERROR(TRUE, LastError);
 }
 
+#define WAIT_FOR_INTERFACE_TIMEOUT 15000
+
+_Must_inspect_result_
+static _Return_type_success_(return != FALSE)
+BOOL
+WaitForInterface(_In_ WCHAR *InstanceId)
+{
+    if (IsWindows7)
+        return TRUE;
+
+    WAIT_FOR_INTERFACE_CTX Ctx;
+    return BeginWaitForInterface(InstanceId, &Ctx) && EndWaitForInterface(&Ctx, WAIT_FOR_INTERFACE_TIMEOUT);
+}
+
 typedef struct _SW_DEVICE_CREATE_CTX
 {
     HRESULT CreateResult;
@@ -527,51 +737,18 @@ DeviceCreateCallback(
     SetEvent(Ctx->Triggered);
 }
 
-_Use_decl_annotations_
-WINTUN_ADAPTER_HANDLE WINAPI
-WintunCreateAdapter(LPCWSTR Name, LPCWSTR TunnelType, const GUID *RequestedGUID)
+/* Creates the devnode of the adapter. Its network interface may not be there yet on return. */
+_Must_inspect_result_
+static _Return_type_success_(return != FALSE)
+BOOL
+CreateDevice(
+    _Inout_ WINTUN_ADAPTER *Adapter,
+    _In_z_ LPCWSTR Name,
+    _In_z_ LPCWSTR TunnelTypeName,
+    _In_opt_ const GUID *RequestedGUID,
+    _In_z_ LPCWSTR RootNodeName)
 {
     DWORD LastError = ERROR_SUCCESS;
-    WINTUN_ADAPTER *Adapter = NULL;
-
-    HANDLE DeviceInstallationMutex = NamespaceTakeDeviceInstallationMutex();
-    if (!DeviceInstallationMutex)
-    {
-        LastError = LOG_LAST_ERROR(L"Failed to take device installation mutex");
-        goto cleanup;
-    }
-
-    HDEVINFO DevInfoExistingAdapters;
-    SP_DEVINFO_DATA_LIST *ExistingAdapters;
-    if (!DriverInstall(&DevInfoExistingAdapters, &ExistingAdapters))
-    {
-        LastError = GetLastError();
-        goto cleanupDeviceInstallationMutex;
-    }
-
-    LOG(WINTUN_LOG_INFO, L"Creating adapter");
-
-    Adapter = Zalloc(sizeof(*Adapter));
-    if (!Adapter)
-        goto cleanupDriverInstall;
-
-    WCHAR TunnelTypeName[MAX_ADAPTER_NAME + 8];
-    if (_snwprintf_s(TunnelTypeName, _countof(TunnelTypeName), _TRUNCATE, L"%s Tunnel", TunnelType) == -1)
-    {
-        LastError = ERROR_BUFFER_OVERFLOW;
-        goto cleanupAdapter;
-    }
-
-    DEVINST RootNode;
-    WCHAR RootNodeName[200 /* rasmans.dll uses 200 hard coded instead of calling CM_Get_Device_ID_Size. */];
-    CONFIGRET ConfigRet;
-    if ((ConfigRet = CM_Locate_DevNodeW(&RootNode, NULL, CM_LOCATE_DEVNODE_NORMAL)) != CR_SUCCESS ||
-        (ConfigRet = CM_Get_Device_IDW(RootNode, RootNodeName, _countof(RootNodeName), 0)) != CR_SUCCESS)
-    {
-        LastError = LOG_ERROR(CM_MapCrToWin32Err(ConfigRet, ERROR_GEN_FAILURE), L"Failed to get root node name");
-        goto cleanupAdapter;
-    }
-
     GUID InstanceId;
     HRESULT HRet = S_OK;
     if (RequestedGUID)
@@ -582,24 +759,21 @@ WintunCreateAdapter(LPCWSTR Name, LPCWSTR TunnelType, const GUID *RequestedGUID)
     if (FAILED(HRet) || !StringFromGUID2(&InstanceId, InstanceIdStr, _countof(InstanceIdStr)))
     {
         LastError = LOG_ERROR(HRet, L"Failed to convert GUID");
-        goto cleanupAdapter;
+        goto cleanup;
     }
     SW_DEVICE_CREATE_CTX CreateContext = { .DeviceInstanceId = Adapter->DevInstanceID,
                                            .Triggered = CreateEventW(NULL, FALSE, FALSE, NULL) };
     if (!CreateContext.Triggered)
     {
         LastError = LOG_LAST_ERROR(L"Failed to create event trigger");
-        goto cleanupAdapter;
+        goto cleanup;
     }
 
     if (IsWindows7)
     {
         if (!CreateAdapterWin7(Adapter, Name, TunnelTypeName))
-        {
             LastError = GetLastError();
-            goto cleanupCreateContext;
-        }
-        goto skipSwDevice;
+        goto cleanupCreateContext;
     }
     if (!IsWindows10)
         goto skipStub;
@@ -681,11 +855,11 @@ skipStub:;
           .BufferSize = (ULONG)((wcslen(Name) + 1) * sizeof(*Name)) },
         { .CompKey = { .Key = DEVPKEY_Device_FriendlyName, .Store = DEVPROP_STORE_SYSTEM },
           .Type = DEVPROP_TYPE_STRING,
-          .Buffer = TunnelTypeName,
+          .Buffer = (WCHAR *)TunnelTypeName,
           .BufferSize = (ULONG)((wcslen(TunnelTypeName) + 1) * sizeof(*TunnelTypeName)) },
         { .CompKey = { .Key = DEVPKEY_Device_DeviceDesc, .Store = DEVPROP_STORE_SYSTEM },
           .Type = DEVPROP_TYPE_STRING,
-          .Buffer = TunnelTypeName,
+          .Buffer = (WCHAR *)TunnelTypeName,
           .BufferSize = (ULONG)((wcslen(TunnelTypeName) + 1) * sizeof(*TunnelTypeName)) }
     };
 
@@ -713,63 +887,75 @@ skipStub:;
         LastError = LOG_ERROR(CreateContext.CreateResult, L"Failed to create device");
         goto cleanupCreateContext;
     }
+cleanupCreateContext:
+    CloseHandle(CreateContext.Triggered);
+cleanup:
+    return RET_ERROR(TRUE, LastError);
+}
 
-    if (!WaitForInterface(Adapter->DevInstanceID))
+/* Finds out why the network interface of the adapter did not show up. */
+static DWORD
+LogDeviceProblem(_Inout_ WINTUN_ADAPTER *Adapter, _In_ DWORD LastError)
+{
+    DEVPROPTYPE PropertyType = 0;
+    NTSTATUS NtStatus = 0;
+    INT32 ProblemCode = 0;
+    Adapter->DevInfo = SetupDiCreateDeviceInfoListExW(NULL, NULL, NULL, NULL);
+    if (Adapter->DevInfo == INVALID_HANDLE_VALUE)
     {
-        LastError = GetLastError();
-        DEVPROPTYPE PropertyType = 0;
-        NTSTATUS NtStatus = 0;
-        INT32 ProblemCode = 0;
-        Adapter->DevInfo = SetupDiCreateDeviceInfoListExW(NULL, NULL, NULL, NULL);
-        if (Adapter->DevInfo == INVALID_HANDLE_VALUE)
-        {
-            Adapter->DevInfo = NULL;
-            goto cleanupCreateContext;
-        }
-        Adapter->DevInfoData.cbSize = sizeof(Adapter->DevInfoData);
-        if (!SetupDiOpenDeviceInfoW(
-                Adapter->DevInfo, Adapter->DevInstanceID, NULL, DIOD_INHERIT_CLASSDRVS, &Adapter->DevInfoData))
-        {
-            SetupDiDestroyDeviceInfoList(Adapter->DevInfo);
-            Adapter->DevInfo = NULL;
-            goto cleanupCreateContext;
-        }
-        if (!SetupDiGetDevicePropertyW(
-                Adapter->DevInfo,
-                &Adapter->DevInfoData,
-                &DEVPKEY_Device_ProblemStatus,
-                &PropertyType,
-                (PBYTE)&NtStatus,
-                sizeof(NtStatus),
-                NULL,
-                0) ||
-            PropertyType != DEVPROP_TYPE_NTSTATUS)
-            NtStatus = 0;
-        if (!SetupDiGetDevicePropertyW(
-                Adapter->DevInfo,
-                &Adapter->DevInfoData,
-                &DEVPKEY_Device_ProblemCode,
-                &PropertyType,
-                (PBYTE)&ProblemCode,
-                sizeof(ProblemCode),
-                NULL,
-                0) ||
-            (PropertyType != DEVPROP_TYPE_INT32 && PropertyType != DEVPROP_TYPE_UINT32))
-            ProblemCode = 0;
-        LastError = RtlNtStatusToDosError(NtStatus);
-        if (LastError == ERROR_SUCCESS)
-            LastError = ERROR_DEVICE_NOT_AVAILABLE;
-        LOG_ERROR(LastError, L"Failed to setup adapter (problem code: 0x%X, ntstatus: 0x%X)", ProblemCode, NtStatus);
-        goto cleanupCreateContext;
+        Adapter->DevInfo = NULL;
+        return LastError;
     }
+    Adapter->DevInfoData.cbSize = sizeof(Adapter->DevInfoData);
+    if (!SetupDiOpenDeviceInfoW(
+            Adapter->DevInfo, Adapter->DevInstanceID, NULL, DIOD_INHERIT_CLASSDRVS, &Adapter->DevInfoData))
+    {
+        SetupDiDestroyDeviceInfoList(Adapter->DevInfo);
+        Adapter->DevInfo = NULL;
+        return LastError;
+    }
+    if (!SetupDiGetDevicePropertyW(
+            Adapter->DevInfo,
+            &Adapter->DevInfoData,
+            &DEVPKEY_Device_ProblemStatus,
+            &PropertyType,
+            (PBYTE)&NtStatus,
+            sizeof(NtStatus),
+            NULL,
+            0) ||
+        PropertyType != DEVPROP_TYPE_NTSTATUS)
+        NtStatus = 0;
+    if (!SetupDiGetDevicePropertyW(
+            Adapter->DevInfo,
+            &Adapter->DevInfoData,
+            &DEVPKEY_Device_ProblemCode,
+            &PropertyType,
+            (PBYTE)&ProblemCode,
+            sizeof(ProblemCode),
+            NULL,
+            0) ||
+        (PropertyType != DEVPROP_TYPE_INT32 && PropertyType != DEVPROP_TYPE_UINT32))
+        ProblemCode = 0;
+    LastError = RtlNtStatusToDosError(NtStatus);
+    if (LastError == ERROR_SUCCESS)
+        LastError = ERROR_DEVICE_NOT_AVAILABLE;
+    LOG_ERROR(LastError, L"Failed to setup adapter (problem code: 0x%X, ntstatus: 0x%X)", ProblemCode, NtStatus);
+    return LastError;
+}
 
-skipSwDevice:
+/* Opens the adapter, once its network interface is up, and names it. */
+_Must_inspect_result_
+static _Return_type_success_(return != FALSE)
+BOOL
+FinishAdapter(_Inout_ WINTUN_ADAPTER *Adapter, _In_z_ LPCWSTR Name, _In_z_ LPCWSTR TunnelTypeName)
+{
+    DWORD LastError = ERROR_SUCCESS;
     Adapter->DevInfo = SetupDiCreateDeviceInfoListExW(&GUID_DEVCLASS_NET, NULL, NULL, NULL);
     if (Adapter->DevInfo == INVALID_HANDLE_VALUE)
     {
         Adapter->DevInfo = NULL;
         LastError = LOG_LAST_ERROR(L"Failed to make device list");
-        goto cleanupCreateContext;
+        goto cleanup;
     }
     Adapter->DevInfoData.cbSize = sizeof(Adapter->DevInfoData);
     if (!SetupDiOpenDeviceInfoW(
@@ -778,39 +964,525 @@ skipSwDevice:
         LastError = LOG_LAST_ERROR(L"Failed to open device instance ID %s", Adapter->DevInstanceID);
         SetupDiDestroyDeviceInfoList(Adapter->DevInfo);
         Adapter->DevInfo = NULL;
-        goto cleanupCreateContext;
+        goto cleanup;
     }
 
     if (!PopulateAdapterData(Adapter))
     {
         LastError = LOG(WINTUN_LOG_ERR, L"Failed to populate adapter data");
-        goto cleanupCreateContext;
+        goto cleanup;
     }
 
     if (!NciSetAdapterName(&Adapter->CfgInstanceID, Name))
     {
         LastError = LOG(WINTUN_LOG_ERR, L"Failed to set adapter name \"%s\"", Name);
-        goto cleanupCreateContext;
+        goto cleanup;
     }
 
     if (IsWindows7)
         CreateAdapterPostWin7(Adapter, TunnelTypeName);
+    AdapterIndexInsert(Name, Adapter->DevInstanceID);
+cleanup:
+    return RET_ERROR(TRUE, LastError);
+}
 
-cleanupCreateContext:
-    CloseHandle(CreateContext.Triggered);
-cleanupAdapter:
-    if (LastError != ERROR_SUCCESS)
+typedef struct _CREATE_ADAPTER_CTX
+{
+    WINTUN_ADAPTER *Adapter;
+    WCHAR TunnelTypeName[MAX_ADAPTER_NAME + 8];
+    WAIT_FOR_INTERFACE_CTX Wait;
+    DWORD LastError;
+} CREATE_ADAPTER_CTX;
+
+/* Creates a batch of adapters. The driver is installed once, the installation mutex is only held while creating the
+ * devnodes and while naming the adapters, and the network interfaces are waited for all at once. Fills Ctxs with the
+ * outcome of each request, and fails only when none could be attempted. */
+_Must_inspect_result_
+static _Return_type_success_(return != FALSE)
+BOOL
+CreateAdapters(
+    _In_reads_(Count) const WINTUN_CREATE_ADAPTER_REQUEST *Requests,
+    _In_ DWORD Count,
+    _Out_writes_(Count) CREATE_ADAPTER_CTX *Ctxs)
+{
+    DWORD LastError = ERROR_SUCCESS;
+    ZeroMemory(Ctxs, sizeof(*Ctxs) * Count);
+
+    HANDLE DeviceInstallationMutex = NamespaceTakeDeviceInstallationMutex();
+    if (!DeviceInstallationMutex)
     {
-        WintunCloseAdapter(Adapter);
-        Adapter = NULL;
+        LastError = LOG_LAST_ERROR(L"Failed to take device installation mutex");
+        goto cleanup;
     }
+
+    HDEVINFO DevInfoExistingAdapters;
+    SP_DEVINFO_DATA_LIST *ExistingAdapters;
+    if (!DriverInstall(&DevInfoExistingAdapters, &ExistingAdapters))
+    {
+        LastError = GetLastError();
+        goto cleanupDeviceInstallationMutex;
+    }
+
+    DEVINST RootNode;
+    WCHAR RootNodeName[200 /* rasmans.dll uses 200 hard coded instead of calling CM_Get_Device_ID_Size. */];
+    CONFIGRET ConfigRet;
+    if ((ConfigRet = CM_Locate_DevNodeW(&RootNode, NULL, CM_LOCATE_DEVNODE_NORMAL)) != CR_SUCCESS ||
+        (ConfigRet = CM_Get_Device_IDW(RootNode, RootNodeName, _countof(RootNodeName), 0)) != CR_SUCCESS)
+    {
+        LastError = LOG_ERROR(CM_MapCrToWin32Err(ConfigRet, ERROR_GEN_FAILURE), L"Failed to get root node name");
+        goto cleanupDriverInstall;
+    }
+
+    for (DWORD i = 0; i < Count; ++i)
+    {
+        CREATE_ADAPTER_CTX *Ctx = &Ctxs[i];
+        LOG(WINTUN_LOG_INFO, L"Creating adapter");
+        if (_snwprintf_s(
+                Ctx->TunnelTypeName, _countof(Ctx->TunnelTypeName), _TRUNCATE, L"%s Tunnel", Requests[i].TunnelType) ==
+            -1)
+        {
+            Ctx->LastError = ERROR_BUFFER_OVERFLOW;
+            continue;
+        }
+        Ctx->Adapter = Zalloc(sizeof(*Ctx->Adapter));
+        if (!Ctx->Adapter)
+        {
+            Ctx->LastError = GetLastError();
+            continue;
+        }
+        if (!CreateDevice(
+                Ctx->Adapter, Requests[i].Name, Ctx->TunnelTypeName, Requests[i].RequestedGUID, RootNodeName))
+            Ctx->LastError = GetLastError();
+    }
+    DriverInstallDeferredCleanup(DevInfoExistingAdapters, ExistingAdapters);
+    NamespaceReleaseMutex(DeviceInstallationMutex);
+
+    if (!IsWindows7)
+    {
+        for (DWORD i = 0; i < Count; ++i)
+        {
+            if (Ctxs[i].LastError == ERROR_SUCCESS &&
+                !BeginWaitForInterface(Ctxs[i].Adapter->DevInstanceID, &Ctxs[i].Wait))
+                Ctxs[i].LastError = LogDeviceProblem(Ctxs[i].Adapter, GetLastError());
+        }
+        /* All interfaces have been coming up since their queries started, so they share one timeout. */
+        ULONGLONG Deadline = GetTickCount64() + WAIT_FOR_INTERFACE_TIMEOUT;
+        for (DWORD i = 0; i < Count; ++i)
+        {
+            if (Ctxs[i].LastError != ERROR_SUCCESS)
+                continue;
+            ULONGLONG Now = GetTickCount64();
+            if (!EndWaitForInterface(&Ctxs[i].Wait, Now < Deadline ? (DWORD)(Deadline - Now) : 0))
+                Ctxs[i].LastError = LogDeviceProblem(Ctxs[i].Adapter, GetLastError());
+        }
+    }
+
+    DeviceInstallationMutex = NamespaceTakeDeviceInstallationMutex();
+    if (!DeviceInstallationMutex)
+        LastError = LOG_LAST_ERROR(L"Failed to take device installation mutex");
+    for (DWORD i = 0; i < Count; ++i)
+    {
+        CREATE_ADAPTER_CTX *Ctx = &Ctxs[i];
+        if (Ctx->LastError == ERROR_SUCCESS)
+        {
+            if (LastError != ERROR_SUCCESS)
+                Ctx->LastError = LastError;
+            else if (!FinishAdapter(Ctx->Adapter, Requests[i].Name, Ctx->TunnelTypeName))
+                Ctx->LastError = GetLastError();
+        }
+        if (Ctx->LastError != ERROR_SUCCESS)
+        {
+            WintunCloseAdapter(Ctx->Adapter);
+            Ctx->Adapter = NULL;
+        }
+    }
+    if (DeviceInstallationMutex)
+        NamespaceReleaseMutex(DeviceInstallationMutex);
+    QueueUpOrphanedDeviceCleanupRoutine();
+    return TRUE;
+
 cleanupDriverInstall:
     DriverInstallDeferredCleanup(DevInfoExistingAdapters, ExistingAdapters);
 cleanupDeviceInstallationMutex:
     NamespaceReleaseMutex(DeviceInstallationMutex);
 cleanup:
     QueueUpOrphanedDeviceCleanupRoutine();
-    return RET_ERROR(Adapter, LastError);
+    SetLastError(LastError);
+    return FALSE;
+}
+
+_Use_decl_annotations_
+WINTUN_ADAPTER_HANDLE WINAPI
+WintunCreateAdapter(LPCWSTR Name, LPCWSTR TunnelType, const GUID *RequestedGUID)
+{
+    const WINTUN_CREATE_ADAPTER_REQUEST Request = { .Name = Name,
+                                                    .TunnelType = TunnelType,
+                                                    .RequestedGUID = RequestedGUID };
+    CREATE_ADAPTER_CTX Ctx;
+    if (!CreateAdapters(&Request, 1, &Ctx))
+        return NULL;
+    return RET_ERROR(Ctx.Adapter, Ctx.LastError);
+}
+
+typedef struct _CREATE_ADAPTERS_ASYNC_CTX
+{
+    WINTUN_CREATE_ADAPTER_CALLBACK *Callback;
+    VOID *Context;
+    DWORD Count;
+    WINTUN_CREATE_ADAPTER_REQUEST *Requests;
+    GUID *RequestedGUIDs;
+    CREATE_ADAPTER_CTX *Ctxs;
+} CREATE_ADAPTERS_ASYNC_CTX;
+
+static DWORD WINAPI
+CreateAdaptersAsyncWorker(_In_ LPVOID Context)
+{
+    CREATE_ADAPTERS_ASYNC_CTX *Async = Context;
+    if (!CreateAdapters(Async->Requests, Async->Count, Async->Ctxs))
+    {
+        DWORD LastError = GetLastError();
+        for (DWORD i = 0; i < Async->Count; ++i)
+            Async->Ctxs[i] = (CREATE_ADAPTER_CTX){ .LastError = LastError };
+    }
+    for (DWORD i = 0; i < Async->Count; ++i)
+        Async->Callback(Async->Context, i, Async->Ctxs[i].Adapter, Async->Ctxs[i].LastError);
+    for (DWORD i = 0; i < Async->Count; ++i)
+    {
+        Free((VOID *)Async->Requests[i].Name);
+        Free((VOID *)Async->Requests[i].TunnelType);
+    }
+    Free(Async->Ctxs);
+    Free(Async->RequestedGUIDs);
+    Free(Async->Requests);
+    Free(Async);
+    return 0;
+}
+
+static _Return_type_success_(return != NULL)
+_Post_maybenull_
+LPWSTR
+DuplicateString(_In_z_ LPCWSTR String)
+{
+    SIZE_T Size = (wcslen(String) + 1) * sizeof(*String);
+    LPWSTR Copy = Alloc(Size);
+    if (Copy)
+        memcpy(Copy, String, Size);
+    return Copy;
+}
+
+_Use_decl_annotations_
+BOOL WINAPI
+WintunCreateAdaptersAsync(
+    const WINTUN_CREATE_ADAPTER_REQUEST *Requests,
+    DWORD Count,
+    WINTUN_CREATE_ADAPTER_CALLBACK *Callback,
+    VOID *Context)
+{
+    DWORD LastError = ERROR_SUCCESS;
+    if (!Count || !Callback)
+    {
+        LastError = ERROR_INVALID_PARAMETER;
+        goto cleanup;
+    }
+    CREATE_ADAPTERS_ASYNC_CTX *Async = Zalloc(sizeof(*Async));
+    if (!Async)
+    {
+        LastError = GetLastError();
+        goto cleanup;
+    }
+    Async->Callback = Callback;
+    Async->Context = Context;
+    Async->Requests = ZallocArray(Count, sizeof(*Async->Requests));
+    Async->RequestedGUIDs = ZallocArray(Count, sizeof(*Async->RequestedGUIDs));
+    Async->Ctxs = ZallocArray(Count, sizeof(*Async->Ctxs));
+    if (!Async->Requests || !Async->RequestedGUIDs || !Async->Ctxs)
+    {
+        LastError = GetLastError();
+        goto cleanupAsync;
+    }
+    /* The caller's strings need not outlive the call. */
+    for (; Async->Count < Count; ++Async->Count)
+    {
+        WINTUN_CREATE_ADAPTER_REQUEST *Request = &Async->Requests[Async->Count];
+        Request->Name = DuplicateString(Requests[Async->Count].Name);
+        Request->TunnelType = DuplicateString(Requests[Async->Count].TunnelType);
+        if (!Request->Name || !Request->TunnelType)
+        {
+            LastError = GetLastError();
+            ++Async->Count;
+            goto cleanupAsync;
+        }
+        if (Requests[Async->Count].RequestedGUID)
+        {
+            Async->RequestedGUIDs[Async->Count] = *Requests[Async->Count].RequestedGUID;
+            Request->RequestedGUID = &Async->RequestedGUIDs[Async->Count];
+        }
+    }
+    if (!QueueUserWorkItem(CreateAdaptersAsyncWorker, Async, WT_EXECUTELONGFUNCTION))
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to queue adapter creation");
+        goto cleanupAsync;
+    }
+    return TRUE;
+cleanupAsync:
+    if (Async->Requests)
+    {
+        for (DWORD i = 0; i < Async->Count; ++i)
+        {
+            Free((VOID *)Async->Requests[i].Name);
+            Free((VOID *)Async->Requests[i].TunnelType);
+        }
+    }
+    Free(Async->Ctxs);
+    Free(Async->RequestedGUIDs);
+    Free(Async->Requests);
+    Free(Async);
+cleanup:
+    SetLastError(LastError);
+    return FALSE;
+}
+
+typedef struct _WINTUN_ADAPTER_POOL
+{
+    SRWLOCK Lock;
+    WCHAR TunnelType[MAX_ADAPTER_NAME];
+    DWORD Size;
+    DWORD Count;
+    BOOL Refilling;
+    BOOL Closing;
+    HANDLE Refilled;
+    WINTUN_ADAPTER *Adapters[];
+} WINTUN_ADAPTER_POOL;
+
+/* Parks a freshly created adapter in the pool. It is marked with our process so that the orphan cleanup leaves it be
+ * while disabled. */
+_Must_inspect_result_
+static _Return_type_success_(return != FALSE)
+BOOL
+ParkAdapter(_Inout_ WINTUN_ADAPTER *Adapter)
+{
+    OWNING_PROCESS OwningProcess = { .ProcessId = GetCurrentProcessId() };
+    FILETIME Unused;
+    if (!GetProcessTimes(GetCurrentProcess(), &OwningProcess.CreationTime, &Unused, &Unused, &Unused))
+        return FALSE;
+    if (!SetupDiSetDevicePropertyW(
+            Adapter->DevInfo,
+            &Adapter->DevInfoData,
+            &DEVPKEY_Wintun_OwningProcess,
+            DEVPROP_TYPE_BINARY,
+            (PBYTE)&OwningProcess,
+            sizeof(OwningProcess),
+            0))
+        return FALSE;
+    return AdapterDisableInstance(Adapter->DevInfo, &Adapter->DevInfoData);
+}
+
+_Must_inspect_result_
+static _Return_type_success_(return != FALSE)
+BOOL
+FillAdapterPool(_Inout_ WINTUN_ADAPTER_POOL *Pool, _In_ DWORD Missing)
+{
+    static volatile LONG PooledAdapterCounter;
+    DWORD LastError = ERROR_SUCCESS;
+    WINTUN_CREATE_ADAPTER_REQUEST *Requests = ZallocArray(Missing, sizeof(*Requests));
+    WCHAR(*Names)[MAX_ADAPTER_NAME] = AllocArray(Missing, sizeof(*Names));
+    CREATE_ADAPTER_CTX *Ctxs = AllocArray(Missing, sizeof(*Ctxs));
+    if (!Requests || !Names || !Ctxs)
+    {
+        LastError = GetLastError();
+        goto cleanup;
+    }
+    for (DWORD i = 0; i < Missing; ++i)
+    {
+        /* Unique placeholders, so that naming does not have to shuffle suffixes around. */
+        _snwprintf_s(
+            Names[i],
+            _countof(Names[i]),
+            _TRUNCATE,
+            L"Pool %u.%u %s",
+            GetCurrentProcessId(),
+            (ULONG)InterlockedIncrement(&PooledAdapterCounter),
+            Pool->TunnelType);
+        Requests[i].Name = Names[i];
+        Requests[i].TunnelType = Pool->TunnelType;
+    }
+    if (!CreateAdapters(Requests, Missing, Ctxs))
+    {
+        LastError = GetLastError();
+        goto cleanup;
+    }
+    for (DWORD i = 0; i < Missing; ++i)
+    {
+        if (Ctxs[i].LastError != ERROR_SUCCESS)
+        {
+            LastError = Ctxs[i].LastError;
+            continue;
+        }
+        if (!ParkAdapter(Ctxs[i].Adapter))
+        {
+            LastError = LOG_LAST_ERROR(L"Failed to park pooled adapter");
+            WintunCloseAdapter(Ctxs[i].Adapter);
+            continue;
+        }
+        AcquireSRWLockExclusive(&Pool->Lock);
+        Pool->Adapters[Pool->Count++] = Ctxs[i].Adapter;
+        ReleaseSRWLockExclusive(&Pool->Lock);
+    }
+cleanup:
+    Free(Ctxs);
+    Free(Names);
+    Free(Requests);
+    return RET_ERROR(TRUE, LastError);
+}
+
+static DWORD WINAPI
+DoAdapterPoolRefill(_In_ LPVOID Context)
+{
+    WINTUN_ADAPTER_POOL *Pool = Context;
+    for (;;)
+    {
+        AcquireSRWLockExclusive(&Pool->Lock);
+        DWORD Missing = Pool->Closing ? 0 : Pool->Size - Pool->Count;
+        ReleaseSRWLockExclusive(&Pool->Lock);
+        /* Stop at the first failure rather than spinning on a host that cannot create adapters right now. The next
+         * claim tries again. */
+        if (!Missing || !FillAdapterPool(Pool, Missing))
+            break;
+    }
+    AcquireSRWLockExclusive(&Pool->Lock);
+    Pool->Refilling = FALSE;
+    SetEvent(Pool->Refilled);
+    ReleaseSRWLockExclusive(&Pool->Lock);
+    return 0;
+}
+
+static VOID
+QueueUpAdapterPoolRefill(_Inout_ WINTUN_ADAPTER_POOL *Pool)
+{
+    AcquireSRWLockExclusive(&Pool->Lock);
+    if (!Pool->Refilling && !Pool->Closing && Pool->Count < Pool->Size)
+    {
+        Pool->Refilling = TRUE;
+        ResetEvent(Pool->Refilled);
+        if (!QueueUserWorkItem(DoAdapterPoolRefill, Pool, WT_EXECUTELONGFUNCTION))
+        {
+            Pool->Refilling = FALSE;
+            SetEvent(Pool->Refilled);
+        }
+    }
+    ReleaseSRWLockExclusive(&Pool->Lock);
+}
+
+_Use_decl_annotations_
+WINTUN_ADAPTER_POOL_HANDLE WINAPI
+WintunCreateAdapterPool(LPCWSTR TunnelType, DWORD Size)
+{
+    DWORD LastError = ERROR_SUCCESS;
+    if (!Size || Size > WINTUN_MAX_POOL_SIZE)
+    {
+        LastError = ERROR_INVALID_PARAMETER;
+        goto cleanup;
+    }
+    WINTUN_ADAPTER_POOL *Pool = Zalloc(sizeof(*Pool) + sizeof(*Pool->Adapters) * Size);
+    if (!Pool)
+    {
+        LastError = GetLastError();
+        goto cleanup;
+    }
+    if (wcsncpy_s(Pool->TunnelType, _countof(Pool->TunnelType), TunnelType, _TRUNCATE) == STRUNCATE)
+    {
+        LastError = ERROR_BUFFER_OVERFLOW;
+        goto cleanupPool;
+    }
+    InitializeSRWLock(&Pool->Lock);
+    Pool->Size = Size;
+    Pool->Refilled = CreateEventW(NULL, TRUE, TRUE, NULL);
+    if (!Pool->Refilled)
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to create event");
+        goto cleanupPool;
+    }
+    QueueUpAdapterPoolRefill(Pool);
+    return Pool;
+cleanupPool:
+    Free(Pool);
+cleanup:
+    SetLastError(LastError);
+    return NULL;
+}
+
+_Use_decl_annotations_
+WINTUN_ADAPTER_HANDLE WINAPI
+WintunClaimPooledAdapter(WINTUN_ADAPTER_POOL *Pool, LPCWSTR Name)
+{
+    DWORD LastError = ERROR_SUCCESS;
+    AcquireSRWLockExclusive(&Pool->Lock);
+    WINTUN_ADAPTER *Adapter = Pool->Count ? Pool->Adapters[--Pool->Count] : NULL;
+    ReleaseSRWLockExclusive(&Pool->Lock);
+    QueueUpAdapterPoolRefill(Pool);
+    if (!Adapter)
+    {
+        LOG(WINTUN_LOG_WARN, L"Adapter pool is empty, creating adapter");
+        return WintunCreateAdapter(Name, Pool->TunnelType, NULL);
+    }
+
+    if (!AdapterEnableInstance(Adapter->DevInfo, &Adapter->DevInfoData))
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to enable pooled adapter");
+        goto cleanupAdapter;
+    }
+    if (!WaitForInterface(Adapter->DevInstanceID))
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to wait for pooled adapter");
+        goto cleanupAdapter;
+    }
+    /* The interface may come back with a new device object, so look everything up again. */
+    Free(Adapter->InterfaceFilename);
+    Adapter->InterfaceFilename = NULL;
+    if (!PopulateAdapterData(Adapter))
+    {
+        LastError = LOG(WINTUN_LOG_ERR, L"Failed to populate adapter data");
+        goto cleanupAdapter;
+    }
+    if (!SetupDiSetDevicePropertyW(
+            Adapter->DevInfo,
+            &Adapter->DevInfoData,
+            &DEVPKEY_Wintun_Name,
+            DEVPROP_TYPE_STRING,
+            (PBYTE)Name,
+            (DWORD)((wcslen(Name) + 1) * sizeof(Name[0])),
+            0))
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to set adapter name property");
+        goto cleanupAdapter;
+    }
+    if (!NciSetAdapterName(&Adapter->CfgInstanceID, Name))
+    {
+        LastError = LOG(WINTUN_LOG_ERR, L"Failed to set adapter name \"%s\"", Name);
+        goto cleanupAdapter;
+    }
+    AdapterIndexInsert(Name, Adapter->DevInstanceID);
+    return Adapter;
+cleanupAdapter:
+    WintunCloseAdapter(Adapter);
+    SetLastError(LastError);
+    return NULL;
+}
+
+_Use_decl_annotations_
+VOID WINAPI
+WintunDeleteAdapterPool(WINTUN_ADAPTER_POOL *Pool)
+{
+    if (!Pool)
+        return;
+    AcquireSRWLockExclusive(&Pool->Lock);
+    Pool->Closing = TRUE;
+    ReleaseSRWLockExclusive(&Pool->Lock);
+    WaitForSingleObject(Pool->Refilled, INFINITE);
+    for (DWORD i = 0; i < Pool->Count; ++i)
+        WintunCloseAdapter(Pool->Adapters[i]);
+    CloseHandle(Pool->Refilled);
+    Free(Pool);
 }
 
 _Use_decl_annotations_
@@ -831,15 +1503,19 @@ WintunOpenAdapter(LPCWSTR Name)
     if (!Adapter)
         goto cleanupDeviceInstallationMutex;
 
-    HDEVINFO DevInfo =
-        SetupDiGetClassDevsExW(&GUID_DEVCLASS_NET, WINTUN_ENUMERATOR, NULL, DIGCF_PRESENT, NULL, NULL, NULL);
+    SP_DEVINFO_DATA DevInfoData;
+    HDEVINFO DevInfo = OpenIndexedAdapter(Name, Adapter->DevInstanceID, &DevInfoData);
+    if (DevInfo != INVALID_HANDLE_VALUE)
+        goto foundAdapter;
+
+    DevInfo = SetupDiGetClassDevsExW(&GUID_DEVCLASS_NET, WINTUN_ENUMERATOR, NULL, DIGCF_PRESENT, NULL, NULL, NULL);
     if (DevInfo == INVALID_HANDLE_VALUE)
     {
         LastError = LOG_LAST_ERROR(L"Failed to get present adapters");
         goto cleanupAdapter;
     }
 
-    SP_DEVINFO_DATA DevInfoData = { .cbSize = sizeof(DevInfoData) };
+    DevInfoData.cbSize = sizeof(DevInfoData);
     BOOL Found = FALSE;
     for (DWORD EnumIndex = 0; !Found; ++EnumIndex)
     {
@@ -849,19 +1525,7 @@ WintunOpenAdapter(LPCWSTR Name)
                 break;
             continue;
         }
-
-        DEVPROPTYPE PropType;
-        WCHAR OtherName[MAX_ADAPTER_NAME];
-        Found = SetupDiGetDevicePropertyW(
-                    DevInfo,
-                    &DevInfoData,
-                    &DEVPKEY_Wintun_Name,
-                    &PropType,
-                    (PBYTE)OtherName,
-                    MAX_ADAPTER_NAME * sizeof(OtherName[0]),
-                    NULL,
-                    0) &&
-                PropType == DEVPROP_TYPE_STRING && !_wcsicmp(Name, OtherName);
+        Found = AdapterNameMatches(DevInfo, &DevInfoData, Name);
     }
     if (!Found)
     {
@@ -874,6 +1538,9 @@ WintunOpenAdapter(LPCWSTR Name)
         LastError = LOG_LAST_ERROR(L"Failed to get adapter instance ID");
         goto cleanupDevInfo;
     }
+    AdapterIndexInsert(Name, Adapter->DevInstanceID);
+
+foundAdapter:
     Adapter->DevInfo = DevInfo;
     Adapter->DevInfoData = DevInfoData;
     BOOL Ret = WaitForInterface(Adapter->DevInstanceID) && PopulateAdapterData(Adapter);
@@ -38,6 +38,26 @@ typedef struct _WINTUN_ADAPTER
  */
 WINTUN_CREATE_ADAPTER_FUNC WintunCreateAdapter;
 
+/**
+ * @copydoc WINTUN_CREATE_ADAPTERS_ASYNC_FUNC
+ */
+WINTUN_CREATE_ADAPTERS_ASYNC_FUNC WintunCreateAdaptersAsync;
+
+/**
+ * @copydoc WINTUN_CREATE_ADAPTER_POOL_FUNC
+ */
+WINTUN_CREATE_ADAPTER_POOL_FUNC WintunCreateAdapterPool;
+
+/**
+ * @copydoc WINTUN_CLAIM_POOLED_ADAPTER_FUNC
+ */
+WINTUN_CLAIM_POOLED_ADAPTER_FUNC WintunClaimPooledAdapter;
+
+/**
+ * @copydoc WINTUN_DELETE_ADAPTER_POOL_FUNC
+ */
+WINTUN_DELETE_ADAPTER_POOL_FUNC WintunDeleteAdapterPool;
+
 /**
  * @copydoc WINTUN_OPEN_ADAPTER_FUNC
  */
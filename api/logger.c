@@ -20,6 +20,41 @@ NopLogger(_In_ WINTUN_LOGGER_LEVEL Level, _In_ DWORD64 Timestamp, _In_z_ LPCWSTR
 
 WINTUN_LOGGER_CALLBACK Logger = NopLogger;
 
+TRACELOGGING_DEFINE_PROVIDER(
+    TraceProvider,
+    "WireGuard.Wintun",
+    (0x4cde0898, 0x3b76, 0x5f71, 0x63, 0x7e, 0x2c, 0xbc, 0x42, 0xcd, 0xd1, 0x63));
+static volatile LONG LoggerMinLevel = WINTUN_LOG_INFO;
+static SRWLOCK LoggerConfigLock = SRWLOCK_INIT;
+
+/* Records are claimed from the ring by any thread, formatted in place, and handed to Logger in order by a single
+ * thread. Lookups of system error messages, which are the most expensive part of logging, happen on that thread too. */
+#define LOG_RING_CAPACITY 0x100
+#define LOG_LINE_CHARS 0x400
+
+typedef struct _LOG_RECORD
+{
+    volatile LONG Sequence;
+    WINTUN_LOGGER_LEVEL Level;
+    BOOL IsError;
+    DWORD Error;
+    DWORD64 Timestamp;
+    WCHAR LogLine[LOG_LINE_CHARS];
+} LOG_RECORD;
+
+static struct
+{
+    LOG_RECORD *Records;
+    volatile LONG Tail;
+    ULONG Head;
+    volatile LONG Enabled;
+    volatile LONG Writers;
+    volatile LONG Stop;
+    volatile LONG Dropped;
+    HANDLE Event;
+    HANDLE Thread;
+} LogRing;
+
 static DWORD64 Now(VOID)
 {
     LARGE_INTEGER Timestamp;
@@ -27,48 +62,56 @@ static DWORD64 Now(VOID)
     return Timestamp.QuadPart;
 }
 
-_Use_decl_annotations_
-VOID WINAPI
-WintunSetLogger(WINTUN_LOGGER_CALLBACK NewLogger)
+static BOOL
+LoggerWants(_In_ WINTUN_LOGGER_LEVEL Level)
 {
-    if (!NewLogger)
-        NewLogger = NopLogger;
-    Logger = NewLogger;
+    return Logger != NopLogger && (LONG)Level >= LoggerMinLevel;
 }
 
-static VOID
-StrTruncate(_Inout_count_(StrChars) LPWSTR Str, _In_ SIZE_T StrChars)
+_Must_inspect_result_
+static _Return_type_success_(return != NULL)
+_Post_maybenull_
+LOG_RECORD *
+LogRingClaim(VOID)
 {
-    Str[StrChars - 2] = L'\u2026'; /* Horizontal Ellipsis */
-    Str[StrChars - 1] = 0;
+    ULONG Pos = (ULONG)ReadAcquire(&LogRing.Tail);
+    for (;;)
+    {
+        LOG_RECORD *Record = &LogRing.Records[Pos & (LOG_RING_CAPACITY - 1)];
+        LONG Diff = (LONG)((ULONG)ReadAcquire(&Record->Sequence) - Pos);
+        if (!Diff)
+        {
+            ULONG Prev = (ULONG)InterlockedCompareExchange(&LogRing.Tail, (LONG)(Pos + 1), (LONG)Pos);
+            if (Prev == Pos)
+                return Record;
+            Pos = Prev;
+        }
+        else if (Diff < 0)
+        {
+            InterlockedIncrement(&LogRing.Dropped);
+            return NULL;
+        }
+        else
+            Pos = (ULONG)ReadAcquire(&LogRing.Tail);
+    }
 }
 
-_Use_decl_annotations_
-DWORD
-LoggerLog(WINTUN_LOGGER_LEVEL Level, LPCWSTR LogLine)
+static VOID
+LogRingPublish(_Inout_ LOG_RECORD *Record)
 {
-    DWORD LastError = GetLastError();
-    Logger(Level, Now(), LogLine);
-    SetLastError(LastError);
-    return LastError;
+    WriteRelease(&Record->Sequence, Record->Sequence + 1);
+    SetEvent(LogRing.Event);
 }
 
-_Use_decl_annotations_
-DWORD
-LoggerLogV(WINTUN_LOGGER_LEVEL Level, LPCWSTR Format, va_list Args)
+static VOID
+StrTruncate(_Inout_count_(StrChars) LPWSTR Str, _In_ SIZE_T StrChars)
 {
-    DWORD LastError = GetLastError();
-    WCHAR LogLine[0x400];
-    if (_vsnwprintf_s(LogLine, _countof(LogLine), _TRUNCATE, Format, Args) == -1)
-        StrTruncate(LogLine, _countof(LogLine));
-    Logger(Level, Now(), LogLine);
-    SetLastError(LastError);
-    return LastError;
+    Str[StrChars - 2] = L'\u2026'; /* Horizontal Ellipsis */
+    Str[StrChars - 1] = 0;
 }
 
-_Use_decl_annotations_
-DWORD
-LoggerError(DWORD Error, LPCWSTR Prefix)
+static VOID
+DeliverError(_In_ DWORD64 Timestamp, _In_ DWORD Error, _In_z_ LPCWSTR Prefix)
 {
     LPWSTR SystemMessage = NULL, FormattedMessage = NULL;
     FormatMessageW(
@@ -89,9 +132,223 @@ LoggerError(DWORD Error, LPCWSTR Prefix)
         0,
         (va_list *)(DWORD_PTR[]){ (DWORD_PTR)Prefix, (DWORD_PTR)Error, (DWORD_PTR)SystemMessage });
     if (FormattedMessage)
-        Logger(WINTUN_LOG_ERR, Now(), FormattedMessage);
+        Logger(WINTUN_LOG_ERR, Timestamp, FormattedMessage);
     LocalFree(FormattedMessage);
     LocalFree(SystemMessage);
+}
+
+static DWORD WINAPI
+LoggerThread(_In_ LPVOID Module)
+{
+    for (;;)
+    {
+        /* Sample the stop request before draining, so that nothing published ahead of it is left behind. */
+        BOOL Stopping = ReadAcquire(&LogRing.Stop);
+        for (;;)
+        {
+            LOG_RECORD *Record = &LogRing.Records[LogRing.Head & (LOG_RING_CAPACITY - 1)];
+            if ((ULONG)ReadAcquire(&Record->Sequence) != LogRing.Head + 1)
+                break;
+            if (Record->IsError)
+                DeliverError(Record->Timestamp, Record->Error, Record->LogLine);
+            else
+                Logger(Record->Level, Record->Timestamp, Record->LogLine);
+            WriteRelease(&Record->Sequence, (LONG)(LogRing.Head + LOG_RING_CAPACITY));
+            ++LogRing.Head;
+        }
+        LONG Dropped = InterlockedExchange(&LogRing.Dropped, 0);
+        if (Dropped)
+        {
+            WCHAR LogLine[0x40];
+            _snwprintf_s(LogLine, _countof(LogLine), _TRUNCATE, L"Dropped %ld log messages", Dropped);
+            Logger(WINTUN_LOG_WARN, Now(), LogLine);
+        }
+        if (Stopping)
+            break;
+        WaitForSingleObject(LogRing.Event, INFINITE);
+    }
+    FreeLibraryAndExitThread(Module, 0);
+}
+
+_Must_inspect_result_
+static _Return_type_success_(return != FALSE)
+BOOL
+StartLoggerThread(VOID)
+{
+    DWORD LastError = ERROR_SUCCESS;
+    if (!LogRing.Records)
+    {
+        LogRing.Records = AllocArray(LOG_RING_CAPACITY, sizeof(*LogRing.Records));
+        if (!LogRing.Records)
+            return FALSE;
+    }
+    if (!LogRing.Event)
+    {
+        LogRing.Event = CreateEventW(NULL, FALSE, FALSE, NULL);
+        if (!LogRing.Event)
+            return FALSE;
+    }
+    for (ULONG i = 0; i < LOG_RING_CAPACITY; ++i)
+        LogRing.Records[i].Sequence = (LONG)i;
+    LogRing.Tail = 0;
+    LogRing.Head = 0;
+    LogRing.Stop = FALSE;
+    /* The thread holds a reference to the module, so that it may finish delivering even if we're being unloaded. */
+    HMODULE Module;
+    if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)LoggerThread, &Module))
+        return FALSE;
+    LogRing.Thread = CreateThread(NULL, 0, LoggerThread, Module, 0, NULL);
+    if (!LogRing.Thread)
+    {
+        LastError = GetLastError();
+        FreeLibrary(Module);
+        SetLastError(LastError);
+        return FALSE;
+    }
+    WriteRelease(&LogRing.Enabled, TRUE);
+    return TRUE;
+}
+
+static VOID
+StopLoggerThread(VOID)
+{
+    if (!LogRing.Thread)
+        return;
+    WriteRelease(&LogRing.Enabled, FALSE);
+    while (ReadAcquire(&LogRing.Writers))
+        YieldProcessor();
+    WriteRelease(&LogRing.Stop, TRUE);
+    SetEvent(LogRing.Event);
+    WaitForSingleObject(LogRing.Thread, INFINITE);
+    CloseHandle(LogRing.Thread);
+    LogRing.Thread = NULL;
+}
+
+_Use_decl_annotations_
+BOOL WINAPI
+WintunSetLoggerEx(WINTUN_LOGGER_CALLBACK NewLogger, WINTUN_LOGGER_LEVEL MinLevel, DWORD Flags)
+{
+    if (Flags & ~WINTUN_LOGGER_ASYNC)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (!NewLogger)
+        NewLogger = NopLogger;
+    BOOL Ret = TRUE;
+    AcquireSRWLockExclusive(&LoggerConfigLock);
+    StopLoggerThread();
+    Logger = NewLogger;
+    LoggerMinLevel = MinLevel;
+    if (Flags & WINTUN_LOGGER_ASYNC)
+        Ret = StartLoggerThread();
+    ReleaseSRWLockExclusive(&LoggerConfigLock);
+    return Ret;
+}
+
+_Use_decl_annotations_
+VOID WINAPI
+WintunSetLogger(WINTUN_LOGGER_CALLBACK NewLogger)
+{
+    WintunSetLoggerEx(NewLogger, WINTUN_LOG_INFO, 0);
+}
+
+/* Claims a record when asynchronous logging is on. Must be paired with LogRingLeave. */
+_Must_inspect_result_
+static _Return_type_success_(return != NULL)
+_Post_maybenull_
+LOG_RECORD *
+LogRingEnter(_In_ WINTUN_LOGGER_LEVEL Level, _In_ BOOL IsError, _In_ DWORD Error, _Out_ BOOL *Async)
+{
+    InterlockedIncrement(&LogRing.Writers);
+    *Async = ReadAcquire(&LogRing.Enabled);
+    if (!*Async)
+        return NULL;
+    LOG_RECORD *Record = LogRingClaim();
+    if (!Record)
+        return NULL;
+    Record->Level = Level;
+    Record->IsError = IsError;
+    Record->Error = Error;
+    Record->Timestamp = Now();
+    return Record;
+}
+
+static VOID
+LogRingLeave(_In_opt_ LOG_RECORD *Record)
+{
+    if (Record)
+        LogRingPublish(Record);
+    InterlockedDecrement(&LogRing.Writers);
+}
+
+_Use_decl_annotations_
+DWORD
+LoggerLogAt(WINTUN_LOGGER_LEVEL Level, DWORD64 Timestamp, LPCWSTR LogLine)
+{
+    DWORD LastError = GetLastError();
+    if (!LoggerWants(Level))
+        return LastError;
+    BOOL Async;
+    LOG_RECORD *Record = LogRingEnter(Level, FALSE, 0, &Async);
+    if (Record)
+    {
+        Record->Timestamp = Timestamp;
+        wcsncpy_s(Record->LogLine, _countof(Record->LogLine), LogLine, _TRUNCATE);
+    }
+    else if (!Async)
+        Logger(Level, Timestamp, LogLine);
+    LogRingLeave(Record);
+    SetLastError(LastError);
+    return LastError;
+}
+
+_Use_decl_annotations_
+DWORD
+LoggerLog(WINTUN_LOGGER_LEVEL Level, LPCWSTR LogLine)
+{
+    return LoggerLogAt(Level, Now(), LogLine);
+}
+
+_Use_decl_annotations_
+DWORD
+LoggerLogV(WINTUN_LOGGER_LEVEL Level, LPCWSTR Format, va_list Args)
+{
+    DWORD LastError = GetLastError();
+    if (!LoggerWants(Level))
+        return LastError;
+    BOOL Async;
+    LOG_RECORD *Record = LogRingEnter(Level, FALSE, 0, &Async);
+    if (Record)
+    {
+        if (_vsnwprintf_s(Record->LogLine, _countof(Record->LogLine), _TRUNCATE, Format, Args) == -1)
+            StrTruncate(Record->LogLine, _countof(Record->LogLine));
+    }
+    else if (!Async)
+    {
+        WCHAR LogLine[LOG_LINE_CHARS];
+        if (_vsnwprintf_s(LogLine, _countof(LogLine), _TRUNCATE, Format, Args) == -1)
+            StrTruncate(LogLine, _countof(LogLine));
+        Logger(Level, Now(), LogLine);
+    }
+    LogRingLeave(Record);
+    SetLastError(LastError);
+    return LastError;
+}
+
+_Use_decl_annotations_
+DWORD
+LoggerError(DWORD Error, LPCWSTR Prefix)
+{
+    if (!LoggerWants(WINTUN_LOG_ERR))
+        return Error;
+    BOOL Async;
+    LOG_RECORD *Record = LogRingEnter(WINTUN_LOG_ERR, TRUE, Error, &Async);
+    if (Record)
+        wcsncpy_s(Record->LogLine, _countof(Record->LogLine), Prefix, _TRUNCATE);
+    else if (!Async)
+        DeliverError(Now(), Error, Prefix);
+    LogRingLeave(Record);
     return Error;
 }
 
@@ -99,10 +356,24 @@ _Use_decl_annotations_
 DWORD
 LoggerErrorV(DWORD Error, LPCWSTR Format, va_list Args)
 {
-    WCHAR LogLine[0x400];
-    if (_vsnwprintf_s(LogLine, _countof(LogLine), _TRUNCATE, Format, Args) == -1)
-        StrTruncate(LogLine, _countof(LogLine));
-    return LoggerError(Error, LogLine);
+    if (!LoggerWants(WINTUN_LOG_ERR))
+        return Error;
+    BOOL Async;
+    LOG_RECORD *Record = LogRingEnter(WINTUN_LOG_ERR, TRUE, Error, &Async);
+    if (Record)
+    {
+        if (_vsnwprintf_s(Record->LogLine, _countof(Record->LogLine), _TRUNCATE, Format, Args) == -1)
+            StrTruncate(Record->LogLine, _countof(Record->LogLine));
+    }
+    else if (!Async)
+    {
+        WCHAR LogLine[LOG_LINE_CHARS];
+        if (_vsnwprintf_s(LogLine, _countof(LogLine), _TRUNCATE, Format, Args) == -1)
+            StrTruncate(LogLine, _countof(LogLine));
+        DeliverError(Now(), Error, LogLine);
+    }
+    LogRingLeave(Record);
+    return Error;
 }
 
 _Use_decl_annotations_
@@ -9,21 +9,39 @@
 #include "main.h"
 #include "registry.h"
 #include <Windows.h>
+#include <TraceLoggingProvider.h>
 #include <intsafe.h>
 #include <stdarg.h>
 #include <wchar.h>
 
 extern WINTUN_LOGGER_CALLBACK Logger;
 
+/* The ETW provider the driver writes to as well, so that one trace session records both ends of the rings. Keywords
+ * match the driver's, and name the rings the way it does: Send carries packets the stack sends, Receive the ones the
+ * client sends. Hot path events are WINEVENT_LEVEL_VERBOSE. */
+TRACELOGGING_DECLARE_PROVIDER(TraceProvider);
+#define TRACE_KEYWORD_SEND 0x1
+#define TRACE_KEYWORD_RECEIVE 0x2
+#define TRACE_KEYWORD_STATE 0x8
+
 /**
  * @copydoc WINTUN_SET_LOGGER_FUNC
  */
 WINTUN_SET_LOGGER_FUNC WintunSetLogger;
 
+/**
+ * @copydoc WINTUN_SET_LOGGER_EX_FUNC
+ */
+WINTUN_SET_LOGGER_EX_FUNC WintunSetLoggerEx;
+
 _Post_equals_last_error_
 DWORD
 LoggerLog(_In_ WINTUN_LOGGER_LEVEL Level, _In_z_ LPCWSTR LogLine);
 
+_Post_equals_last_error_
+DWORD
+LoggerLogAt(_In_ WINTUN_LOGGER_LEVEL Level, _In_ DWORD64 Timestamp, _In_z_ LPCWSTR LogLine);
+
 _Post_equals_last_error_
 DWORD
 LoggerLogV(_In_ WINTUN_LOGGER_LEVEL Level, _In_z_ _Printf_format_string_ LPCWSTR Format, _In_ va_list Args);
@@ -119,13 +119,18 @@ DllMain(_In_ HINSTANCE hinstDLL, _In_ DWORD fdwReason, _In_ LPVOID lpvReserved)
             HeapDestroy(ModuleHeap);
             return FALSE;
         }
+        /* Tracing is optional, so failing to register the provider leaves it disabled. */
+        TraceLoggingRegister(TraceProvider);
         EnvInit();
         NamespaceInit();
         AdapterCleanupLegacyDevices();
         break;
 
     case DLL_PROCESS_DETACH:
+        /* The adapter index is left be: its entries are in the module heap, and its notification, if registered,
+         * pinned the module, so it only gets here at process exit. */
         NamespaceDone();
+        TraceLoggingUnregister(TraceProvider);
         LocalFree(SecurityAttributes.lpSecurityDescriptor);
         HeapDestroy(ModuleHeap);
         break;
@@ -153,7 +153,7 @@ ProcessStderr(_In_ HANDLE Stderr)
         if (!((Level = WINTUN_LOG_INFO, LevelRune == L'+') || (Level = WINTUN_LOG_WARN, LevelRune == L'-') ||
               (Level = WINTUN_LOG_ERR, LevelRune == L'!')))
             return ERROR_INVALID_DATA;
-        Logger(Level, Timestamp, Msg);
+        LoggerLogAt(Level, Timestamp, Msg);
     }
 }
 
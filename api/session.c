@@ -8,117 +8,664 @@
 #include "main.h"
 #include "wintun.h"
 #include <Windows.h>
+#include <winternl.h>
 #include <devioctl.h>
+#include <iphlpapi.h>
 #include <stdlib.h>
+#include "protocol.h"
 
 #pragma warning(disable : 4200) /* nonstandard: zero-sized array in struct/union */
 
-#define TUN_ALIGNMENT sizeof(ULONG)
-#define TUN_ALIGN(Size) (((ULONG)(Size) + ((ULONG)TUN_ALIGNMENT - 1)) & ~((ULONG)TUN_ALIGNMENT - 1))
-#define TUN_IS_ALIGNED(Size) (!((ULONG)(Size) & ((ULONG)TUN_ALIGNMENT - 1)))
-#define TUN_MAX_PACKET_SIZE TUN_ALIGN(sizeof(TUN_PACKET) + WINTUN_MAX_IP_PACKET_SIZE)
-#define TUN_RING_CAPACITY(Size) ((Size) - sizeof(TUN_RING) - (TUN_MAX_PACKET_SIZE - TUN_ALIGNMENT))
-#define TUN_RING_SIZE(Capacity) (sizeof(TUN_RING) + (Capacity) + (TUN_MAX_PACKET_SIZE - TUN_ALIGNMENT))
-#define TUN_RING_WRAP(Value, Capacity) ((Value) & (Capacity - 1))
+#define TUN_RING_SLACK(MaxPacketSize) (TUN_ALIGN(sizeof(TUN_PACKET) + (MaxPacketSize)) - TUN_ALIGNMENT)
+#define TUN_RING_SIZE(Capacity, MaxPacketSize) (sizeof(TUN_RING_V2) + (Capacity) + TUN_RING_SLACK(MaxPacketSize))
 #define LOCK_SPIN_COUNT 0x10000
-#define TUN_PACKET_RELEASE ((DWORD)0x80000000)
-
-typedef struct _TUN_PACKET
-{
-    ULONG Size;
-    UCHAR Data[];
-} TUN_PACKET;
-
-typedef struct _TUN_RING
-{
-    volatile ULONG Head;
-    volatile ULONG Tail;
-    volatile LONG Alertable;
-    UCHAR Data[];
-} TUN_RING;
-
-#define TUN_IOCTL_REGISTER_RINGS CTL_CODE(51820U, 0x970U, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
-
-typedef struct _TUN_REGISTER_RINGS
-{
-    struct
-    {
-        ULONG RingSize;
-        TUN_RING *Ring;
-        HANDLE TailMoved;
-    } Send, Receive;
-} TUN_REGISTER_RINGS;
+/* One completion per 8 bytes of ring is more than a ring can hold descriptors. */
+#define TUN_COMPLETION_COUNT(Capacity) ((Capacity) / 8)
+#define TUN_COMPLETION_RING_SIZE(Capacity) \
+    (sizeof(TUN_COMPLETION_RING) + TUN_COMPLETION_COUNT(Capacity) * sizeof(ULONG))
+/* The priority queue carries little, and what it carries should not queue up, so its rings are kept small. */
+#define TUN_PRIORITY_RING_CAPACITY(Capacity) min((ULONG)(Capacity), (ULONG)WINTUN_MIN_RING_CAPACITY)
 
+/* Sessions with multiple queues are allocated as a contiguous array of TUN_SESSION, one per ring pair. The first
+ * element is the session handle returned to the client and owns the resources shared by all queues. The state of the
+ * writer (Receive) and the reader (Send) each get their own cache line, apart from the read-mostly fields. Each side
+ * keeps the last index it read from the driver, and only reads the ring's again once that one is used up. The priority
+ * queue, if any, is the last element. Its send ring is read along with the first queue's, under that one's lock, and
+ * Priority of the first element points to it. */
 typedef struct _TUN_SESSION
 {
-    ULONG Capacity;
-    struct
+    DECLSPEC_CACHEALIGN ULONG Capacity;
+    TUN_REGISTER_RINGS Descriptor;
+    HANDLE Handle;
+    HANDLE Section;
+    ULONG MetadataSize;
+    ULONG TimestampSize;
+    ULONG PrefixSize;
+    ULONG MaxPacketSize;
+    ULONG Flags;
+    ULONG QueueIndex;
+    ULONG QueueCount;
+    BYTE *BufferRegion;
+    ULONG BufferRegionSize;
+    TUN_COMPLETION_RING *CompletionRing;
+    struct _TUN_SESSION *Priority;
+    DECLSPEC_CACHEALIGN struct
     {
+        ULONG Head;
         ULONG Tail;
         ULONG TailRelease;
         ULONG PacketsToRelease;
         CRITICAL_SECTION Lock;
+        volatile LONG64 EventsSignaled;
     } Receive;
-    struct
+    DECLSPEC_CACHEALIGN struct
     {
+        ULONG Tail;
         ULONG Head;
         ULONG HeadRelease;
         ULONG PacketsToRelease;
         CRITICAL_SECTION Lock;
+        DWORD64 Latency[WINTUN_LATENCY_BUCKETS];
+        struct
+        {
+            PTP_WAIT Wait;
+            WINTUN_READ_CALLBACK *Callback;
+            VOID *Context;
+            volatile LONG Closing;
+            HANDLE CompletionPacket;
+            HANDLE CompletionPort;
+            ULONG_PTR CompletionKey;
+            BOOL Armed;
+        } Notify;
     } Send;
-    TUN_REGISTER_RINGS Descriptor;
-    HANDLE Handle;
 } TUN_SESSION;
 
-WINTUN_START_SESSION_FUNC WintunStartSession;
-_Use_decl_annotations_
-TUN_SESSION *WINAPI
-WintunStartSession(WINTUN_ADAPTER *Adapter, DWORD Capacity)
+/* Wait completion packets are available on Windows 8 and newer only, so they are looked up at runtime. */
+static NTSTATUS(NTAPI *NtCreateWaitCompletionPacket)(
+    _Out_ HANDLE *WaitCompletionPacketHandle,
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_opt_ OBJECT_ATTRIBUTES *ObjectAttributes);
+static NTSTATUS(NTAPI *NtAssociateWaitCompletionPacket)(
+    _In_ HANDLE WaitCompletionPacketHandle,
+    _In_ HANDLE IoCompletionHandle,
+    _In_ HANDLE TargetObjectHandle,
+    _In_opt_ VOID *KeyContext,
+    _In_opt_ VOID *ApcContext,
+    _In_ NTSTATUS IoStatus,
+    _In_ ULONG_PTR IoStatusInformation,
+    _Out_opt_ BOOLEAN *AlreadySignaled);
+static NTSTATUS(NTAPI *NtCancelWaitCompletionPacket)(
+    _In_ HANDLE WaitCompletionPacketHandle,
+    _In_ BOOLEAN RemoveSignaledPacket);
+
+/* Sessions started with WINTUN_SESSION_FLAG_SINGLE_THREADED have the client serialize calls per direction, making
+ * the rings plain single-producer/single-consumer queues between the client and the driver. */
+static VOID
+LockDirection(_In_ const TUN_SESSION *Session, _Inout_ CRITICAL_SECTION *Lock)
+{
+    if (!(Session->Flags & WINTUN_SESSION_FLAG_SINGLE_THREADED))
+        EnterCriticalSection(Lock);
+}
+
+static VOID
+UnlockDirection(_In_ const TUN_SESSION *Session, _Inout_ CRITICAL_SECTION *Lock)
+{
+    if (!(Session->Flags & WINTUN_SESSION_FLAG_SINGLE_THREADED))
+        LeaveCriticalSection(Lock);
+}
+
+/* The priority queue is read through the first queue, so its receive functions act on that one. */
+static TUN_SESSION *
+ReaderOf(_In_ TUN_SESSION *Session)
+{
+    TUN_SESSION *First = Session - Session->QueueIndex;
+    return First->Priority == Session ? First : Session;
+}
+
+/* Has the driver signal the read-wait event on tail moves of the send ring from now on. Returns whether the tail had
+ * moved already. */
+static BOOL
+ArmSendRing(_Inout_ TUN_SESSION *Queue)
+{
+    TUN_RING_V2 *Ring = Queue->Descriptor.Send.RingV2;
+    InterlockedExchange(&Ring->Alertable, TRUE);
+    const ULONG BuffTail = ReadULongAcquire(&Ring->Tail);
+    return BuffTail < Queue->Capacity && BuffTail != ReadULongNoFence(&Queue->Send.Head);
+}
+
+/* Has the driver signal the read-wait event from now on, for the priority ring too, which shares it. Should a tail
+ * have moved before the driver saw the flag, signals the event on its behalf. */
+static VOID
+ArmReadEvent(_Inout_ TUN_SESSION *Session)
+{
+    BOOL Moved = ArmSendRing(Session);
+    if (Session->Priority)
+        Moved |= ArmSendRing(Session->Priority);
+    if (Moved)
+        SetEvent(Session->Descriptor.Send.TailMoved);
+}
+
+/* Re-arms the thread pool wait or the wait completion packet on the read-wait event. Any completion the port still
+ * holds from the last round is stale by now, and is removed. */
+static VOID
+ArmReadNotification(_Inout_ TUN_SESSION *Session)
+{
+    if (Session->Send.Notify.Wait)
+        SetThreadpoolWait(Session->Send.Notify.Wait, Session->Descriptor.Send.TailMoved, NULL);
+    else
+    {
+        NtCancelWaitCompletionPacket(Session->Send.Notify.CompletionPacket, TRUE);
+        Session->Send.Notify.Armed = NT_SUCCESS(NtAssociateWaitCompletionPacket(
+            Session->Send.Notify.CompletionPacket,
+            Session->Send.Notify.CompletionPort,
+            Session->Descriptor.Send.TailMoved,
+            (VOID *)Session->Send.Notify.CompletionKey,
+            Session,
+            0,
+            0,
+            NULL));
+    }
+    ArmReadEvent(Session);
+}
+
+/* Re-arms the read notification once the reader has drained the ring. The completion packet is set up and torn down
+ * from whatever thread the client calls WintunSetReadCompletionPort on, so sessions started with
+ * WINTUN_SESSION_FLAG_SINGLE_THREADED, whose reader does not hold the lock, take it here. Seeing no completion packet
+ * without the lock is fine: one set up just now is armed by WintunSetReadCompletionPort itself. */
+static VOID
+RearmReadNotification(_Inout_ TUN_SESSION *Session)
+{
+    if (!ReadPointerNoFence(&Session->Send.Notify.CompletionPacket))
+    {
+        ArmReadEvent(Session);
+        return;
+    }
+    const BOOL SingleThreaded = !!(Session->Flags & WINTUN_SESSION_FLAG_SINGLE_THREADED);
+    if (SingleThreaded)
+        EnterCriticalSection(&Session->Send.Lock);
+    if (Session->Send.Notify.CompletionPacket && !Session->Send.Notify.Armed)
+        ArmReadNotification(Session);
+    else
+        ArmReadEvent(Session);
+    if (SingleThreaded)
+        LeaveCriticalSection(&Session->Send.Lock);
+}
+
+/* Tears down the read notification. Takes the lock regardless of WINTUN_SESSION_FLAG_SINGLE_THREADED, as the reader
+ * may be re-arming it at the same time. */
+static VOID
+ClearReadNotification(_Inout_ TUN_SESSION *Session)
+{
+    if (Session->Send.Notify.Wait)
+    {
+        /* Can't hold the lock here, as the callback is likely to be in WintunReceivePackets. A callback that was
+         * already running may have re-armed the wait, hence the second round. */
+        WriteNoFence(&Session->Send.Notify.Closing, TRUE);
+        for (int i = 0; i < 2; ++i)
+        {
+            SetThreadpoolWait(Session->Send.Notify.Wait, NULL, NULL);
+            WaitForThreadpoolWaitCallbacks(Session->Send.Notify.Wait, TRUE);
+        }
+        CloseThreadpoolWait(Session->Send.Notify.Wait);
+        Session->Send.Notify.Wait = NULL;
+    }
+    EnterCriticalSection(&Session->Send.Lock);
+    HANDLE CompletionPacket = Session->Send.Notify.CompletionPacket;
+    Session->Send.Notify.CompletionPacket = NULL;
+    LeaveCriticalSection(&Session->Send.Lock);
+    if (CompletionPacket)
+    {
+        NtCancelWaitCompletionPacket(CompletionPacket, TRUE);
+        CloseHandle(CompletionPacket);
+    }
+}
+
+static DWORD
+GetAllocationGranularity(VOID)
+{
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
+    return SystemInfo.dwAllocationGranularity;
+}
+
+/* Ring Index of a session alternates between the send and the receive ring of each queue, of the queue's Capacity. */
+static TUN_RING_V2 **
+MirroredRing(_Inout_ TUN_SESSION *Session, _In_ DWORD Index)
+{
+    return Index & 1 ? &Session[Index / 2].Descriptor.Receive.RingV2 : &Session[Index / 2].Descriptor.Send.RingV2;
+}
+
+static VOID
+UnmapMirroredRings(_Inout_ TUN_SESSION *Session, _In_ DWORD Count)
+{
+    const DWORD Granularity = GetAllocationGranularity();
+    for (DWORD Index = 0; Index < Count; ++Index)
+    {
+        BYTE *View = (BYTE *)*MirroredRing(Session, Index) + sizeof(TUN_RING_V2) - Granularity;
+        UnmapViewOfFile(View + Granularity + Session[Index / 2].Capacity);
+        UnmapViewOfFile(View);
+    }
+}
+
+typedef VOID *(WINAPI VIRTUAL_ALLOC2_FUNC)(
+    _In_opt_ HANDLE Process,
+    _In_opt_ VOID *BaseAddress,
+    _In_ SIZE_T Size,
+    _In_ ULONG AllocationType,
+    _In_ ULONG PageProtection,
+    _Inout_updates_opt_(ParameterCount) MEM_EXTENDED_PARAMETER *ExtendedParameters,
+    _In_ ULONG ParameterCount);
+typedef VOID *(WINAPI MAP_VIEW_OF_FILE3_FUNC)(
+    _In_ HANDLE FileMapping,
+    _In_opt_ HANDLE Process,
+    _In_opt_ VOID *BaseAddress,
+    _In_ ULONG64 Offset,
+    _In_ SIZE_T ViewSize,
+    _In_ ULONG AllocationType,
+    _In_ ULONG PageProtection,
+    _Inout_updates_opt_(ParameterCount) MEM_EXTENDED_PARAMETER *ExtendedParameters,
+    _In_ ULONG ParameterCount);
+
+/* Each ring is a section of one allocation granule for the header, which ends right where the data begins, followed
+ * by the data. A placeholder reserves room for the section and another view of the data only, so that whatever runs
+ * past the end of the data lands at its beginning again. */
+_Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+static TUN_RING_V2 *
+MapMirroredRing(
+    _In_ VIRTUAL_ALLOC2_FUNC *VirtualAlloc2,
+    _In_ MAP_VIEW_OF_FILE3_FUNC *MapViewOfFile3,
+    _In_ DWORD Granularity,
+    _In_ DWORD Capacity,
+    _In_ DWORD NumaNode)
 {
     DWORD LastError;
-    TUN_SESSION *Session = Zalloc(sizeof(TUN_SESSION));
+    const SIZE_T SectionSize = (SIZE_T)Granularity + Capacity;
+    HANDLE Section =
+        CreateFileMappingNumaW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)SectionSize, NULL, NumaNode);
+    if (!Section)
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to create ring section (requested size: 0x%zx)", SectionSize);
+        goto cleanup;
+    }
+    BYTE *Placeholder = VirtualAlloc2(
+        GetCurrentProcess(),
+        NULL,
+        SectionSize + Capacity,
+        MEM_RESERVE | MEM_RESERVE_PLACEHOLDER,
+        PAGE_NOACCESS,
+        NULL,
+        0);
+    if (!Placeholder)
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to reserve ring placeholder");
+        goto cleanupSection;
+    }
+    if (!VirtualFree(Placeholder, SectionSize, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER))
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to split ring placeholder");
+        VirtualFree(Placeholder, 0, MEM_RELEASE);
+        goto cleanupSection;
+    }
+    if (!MapViewOfFile3(
+            Section,
+            GetCurrentProcess(),
+            Placeholder,
+            0,
+            SectionSize,
+            MEM_REPLACE_PLACEHOLDER,
+            PAGE_READWRITE,
+            NULL,
+            0))
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to map ring");
+        VirtualFree(Placeholder, 0, MEM_RELEASE);
+        goto cleanupMirrorPlaceholder;
+    }
+    if (!MapViewOfFile3(
+            Section,
+            GetCurrentProcess(),
+            Placeholder + SectionSize,
+            Granularity,
+            Capacity,
+            MEM_REPLACE_PLACEHOLDER,
+            PAGE_READWRITE,
+            NULL,
+            0))
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to map ring mirror");
+        UnmapViewOfFile(Placeholder);
+        goto cleanupMirrorPlaceholder;
+    }
+    /* The views keep the section alive. */
+    CloseHandle(Section);
+    return (TUN_RING_V2 *)(Placeholder + Granularity - sizeof(TUN_RING_V2));
+cleanupMirrorPlaceholder:
+    VirtualFree(Placeholder + SectionSize, 0, MEM_RELEASE);
+cleanupSection:
+    CloseHandle(Section);
+cleanup:
+    SetLastError(LastError);
+    return NULL;
+}
+
+_Must_inspect_result_
+static _Return_type_success_(return != FALSE)
+BOOL
+MapMirroredRings(_Inout_ TUN_SESSION *Session, _In_ DWORD Count, _In_ DWORD NumaNode)
+{
+    VIRTUAL_ALLOC2_FUNC *VirtualAlloc2;
+    MAP_VIEW_OF_FILE3_FUNC *MapViewOfFile3;
+    HMODULE KernelBase = GetModuleHandleW(L"kernelbase.dll");
+    if (!KernelBase || (*(FARPROC *)&VirtualAlloc2 = GetProcAddress(KernelBase, "VirtualAlloc2")) == NULL ||
+        (*(FARPROC *)&MapViewOfFile3 = GetProcAddress(KernelBase, "MapViewOfFile3")) == NULL)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
+    }
+    const DWORD Granularity = GetAllocationGranularity();
+    for (DWORD Index = 0; Index < Count; ++Index)
+    {
+        const DWORD Capacity = Session[Index / 2].Capacity;
+        if (!Capacity || (Capacity & (Capacity - 1)) || Capacity % Granularity || Capacity > WINTUN_MAX_RING_CAPACITY)
+        {
+            UnmapMirroredRings(Session, Index);
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        TUN_RING_V2 *Ring = MapMirroredRing(VirtualAlloc2, MapViewOfFile3, Granularity, Capacity, NumaNode);
+        if (!Ring)
+        {
+            DWORD LastError = GetLastError();
+            UnmapMirroredRings(Session, Index);
+            SetLastError(LastError);
+            return FALSE;
+        }
+        *MirroredRing(Session, Index) = Ring;
+    }
+    return TRUE;
+}
+
+/* Rings of sessions that may be handed off are in a section of their own, laid out like the ring memory of any other
+ * session, which the driver maps itself. */
+_Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+static BYTE *
+MapRingSection(_In_ size_t Size, _In_ DWORD NumaNode, _Out_ HANDLE *Section)
+{
+    DWORD LastError;
+    *Section = CreateFileMappingNumaW(
+        INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((DWORD64)Size >> 32), (DWORD)Size, NULL, NumaNode);
+    if (!*Section)
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to create ring section (requested size: 0x%zx)", Size);
+        goto cleanup;
+    }
+    BYTE *View = MapViewOfFileExNuma(*Section, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, Size, NULL, NumaNode);
+    if (!View)
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to map ring section");
+        goto cleanupSection;
+    }
+    return View;
+cleanupSection:
+    CloseHandle(*Section);
+    *Section = NULL;
+cleanup:
+    SetLastError(LastError);
+    return NULL;
+}
+
+/* Sets up the client side of a queue whose rings the driver has taken. The Capacity is set already. */
+static VOID
+InitializeQueue(_Inout_ TUN_SESSION *Session, _In_ DWORD Index, _In_ DWORD Flags, _In_ ULONG MaxPacketSize)
+{
+    TUN_SESSION *Queue = &Session[Index];
+    Queue->Handle = Session->Handle;
+    Queue->MetadataSize = Flags & WINTUN_SESSION_FLAG_METADATA ? sizeof(WINTUN_PACKET_METADATA) : 0;
+    Queue->TimestampSize = Flags & WINTUN_SESSION_FLAG_TIMESTAMPS ? sizeof(LONG64) : 0;
+    Queue->PrefixSize = Queue->TimestampSize + Queue->MetadataSize;
+    Queue->MaxPacketSize = MaxPacketSize;
+    Queue->Flags = Flags;
+    Queue->QueueIndex = Index;
+    (VOID) InitializeCriticalSectionAndSpinCount(&Queue->Receive.Lock, LOCK_SPIN_COUNT);
+    (VOID) InitializeCriticalSectionAndSpinCount(&Queue->Send.Lock, LOCK_SPIN_COUNT);
+    if (Flags & WINTUN_SESSION_FLAG_PRIORITY_QUEUE && Index == Session->QueueCount - 1)
+        Session->Priority = Queue;
+}
+
+/* Sets the capacity of each queue's rings, the priority queue's being the smaller one. */
+static VOID
+SetQueueCapacities(_Inout_ TUN_SESSION *Session, _In_ DWORD QueueCount, _In_ DWORD Capacity, _In_ DWORD Flags)
+{
+    for (DWORD Index = 0; Index < QueueCount; ++Index)
+        Session[Index].Capacity = Capacity;
+    if (Flags & WINTUN_SESSION_FLAG_PRIORITY_QUEUE)
+        Session[QueueCount - 1].Capacity = TUN_PRIORITY_RING_CAPACITY(Capacity);
+}
+
+/* The driver reads the adapter MTU from its registry key on initialization and reports it as the interface MTU. Packets
+ * without metadata never exceed it, so rings need no more slack than one such packet. */
+static ULONG
+GetMaxPacketSize(_In_ WINTUN_ADAPTER *Adapter)
+{
+    MIB_IF_ROW2 IfRow = { 0 };
+    WintunGetAdapterLUID(Adapter, &IfRow.InterfaceLuid);
+    DWORD LastError = GetIfEntry2(&IfRow);
+    if (LastError != NO_ERROR)
+    {
+        LOG(WINTUN_LOG_WARN, L"Failed to query adapter MTU (error: %u), sizing rings for largest packets", LastError);
+        return WINTUN_MAX_IP_PACKET_SIZE;
+    }
+    return IfRow.Mtu && IfRow.Mtu < WINTUN_MAX_IP_PACKET_SIZE ? IfRow.Mtu : WINTUN_MAX_IP_PACKET_SIZE;
+}
+
+_Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+static TUN_SESSION *
+StartSession(
+    _In_ WINTUN_ADAPTER *Adapter,
+    _In_ DWORD Capacity,
+    _In_ DWORD QueueCount,
+    _In_ DWORD Flags,
+    _In_ DWORD NumaNode,
+    _In_opt_ BYTE *BufferRegion,
+    _In_ DWORD BufferRegionSize)
+{
+    DWORD LastError;
+    ULONG HighestNumaNode;
+    if (!QueueCount || QueueCount > WINTUN_MAX_QUEUES - !!(Flags & WINTUN_SESSION_FLAG_PRIORITY_QUEUE) ||
+        (Flags & ~(WINTUN_SESSION_FLAG_METADATA | WINTUN_SESSION_FLAG_SINGLE_THREADED |
+                   WINTUN_SESSION_FLAG_LARGE_PAGES | WINTUN_SESSION_FLAG_MIRRORED_RINGS |
+                   WINTUN_SESSION_FLAG_TIMESTAMPS | WINTUN_SESSION_FLAG_HAND_OFF |
+                   WINTUN_SESSION_FLAG_PRIORITY_QUEUE)) ||
+        ((Flags & WINTUN_SESSION_FLAG_HAND_OFF) && ((Flags & WINTUN_SESSION_FLAG_MIRRORED_RINGS) || BufferRegion)) ||
+        (NumaNode != NUMA_NO_PREFERRED_NODE &&
+         (!GetNumaHighestNodeNumber(&HighestNumaNode) || NumaNode > HighestNumaNode)))
+    {
+        LastError = ERROR_INVALID_PARAMETER;
+        goto cleanup;
+    }
+    /* The priority queue is one more ring pair, the last one, which the driver keeps for latency sensitive traffic. */
+    const DWORD PriorityCount = !!(Flags & WINTUN_SESSION_FLAG_PRIORITY_QUEUE);
+    QueueCount += PriorityCount;
+    /* Allocated as pages to keep the elements cache aligned. */
+    TUN_SESSION *Session = VirtualAlloc(0, sizeof(TUN_SESSION) * QueueCount, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
     if (!Session)
     {
-        LastError = GetLastError();
+        LastError = LOG_LAST_ERROR(L"Failed to allocate session memory");
         goto cleanup;
     }
-    const ULONG RingSize = TUN_RING_SIZE(Capacity);
-    BYTE *AllocatedRegion = VirtualAlloc(0, (size_t)RingSize * 2, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-    if (!AllocatedRegion)
+    SetQueueCapacities(Session, QueueCount, Capacity, Flags);
+    const ULONG TimestampSize = Flags & WINTUN_SESSION_FLAG_TIMESTAMPS ? sizeof(LONG64) : 0;
+    const ULONG PrefixSize =
+        TimestampSize + (Flags & WINTUN_SESSION_FLAG_METADATA ? sizeof(WINTUN_PACKET_METADATA) : 0);
+    /* Ring packets are IP packets of up to the MTU, or of any size with metadata, plus their prefix. */
+    const ULONG MaxPacketSize =
+        (Flags & WINTUN_SESSION_FLAG_METADATA ? WINTUN_MAX_IP_PACKET_SIZE : GetMaxPacketSize(Adapter)) + PrefixSize;
+    const BOOL Mirrored = !!(Flags & WINTUN_SESSION_FLAG_MIRRORED_RINGS);
+    const BOOL HandOff = !!(Flags & WINTUN_SESSION_FLAG_HAND_OFF);
+    const ULONG PriorityCapacity = TUN_PRIORITY_RING_CAPACITY(Capacity);
+    const ULONG RingSize = Mirrored ? sizeof(TUN_RING_V2) + Capacity * 2 : TUN_RING_SIZE(Capacity, MaxPacketSize);
+    const ULONG PriorityRingSize =
+        Mirrored ? sizeof(TUN_RING_V2) + PriorityCapacity * 2 : TUN_RING_SIZE(PriorityCapacity, MaxPacketSize);
+    /* Completion rings of buffer region sessions go after the ring pairs, of which the priority queue's is the last
+     * and smaller one. Mirrored rings are mapped on their own. */
+    const size_t RingsSize =
+        Mirrored ? 0
+                 : (size_t)RingSize * 2 * (QueueCount - PriorityCount) + (size_t)PriorityRingSize * 2 * PriorityCount;
+    const size_t RegionSize = RingsSize + (BufferRegion ? TUN_COMPLETION_RING_SIZE(Capacity) * QueueCount : 0);
+    const size_t RqbSize = sizeof(TUN_REGISTER_QUEUES) + sizeof(TUN_REGISTER_RINGS) * QueueCount +
+                           (BufferRegion ? sizeof(TUN_REGISTER_REGION) : 0) +
+                           (HandOff ? sizeof(TUN_REGISTER_SECTION) : 0);
+    BYTE *AllocatedRegion = NULL;
+    HANDLE Section = NULL;
+    if (HandOff)
     {
-        LastError = LOG_LAST_ERROR(L"Failed to allocate ring memory (requested size: 0x%zx)", (size_t)RingSize * 2);
-        goto cleanupRings;
+        AllocatedRegion = MapRingSection(RegionSize, NumaNode, &Section);
+        if (!AllocatedRegion)
+        {
+            LastError = GetLastError();
+            goto cleanupRings;
+        }
     }
-    Session->Descriptor.Send.RingSize = RingSize;
-    Session->Descriptor.Send.Ring = (TUN_RING *)AllocatedRegion;
-    Session->Descriptor.Send.TailMoved = CreateEventW(&SecurityAttributes, FALSE, FALSE, NULL);
-    if (!Session->Descriptor.Send.TailMoved)
+    else if (RegionSize)
     {
-        LastError = LOG_LAST_ERROR(L"Failed to create send event");
+        const size_t LargePageSize = GetLargePageMinimum();
+        if (Flags & WINTUN_SESSION_FLAG_LARGE_PAGES && LargePageSize)
+        {
+            const size_t LargeRegionSize = (RegionSize + LargePageSize - 1) & ~(LargePageSize - 1);
+            AllocatedRegion = VirtualAllocExNuma(
+                GetCurrentProcess(),
+                NULL,
+                LargeRegionSize,
+                MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+                PAGE_READWRITE,
+                NumaNode);
+            if (!AllocatedRegion)
+                LOG(WINTUN_LOG_WARN,
+                    L"Failed to allocate ring memory from large pages (requested size: 0x%zx, error: %u), falling "
+                    L"back to regular pages",
+                    LargeRegionSize,
+                    GetLastError());
+        }
+        if (!AllocatedRegion)
+            AllocatedRegion = VirtualAllocExNuma(
+                GetCurrentProcess(), NULL, RegionSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE, NumaNode);
+        if (!AllocatedRegion)
+        {
+            LastError = LOG_LAST_ERROR(L"Failed to allocate ring memory (requested size: 0x%zx)", RegionSize);
+            goto cleanupRings;
+        }
+    }
+    if (Mirrored && !MapMirroredRings(Session, QueueCount * 2, NumaNode))
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to map mirrored rings");
         goto cleanupAllocatedRegion;
     }
+    TUN_REGISTER_QUEUES *Rqb = Zalloc(RqbSize);
+    if (!Rqb)
+    {
+        LastError = GetLastError();
+        goto cleanupMirroredRings;
+    }
+    Rqb->Flags = TUN_REGISTER_FLAG_SEND_ALERTABLE | TUN_REGISTER_FLAG_RING_V2;
+    if (Mirrored)
+        Rqb->Flags |= TUN_REGISTER_FLAG_MIRRORED;
+    if (Flags & WINTUN_SESSION_FLAG_METADATA)
+        Rqb->Flags |= TUN_REGISTER_FLAG_METADATA;
+    if (TimestampSize)
+        Rqb->Flags |= TUN_REGISTER_FLAG_TIMESTAMP;
+    if (Flags & WINTUN_SESSION_FLAG_PRIORITY_QUEUE)
+        Rqb->Flags |= TUN_REGISTER_FLAG_PRIORITY;
+    if (NumaNode != NUMA_NO_PREFERRED_NODE)
+    {
+        Rqb->Flags |= TUN_REGISTER_FLAG_NUMA_NODE;
+        Rqb->NumaNode = NumaNode;
+    }
+    Rqb->QueueCount = QueueCount;
+    if (MaxPacketSize < WINTUN_MAX_IP_PACKET_SIZE + PrefixSize)
+        Rqb->MaxPacketSize = MaxPacketSize;
+    if (BufferRegion)
+    {
+        Rqb->Flags |= TUN_REGISTER_FLAG_BUFFER_REGION;
+        TUN_REGISTER_REGION *Rrb = (TUN_REGISTER_REGION *)&Rqb->Queues[QueueCount];
+        Rrb->Region = (ULONG_PTR)BufferRegion;
+        Rrb->RegionSize = BufferRegionSize;
+        Rrb->CompletionRingSize = (ULONG)TUN_COMPLETION_RING_SIZE(Capacity);
+        Rrb->CompletionRings = (ULONG_PTR)(AllocatedRegion + RingsSize);
+    }
+    if (HandOff)
+    {
+        Rqb->Flags |= TUN_REGISTER_FLAG_SECTION;
+        TUN_REGISTER_SECTION *Rsb = (TUN_REGISTER_SECTION *)&Rqb->Queues[QueueCount];
+        Rsb->Section = (ULONG_PTR)Section;
+    }
 
-    Session->Descriptor.Receive.RingSize = RingSize;
-    Session->Descriptor.Receive.Ring = (TUN_RING *)(AllocatedRegion + RingSize);
-    Session->Descriptor.Receive.TailMoved = CreateEventW(&SecurityAttributes, FALSE, FALSE, NULL);
-    if (!Session->Descriptor.Receive.TailMoved)
+    DWORD Index;
+    for (Index = 0; Index < QueueCount; ++Index)
     {
-        LastError = LOG_LAST_ERROR(L"Failed to create receive event");
-        goto cleanupSendTailMoved;
+        TUN_SESSION *Queue = &Session[Index];
+        const ULONG QueueRingSize = Index < QueueCount - PriorityCount ? RingSize : PriorityRingSize;
+        Queue->Descriptor.Send.RingSize = QueueRingSize;
+        if (!Mirrored)
+            Queue->Descriptor.Send.RingV2 = (TUN_RING_V2 *)(AllocatedRegion + (size_t)RingSize * 2 * Index);
+        /* Clients may wait on the read-wait event before their first WintunReceivePacket(s). */
+        Queue->Descriptor.Send.RingV2->Alertable = TRUE;
+        /* The priority ring is read along with the first queue's, so its tail moves signal the same event. */
+        if (Index < QueueCount - PriorityCount)
+            Queue->Descriptor.Send.TailMoved = CreateEventW(&SecurityAttributes, FALSE, FALSE, NULL);
+        else if (!DuplicateHandle(
+                     GetCurrentProcess(),
+                     Session->Descriptor.Send.TailMoved,
+                     GetCurrentProcess(),
+                     &Queue->Descriptor.Send.TailMoved,
+                     0,
+                     FALSE,
+                     DUPLICATE_SAME_ACCESS))
+            Queue->Descriptor.Send.TailMoved = NULL;
+        if (!Queue->Descriptor.Send.TailMoved)
+        {
+            LastError = LOG_LAST_ERROR(L"Failed to create send event");
+            goto cleanupTailMoved;
+        }
+
+        Queue->Descriptor.Receive.RingSize = QueueRingSize;
+        if (!Mirrored)
+            Queue->Descriptor.Receive.RingV2 = (TUN_RING_V2 *)((BYTE *)Queue->Descriptor.Send.RingV2 + QueueRingSize);
+        Queue->Descriptor.Receive.TailMoved = CreateEventW(&SecurityAttributes, FALSE, FALSE, NULL);
+        if (!Queue->Descriptor.Receive.TailMoved)
+        {
+            LastError = LOG_LAST_ERROR(L"Failed to create receive event");
+            CloseHandle(Queue->Descriptor.Send.TailMoved);
+            goto cleanupTailMoved;
+        }
+        Rqb->Queues[Index] = Queue->Descriptor;
+        if (HandOff)
+        {
+            /* The driver takes rings in a section by their offset in it. */
+            Rqb->Queues[Index].Send.RingV2 =
+                (TUN_RING_V2 *)(ULONG_PTR)((BYTE *)Queue->Descriptor.Send.RingV2 - AllocatedRegion);
+            Rqb->Queues[Index].Receive.RingV2 =
+                (TUN_RING_V2 *)(ULONG_PTR)((BYTE *)Queue->Descriptor.Receive.RingV2 - AllocatedRegion);
+        }
     }
 
     Session->Handle = AdapterOpenDeviceObject(Adapter);
     if (Session->Handle == INVALID_HANDLE_VALUE)
     {
         LastError = LOG(WINTUN_LOG_ERR, L"Failed to open adapter device object");
-        goto cleanupReceiveTailMoved;
+        goto cleanupTailMoved;
     }
     DWORD BytesReturned;
     if (!DeviceIoControl(
             Session->Handle,
-            TUN_IOCTL_REGISTER_RINGS,
-            &Session->Descriptor,
-            sizeof(TUN_REGISTER_RINGS),
+            TUN_IOCTL_REGISTER_QUEUES,
+            Rqb,
+            (DWORD)RqbSize,
             NULL,
             0,
             &BytesReturned,
@@ -127,157 +674,803 @@ WintunStartSession(WINTUN_ADAPTER *Adapter, DWORD Capacity)
         LastError = LOG_LAST_ERROR(L"Failed to register rings");
         goto cleanupHandle;
     }
-    Session->Capacity = Capacity;
-    (VOID) InitializeCriticalSectionAndSpinCount(&Session->Receive.Lock, LOCK_SPIN_COUNT);
-    (VOID) InitializeCriticalSectionAndSpinCount(&Session->Send.Lock, LOCK_SPIN_COUNT);
+    Free(Rqb);
+    Session->QueueCount = QueueCount;
+    Session->Section = Section;
+    for (Index = 0; Index < QueueCount; ++Index)
+    {
+        InitializeQueue(Session, Index, Flags, MaxPacketSize);
+        if (BufferRegion)
+        {
+            TUN_SESSION *Queue = &Session[Index];
+            Queue->BufferRegion = BufferRegion;
+            Queue->BufferRegionSize = BufferRegionSize;
+            Queue->CompletionRing =
+                (TUN_COMPLETION_RING *)(AllocatedRegion + RingsSize + TUN_COMPLETION_RING_SIZE(Capacity) * Index);
+        }
+    }
+    TraceLoggingWrite(
+        TraceProvider,
+        "StartSession",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(TRACE_KEYWORD_STATE),
+        TraceLoggingPointer(Session, "Session"),
+        TraceLoggingUInt32(QueueCount, "Queues"),
+        TraceLoggingHexUInt32(Flags, "Flags"),
+        TraceLoggingUInt32(Capacity, "Capacity"),
+        TraceLoggingUInt32(MaxPacketSize, "MaxPacketSize"));
     return Session;
 cleanupHandle:
     CloseHandle(Session->Handle);
-cleanupReceiveTailMoved:
-    CloseHandle(Session->Descriptor.Receive.TailMoved);
-cleanupSendTailMoved:
-    CloseHandle(Session->Descriptor.Send.TailMoved);
+cleanupTailMoved:
+    while (Index--)
+    {
+        CloseHandle(Session[Index].Descriptor.Receive.TailMoved);
+        CloseHandle(Session[Index].Descriptor.Send.TailMoved);
+    }
+    Free(Rqb);
+cleanupMirroredRings:
+    if (Mirrored)
+        UnmapMirroredRings(Session, QueueCount * 2);
 cleanupAllocatedRegion:
-    VirtualFree(AllocatedRegion, 0, MEM_RELEASE);
+    if (Section)
+    {
+        UnmapViewOfFile(AllocatedRegion);
+        CloseHandle(Section);
+    }
+    else if (AllocatedRegion)
+        VirtualFree(AllocatedRegion, 0, MEM_RELEASE);
 cleanupRings:
-    Free(Session);
+    VirtualFree(Session, 0, MEM_RELEASE);
 cleanup:
     SetLastError(LastError);
     return NULL;
 }
 
+WINTUN_START_SESSION_EX_FUNC WintunStartSessionEx;
+_Use_decl_annotations_
+TUN_SESSION *WINAPI
+WintunStartSessionEx(WINTUN_ADAPTER *Adapter, DWORD Capacity, DWORD QueueCount, DWORD Flags, DWORD NumaNode)
+{
+    return StartSession(Adapter, Capacity, QueueCount, Flags, NumaNode, NULL, 0);
+}
+
+WINTUN_START_SESSION_WITH_BUFFERS_FUNC WintunStartSessionWithBuffers;
+_Use_decl_annotations_
+TUN_SESSION *WINAPI
+WintunStartSessionWithBuffers(
+    WINTUN_ADAPTER *Adapter,
+    DWORD Capacity,
+    DWORD QueueCount,
+    DWORD Flags,
+    DWORD NumaNode,
+    BYTE *BufferRegion,
+    DWORD BufferRegionSize)
+{
+    if (!BufferRegion || !BufferRegionSize)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    return StartSession(Adapter, Capacity, QueueCount, Flags, NumaNode, BufferRegion, BufferRegionSize);
+}
+
+WINTUN_START_SESSION_FUNC WintunStartSession;
+_Use_decl_annotations_
+TUN_SESSION *WINAPI
+WintunStartSession(WINTUN_ADAPTER *Adapter, DWORD Capacity)
+{
+    return WintunStartSessionEx(Adapter, Capacity, 1, 0, NUMA_NO_PREFERRED_NODE);
+}
+
 WINTUN_END_SESSION_FUNC WintunEndSession;
 _Use_decl_annotations_
 VOID WINAPI
 WintunEndSession(TUN_SESSION *Session)
 {
-    DeleteCriticalSection(&Session->Send.Lock);
-    DeleteCriticalSection(&Session->Receive.Lock);
+    TraceLoggingWrite(
+        TraceProvider,
+        "EndSession",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(TRACE_KEYWORD_STATE),
+        TraceLoggingPointer(Session, "Session"));
     CloseHandle(Session->Handle);
-    CloseHandle(Session->Descriptor.Send.TailMoved);
-    CloseHandle(Session->Descriptor.Receive.TailMoved);
-    VirtualFree(Session->Descriptor.Send.Ring, 0, MEM_RELEASE);
-    Free(Session);
+    for (ULONG Index = 0; Index < Session->QueueCount; ++Index)
+    {
+        TUN_SESSION *Queue = &Session[Index];
+        ClearReadNotification(Queue);
+        DeleteCriticalSection(&Queue->Send.Lock);
+        DeleteCriticalSection(&Queue->Receive.Lock);
+        CloseHandle(Queue->Descriptor.Send.TailMoved);
+        CloseHandle(Queue->Descriptor.Receive.TailMoved);
+    }
+    if (Session->Flags & WINTUN_SESSION_FLAG_MIRRORED_RINGS)
+    {
+        UnmapMirroredRings(Session, Session->QueueCount * 2);
+        /* Completion rings, if any, are all that is left of the ring memory. */
+        if (Session->CompletionRing)
+            VirtualFree(Session->CompletionRing, 0, MEM_RELEASE);
+    }
+    else if (Session->Section)
+    {
+        UnmapViewOfFile(Session->Descriptor.Send.RingV2);
+        CloseHandle(Session->Section);
+    }
+    else
+        VirtualFree(Session->Descriptor.Send.RingV2, 0, MEM_RELEASE);
+    VirtualFree(Session, 0, MEM_RELEASE);
 }
 
-WINTUN_GET_READ_WAIT_EVENT_FUNC WintunGetReadWaitEvent;
+_Return_type_success_(return != FALSE)
+static BOOL
+DuplicateInto(_In_ HANDLE Process, _In_ HANDLE Source, _Out_ DWORD64 *Target)
+{
+    HANDLE Handle;
+    if (!DuplicateHandle(GetCurrentProcess(), Source, Process, &Handle, 0, FALSE, DUPLICATE_SAME_ACCESS))
+        return FALSE;
+    *Target = (ULONG_PTR)Handle;
+    return TRUE;
+}
+
+static VOID
+CloseInto(_In_ HANDLE Process, _In_ DWORD64 Target)
+{
+    if (Target)
+        DuplicateHandle(Process, (HANDLE)(ULONG_PTR)Target, NULL, NULL, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+}
+
+WINTUN_HAND_OFF_SESSION_FUNC WintunHandOffSession;
 _Use_decl_annotations_
-HANDLE WINAPI
-WintunGetReadWaitEvent(TUN_SESSION *Session)
+BOOL WINAPI
+WintunHandOffSession(TUN_SESSION *Session, HANDLE Process, WINTUN_SESSION_HAND_OFF *HandOff)
 {
-    return Session->Descriptor.Send.TailMoved;
+    DWORD LastError;
+    ZeroMemory(HandOff, sizeof(*HandOff));
+    if (!Session->Section)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
+    }
+    HandOff->Capacity = Session->Capacity;
+    HandOff->QueueCount = Session->QueueCount;
+    HandOff->Flags = Session->Flags;
+    HandOff->MaxPacketSize = Session->MaxPacketSize;
+    if (!DuplicateInto(Process, Session->Handle, &HandOff->Device) ||
+        !DuplicateInto(Process, Session->Section, &HandOff->Section))
+        goto cleanupHandles;
+    for (ULONG Index = 0; Index < Session->QueueCount; ++Index)
+    {
+        if (!DuplicateInto(Process, Session[Index].Descriptor.Send.TailMoved, &HandOff->Queues[Index].SendTailMoved) ||
+            !DuplicateInto(
+                Process, Session[Index].Descriptor.Receive.TailMoved, &HandOff->Queues[Index].ReceiveTailMoved))
+            goto cleanupHandles;
+    }
+    TraceLoggingWrite(
+        TraceProvider,
+        "HandOffSession",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(TRACE_KEYWORD_STATE),
+        TraceLoggingPointer(Session, "Session"),
+        TraceLoggingUInt32(GetProcessId(Process), "ProcessId"));
+    return TRUE;
+cleanupHandles:
+    LastError = LOG_LAST_ERROR(L"Failed to duplicate session handles");
+    for (ULONG Index = 0; Index < Session->QueueCount; ++Index)
+    {
+        CloseInto(Process, HandOff->Queues[Index].ReceiveTailMoved);
+        CloseInto(Process, HandOff->Queues[Index].SendTailMoved);
+    }
+    CloseInto(Process, HandOff->Section);
+    CloseInto(Process, HandOff->Device);
+    ZeroMemory(HandOff, sizeof(*HandOff));
+    SetLastError(LastError);
+    return FALSE;
 }
 
-WINTUN_RECEIVE_PACKET_FUNC WintunReceivePacket;
+/* The predecessor may have released packets past one it had not, which leaves them flagged in the send ring. They are
+ * retrieved again along with that one, so clear them back to how the driver put them in the ring. */
+static VOID
+RewindSendRing(_Inout_ TUN_SESSION *Session)
+{
+    TUN_RING_V2 *Ring = Session->Descriptor.Send.RingV2;
+    const ULONG BuffHead = ReadULongAcquire(&Ring->Head);
+    const ULONG BuffTail = ReadULongAcquire(&Ring->Tail);
+    Session->Send.Head = Session->Send.Tail = Session->Send.HeadRelease = BuffHead;
+    if (BuffHead >= Session->Capacity || BuffTail >= Session->Capacity)
+        return;
+    for (ULONG Offset = BuffHead, BuffContent = TUN_RING_WRAP(BuffTail - BuffHead, Session->Capacity);
+         BuffContent >= sizeof(TUN_PACKET);)
+    {
+        TUN_PACKET *BuffPacket = (TUN_PACKET *)&Ring->Data[Offset];
+        const ULONG PacketSize = BuffPacket->Size & ~TUN_PACKET_RELEASE;
+        const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + PacketSize);
+        if (PacketSize > Session->MaxPacketSize || AlignedPacketSize > BuffContent)
+            break;
+        BuffPacket->Size = PacketSize;
+        Offset = TUN_RING_WRAP(Offset + AlignedPacketSize, Session->Capacity);
+        BuffContent -= AlignedPacketSize;
+    }
+}
+
+WINTUN_TAKE_OVER_SESSION_FUNC WintunTakeOverSession;
 _Use_decl_annotations_
-BYTE *WINAPI
-WintunReceivePacket(TUN_SESSION *Session, DWORD *PacketSize)
+TUN_SESSION *WINAPI
+WintunTakeOverSession(const WINTUN_SESSION_HAND_OFF *HandOff)
 {
     DWORD LastError;
-    EnterCriticalSection(&Session->Send.Lock);
-    if (Session->Send.Head >= Session->Capacity)
+    const DWORD Capacity = HandOff->Capacity, QueueCount = HandOff->QueueCount;
+    const DWORD PriorityCount = !!(HandOff->Flags & WINTUN_SESSION_FLAG_PRIORITY_QUEUE);
+    if (QueueCount <= PriorityCount || QueueCount > WINTUN_MAX_QUEUES ||
+        !(HandOff->Flags & WINTUN_SESSION_FLAG_HAND_OFF) ||
+        !Capacity || (Capacity & (Capacity - 1)) || Capacity > WINTUN_MAX_RING_CAPACITY ||
+        HandOff->MaxPacketSize > WINTUN_MAX_IP_PACKET_SIZE + sizeof(LONG64) + sizeof(WINTUN_PACKET_METADATA))
     {
-        LastError = ERROR_HANDLE_EOF;
+        LastError = ERROR_INVALID_PARAMETER;
         goto cleanup;
     }
-    const ULONG BuffTail = ReadULongAcquire(&Session->Descriptor.Send.Ring->Tail);
-    if (BuffTail >= Session->Capacity)
+    TUN_SESSION *Session = VirtualAlloc(0, sizeof(TUN_SESSION) * QueueCount, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!Session)
     {
-        LastError = ERROR_HANDLE_EOF;
+        LastError = LOG_LAST_ERROR(L"Failed to allocate session memory");
         goto cleanup;
     }
-    if (Session->Send.Head == BuffTail)
+    SetQueueCapacities(Session, QueueCount, Capacity, HandOff->Flags);
+    const ULONG RingSize = TUN_RING_SIZE(Capacity, HandOff->MaxPacketSize);
+    const ULONG PriorityRingSize = TUN_RING_SIZE(TUN_PRIORITY_RING_CAPACITY(Capacity), HandOff->MaxPacketSize);
+    BYTE *Rings = MapViewOfFile(
+        (HANDLE)(ULONG_PTR)HandOff->Section,
+        FILE_MAP_READ | FILE_MAP_WRITE,
+        0,
+        0,
+        (size_t)RingSize * 2 * (QueueCount - PriorityCount) + (size_t)PriorityRingSize * 2 * PriorityCount);
+    if (!Rings)
     {
-        LastError = ERROR_NO_MORE_ITEMS;
-        goto cleanup;
+        LastError = LOG_LAST_ERROR(L"Failed to map ring section");
+        goto cleanupSession;
     }
-    const ULONG BuffContent = TUN_RING_WRAP(BuffTail - Session->Send.Head, Session->Capacity);
-    if (BuffContent < sizeof(TUN_PACKET))
+    Session->Handle = (HANDLE)(ULONG_PTR)HandOff->Device;
+    DWORD BytesReturned;
+    if (!DeviceIoControl(Session->Handle, TUN_IOCTL_TAKE_OVER, NULL, 0, NULL, 0, &BytesReturned, NULL))
     {
-        LastError = ERROR_INVALID_DATA;
-        goto cleanup;
+        LastError = LOG_LAST_ERROR(L"Failed to take over rings");
+        goto cleanupRings;
     }
-    TUN_PACKET *BuffPacket = (TUN_PACKET *)&Session->Descriptor.Send.Ring->Data[Session->Send.Head];
-    if (BuffPacket->Size > WINTUN_MAX_IP_PACKET_SIZE)
+    Session->QueueCount = QueueCount;
+    Session->Section = (HANDLE)(ULONG_PTR)HandOff->Section;
+    for (DWORD Index = 0; Index < QueueCount; ++Index)
     {
-        LastError = ERROR_INVALID_DATA;
+        TUN_SESSION *Queue = &Session[Index];
+        const ULONG QueueRingSize = Index < QueueCount - PriorityCount ? RingSize : PriorityRingSize;
+        Queue->Descriptor.Send.RingSize = QueueRingSize;
+        Queue->Descriptor.Send.RingV2 = (TUN_RING_V2 *)(Rings + (size_t)RingSize * 2 * Index);
+        Queue->Descriptor.Send.TailMoved = (HANDLE)(ULONG_PTR)HandOff->Queues[Index].SendTailMoved;
+        Queue->Descriptor.Receive.RingSize = QueueRingSize;
+        Queue->Descriptor.Receive.RingV2 = (TUN_RING_V2 *)((BYTE *)Queue->Descriptor.Send.RingV2 + QueueRingSize);
+        Queue->Descriptor.Receive.TailMoved = (HANDLE)(ULONG_PTR)HandOff->Queues[Index].ReceiveTailMoved;
+        InitializeQueue(Session, Index, HandOff->Flags, HandOff->MaxPacketSize);
+        RewindSendRing(Queue);
+        Queue->Receive.Head = ReadULongAcquire(&Queue->Descriptor.Receive.RingV2->Head);
+        Queue->Receive.Tail = Queue->Receive.TailRelease = ReadULongAcquire(&Queue->Descriptor.Receive.RingV2->Tail);
+    }
+    TraceLoggingWrite(
+        TraceProvider,
+        "TakeOverSession",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(TRACE_KEYWORD_STATE),
+        TraceLoggingPointer(Session, "Session"),
+        TraceLoggingUInt32(QueueCount, "Queues"),
+        TraceLoggingHexUInt32(HandOff->Flags, "Flags"),
+        TraceLoggingUInt32(Capacity, "Capacity"),
+        TraceLoggingUInt32(HandOff->MaxPacketSize, "MaxPacketSize"));
+    return Session;
+cleanupRings:
+    UnmapViewOfFile(Rings);
+cleanupSession:
+    VirtualFree(Session, 0, MEM_RELEASE);
+cleanup:
+    SetLastError(LastError);
+    return NULL;
+}
+
+WINTUN_GET_SESSION_QUEUE_FUNC WintunGetSessionQueue;
+_Use_decl_annotations_
+TUN_SESSION *WINAPI
+WintunGetSessionQueue(TUN_SESSION *Session, DWORD QueueIndex)
+{
+    if (QueueIndex >= Session->QueueCount - !!(Session->Flags & WINTUN_SESSION_FLAG_PRIORITY_QUEUE))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    return &Session[QueueIndex];
+}
+
+WINTUN_GET_SESSION_PRIORITY_QUEUE_FUNC WintunGetSessionPriorityQueue;
+_Use_decl_annotations_
+TUN_SESSION *WINAPI
+WintunGetSessionPriorityQueue(TUN_SESSION *Session)
+{
+    if (!(Session->Flags & WINTUN_SESSION_FLAG_PRIORITY_QUEUE))
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return NULL;
+    }
+    return &Session[Session->QueueCount - 1];
+}
+
+WINTUN_GET_READ_WAIT_EVENT_FUNC WintunGetReadWaitEvent;
+_Use_decl_annotations_
+HANDLE WINAPI
+WintunGetReadWaitEvent(TUN_SESSION *Session)
+{
+    return Session->Descriptor.Send.TailMoved;
+}
+
+static VOID CALLBACK
+ReadWaitCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _Inout_opt_ VOID *Context,
+    _Inout_ PTP_WAIT Wait,
+    _In_ TP_WAIT_RESULT WaitResult)
+{
+    UNREFERENCED_PARAMETER(Instance);
+    UNREFERENCED_PARAMETER(Wait);
+    UNREFERENCED_PARAMETER(WaitResult);
+    TUN_SESSION *Session = Context;
+    Session->Send.Notify.Callback(Session, Session->Send.Notify.Context);
+    if (!ReadNoFence(&Session->Send.Notify.Closing))
+        ArmReadNotification(Session);
+}
+
+WINTUN_SET_READ_CALLBACK_FUNC WintunSetReadCallback;
+_Use_decl_annotations_
+BOOL WINAPI
+WintunSetReadCallback(
+    TUN_SESSION *Session,
+    WINTUN_READ_CALLBACK *Callback,
+    VOID *Context,
+    TP_CALLBACK_ENVIRON *CallbackEnvironment)
+{
+    Session = ReaderOf(Session);
+    ClearReadNotification(Session);
+    if (!Callback)
+        return TRUE;
+    Session->Send.Notify.Callback = Callback;
+    Session->Send.Notify.Context = Context;
+    Session->Send.Notify.Closing = FALSE;
+    Session->Send.Notify.Wait = CreateThreadpoolWait(ReadWaitCallback, Session, CallbackEnvironment);
+    if (!Session->Send.Notify.Wait)
+    {
+        LOG_LAST_ERROR(L"Failed to create thread pool wait");
+        return FALSE;
+    }
+    ArmReadNotification(Session);
+    return TRUE;
+}
+
+WINTUN_SET_READ_COMPLETION_PORT_FUNC WintunSetReadCompletionPort;
+_Use_decl_annotations_
+BOOL WINAPI
+WintunSetReadCompletionPort(TUN_SESSION *Session, HANDLE CompletionPort, ULONG_PTR CompletionKey)
+{
+    DWORD LastError;
+    Session = ReaderOf(Session);
+    ClearReadNotification(Session);
+    if (!CompletionPort)
+        return TRUE;
+    HMODULE Ntdll = GetModuleHandleW(L"ntdll.dll");
+    if (!Ntdll ||
+        (*(FARPROC *)&NtCreateWaitCompletionPacket = GetProcAddress(Ntdll, "NtCreateWaitCompletionPacket")) == NULL ||
+        (*(FARPROC *)&NtAssociateWaitCompletionPacket = GetProcAddress(Ntdll, "NtAssociateWaitCompletionPacket")) ==
+            NULL ||
+        (*(FARPROC *)&NtCancelWaitCompletionPacket = GetProcAddress(Ntdll, "NtCancelWaitCompletionPacket")) == NULL)
+    {
+        LastError = ERROR_NOT_SUPPORTED;
         goto cleanup;
     }
-    const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + BuffPacket->Size);
-    if (AlignedPacketSize > BuffContent)
+    HANDLE CompletionPacket;
+    NTSTATUS Status = NtCreateWaitCompletionPacket(&CompletionPacket, GENERIC_ALL, NULL);
+    if (!NT_SUCCESS(Status))
     {
-        LastError = ERROR_INVALID_DATA;
+        LastError = LOG_ERROR(RtlNtStatusToDosError(Status), L"Failed to create wait completion packet");
         goto cleanup;
     }
-    *PacketSize = BuffPacket->Size;
-    BYTE *Packet = BuffPacket->Data;
-    Session->Send.Head = TUN_RING_WRAP(Session->Send.Head + AlignedPacketSize, Session->Capacity);
-    Session->Send.PacketsToRelease++;
+    EnterCriticalSection(&Session->Send.Lock);
+    Session->Send.Notify.CompletionPort = CompletionPort;
+    Session->Send.Notify.CompletionKey = CompletionKey;
+    Session->Send.Notify.CompletionPacket = CompletionPacket;
+    ArmReadNotification(Session);
     LeaveCriticalSection(&Session->Send.Lock);
-    return Packet;
+    return TRUE;
 cleanup:
-    LeaveCriticalSection(&Session->Send.Lock);
     SetLastError(LastError);
-    return NULL;
+    return FALSE;
 }
 
-WINTUN_RELEASE_RECEIVE_PACKET_FUNC WintunReleaseReceivePacket;
+/* Counts a packet into a latency histogram of WINTUN_LATENCY_BUCKETS. Callers hold the lock of the direction the
+ * histogram belongs to. */
+static VOID
+CountLatency(_Inout_ DWORD64 *Histogram, _In_ LONG64 Ticks, _In_ LONG64 Frequency)
+{
+    const DWORD64 Nanoseconds = Ticks > 0 ? (DWORD64)(Ticks / Frequency) * 1000000000 +
+                                                (DWORD64)(Ticks % Frequency) * 1000000000 / (DWORD64)Frequency
+                                          : 0;
+    DWORD Bucket = 0;
+    if (Nanoseconds)
+        _BitScanReverse(&Bucket, (DWORD)min(Nanoseconds, MAXDWORD));
+    WriteNoFence64((LONG64 *)&Histogram[Bucket], ReadNoFence64((LONG64 *)&Histogram[Bucket]) + 1);
+}
+
+/* Retrieves packets from the send ring of Queue, which is the priority queue when read along with the first queue.
+ * Returns why it stopped short of MaxCount. */
+static DWORD
+ReceiveFromRing(
+    _Inout_ TUN_SESSION *Queue,
+    _Out_writes_to_(MaxCount, *Received) BYTE **Packets,
+    _Out_writes_to_(MaxCount, *Received) DWORD *PacketSizes,
+    _In_ DWORD MaxCount,
+    _In_ LONG64 Now,
+    _In_ LONG64 Frequency,
+    _Out_ DWORD *Received)
+{
+    DWORD LastError, Count = 0;
+    if (Queue->Send.Head >= Queue->Capacity)
+    {
+        *Received = 0;
+        return ERROR_HANDLE_EOF;
+    }
+    for (LastError = ERROR_NO_MORE_ITEMS; Count < MaxCount; ++Count)
+    {
+        if (Queue->Send.Head == Queue->Send.Tail)
+        {
+            const ULONG BuffTail = ReadULongAcquire(&Queue->Descriptor.Send.RingV2->Tail);
+            if (BuffTail >= Queue->Capacity)
+            {
+                LastError = ERROR_HANDLE_EOF;
+                break;
+            }
+            Queue->Send.Tail = BuffTail;
+            if (Queue->Send.Head == BuffTail)
+                break;
+        }
+        const ULONG BuffContent = TUN_RING_WRAP(Queue->Send.Tail - Queue->Send.Head, Queue->Capacity);
+        if (BuffContent < sizeof(TUN_PACKET))
+        {
+            LastError = ERROR_INVALID_DATA;
+            break;
+        }
+        TUN_PACKET *BuffPacket = (TUN_PACKET *)&Queue->Descriptor.Send.RingV2->Data[Queue->Send.Head];
+        if (BuffPacket->Size > Queue->MaxPacketSize)
+        {
+            LastError = ERROR_INVALID_DATA;
+            break;
+        }
+        const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + BuffPacket->Size);
+        if (AlignedPacketSize > BuffContent || BuffPacket->Size < Queue->PrefixSize)
+        {
+            LastError = ERROR_INVALID_DATA;
+            break;
+        }
+        if (Queue->TimestampSize)
+            CountLatency(Queue->Send.Latency, Now - *(const LONG64 UNALIGNED *)BuffPacket->Data, Frequency);
+        PacketSizes[Count] = BuffPacket->Size - Queue->PrefixSize;
+        Packets[Count] = BuffPacket->Data + Queue->PrefixSize;
+        Queue->Send.Head = TUN_RING_WRAP(Queue->Send.Head + AlignedPacketSize, Queue->Capacity);
+    }
+    Queue->Send.PacketsToRelease += Count;
+    if (Count && ReadNoFence(&Queue->Descriptor.Send.RingV2->Alertable))
+        WriteNoFence(&Queue->Descriptor.Send.RingV2->Alertable, FALSE);
+    *Received = Count;
+    return LastError;
+}
+
+WINTUN_RECEIVE_PACKETS_FUNC WintunReceivePackets;
 _Use_decl_annotations_
-VOID WINAPI
-WintunReleaseReceivePacket(TUN_SESSION *Session, const BYTE *Packet)
+DWORD WINAPI
+WintunReceivePackets(TUN_SESSION *Session, BYTE **Packets, DWORD *PacketSizes, DWORD MaxCount)
 {
-    EnterCriticalSection(&Session->Send.Lock);
-    TUN_PACKET *ReleasedBuffPacket = (TUN_PACKET *)(Packet - offsetof(TUN_PACKET, Data));
-    ReleasedBuffPacket->Size |= TUN_PACKET_RELEASE;
-    while (Session->Send.PacketsToRelease)
+    DWORD LastError = ERROR_NO_MORE_ITEMS, Count = 0, Received;
+    LARGE_INTEGER Now = { 0 }, Frequency = { 0 };
+    Session = ReaderOf(Session);
+    LockDirection(Session, &Session->Send.Lock);
+    if (Session->TimestampSize)
+    {
+        QueryPerformanceCounter(&Now);
+        QueryPerformanceFrequency(&Frequency);
+    }
+    /* The priority ring is drained first, so its packets never wait behind the bulk of the traffic. Should it fail,
+     * the bulk ring is left for the next call, lest its packets hide the error for good. */
+    if (Session->Priority)
+        LastError = ReceiveFromRing(
+            Session->Priority, Packets, PacketSizes, MaxCount, Now.QuadPart, Frequency.QuadPart, &Count);
+    if (LastError == ERROR_NO_MORE_ITEMS && Count < MaxCount)
+    {
+        LastError = ReceiveFromRing(
+            Session,
+            Packets + Count,
+            PacketSizes + Count,
+            MaxCount - Count,
+            Now.QuadPart,
+            Frequency.QuadPart,
+            &Received);
+        Count += Received;
+    }
+    TraceLoggingWrite(
+        TraceProvider,
+        "ReceivePackets",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingKeyword(TRACE_KEYWORD_SEND),
+        TraceLoggingPointer(Session - Session->QueueIndex, "Session"),
+        TraceLoggingUInt32(Session->QueueIndex, "Queue"),
+        TraceLoggingUInt32(Count, "Packets"),
+        TraceLoggingUInt32(Count ? ERROR_SUCCESS : LastError, "Error"));
+    if (Count)
+        Session->Send.Notify.Armed = FALSE;
+    else if (LastError == ERROR_NO_MORE_ITEMS)
+    {
+        /* The rings are drained, time to re-arm the completion port notification. */
+        RearmReadNotification(Session);
+    }
+    UnlockDirection(Session, &Session->Send.Lock);
+    if (!Count)
+        SetLastError(LastError);
+    return Count;
+}
+
+WINTUN_RECEIVE_PACKET_FUNC WintunReceivePacket;
+_Use_decl_annotations_
+BYTE *WINAPI
+WintunReceivePacket(TUN_SESSION *Session, DWORD *PacketSize)
+{
+    BYTE *Packet;
+    return WintunReceivePackets(Session, &Packet, PacketSize, 1) ? Packet : NULL;
+}
+
+/* Whether the send ring of Queue holds packets not retrieved yet. Unlocked reads: a stale head only makes this return
+ * TRUE early, and the caller's WintunReceivePackets sort it out. */
+static BOOL
+SendRingPending(_In_ TUN_SESSION *Queue)
+{
+    const ULONG Head = ReadULongNoFence(&Queue->Send.Head);
+    return ReadULongNoFence(&Queue->Send.Tail) != Head ||
+           ReadULongAcquire(&Queue->Descriptor.Send.RingV2->Tail) != Head;
+}
+
+static BOOL
+PacketsPending(_In_ TUN_SESSION *Session)
+{
+    return SendRingPending(Session) || (Session->Priority && SendRingPending(Session->Priority));
+}
+
+WINTUN_WAIT_FOR_PACKETS_FUNC WintunWaitForPackets;
+_Use_decl_annotations_
+BOOL WINAPI
+WintunWaitForPackets(TUN_SESSION *Session, DWORD SpinMicroseconds, DWORD Milliseconds)
+{
+    Session = ReaderOf(Session);
+    if (PacketsPending(Session))
+        return TRUE;
+
+    LARGE_INTEGER Frequency, SpinStart, SpinNow;
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&SpinStart);
+    const ULONGLONG SpinMax = (ULONGLONG)Frequency.QuadPart * SpinMicroseconds / 1000000;
+    for (;;)
     {
-        const TUN_PACKET *BuffPacket = (TUN_PACKET *)&Session->Descriptor.Send.Ring->Data[Session->Send.HeadRelease];
+        YieldProcessor();
+        if (PacketsPending(Session))
+        {
+            TraceLoggingWrite(
+                TraceProvider,
+                "WaitSpinHit",
+                TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                TraceLoggingKeyword(TRACE_KEYWORD_SEND),
+                TraceLoggingPointer(Session - Session->QueueIndex, "Session"),
+                TraceLoggingUInt32(Session->QueueIndex, "Queue"));
+            return TRUE;
+        }
+        QueryPerformanceCounter(&SpinNow);
+        if ((ULONGLONG)(SpinNow.QuadPart - SpinStart.QuadPart) >= SpinMax)
+            break;
+    }
+
+    InterlockedExchange(&Session->Descriptor.Send.RingV2->Alertable, TRUE);
+    if (Session->Priority)
+        InterlockedExchange(&Session->Priority->Descriptor.Send.RingV2->Alertable, TRUE);
+    if (PacketsPending(Session))
+        return TRUE;
+    DWORD Result = WaitForSingleObject(Session->Descriptor.Send.TailMoved, Milliseconds);
+    TraceLoggingWrite(
+        TraceProvider,
+        "Wait",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingKeyword(TRACE_KEYWORD_SEND),
+        TraceLoggingPointer(Session - Session->QueueIndex, "Session"),
+        TraceLoggingUInt32(Session->QueueIndex, "Queue"),
+        TraceLoggingBoolean(Result == WAIT_TIMEOUT, "TimedOut"));
+    switch (Result)
+    {
+    case WAIT_OBJECT_0:
+        return TRUE;
+    case WAIT_TIMEOUT:
+        SetLastError(ERROR_TIMEOUT);
+        return FALSE;
+    }
+    return FALSE;
+}
+
+/* Hands the packets released from the head of the send ring of Queue back to the driver. */
+static VOID
+ReleaseSendRing(_Inout_ TUN_SESSION *Queue)
+{
+    while (Queue->Send.PacketsToRelease)
+    {
+        const TUN_PACKET *BuffPacket = (TUN_PACKET *)&Queue->Descriptor.Send.RingV2->Data[Queue->Send.HeadRelease];
         if ((BuffPacket->Size & TUN_PACKET_RELEASE) == 0)
             break;
         const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + (BuffPacket->Size & ~TUN_PACKET_RELEASE));
-        Session->Send.HeadRelease = TUN_RING_WRAP(Session->Send.HeadRelease + AlignedPacketSize, Session->Capacity);
-        Session->Send.PacketsToRelease--;
+        Queue->Send.HeadRelease = TUN_RING_WRAP(Queue->Send.HeadRelease + AlignedPacketSize, Queue->Capacity);
+        Queue->Send.PacketsToRelease--;
     }
-    WriteULongRelease(&Session->Descriptor.Send.Ring->Head, Session->Send.HeadRelease);
-    LeaveCriticalSection(&Session->Send.Lock);
+    WriteULongRelease(&Queue->Descriptor.Send.RingV2->Head, Queue->Send.HeadRelease);
 }
 
-WINTUN_ALLOCATE_SEND_PACKET_FUNC WintunAllocateSendPacket;
+WINTUN_RELEASE_RECEIVE_PACKETS_FUNC WintunReleaseReceivePackets;
 _Use_decl_annotations_
-BYTE *WINAPI
-WintunAllocateSendPacket(TUN_SESSION *Session, DWORD PacketSize)
+VOID WINAPI
+WintunReleaseReceivePackets(TUN_SESSION *Session, const BYTE **Packets, DWORD Count)
 {
-    DWORD LastError;
-    EnterCriticalSection(&Session->Receive.Lock);
-    if (Session->Receive.Tail >= Session->Capacity)
+    Session = ReaderOf(Session);
+    TUN_SESSION *Priority = Session->Priority;
+    BOOL PriorityReleased = FALSE;
+    LockDirection(Session, &Session->Send.Lock);
+    for (DWORD i = 0; i < Count; ++i)
     {
-        LastError = ERROR_HANDLE_EOF;
-        goto cleanup;
+        TUN_PACKET *ReleasedBuffPacket =
+            (TUN_PACKET *)(Packets[i] - Session->PrefixSize - offsetof(TUN_PACKET, Data));
+        ReleasedBuffPacket->Size |= TUN_PACKET_RELEASE;
+        /* Packets of the priority ring are told apart by their address, the ring's mirror or slack included. */
+        if (Priority && (ULONG_PTR)((BYTE *)ReleasedBuffPacket - (BYTE *)Priority->Descriptor.Send.RingV2) <
+                            Priority->Descriptor.Send.RingSize)
+            PriorityReleased = TRUE;
     }
-    const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + PacketSize);
-    const ULONG BuffHead = ReadULongAcquire(&Session->Descriptor.Receive.Ring->Head);
+    if (PriorityReleased)
+        ReleaseSendRing(Priority);
+    ReleaseSendRing(Session);
+    UnlockDirection(Session, &Session->Send.Lock);
+}
+
+WINTUN_RELEASE_RECEIVE_PACKET_FUNC WintunReleaseReceivePacket;
+_Use_decl_annotations_
+VOID WINAPI
+WintunReleaseReceivePacket(TUN_SESSION *Session, const BYTE *Packet)
+{
+    WintunReleaseReceivePackets(Session, &Packet, 1);
+}
+
+/* Checks the receive ring has room for AlignedPacketSize more bytes. The driver's head is only read again when the
+ * cached one shows too little space. */
+static DWORD
+ReserveSendSpace(_Inout_ TUN_SESSION *Session, _In_ ULONG AlignedPacketSize, _Inout_ ULONG *BuffSpace)
+{
+    if (AlignedPacketSize <= *BuffSpace)
+        return ERROR_SUCCESS;
+    const ULONG BuffHead = ReadULongAcquire(&Session->Descriptor.Receive.RingV2->Head);
     if (BuffHead >= Session->Capacity)
+        return ERROR_HANDLE_EOF;
+    Session->Receive.Head = BuffHead;
+    *BuffSpace = TUN_RING_WRAP(BuffHead - Session->Receive.Tail - TUN_ALIGNMENT, Session->Capacity);
+    return AlignedPacketSize > *BuffSpace ? ERROR_BUFFER_OVERFLOW : ERROR_SUCCESS;
+}
+
+/* Moves the receive ring tail past all packets ready to send that follow the last one published, and wakes the
+ * driver if it is waiting. */
+static VOID
+PublishSendPackets(_Inout_ TUN_SESSION *Session)
+{
+    LARGE_INTEGER Now = { 0 };
+    if (Session->TimestampSize)
+        QueryPerformanceCounter(&Now);
+    const ULONG PacketsToRelease = Session->Receive.PacketsToRelease;
+    while (Session->Receive.PacketsToRelease)
+    {
+        TUN_PACKET *BuffPacket = (TUN_PACKET *)&Session->Descriptor.Receive.RingV2->Data[Session->Receive.TailRelease];
+        if (BuffPacket->Size & TUN_PACKET_RELEASE)
+            break;
+        if (Session->TimestampSize)
+            *(LONG64 UNALIGNED *)BuffPacket->Data = Now.QuadPart;
+        const ULONG AlignedPacketSize =
+            TUN_ALIGN(sizeof(TUN_PACKET) + (BuffPacket->Size & ~TUN_PACKET_SIZE_DESCRIPTOR));
+        Session->Receive.TailRelease =
+            TUN_RING_WRAP(Session->Receive.TailRelease + AlignedPacketSize, Session->Capacity);
+        Session->Receive.PacketsToRelease--;
+    }
+    if (Session->Descriptor.Receive.RingV2->Tail != Session->Receive.TailRelease)
+    {
+        WriteULongRelease(&Session->Descriptor.Receive.RingV2->Tail, Session->Receive.TailRelease);
+        const BOOL Signaled = !!ReadAcquire(&Session->Descriptor.Receive.RingV2->Alertable);
+        if (Signaled)
+        {
+            SetEvent(Session->Descriptor.Receive.TailMoved);
+            InterlockedIncrementNoFence64(&Session->Receive.EventsSignaled);
+        }
+        TraceLoggingWrite(
+            TraceProvider,
+            "SendPackets",
+            TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+            TraceLoggingKeyword(TRACE_KEYWORD_RECEIVE),
+            TraceLoggingPointer(Session - Session->QueueIndex, "Session"),
+            TraceLoggingUInt32(Session->QueueIndex, "Queue"),
+            TraceLoggingUInt32(PacketsToRelease - Session->Receive.PacketsToRelease, "Packets"),
+            TraceLoggingUInt32(
+                TUN_RING_WRAP(Session->Receive.Head - Session->Receive.Tail - TUN_ALIGNMENT, Session->Capacity),
+                "RingSpaceLeft"),
+            TraceLoggingBoolean(Signaled, "Signaled"));
+    }
+}
+
+WINTUN_ALLOCATE_SEND_PACKETS_FUNC WintunAllocateSendPackets;
+_Use_decl_annotations_
+DWORD WINAPI
+WintunAllocateSendPackets(TUN_SESSION *Session, BYTE **Packets, const DWORD *PacketSizes, DWORD Count)
+{
+    DWORD LastError, Allocated = 0;
+    LockDirection(Session, &Session->Receive.Lock);
+    if (Session->Receive.Tail >= Session->Capacity)
     {
         LastError = ERROR_HANDLE_EOF;
         goto cleanup;
     }
-    const ULONG BuffSpace = TUN_RING_WRAP(BuffHead - Session->Receive.Tail - TUN_ALIGNMENT, Session->Capacity);
-    if (AlignedPacketSize > BuffSpace)
+    ULONG BuffSpace = TUN_RING_WRAP(Session->Receive.Head - Session->Receive.Tail - TUN_ALIGNMENT, Session->Capacity);
+    for (LastError = ERROR_BUFFER_OVERFLOW; Allocated < Count; ++Allocated)
     {
-        LastError = ERROR_BUFFER_OVERFLOW;
-        goto cleanup;
+        if (PacketSizes[Allocated] > Session->MaxPacketSize - Session->PrefixSize)
+        {
+            LastError = ERROR_INVALID_PARAMETER;
+            break;
+        }
+        const ULONG BuffPacketSize = Session->PrefixSize + PacketSizes[Allocated];
+        const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + BuffPacketSize);
+        if ((LastError = ReserveSendSpace(Session, AlignedPacketSize, &BuffSpace)) != ERROR_SUCCESS)
+            break;
+        TUN_PACKET *BuffPacket = (TUN_PACKET *)&Session->Descriptor.Receive.RingV2->Data[Session->Receive.Tail];
+        BuffPacket->Size = BuffPacketSize | TUN_PACKET_RELEASE;
+        ZeroMemory(BuffPacket->Data + Session->TimestampSize, Session->MetadataSize);
+        Packets[Allocated] = BuffPacket->Data + Session->PrefixSize;
+        Session->Receive.Tail = TUN_RING_WRAP(Session->Receive.Tail + AlignedPacketSize, Session->Capacity);
+        BuffSpace -= AlignedPacketSize;
     }
-    TUN_PACKET *BuffPacket = (TUN_PACKET *)&Session->Descriptor.Receive.Ring->Data[Session->Receive.Tail];
-    BuffPacket->Size = PacketSize | TUN_PACKET_RELEASE;
-    BYTE *Packet = BuffPacket->Data;
-    Session->Receive.Tail = TUN_RING_WRAP(Session->Receive.Tail + AlignedPacketSize, Session->Capacity);
-    Session->Receive.PacketsToRelease++;
-    LeaveCriticalSection(&Session->Receive.Lock);
-    return Packet;
+    Session->Receive.PacketsToRelease += Allocated;
 cleanup:
-    LeaveCriticalSection(&Session->Receive.Lock);
-    SetLastError(LastError);
-    return NULL;
+    UnlockDirection(Session, &Session->Receive.Lock);
+    if (!Allocated)
+        SetLastError(LastError);
+    return Allocated;
+}
+
+WINTUN_ALLOCATE_SEND_PACKET_FUNC WintunAllocateSendPacket;
+_Use_decl_annotations_
+BYTE *WINAPI
+WintunAllocateSendPacket(TUN_SESSION *Session, DWORD PacketSize)
+{
+    BYTE *Packet;
+    return WintunAllocateSendPackets(Session, &Packet, &PacketSize, 1) ? Packet : NULL;
+}
+
+WINTUN_SEND_PACKETS_FUNC WintunSendPackets;
+_Use_decl_annotations_
+VOID WINAPI
+WintunSendPackets(TUN_SESSION *Session, const BYTE **Packets, DWORD Count)
+{
+    LockDirection(Session, &Session->Receive.Lock);
+    for (DWORD i = 0; i < Count; ++i)
+    {
+        TUN_PACKET *ReleasedBuffPacket =
+            (TUN_PACKET *)(Packets[i] - Session->PrefixSize - offsetof(TUN_PACKET, Data));
+        ReleasedBuffPacket->Size &= ~TUN_PACKET_RELEASE;
+    }
+    PublishSendPackets(Session);
+    UnlockDirection(Session, &Session->Receive.Lock);
 }
 
 WINTUN_SEND_PACKET_FUNC WintunSendPacket;
@@ -285,25 +1478,205 @@ _Use_decl_annotations_
 VOID WINAPI
 WintunSendPacket(TUN_SESSION *Session, const BYTE *Packet)
 {
-    EnterCriticalSection(&Session->Receive.Lock);
-    TUN_PACKET *ReleasedBuffPacket = (TUN_PACKET *)(Packet - offsetof(TUN_PACKET, Data));
-    ReleasedBuffPacket->Size &= ~TUN_PACKET_RELEASE;
-    while (Session->Receive.PacketsToRelease)
+    WintunSendPackets(Session, &Packet, 1);
+}
+
+WINTUN_GET_PACKET_METADATA_FUNC WintunGetPacketMetadata;
+_Use_decl_annotations_
+WINTUN_PACKET_METADATA *WINAPI
+WintunGetPacketMetadata(TUN_SESSION *Session, const BYTE *Packet)
+{
+    if (!Session->MetadataSize)
     {
-        const TUN_PACKET *BuffPacket =
-            (TUN_PACKET *)&Session->Descriptor.Receive.Ring->Data[Session->Receive.TailRelease];
-        if (BuffPacket->Size & TUN_PACKET_RELEASE)
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return NULL;
+    }
+    return (WINTUN_PACKET_METADATA *)(Packet - sizeof(WINTUN_PACKET_METADATA));
+}
+
+WINTUN_SEND_BUFFERS_FUNC WintunSendBuffers;
+_Use_decl_annotations_
+DWORD WINAPI
+WintunSendBuffers(
+    TUN_SESSION *Session,
+    const BYTE **Packets,
+    const DWORD *PacketSizes,
+    const WINTUN_PACKET_METADATA *Metadata,
+    DWORD Count)
+{
+    DWORD LastError, Sent = 0;
+    if (!Session->BufferRegion)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return 0;
+    }
+    LockDirection(Session, &Session->Receive.Lock);
+    if (Session->Receive.Tail >= Session->Capacity)
+    {
+        LastError = ERROR_HANDLE_EOF;
+        goto cleanup;
+    }
+    const ULONG BuffPacketSize = Session->PrefixSize + sizeof(TUN_BUFFER_DESCRIPTOR);
+    const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + BuffPacketSize);
+    ULONG BuffSpace = TUN_RING_WRAP(Session->Receive.Head - Session->Receive.Tail - TUN_ALIGNMENT, Session->Capacity);
+    for (LastError = ERROR_BUFFER_OVERFLOW; Sent < Count; ++Sent)
+    {
+        if (Packets[Sent] < Session->BufferRegion || PacketSizes[Sent] > WINTUN_MAX_IP_PACKET_SIZE ||
+            PacketSizes[Sent] > Session->BufferRegionSize ||
+            (size_t)(Packets[Sent] - Session->BufferRegion) > Session->BufferRegionSize - PacketSizes[Sent])
+        {
+            LastError = ERROR_INVALID_PARAMETER;
             break;
-        const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + BuffPacket->Size);
-        Session->Receive.TailRelease =
-            TUN_RING_WRAP(Session->Receive.TailRelease + AlignedPacketSize, Session->Capacity);
-        Session->Receive.PacketsToRelease--;
+        }
+        if ((LastError = ReserveSendSpace(Session, AlignedPacketSize, &BuffSpace)) != ERROR_SUCCESS)
+            break;
+        TUN_PACKET *BuffPacket = (TUN_PACKET *)&Session->Descriptor.Receive.RingV2->Data[Session->Receive.Tail];
+        BuffPacket->Size = BuffPacketSize | TUN_PACKET_SIZE_DESCRIPTOR;
+        if (Metadata)
+            memcpy(BuffPacket->Data + Session->TimestampSize, &Metadata[Sent], Session->MetadataSize);
+        else
+            ZeroMemory(BuffPacket->Data + Session->TimestampSize, Session->MetadataSize);
+        TUN_BUFFER_DESCRIPTOR *Descriptor = (TUN_BUFFER_DESCRIPTOR *)(BuffPacket->Data + Session->PrefixSize);
+        Descriptor->Offset = (ULONG)(Packets[Sent] - Session->BufferRegion);
+        Descriptor->Size = PacketSizes[Sent];
+        Session->Receive.Tail = TUN_RING_WRAP(Session->Receive.Tail + AlignedPacketSize, Session->Capacity);
+        BuffSpace -= AlignedPacketSize;
+    }
+    Session->Receive.PacketsToRelease += Sent;
+    PublishSendPackets(Session);
+cleanup:
+    UnlockDirection(Session, &Session->Receive.Lock);
+    if (!Sent)
+        SetLastError(LastError);
+    return Sent;
+}
+
+WINTUN_GET_COMPLETED_BUFFERS_FUNC WintunGetCompletedBuffers;
+_Use_decl_annotations_
+DWORD WINAPI
+WintunGetCompletedBuffers(TUN_SESSION *Session, BYTE **Buffers, DWORD MaxCount)
+{
+    TUN_COMPLETION_RING *Ring = Session->CompletionRing;
+    if (!Ring)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return 0;
     }
-    if (Session->Descriptor.Receive.Ring->Tail != Session->Receive.TailRelease)
+    /* Completion rings are all sized for the first queue's rings, the priority queue's being smaller. */
+    const ULONG CompletionCount = TUN_COMPLETION_COUNT((Session - Session->QueueIndex)->Capacity);
+    LockDirection(Session, &Session->Receive.Lock);
+    const ULONG Head = Ring->Head, Tail = ReadULongAcquire(&Ring->Tail);
+    DWORD Count = 0;
+    for (; Count < MaxCount && Head + Count != Tail; ++Count)
+        Buffers[Count] = Session->BufferRegion + Ring->Offsets[(Head + Count) & (CompletionCount - 1)];
+    WriteULongRelease(&Ring->Head, Head + Count);
+    /* The driver's receive thread waits on the receive ring's event for room in a full completion ring. Order the
+     * head store before the Alertable load, against its store to Alertable and head load. */
+    MemoryBarrier();
+    if (Count && ReadNoFence(&Ring->Alertable))
     {
-        WriteULongRelease(&Session->Descriptor.Receive.Ring->Tail, Session->Receive.TailRelease);
-        if (ReadAcquire(&Session->Descriptor.Receive.Ring->Alertable))
-            SetEvent(Session->Descriptor.Receive.TailMoved);
+        SetEvent(Session->Descriptor.Receive.TailMoved);
+        InterlockedIncrementNoFence64(&Session->Receive.EventsSignaled);
+    }
+    UnlockDirection(Session, &Session->Receive.Lock);
+    if (!Count)
+        SetLastError(ERROR_NO_MORE_ITEMS);
+    return Count;
+}
+
+WINTUN_GET_SESSION_STATISTICS_FUNC WintunGetSessionStatistics;
+_Use_decl_annotations_
+BOOL WINAPI
+WintunGetSessionStatistics(TUN_SESSION *Session, WINTUN_SESSION_STATISTICS *Statistics)
+{
+    TUN_QUEUE_STATISTICS QueueStatistics;
+    DWORD BytesReturned;
+    if (!DeviceIoControl(
+            Session->Handle,
+            TUN_IOCTL_GET_STATISTICS,
+            &Session->QueueIndex,
+            sizeof(Session->QueueIndex),
+            &QueueStatistics,
+            sizeof(QueueStatistics),
+            &BytesReturned,
+            NULL))
+    {
+        LOG_LAST_ERROR(L"Failed to query ring statistics");
+        return FALSE;
+    }
+    ZeroMemory(Statistics, sizeof(*Statistics));
+    Statistics->Send.Capacity = Session->Capacity;
+    Statistics->Send.HighWater = QueueStatistics.Send.HighWater;
+    Statistics->Send.OverflowDrops = QueueStatistics.Send.OverflowDrops;
+    Statistics->Send.InvalidDrops = QueueStatistics.Send.InvalidDrops;
+    Statistics->Send.EventsSignaled = QueueStatistics.Send.EventsSignaled;
+    Statistics->Send.FilterDrops = QueueStatistics.Send.FilterDrops;
+    Statistics->Receive.Capacity = Session->Capacity;
+    Statistics->Receive.HighWater = QueueStatistics.Receive.HighWater;
+    Statistics->Receive.InvalidDrops = QueueStatistics.Receive.InvalidDrops;
+    Statistics->Receive.SpinHits = QueueStatistics.Receive.SpinHits;
+    Statistics->Receive.Waits = QueueStatistics.Receive.Waits;
+    Statistics->Receive.EventsSignaled = ReadNoFence64(&Session->Receive.EventsSignaled);
+    Statistics->Receive.NblAllocationFailures = QueueStatistics.Receive.NblAllocationFailures;
+    Statistics->Receive.CompletionStalls = QueueStatistics.Receive.CompletionStalls;
+    return TRUE;
+}
+
+WINTUN_GET_SESSION_LATENCY_FUNC WintunGetSessionLatency;
+_Use_decl_annotations_
+BOOL WINAPI
+WintunGetSessionLatency(TUN_SESSION *Session, WINTUN_SESSION_LATENCY *Latency)
+{
+    if (!Session->TimestampSize)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
+    }
+    TUN_QUEUE_STATISTICS QueueStatistics;
+    DWORD BytesReturned;
+    if (!DeviceIoControl(
+            Session->Handle,
+            TUN_IOCTL_GET_STATISTICS,
+            &Session->QueueIndex,
+            sizeof(Session->QueueIndex),
+            &QueueStatistics,
+            sizeof(QueueStatistics),
+            &BytesReturned,
+            NULL))
+    {
+        LOG_LAST_ERROR(L"Failed to query ring statistics");
+        return FALSE;
+    }
+    for (DWORD i = 0; i < WINTUN_LATENCY_BUCKETS; ++i)
+    {
+        Latency->Send[i] = ReadNoFence64((LONG64 *)&Session->Send.Latency[i]);
+        Latency->Receive[i] = QueueStatistics.Receive.Latency[i];
+    }
+    return TRUE;
+}
+
+WINTUN_SET_RECEIVE_FILTER_FUNC WintunSetReceiveFilter;
+_Use_decl_annotations_
+BOOL WINAPI
+WintunSetReceiveFilter(TUN_SESSION *Session, DWORD DefaultAction, const WINTUN_FILTER_RULE *Rules, DWORD RuleCount)
+{
+    if (RuleCount > WINTUN_MAX_FILTER_RULES)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
     }
-    LeaveCriticalSection(&Session->Receive.Lock);
+    /* WINTUN_FILTER_RULE has the layout of TUN_FILTER_RULE. */
+    const DWORD FilterSize = sizeof(TUN_FILTER) + sizeof(TUN_FILTER_RULE) * RuleCount;
+    TUN_FILTER *Filter = Alloc(FilterSize);
+    if (!Filter)
+        return FALSE;
+    Filter->DefaultAction = DefaultAction;
+    Filter->RuleCount = RuleCount;
+    if (RuleCount)
+        memcpy(Filter->Rules, Rules, sizeof(TUN_FILTER_RULE) * RuleCount);
+    DWORD LastError = ERROR_SUCCESS, BytesReturned;
+    if (!DeviceIoControl(Session->Handle, TUN_IOCTL_SET_FILTER, Filter, FilterSize, NULL, 0, &BytesReturned, NULL))
+        LastError = LOG_LAST_ERROR(L"Failed to set receive filter");
+    Free(Filter);
+    return RET_ERROR(TRUE, LastError);
 }
@@ -64,6 +64,112 @@ _Post_maybenull_
 WINTUN_ADAPTER_HANDLE(WINAPI WINTUN_CREATE_ADAPTER_FUNC)
 (_In_z_ LPCWSTR Name, _In_z_ LPCWSTR TunnelType, _In_opt_ const GUID *RequestedGUID);
 
+/**
+ * Describes one adapter to create with WintunCreateAdaptersAsync. The members are as for WintunCreateAdapter.
+ */
+typedef struct _WINTUN_CREATE_ADAPTER_REQUEST
+{
+    LPCWSTR Name;              ///< The requested name of the adapter
+    LPCWSTR TunnelType;        ///< Name of the adapter tunnel type
+    const GUID *RequestedGUID; ///< The GUID of the created network adapter, or NULL
+} WINTUN_CREATE_ADAPTER_REQUEST;
+
+/**
+ * Called by WintunCreateAdaptersAsync once for every request, from a worker thread.
+ *
+ * @param Context       The Context passed to WintunCreateAdaptersAsync.
+ *
+ * @param Index         Index of the request in the Requests array.
+ *
+ * @param Adapter       The adapter handle, which must be released with WintunCloseAdapter, or NULL if the adapter could
+ *                      not be created.
+ *
+ * @param LastError     ERROR_SUCCESS, or the reason the adapter could not be created.
+ */
+typedef VOID(CALLBACK WINTUN_CREATE_ADAPTER_CALLBACK)(
+    _In_opt_ VOID *Context,
+    _In_ DWORD Index,
+    _In_opt_ WINTUN_ADAPTER_HANDLE Adapter,
+    _In_ DWORD LastError);
+
+/**
+ * Creates a batch of new Wintun adapters in the background. The driver is installed once for the whole batch, and the
+ * adapters are brought up concurrently, which is much quicker than calling WintunCreateAdapter repeatedly.
+ *
+ * @param Requests      The adapters to create. The array and its strings may be released once the function returns.
+ *
+ * @param Count         Number of elements in Requests.
+ *
+ * @param Callback      Called once for every request when all adapters of the batch are ready or have failed.
+ *
+ * @param Context       Passed to Callback.
+ *
+ * @return If the function succeeds, the return value is nonzero and Callback will be called Count times. If the
+ *         function fails, the return value is zero and Callback will not be called. To get extended error information,
+ *         call GetLastError.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_CREATE_ADAPTERS_ASYNC_FUNC)(
+    _In_reads_(Count) const WINTUN_CREATE_ADAPTER_REQUEST *Requests,
+    _In_ DWORD Count,
+    _In_ WINTUN_CREATE_ADAPTER_CALLBACK *Callback,
+    _In_opt_ VOID *Context);
+
+/**
+ * A handle representing a pool of Wintun adapters
+ */
+typedef struct _WINTUN_ADAPTER_POOL *WINTUN_ADAPTER_POOL_HANDLE;
+
+/**
+ * Maximum number of adapters kept by an adapter pool
+ */
+#define WINTUN_MAX_POOL_SIZE 64
+
+/**
+ * Creates a pool of Wintun adapters that are installed ahead of time and kept disabled, so that one can be handed
+ * out quickly with WintunClaimPooledAdapter. The pool is filled, and refilled after each claim, in the background.
+ *
+ * @param TunnelType    Name of the adapter tunnel type of the pooled adapters. Zero-terminated string of up to
+ *                      MAX_ADAPTER_NAME-1 characters.
+ *
+ * @param Size          Number of adapters to keep in the pool. Must be between 1 and WINTUN_MAX_POOL_SIZE.
+ *
+ * @return If the function succeeds, the return value is the pool handle. Must be released with
+ * WintunDeleteAdapterPool. If the function fails, the return value is NULL. To get extended error information, call
+ * GetLastError.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+WINTUN_ADAPTER_POOL_HANDLE(WINAPI WINTUN_CREATE_ADAPTER_POOL_FUNC)(_In_z_ LPCWSTR TunnelType, _In_ DWORD Size);
+
+/**
+ * Takes an adapter out of the pool, enables it and names it. If the pool is empty, a new adapter is created as with
+ * WintunCreateAdapter.
+ *
+ * @param Pool          Pool handle obtained with WintunCreateAdapterPool.
+ *
+ * @param Name          The requested name of the adapter. Zero-terminated string of up to MAX_ADAPTER_NAME-1
+ *                      characters.
+ *
+ * @return If the function succeeds, the return value is the adapter handle. Must be released with
+ * WintunCloseAdapter. If the function fails, the return value is NULL. To get extended error information, call
+ * GetLastError.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+WINTUN_ADAPTER_HANDLE(WINAPI WINTUN_CLAIM_POOLED_ADAPTER_FUNC)
+(_In_ WINTUN_ADAPTER_POOL_HANDLE Pool, _In_z_ LPCWSTR Name);
+
+/**
+ * Removes the adapters remaining in the pool and releases it. Adapters already claimed are not affected.
+ *
+ * @param Pool          Pool handle obtained with WintunCreateAdapterPool.
+ */
+typedef VOID(WINAPI WINTUN_DELETE_ADAPTER_POOL_FUNC)(_In_opt_ WINTUN_ADAPTER_POOL_HANDLE Pool);
+
 /**
  * Opens an existing Wintun adapter.
  *
@@ -147,11 +253,45 @@ typedef VOID(CALLBACK *WINTUN_LOGGER_CALLBACK)(
  */
 typedef VOID(WINAPI WINTUN_SET_LOGGER_FUNC)(_In_ WINTUN_LOGGER_CALLBACK NewLogger);
 
+/**
+ * Deliver log messages from a background thread instead of the thread that logs them
+ */
+#define WINTUN_LOGGER_ASYNC 0x1
+
+/**
+ * Sets logger callback function, the minimum level of messages it receives, and how they are delivered.
+ *
+ * @param NewLogger     Pointer to callback function to use as a new global logger. Set to NULL to disable.
+ *
+ * @param MinLevel      Messages below this level are dropped before they are formatted.
+ *
+ * @param Flags         Zero, to call NewLogger from various threads concurrently, as with WintunSetLogger, or
+ *                      WINTUN_LOGGER_ASYNC, to call NewLogger from a single background thread, in order. In the latter
+ *                      case messages are dropped rather than waited for when NewLogger falls behind, and a warning
+ *                      says how many. NewLogger must not call WintunSetLogger or WintunSetLoggerEx, and the background
+ *                      thread keeps wintun.dll loaded until they are called again without WINTUN_LOGGER_ASYNC.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError.
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_SET_LOGGER_EX_FUNC)(
+    _In_opt_ WINTUN_LOGGER_CALLBACK NewLogger,
+    _In_ WINTUN_LOGGER_LEVEL MinLevel,
+    _In_ DWORD Flags);
+
 /**
  * Minimum ring capacity.
  */
 #define WINTUN_MIN_RING_CAPACITY 0x20000 /* 128kiB */
 
+/**
+ * Minimum ring capacity of sessions without WINTUN_SESSION_FLAG_METADATA on adapters with the given MTU. The MTU is
+ * the "MTU" value of the adapter registry key, read when the adapter starts, and defaults to WINTUN_MAX_IP_PACKET_SIZE.
+ * Rings of such sessions also reserve only one MTU-sized packet of extra space past their capacity.
+ */
+#define WINTUN_MIN_RING_CAPACITY_FOR_MTU(Mtu) (2 * ((DWORD)(Mtu) + 1))
+
 /**
  * Maximum ring capacity.
  */
@@ -167,8 +307,8 @@ typedef struct _TUN_SESSION *WINTUN_SESSION_HANDLE;
  *
  * @param Adapter       Adapter handle obtained with WintunOpenAdapter or WintunCreateAdapter
  *
- * @param Capacity      Rings capacity. Must be between WINTUN_MIN_RING_CAPACITY and WINTUN_MAX_RING_CAPACITY (incl.)
- *                      Must be a power of two.
+ * @param Capacity      Rings capacity. Must be between WINTUN_MIN_RING_CAPACITY_FOR_MTU of the adapter MTU and
+ *                      WINTUN_MAX_RING_CAPACITY (incl.) Must be a power of two.
  *
  * @return Wintun session handle. Must be released with WintunEndSession. If the function fails, the return value is
  *         NULL. To get extended error information, call GetLastError.
@@ -178,6 +318,167 @@ _Return_type_success_(return != NULL)
 _Post_maybenull_
 WINTUN_SESSION_HANDLE(WINAPI WINTUN_START_SESSION_FUNC)(_In_ WINTUN_ADAPTER_HANDLE Adapter, _In_ DWORD Capacity);
 
+/**
+ * Maximum number of queues per session.
+ */
+#define WINTUN_MAX_QUEUES 64
+
+/**
+ * Every packet carries a WINTUN_PACKET_METADATA, accessible with WintunGetPacketMetadata, and the adapter advertises
+ * TCP checksum offload and large send offload (LSOv2) to the stack for the duration of the session. Received packets
+ * may then be up to 64kB TCP super-segments that the client must segment, and whose checksums the client must
+ * complete.
+ */
+#define WINTUN_SESSION_FLAG_METADATA 0x1
+
+/**
+ * The client guarantees that, for each queue, calls to WintunReceivePacket(s), WintunReleaseReceivePacket(s) and
+ * WintunWaitForPackets never overlap, and neither do calls to WintunAllocateSendPacket(s) and WintunSendPacket(s), as
+ * is the case with one dedicated reader and one dedicated writer thread. The session then skips all locking on the
+ * packet paths. WintunSetReadCallback and WintunSetReadCompletionPort may still be called from any thread.
+ */
+#define WINTUN_SESSION_FLAG_SINGLE_THREADED 0x2
+
+/**
+ * Back the rings with large pages, if the calling process holds and has enabled SeLockMemoryPrivilege. Otherwise, the
+ * rings silently fall back to regular pages.
+ */
+#define WINTUN_SESSION_FLAG_LARGE_PAGES 0x4
+
+/**
+ * Map the data of each ring twice, back to back, so that packets retrieved or allocated in one go are laid out
+ * contiguously, one after another, even where they wrap around the end of the ring. Capacity must also be a multiple of
+ * the allocation granularity (64kiB). Requires Windows 10 version 1803 or newer, and does not use large pages.
+ */
+#define WINTUN_SESSION_FLAG_MIRRORED_RINGS 0x8
+
+/**
+ * Stamp every packet with the performance counter when it is put in a ring, and count how long packets wait in the
+ * rings, for WintunGetSessionLatency. Each packet then takes 8 bytes more of the ring.
+ */
+#define WINTUN_SESSION_FLAG_TIMESTAMPS 0x10
+
+/**
+ * Keep the rings in a section of shared memory the driver maps on its own, so that the session can outlive the process
+ * that started it, and be handed over with WintunHandOffSession, as on a service restart, without the rings being torn
+ * down or the adapter going down. Cannot be combined with WINTUN_SESSION_FLAG_MIRRORED_RINGS nor with
+ * WintunStartSessionWithBuffers, and does not use large pages.
+ */
+#define WINTUN_SESSION_FLAG_HAND_OFF 0x20
+
+/**
+ * Add a priority queue, obtained with WintunGetSessionPriorityQueue, on top of the QueueCount queues. The driver puts
+ * packets the stack sends with a DSCP of CS5 or above or an 802.1p priority of 5 or above, as well as pure TCP ACKs,
+ * in it rather than in the queue of their flow, and runs its receive thread ahead of the others. Its packets are
+ * retrieved through queue 0, the session itself, ahead of that queue's own, with no extra wait event to service.
+ * Clients should send latency sensitive packets through it. Its rings are of WINTUN_MIN_RING_CAPACITY, or of the
+ * session's Capacity if smaller. QueueCount must then be less than WINTUN_MAX_QUEUES.
+ */
+#define WINTUN_SESSION_FLAG_PRIORITY_QUEUE 0x40
+
+/**
+ * Starts Wintun session with multiple queues. Each queue is a separate pair of rings with its own receive thread in
+ * the driver. Packets sent by the stack are distributed among the queues by flow, so packets of the same flow are
+ * always retrieved from the same queue. Packets may be sent to the stack through any queue.
+ *
+ * @param Adapter       Adapter handle obtained with WintunOpenAdapter or WintunCreateAdapter
+ *
+ * @param Capacity      Capacity of each ring. Must be between WINTUN_MIN_RING_CAPACITY and WINTUN_MAX_RING_CAPACITY
+ *                      (incl.), or WINTUN_MIN_RING_CAPACITY_FOR_MTU of the adapter MTU without
+ *                      WINTUN_SESSION_FLAG_METADATA. Must be a power of two.
+ *
+ * @param QueueCount    Number of queues. Must be between 1 and WINTUN_MAX_QUEUES (incl.), less than
+ *                      WINTUN_MAX_QUEUES with WINTUN_SESSION_FLAG_PRIORITY_QUEUE.
+ *
+ * @param Flags         Combination of WINTUN_SESSION_FLAG_* flags, or 0.
+ *
+ * @param NumaNode      NUMA node to allocate the rings on and to run the driver's receive threads on, or
+ *                      NUMA_NO_PREFERRED_NODE.
+ *
+ * @return Wintun session handle. Must be released with WintunEndSession. Use WintunGetSessionQueue to obtain the
+ *         individual queues. If the function fails, the return value is NULL. To get extended error information,
+ *         call GetLastError.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+WINTUN_SESSION_HANDLE(WINAPI WINTUN_START_SESSION_EX_FUNC)
+(_In_ WINTUN_ADAPTER_HANDLE Adapter,
+ _In_ DWORD Capacity,
+ _In_ DWORD QueueCount,
+ _In_ DWORD Flags,
+ _In_ DWORD NumaNode);
+
+/**
+ * Starts Wintun session like WintunStartSessionEx, with a buffer region the client sends packets from in place using
+ * WintunSendBuffers. The driver locks the region in memory for as long as the session lasts, and passes packets in it
+ * to the stack without copying them.
+ *
+ * @param Adapter          Adapter handle obtained with WintunOpenAdapter or WintunCreateAdapter
+ *
+ * @param Capacity         Capacity of each ring. Same as for WintunStartSessionEx.
+ *
+ * @param QueueCount       Number of queues. Same as for WintunStartSessionEx.
+ *
+ * @param Flags            Combination of WINTUN_SESSION_FLAG_* flags, or 0.
+ *
+ * @param NumaNode         NUMA node, or NUMA_NO_PREFERRED_NODE. Same as for WintunStartSessionEx.
+ *
+ * @param BufferRegion     Client allocated, writable memory to send packets from. It must remain allocated until the
+ *                         session is ended.
+ *
+ * @param BufferRegionSize Size of BufferRegion in bytes, 256MiB max.
+ *
+ * @return Wintun session handle. Must be released with WintunEndSession. If the function fails, the return value is
+ *         NULL. To get extended error information, call GetLastError.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+WINTUN_SESSION_HANDLE(WINAPI WINTUN_START_SESSION_WITH_BUFFERS_FUNC)
+(_In_ WINTUN_ADAPTER_HANDLE Adapter,
+ _In_ DWORD Capacity,
+ _In_ DWORD QueueCount,
+ _In_ DWORD Flags,
+ _In_ DWORD NumaNode,
+ _In_ BYTE *BufferRegion,
+ _In_ DWORD BufferRegionSize);
+
+/**
+ * Gets a queue of Wintun session. The returned handle may be passed to all packet and wait event functions, but not
+ * to WintunEndSession. It remains valid until the session is ended.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession or WintunStartSessionEx
+ *
+ * @param QueueIndex    Zero-based queue index, less than the QueueCount passed to WintunStartSessionEx. Queue 0 is the
+ *                      session itself.
+ *
+ * @return Wintun session handle of the queue. If the function fails, the return value is NULL. To get extended error
+ *         information, call GetLastError.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+WINTUN_SESSION_HANDLE(WINAPI WINTUN_GET_SESSION_QUEUE_FUNC)(_In_ WINTUN_SESSION_HANDLE Session, _In_ DWORD QueueIndex);
+
+/**
+ * Gets the priority queue of Wintun session. The returned handle may be passed to all packet and wait event functions,
+ * but not to WintunEndSession. It remains valid until the session is ended. WintunReceivePacket(s), the waiting and
+ * the read notification functions act on queue 0 then, which retrieves the priority queue's packets along with its
+ * own, so WINTUN_SESSION_FLAG_SINGLE_THREADED clients must call them from queue 0's thread.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSessionEx with
+ *                      WINTUN_SESSION_FLAG_PRIORITY_QUEUE
+ *
+ * @return Wintun session handle of the priority queue. If the function fails, the return value is NULL. To get
+ *         extended error information, call GetLastError. ERROR_NOT_SUPPORTED means the session was started without
+ *         WINTUN_SESSION_FLAG_PRIORITY_QUEUE.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+WINTUN_SESSION_HANDLE(WINAPI WINTUN_GET_SESSION_PRIORITY_QUEUE_FUNC)(_In_ WINTUN_SESSION_HANDLE Session);
+
 /**
  * Ends Wintun session.
  *
@@ -185,6 +486,64 @@ WINTUN_SESSION_HANDLE(WINAPI WINTUN_START_SESSION_FUNC)(_In_ WINTUN_ADAPTER_HAND
  */
 typedef VOID(WINAPI WINTUN_END_SESSION_FUNC)(_In_ WINTUN_SESSION_HANDLE Session);
 
+/**
+ * What a process needs to take over a session with WintunTakeOverSession. The handles are only valid in the process
+ * the session is handed to, so the structure is meant to be passed to it as is, by whatever means of IPC.
+ */
+typedef struct _WINTUN_SESSION_HAND_OFF
+{
+    DWORD Capacity;      /**< Capacity of each ring but the priority queue's */
+    DWORD QueueCount;    /**< Number of queues */
+    DWORD Flags;         /**< WINTUN_SESSION_FLAG_* flags the session was started with */
+    DWORD MaxPacketSize; /**< Largest packet the rings carry, prefixes included, which the ring size follows from */
+    DWORD64 Device;      /**< Adapter device object handle the rings are registered on */
+    DWORD64 Section;     /**< Section handle the rings are in */
+    struct
+    {
+        DWORD64 SendTailMoved;    /**< Read-wait event handle of the queue */
+        DWORD64 ReceiveTailMoved; /**< Event handle the queue wakes the driver with */
+    } Queues[WINTUN_MAX_QUEUES];
+} WINTUN_SESSION_HAND_OFF;
+
+/**
+ * Hands a session over to another process, which takes it over with WintunTakeOverSession. The rings stay registered,
+ * and the adapter connected, throughout. Once this function succeeds, the session must not be used anymore other than
+ * to end it with WintunEndSession, which then leaves the rings be. The calling process must not exit before the other
+ * one has taken the session over, or the rings are torn down as usual. Packets the session retrieved but the ring
+ * still holds, as they were not released or a packet before them was not, are retrieved by the new owner again.
+ * Packets allocated but not sent are dropped.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSessionEx with WINTUN_SESSION_FLAG_HAND_OFF
+ *
+ * @param Process       Handle to the process to hand the session over to, with PROCESS_DUP_HANDLE access
+ *
+ * @param HandOff       Pointer to a structure to receive the handles, duplicated into Process, the session consists
+ *                      of. Should the other process never take the session over, it should close them.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError. ERROR_NOT_SUPPORTED means the session was started without
+ *         WINTUN_SESSION_FLAG_HAND_OFF.
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_HAND_OFF_SESSION_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session, _In_ HANDLE Process, _Out_ WINTUN_SESSION_HAND_OFF *HandOff);
+
+/**
+ * Takes over a session another process handed over with WintunHandOffSession, and makes the calling process the owner
+ * of its rings. From then on, the session lasts until the calling process ends it or exits, and may be handed over
+ * again.
+ *
+ * @param HandOff       Pointer to the structure the other process's WintunHandOffSession filled in. On success, the
+ *                      handles in it belong to the session. On failure, they are left to the caller.
+ *
+ * @return Wintun session handle. Must be released with WintunEndSession. If the function fails, the return value is
+ *         NULL. To get extended error information, call GetLastError.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+WINTUN_SESSION_HANDLE(WINAPI WINTUN_TAKE_OVER_SESSION_FUNC)(_In_ const WINTUN_SESSION_HAND_OFF *HandOff);
+
 /**
  * Gets Wintun session's read-wait event handle.
  *
@@ -233,6 +592,117 @@ BYTE *(WINAPI WINTUN_RECEIVE_PACKET_FUNC)(_In_ WINTUN_SESSION_HANDLE Session, _O
 typedef VOID(
     WINAPI WINTUN_RELEASE_RECEIVE_PACKET_FUNC)(_In_ WINTUN_SESSION_HANDLE Session, _In_ const BYTE *Packet);
 
+/**
+ * Retrieves multiple packets at once. After the packets' content is consumed, call WintunReleaseReceivePackets (or
+ * WintunReleaseReceivePacket for each) to release internal buffers. This function is thread-safe.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Packets       Pointer to an array of MaxCount elements to receive pointers to layer 3 IPv4 or IPv6 packets.
+ *                      Client may modify their content at will.
+ *
+ * @param PacketSizes   Pointer to an array of MaxCount elements to receive packet sizes.
+ *
+ * @param MaxCount      Maximum number of packets to retrieve.
+ *
+ * @return Number of packets retrieved. If no packets were retrieved, the return value is zero. To get extended error
+ *         information, call GetLastError. Possible errors are the same as for WintunReceivePacket.
+ */
+typedef _Must_inspect_result_
+_Success_(return != 0)
+DWORD(WINAPI WINTUN_RECEIVE_PACKETS_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session,
+ _Out_writes_to_(MaxCount, return) BYTE **Packets,
+ _Out_writes_to_(MaxCount, return) DWORD *PacketSizes,
+ _In_ DWORD MaxCount);
+
+/**
+ * Waits for packets to become available to WintunReceivePacket(s). Spins on the ring first and only then blocks on the
+ * read-wait event, so packets arriving during the spin are picked up without a wakeup and without the driver having to
+ * signal the event. The function may return TRUE spuriously, so WintunReceivePacket(s) may still report
+ * ERROR_NO_MORE_ITEMS afterwards.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param SpinMicroseconds Maximum time to spin before blocking, in microseconds. 0 blocks right away.
+ *
+ * @param Milliseconds  Maximum time to block, in milliseconds, or INFINITE.
+ *
+ * @return If packets may be available or the adapter is terminating, the return value is nonzero. Otherwise, the return
+ *         value is zero. To get extended error information, call GetLastError. Possible errors include the following:
+ *         ERROR_TIMEOUT          No packets arrived within the timeout;
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_WAIT_FOR_PACKETS_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session, _In_ DWORD SpinMicroseconds, _In_ DWORD Milliseconds);
+
+/**
+ * Called by the thread pool when packets are available to WintunReceivePacket(s).
+ *
+ * @param Session       Wintun session handle the callback was registered for
+ *
+ * @param Context       Context passed to WintunSetReadCallback
+ */
+typedef VOID(CALLBACK WINTUN_READ_CALLBACK)(_In_ WINTUN_SESSION_HANDLE Session, _In_opt_ VOID *Context);
+
+/**
+ * Has a thread pool call back whenever packets are available to WintunReceivePacket(s), so that many sessions can be
+ * served by a few threads instead of a thread blocking in each. The callback should drain the session with
+ * WintunReceivePacket(s). The notification is re-armed when the callback returns, and fires again right away if
+ * packets are still pending. Replaces any read callback or completion port registered before.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Callback      Callback, or NULL to unregister. Must not call WintunSetReadCallback,
+ *                      WintunSetReadCompletionPort or WintunEndSession on the same session.
+ *
+ * @param Context       Context passed to the callback
+ *
+ * @param CallbackEnvironment Thread pool callback environment, or NULL for the process default thread pool
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError.
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_SET_READ_CALLBACK_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session,
+ _In_opt_ WINTUN_READ_CALLBACK *Callback,
+ _In_opt_ VOID *Context,
+ _In_opt_ PTP_CALLBACK_ENVIRON CallbackEnvironment);
+
+/**
+ * Has a completion packet queued to an I/O completion port whenever packets are available to WintunReceivePacket(s).
+ * The completion carries CompletionKey and the session handle as its lpOverlapped, with zero bytes transferred. The
+ * notification is re-armed once WintunReceivePacket(s) finds the session drained and returns ERROR_NO_MORE_ITEMS.
+ * Replaces any read callback or completion port registered before. Requires Windows 8 or newer.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param CompletionPort I/O completion port handle, or NULL to unregister. Must stay valid until unregistered or the
+ *                      session ends.
+ *
+ * @param CompletionKey Completion key
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError. Possible errors include the following:
+ *         ERROR_NOT_SUPPORTED    Wait completion packets are not supported on this version of Windows;
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_SET_READ_COMPLETION_PORT_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session, _In_opt_ HANDLE CompletionPort, _In_ ULONG_PTR CompletionKey);
+
+/**
+ * Releases internal buffers of multiple received packets at once. This function is thread-safe.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Packets       Array of packets obtained with WintunReceivePackets or WintunReceivePacket
+ *
+ * @param Count         Number of elements in Packets
+ */
+typedef VOID(WINAPI WINTUN_RELEASE_RECEIVE_PACKETS_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session, _In_reads_(Count) const BYTE **Packets, _In_ DWORD Count);
+
 /**
  * Allocates memory for a packet to send. After the memory is filled with packet data, call WintunSendPacket to send
  * and release internal buffer. WintunAllocateSendPacket is thread-safe and the WintunAllocateSendPacket order of
@@ -240,13 +710,15 @@ typedef VOID(
  *
  * @param Session       Wintun session handle obtained with WintunStartSession
  *
- * @param PacketSize    Exact packet size. Must be less or equal to WINTUN_MAX_IP_PACKET_SIZE.
+ * @param PacketSize    Exact packet size. Must be less or equal to WINTUN_MAX_IP_PACKET_SIZE on sessions started with
+ *                      WINTUN_SESSION_FLAG_METADATA. On other sessions, it must not exceed the adapter MTU.
  *
  * @return Returns pointer to memory where to prepare layer 3 IPv4 or IPv6 packet for sending. If the function fails,
  *         the return value is NULL. To get extended error information, call GetLastError. Possible errors include the
  *         following:
  *         ERROR_HANDLE_EOF       Wintun adapter is terminating;
  *         ERROR_BUFFER_OVERFLOW  Wintun buffer is full;
+ *         ERROR_INVALID_PARAMETER  PacketSize is too big;
  */
 typedef _Must_inspect_result_
 _Return_type_success_(return != NULL)
@@ -265,6 +737,278 @@ BYTE *(WINAPI WINTUN_ALLOCATE_SEND_PACKET_FUNC)(_In_ WINTUN_SESSION_HANDLE Sessi
  */
 typedef VOID(WINAPI WINTUN_SEND_PACKET_FUNC)(_In_ WINTUN_SESSION_HANDLE Session, _In_ const BYTE *Packet);
 
+/**
+ * Allocates memory for multiple packets to send at once. After the memory is filled with packet data, call
+ * WintunSendPackets (or WintunSendPacket for each) to send and release internal buffers. WintunAllocateSendPackets is
+ * thread-safe and the order of allocation defines the packet sending order.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Packets       Pointer to an array of Count elements to receive pointers to memory where to prepare layer 3
+ *                      IPv4 or IPv6 packets for sending.
+ *
+ * @param PacketSizes   Array of Count exact packet sizes. Each must meet the WintunAllocateSendPacket limit.
+ *
+ * @param Count         Number of packets to allocate.
+ *
+ * @return Number of packets allocated, in order. This may be less than Count when the ring is nearly full. If no
+ *         packets were allocated, the return value is zero. To get extended error information, call GetLastError.
+ *         Possible errors are the same as for WintunAllocateSendPacket.
+ */
+typedef _Must_inspect_result_
+_Success_(return != 0)
+DWORD(WINAPI WINTUN_ALLOCATE_SEND_PACKETS_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session,
+ _Out_writes_to_(Count, return) BYTE **Packets,
+ _In_reads_(Count) const DWORD *PacketSizes,
+ _In_ DWORD Count);
+
+/**
+ * Sends multiple packets and releases their internal buffers at once. The ring tail is published and the driver is
+ * woken at most once per call. WintunSendPackets is thread-safe, but the WintunAllocateSendPackets order of calls
+ * define the packet sending order.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Packets       Array of packets obtained with WintunAllocateSendPackets or WintunAllocateSendPacket
+ *
+ * @param Count         Number of elements in Packets
+ */
+typedef VOID(WINAPI WINTUN_SEND_PACKETS_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session, _In_reads_(Count) const BYTE **Packets, _In_ DWORD Count);
+
+/**
+ * The checksum at CsumStart + CsumOffset holds the pseudo-header sum only and must be completed. For GSO packets, the
+ * sum does not include the TCP length, as each segment needs its own.
+ */
+#define WINTUN_PACKET_METADATA_FLAG_NEEDS_CSUM 0x01
+
+/**
+ * The checksums of the packet have been validated.
+ */
+#define WINTUN_PACKET_METADATA_FLAG_DATA_VALID 0x02
+
+/**
+ * Generic segmentation offload type
+ */
+#define WINTUN_PACKET_METADATA_GSO_NONE 0  /**< Regular packet */
+#define WINTUN_PACKET_METADATA_GSO_TCPV4 1 /**< TCP over IPv4 super-segment */
+#define WINTUN_PACKET_METADATA_GSO_TCPV6 4 /**< TCP over IPv6 super-segment */
+
+/**
+ * Per-packet offload metadata, modelled on struct virtio_net_hdr. Offsets are from the start of the IP header.
+ *
+ * Packets to send may be TCP super-packets of consecutive segments of the same flow, coalesced by the client. Such
+ * packets have GsoType, HdrLen and GsoSize set, either of the checksum flags, and are passed to the stack as a single
+ * coalesced receive.
+ */
+typedef struct _WINTUN_PACKET_METADATA
+{
+    UCHAR Flags;              /**< Combination of WINTUN_PACKET_METADATA_FLAG_* flags */
+    UCHAR GsoType;            /**< WINTUN_PACKET_METADATA_GSO_* */
+    USHORT HdrLen;            /**< Length of IP and TCP headers of GSO packets */
+    USHORT GsoSize;           /**< Maximum segment payload size of GSO packets */
+    USHORT CsumStart;         /**< Offset of the data checksummed, usually the TCP header */
+    USHORT CsumOffset;        /**< Offset of the checksum field from CsumStart */
+    USHORT CoalescedSegments; /**< Number of segments in a GSO packet to send, or 0 to derive it from GsoSize */
+} WINTUN_PACKET_METADATA;
+
+/**
+ * Gets offload metadata of a packet. The metadata of packets to send is initially zero and may be filled in before
+ * calling WintunSendPacket.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSessionEx with WINTUN_SESSION_FLAG_METADATA
+ *
+ * @param Packet        Packet obtained with WintunReceivePacket(s) or WintunAllocateSendPacket(s)
+ *
+ * @return Pointer to packet metadata. If the session was started without WINTUN_SESSION_FLAG_METADATA, the return
+ *         value is NULL and GetLastError returns ERROR_NOT_SUPPORTED.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+WINTUN_PACKET_METADATA *(WINAPI WINTUN_GET_PACKET_METADATA_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session, _In_ const BYTE *Packet);
+
+/**
+ * Sends multiple packets the client placed in its buffer region, without copying them into the ring. Only small
+ * descriptors go into the ring. The packets must not be modified nor reused until WintunGetCompletedBuffers returns
+ * them. Packets are sent in order with those of WintunAllocateSendPackets, and the ring tail is published at most once
+ * per call. WintunSendBuffers is thread-safe.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSessionWithBuffers or WintunGetSessionQueue
+ *
+ * @param Packets       Array of Count pointers to layer 3 IPv4 or IPv6 packets, each entirely within the buffer region
+ *
+ * @param PacketSizes   Array of Count packet sizes. Each must not exceed WINTUN_MAX_IP_PACKET_SIZE.
+ *
+ * @param Metadata      Array of Count packet metadata, or NULL for none. Ignored unless the session was started with
+ *                      WINTUN_SESSION_FLAG_METADATA.
+ *
+ * @param Count         Number of packets to send.
+ *
+ * @return Number of packets sent, in order. This may be less than Count when the ring is nearly full. If no packets
+ *         were sent, the return value is zero. To get extended error information, call GetLastError. Possible errors
+ *         include the following:
+ *         ERROR_HANDLE_EOF       Wintun adapter is terminating;
+ *         ERROR_BUFFER_OVERFLOW  Wintun buffer is full;
+ *         ERROR_INVALID_PARAMETER  A packet is not within the buffer region or is too big;
+ *         ERROR_NOT_SUPPORTED    The session was started without a buffer region.
+ */
+typedef _Must_inspect_result_
+_Success_(return != 0)
+DWORD(WINAPI WINTUN_SEND_BUFFERS_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session,
+ _In_reads_(Count) const BYTE **Packets,
+ _In_reads_(Count) const DWORD *PacketSizes,
+ _In_reads_opt_(Count) const WINTUN_PACKET_METADATA *Metadata,
+ _In_ DWORD Count);
+
+/**
+ * Retrieves packets sent with WintunSendBuffers that the stack is done with, so that their memory may be reused.
+ * Packets of a queue complete in no particular order. The driver stops taking packets off the queue's ring while
+ * Capacity / 8 packets sent with WintunSendBuffers have not been retrieved, and this function wakes it once it
+ * retrieves any, so do call this regularly, e.g. after each WintunSendBuffers.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSessionWithBuffers or WintunGetSessionQueue
+ *
+ * @param Buffers       Pointer to an array of MaxCount elements to receive the pointers passed to WintunSendBuffers
+ *
+ * @param MaxCount      Maximum number of packets to retrieve.
+ *
+ * @return Number of packets retrieved. If none were, the return value is zero and GetLastError returns
+ *         ERROR_NO_MORE_ITEMS, or ERROR_NOT_SUPPORTED if the session was started without a buffer region.
+ */
+typedef _Must_inspect_result_
+_Success_(return != 0)
+DWORD(WINAPI WINTUN_GET_COMPLETED_BUFFERS_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session, _Out_writes_to_(MaxCount, return) BYTE **Buffers, _In_ DWORD MaxCount);
+
+/**
+ * Statistics of one session queue. Ring directions are named from the client's perspective of Wintun: Send is the
+ * ring of packets the stack sends and WintunReceivePacket(s) retrieves, Receive the ring WintunSendPacket(s) fills.
+ */
+typedef struct _WINTUN_SESSION_STATISTICS
+{
+    struct
+    {
+        DWORD Capacity;          /**< Ring capacity in bytes */
+        DWORD64 HighWater;       /**< Largest number of bytes the ring has held */
+        DWORD64 OverflowDrops;   /**< Packets dropped because the ring was full */
+        DWORD64 InvalidDrops;    /**< Packets dropped as too big or needing offloads the session did not enable */
+        DWORD64 EventsSignaled;  /**< Times the read-wait event was signaled */
+        DWORD64 FilterDrops;     /**< Packets the receive filter dropped */
+    } Send;
+    struct
+    {
+        DWORD Capacity;          /**< Ring capacity in bytes */
+        DWORD64 HighWater;       /**< Largest number of bytes the ring has held */
+        DWORD64 InvalidDrops;    /**< Packets dropped as not valid IPv4 or IPv6 */
+        DWORD64 SpinHits;        /**< Times packets arrived while the driver was spinning on the empty ring */
+        DWORD64 Waits;           /**< Times the driver went to sleep on the empty ring */
+        DWORD64 EventsSignaled;  /**< Times the session woke the driver up */
+        DWORD64 NblAllocationFailures; /**< Times the driver ran out of memory while taking in packets */
+        DWORD64 CompletionStalls;      /**< Times the driver ran out of room for completions and waited */
+    } Receive;
+} WINTUN_SESSION_STATISTICS;
+
+/**
+ * Retrieves statistics of a session queue, counted since the session started. Use them to size the ring capacity and
+ * to spot backpressure.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession or WintunGetSessionQueue
+ *
+ * @param Statistics    Pointer to a structure to receive the statistics
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError.
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_GET_SESSION_STATISTICS_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session, _Out_ WINTUN_SESSION_STATISTICS *Statistics);
+
+/**
+ * Number of buckets of a latency histogram.
+ */
+#define WINTUN_LATENCY_BUCKETS 32
+
+/**
+ * Histograms of the time packets of one session queue spent in the rings. Bucket i counts packets that waited
+ * [2^i, 2^(i+1)) nanoseconds; the first bucket also counts shorter waits, and the last one longer waits.
+ */
+typedef struct _WINTUN_SESSION_LATENCY
+{
+    DWORD64 Send[WINTUN_LATENCY_BUCKETS];    /**< From the driver filling the ring to WintunReceivePacket(s) */
+    DWORD64 Receive[WINTUN_LATENCY_BUCKETS]; /**< From WintunSendPacket(s) to the driver draining the ring */
+} WINTUN_SESSION_LATENCY;
+
+/**
+ * Retrieves the ring latency histograms of a session queue, counted since the session started.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSessionEx or WintunGetSessionQueue, started with
+ *                      WINTUN_SESSION_FLAG_TIMESTAMPS
+ *
+ * @param Latency       Pointer to a structure to receive the histograms
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError. ERROR_NOT_SUPPORTED means the session was started without
+ *         WINTUN_SESSION_FLAG_TIMESTAMPS.
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_GET_SESSION_LATENCY_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session, _Out_ WINTUN_SESSION_LATENCY *Latency);
+
+#define WINTUN_FILTER_ACTION_PASS 0 /**< Let the packet through to WintunReceivePacket(s) */
+#define WINTUN_FILTER_ACTION_DROP 1 /**< Drop the packet in the driver */
+
+/**
+ * Matches any protocol in WINTUN_FILTER_RULE.Protocol.
+ */
+#define WINTUN_FILTER_ANY_PROTOCOL 0xFF
+
+/**
+ * Maximum number of filter rules
+ */
+#define WINTUN_MAX_FILTER_RULES 256
+
+/**
+ * Rule of receive filter. A packet matches when all of the rule's conditions hold.
+ */
+typedef struct _WINTUN_FILTER_RULE
+{
+    BYTE Action;          /**< WINTUN_FILTER_ACTION_* taken on packets that match */
+    BYTE IpVersion;       /**< 4 or 6, or 0 for both, in which case PrefixLength must be 0 */
+    BYTE Protocol;        /**< IP protocol, or WINTUN_FILTER_ANY_PROTOCOL. For IPv6, the fixed header's next header. */
+    BYTE PrefixLength;    /**< Number of leading bits of Destination the destination address must have */
+    WORD PortMin;         /**< Lowest destination port of TCP and UDP, or type of ICMP and ICMPv6 */
+    WORD PortMax;         /**< Highest one. Packets of other protocols only match the full range 0 to 0xFFFF. */
+    BYTE Destination[16]; /**< Destination address prefix. IPv4 addresses take the first 4 bytes. */
+} WINTUN_FILTER_RULE;
+
+/**
+ * Sets a filter the driver runs packets through before they take any ring space, so that unwanted traffic, such as
+ * neighbor discovery, multicast or traffic outside the tunnel's routes, costs neither a copy nor a wakeup. The first
+ * rule a packet matches decides. The filter applies to all queues of the session and replaces any previous one.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession or WintunStartSessionEx
+ *
+ * @param DefaultAction WINTUN_FILTER_ACTION_* taken on packets that match no rule.
+ *
+ * @param Rules         Array of RuleCount rules, in order of precedence
+ *
+ * @param RuleCount     Number of rules, WINTUN_MAX_FILTER_RULES max. With no rules and WINTUN_FILTER_ACTION_PASS, the
+ *                      filter is removed.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError.
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_SET_RECEIVE_FILTER_FUNC)
+(_In_ WINTUN_SESSION_HANDLE Session,
+ _In_ DWORD DefaultAction,
+ _In_reads_opt_(RuleCount) const WINTUN_FILTER_RULE *Rules,
+ _In_ DWORD RuleCount);
+
 #if defined(_MSC_VER)
 #    pragma warning(pop)
 #endif
@@ -0,0 +1,936 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Measures the throughput and latency of packets going through the rings both ways. The adapter gets 10.6.7.7/24, and
+ * one reflector thread per session queue turns every packet the stack sends back around:
+ *
+ *  - UDP datagrams have their addresses and ports swapped, so a socket connected to 10.6.7.8 gets its own datagrams
+ *    back. Each round trip goes through both rings once.
+ *  - TCP segments to 10.6.7.8 appear to come from 10.6.7.9, and the other way around, so that a connection to a
+ *    listener of our own on 10.6.7.8 is accepted from 10.6.7.9. Firewalls must let the listener accept it.
+ *
+ * Runs go through every combination of the packet sizes, ring capacities and thread counts given, with one flow per
+ * thread. Results go to the console and, with -json, as one JSON object per line to a file. */
+
+#include <winsock2.h>
+#include <Windows.h>
+#include <ws2ipdef.h>
+#include <iphlpapi.h>
+#include <mstcpip.h>
+#include <winternl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "wintun.h"
+
+static WINTUN_CREATE_ADAPTER_FUNC *WintunCreateAdapter;
+static WINTUN_CLOSE_ADAPTER_FUNC *WintunCloseAdapter;
+static WINTUN_GET_ADAPTER_LUID_FUNC *WintunGetAdapterLUID;
+static WINTUN_GET_RUNNING_DRIVER_VERSION_FUNC *WintunGetRunningDriverVersion;
+static WINTUN_SET_LOGGER_FUNC *WintunSetLogger;
+static WINTUN_START_SESSION_EX_FUNC *WintunStartSessionEx;
+static WINTUN_GET_SESSION_QUEUE_FUNC *WintunGetSessionQueue;
+static WINTUN_GET_SESSION_STATISTICS_FUNC *WintunGetSessionStatistics;
+static WINTUN_END_SESSION_FUNC *WintunEndSession;
+static WINTUN_WAIT_FOR_PACKETS_FUNC *WintunWaitForPackets;
+static WINTUN_RECEIVE_PACKET_FUNC *WintunReceivePacket;
+static WINTUN_RELEASE_RECEIVE_PACKET_FUNC *WintunReleaseReceivePacket;
+static WINTUN_ALLOCATE_SEND_PACKET_FUNC *WintunAllocateSendPacket;
+static WINTUN_SEND_PACKET_FUNC *WintunSendPacket;
+
+static HMODULE
+InitializeWintun(void)
+{
+    HMODULE Wintun =
+        LoadLibraryExW(L"wintun.dll", NULL, LOAD_LIBRARY_SEARCH_APPLICATION_DIR | LOAD_LIBRARY_SEARCH_SYSTEM32);
+    if (!Wintun)
+        return NULL;
+#define X(Name) ((*(FARPROC *)&Name = GetProcAddress(Wintun, #Name)) == NULL)
+    if (X(WintunCreateAdapter) || X(WintunCloseAdapter) || X(WintunGetAdapterLUID) ||
+        X(WintunGetRunningDriverVersion) || X(WintunSetLogger) || X(WintunStartSessionEx) ||
+        X(WintunGetSessionQueue) || X(WintunGetSessionStatistics) || X(WintunEndSession) ||
+        X(WintunWaitForPackets) || X(WintunReceivePacket) || X(WintunReleaseReceivePacket) ||
+        X(WintunAllocateSendPacket) || X(WintunSendPacket))
+#undef X
+    {
+        DWORD LastError = GetLastError();
+        FreeLibrary(Wintun);
+        SetLastError(LastError);
+        return NULL;
+    }
+    return Wintun;
+}
+
+static void CALLBACK
+ConsoleLogger(_In_ WINTUN_LOGGER_LEVEL Level, _In_ DWORD64 Timestamp, _In_z_ const WCHAR *LogLine)
+{
+    SYSTEMTIME SystemTime;
+    FileTimeToSystemTime((FILETIME *)&Timestamp, &SystemTime);
+    WCHAR LevelMarker;
+    switch (Level)
+    {
+    case WINTUN_LOG_INFO:
+        LevelMarker = L'+';
+        break;
+    case WINTUN_LOG_WARN:
+        LevelMarker = L'-';
+        break;
+    case WINTUN_LOG_ERR:
+        LevelMarker = L'!';
+        break;
+    default:
+        return;
+    }
+    fwprintf(
+        stderr,
+        L"%04u-%02u-%02u %02u:%02u:%02u.%04u [%c] %s\n",
+        SystemTime.wYear,
+        SystemTime.wMonth,
+        SystemTime.wDay,
+        SystemTime.wHour,
+        SystemTime.wMinute,
+        SystemTime.wSecond,
+        SystemTime.wMilliseconds,
+        LevelMarker,
+        LogLine);
+}
+
+static DWORD64 Now(VOID)
+{
+    LARGE_INTEGER Timestamp;
+    NtQuerySystemTime(&Timestamp);
+    return Timestamp.QuadPart;
+}
+
+static DWORD
+LogError(_In_z_ const WCHAR *Prefix, _In_ DWORD Error)
+{
+    WCHAR *SystemMessage = NULL, *FormattedMessage = NULL;
+    FormatMessageW(
+        FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_MAX_WIDTH_MASK,
+        NULL,
+        HRESULT_FROM_SETUPAPI(Error),
+        MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+        (void *)&SystemMessage,
+        0,
+        NULL);
+    FormatMessageW(
+        FORMAT_MESSAGE_FROM_STRING | FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_ARGUMENT_ARRAY |
+            FORMAT_MESSAGE_MAX_WIDTH_MASK,
+        SystemMessage ? L"%1: %3(Code 0x%2!08X!)" : L"%1: Code 0x%2!08X!",
+        0,
+        0,
+        (void *)&FormattedMessage,
+        0,
+        (va_list *)(DWORD_PTR[]){ (DWORD_PTR)Prefix, (DWORD_PTR)Error, (DWORD_PTR)SystemMessage });
+    if (FormattedMessage)
+        ConsoleLogger(WINTUN_LOG_ERR, Now(), FormattedMessage);
+    LocalFree(FormattedMessage);
+    LocalFree(SystemMessage);
+    return Error;
+}
+
+static DWORD
+LogLastError(_In_z_ const WCHAR *Prefix)
+{
+    DWORD LastError = GetLastError();
+    LogError(Prefix, LastError);
+    SetLastError(LastError);
+    return LastError;
+}
+
+static void
+Log(_In_ WINTUN_LOGGER_LEVEL Level, _In_z_ const WCHAR *Format, ...)
+{
+    WCHAR LogLine[0x200];
+    va_list args;
+    va_start(args, Format);
+    _vsnwprintf_s(LogLine, _countof(LogLine), _TRUNCATE, Format, args);
+    va_end(args);
+    ConsoleLogger(Level, Now(), LogLine);
+}
+
+#define LOCAL_ADDRESS ((10 << 24) | (6 << 16) | (7 << 8) | (7 << 0)) /* 10.6.7.7 */
+#define PEER_ADDRESS ((10 << 24) | (6 << 16) | (7 << 8) | (8 << 0))  /* 10.6.7.8, mirrored by 10.6.7.9 for TCP */
+#define TUNNEL_PREFIX_LENGTH 24
+#define PORT_BASE 47000
+#define IPV4_HEADER_SIZE 20
+#define UDP_HEADER_SIZE 8
+#define TCP_WRITE_SIZE 0x10000
+#define SOCKET_BUFFER_SIZE 0x400000
+#define MAX_LIST 16
+
+/* Latencies in nanoseconds are counted into 16 buckets per power of two, which is within 1/16 of the true value. */
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_BUCKETS (64 << LATENCY_SUB_BUCKET_BITS)
+
+typedef struct _LATENCY_HISTOGRAM
+{
+    DWORD64 Total;
+    DWORD64 Counts[LATENCY_BUCKETS];
+} LATENCY_HISTOGRAM;
+
+typedef struct _CONFIG
+{
+    DWORD Sizes[MAX_LIST], SizeCount;
+    DWORD Capacities[MAX_LIST], CapacityCount;
+    DWORD Threads[MAX_LIST], ThreadCount;
+    DWORD Seconds;
+    DWORD WarmupSeconds;
+    DWORD Window;
+    DWORD SpinMicroseconds;
+    BOOL Tcp;
+    const WCHAR *JsonPath;
+} CONFIG;
+
+typedef struct _RESULT
+{
+    BOOL Tcp;
+    DWORD PacketSize;
+    DWORD Capacity;
+    DWORD Threads;
+    double Seconds;
+    DWORD64 Packets;
+    DWORD64 Bytes;
+    DWORD64 ReflectorDrops;
+    DWORD64 RingOverflows;
+    DWORD64 Lost;
+    double CpuNanosecondsPerPacket;
+    LATENCY_HISTOGRAM Latency;
+} RESULT;
+
+/* One per session queue, which it is the only reader and writer of. */
+typedef struct DECLSPEC_CACHEALIGN _REFLECTOR
+{
+    WINTUN_SESSION_HANDLE Session;
+    HANDLE Thread;
+    DWORD SpinMicroseconds;
+    volatile LONG64 Packets;
+    volatile LONG64 Bytes;
+    volatile LONG64 Drops;
+} REFLECTOR;
+
+typedef struct _FLOW
+{
+    DWORD Index;
+    DWORD PacketSize;
+    DWORD Window;
+    SOCKET Socket;
+    SOCKET Listener;
+    HANDLE Thread;
+    HANDLE ServerThread;
+    DWORD64 Lost;
+    LATENCY_HISTOGRAM Latency;
+} FLOW;
+
+static HANDLE QuitEvent;
+static volatile LONG HaveQuit, FlowsStopping, ReflectorsStopping, Measuring;
+
+static BOOL WINAPI
+CtrlHandler(_In_ DWORD CtrlType)
+{
+    switch (CtrlType)
+    {
+    case CTRL_C_EVENT:
+    case CTRL_BREAK_EVENT:
+    case CTRL_CLOSE_EVENT:
+    case CTRL_LOGOFF_EVENT:
+    case CTRL_SHUTDOWN_EVENT:
+        Log(WINTUN_LOG_INFO, L"Cleaning up and shutting down...");
+        WriteNoFence(&HaveQuit, TRUE);
+        SetEvent(QuitEvent);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static DWORD64
+TicksToNanoseconds(_In_ LONG64 Ticks, _In_ LONG64 Frequency)
+{
+    if (Ticks <= 0)
+        return 0;
+    return (DWORD64)(Ticks / Frequency) * 1000000000 + (DWORD64)(Ticks % Frequency) * 1000000000 / (DWORD64)Frequency;
+}
+
+static DWORD
+MostSignificantBit(_In_ DWORD64 Value)
+{
+    DWORD Bit;
+    if (_BitScanReverse(&Bit, (DWORD)(Value >> 32)))
+        return Bit + 32;
+    _BitScanReverse(&Bit, (DWORD)Value);
+    return Bit;
+}
+
+static void
+CountLatency(_Inout_ LATENCY_HISTOGRAM *Histogram, _In_ DWORD64 Nanoseconds)
+{
+    DWORD Bucket = (DWORD)Nanoseconds;
+    if (Nanoseconds >= (1 << LATENCY_SUB_BUCKET_BITS))
+    {
+        DWORD Msb = MostSignificantBit(Nanoseconds);
+        Bucket = ((Msb - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS) |
+                 (DWORD)((Nanoseconds >> (Msb - LATENCY_SUB_BUCKET_BITS)) & ((1 << LATENCY_SUB_BUCKET_BITS) - 1));
+    }
+    ++Histogram->Counts[Bucket];
+    ++Histogram->Total;
+}
+
+static void
+MergeLatency(_Inout_ LATENCY_HISTOGRAM *Histogram, _In_ const LATENCY_HISTOGRAM *Other)
+{
+    for (DWORD i = 0; i < LATENCY_BUCKETS; ++i)
+        Histogram->Counts[i] += Other->Counts[i];
+    Histogram->Total += Other->Total;
+}
+
+/* Returns the lowest latency of the bucket the given fraction of samples falls in, in microseconds. */
+static double
+LatencyPercentile(_In_ const LATENCY_HISTOGRAM *Histogram, _In_ double Fraction)
+{
+    if (!Histogram->Total)
+        return 0.0;
+    DWORD64 Target = (DWORD64)(Histogram->Total * Fraction), Seen = 0;
+    for (DWORD Bucket = 0; Bucket < LATENCY_BUCKETS; ++Bucket)
+    {
+        Seen += Histogram->Counts[Bucket];
+        if (Seen <= Target && Bucket < LATENCY_BUCKETS - 1)
+            continue;
+        if (Bucket < (2 << LATENCY_SUB_BUCKET_BITS))
+            return Bucket / 1000.0;
+        DWORD Msb = (Bucket >> LATENCY_SUB_BUCKET_BITS) + LATENCY_SUB_BUCKET_BITS - 1;
+        DWORD64 Mantissa = (1 << LATENCY_SUB_BUCKET_BITS) | (Bucket & ((1 << LATENCY_SUB_BUCKET_BITS) - 1));
+        return (double)(Mantissa << (Msb - LATENCY_SUB_BUCKET_BITS)) / 1000.0;
+    }
+    return 0.0;
+}
+
+/* RFC 1624 update of a checksum in network byte order, for a 16-bit word of the summed data changing. */
+static void
+UpdateChecksum(_Inout_updates_bytes_(2) BYTE *Checksum, _In_ USHORT Old, _In_ USHORT New)
+{
+    ULONG Sum = (USHORT) ~((Checksum[0] << 8) | Checksum[1]) + (USHORT)~Old + New;
+    Sum = (Sum & 0xffff) + (Sum >> 16);
+    Sum = (Sum & 0xffff) + (Sum >> 16);
+    Sum = (USHORT)~Sum;
+    Checksum[0] = (BYTE)(Sum >> 8);
+    Checksum[1] = (BYTE)Sum;
+}
+
+/* Returns whether the stack sent the packet to one of our peers, rather than being, say, a router solicitation. */
+static BOOL
+IsReflectable(_In_reads_bytes_(PacketSize) const BYTE *Packet, _In_ DWORD PacketSize)
+{
+    if (PacketSize < IPV4_HEADER_SIZE || Packet[0] >> 4 != 4)
+        return FALSE;
+    DWORD HeaderSize = (Packet[0] & 0xf) * 4;
+    if (HeaderSize < IPV4_HEADER_SIZE || ntohs(*(USHORT *)&Packet[2]) != PacketSize ||
+        (ntohs(*(USHORT *)&Packet[6]) & 0x3fff))
+        return FALSE;
+    ULONG Source = ntohl(*(ULONG *)&Packet[12]), Destination = ntohl(*(ULONG *)&Packet[16]);
+    if (Source != LOCAL_ADDRESS || Destination == LOCAL_ADDRESS ||
+        Destination >> (32 - TUNNEL_PREFIX_LENGTH) != LOCAL_ADDRESS >> (32 - TUNNEL_PREFIX_LENGTH))
+        return FALSE;
+    return (Packet[9] == IPPROTO_UDP && PacketSize - HeaderSize >= UDP_HEADER_SIZE) ||
+           (Packet[9] == IPPROTO_TCP && PacketSize - HeaderSize >= 20);
+}
+
+/* Turns a reflectable packet into the one the stack should get back, as described at the top. */
+static void
+ReflectPacket(_Inout_updates_bytes_(PacketSize) BYTE *Packet, _In_ DWORD PacketSize)
+{
+    ULONG Source = ntohl(*(ULONG *)&Packet[12]), Destination = ntohl(*(ULONG *)&Packet[16]);
+    BYTE *Transport = Packet + (Packet[0] & 0xf) * 4;
+    UNREFERENCED_PARAMETER(PacketSize);
+    if (Packet[9] == IPPROTO_UDP)
+    {
+        /* Swapping words leaves their sum, and so both checksums, as they were. */
+        *(ULONG *)&Packet[12] = htonl(Destination);
+        *(ULONG *)&Packet[16] = htonl(Source);
+        USHORT Port = *(USHORT *)&Transport[0];
+        *(USHORT *)&Transport[0] = *(USHORT *)&Transport[2];
+        *(USHORT *)&Transport[2] = Port;
+        return;
+    }
+    /* The destination becomes the source with its lowest bit flipped, which is the only change to the sums. */
+    USHORT Old = (USHORT)Destination, New = Old ^ 1;
+    *(ULONG *)&Packet[12] = htonl(Destination ^ 1);
+    *(ULONG *)&Packet[16] = htonl(Source);
+    UpdateChecksum(&Packet[10], Old, New);
+    UpdateChecksum(&Transport[16], Old, New);
+}
+
+static DWORD WINAPI
+Reflect(_Inout_ LPVOID Context)
+{
+    REFLECTOR *Reflector = Context;
+    WINTUN_SESSION_HANDLE Session = Reflector->Session;
+    while (!ReadNoFence(&ReflectorsStopping))
+    {
+        DWORD PacketSize;
+        BYTE *Packet = WintunReceivePacket(Session, &PacketSize);
+        if (!Packet)
+        {
+            DWORD LastError = GetLastError();
+            if (LastError != ERROR_NO_MORE_ITEMS)
+                return LogError(L"Packet read failed", LastError);
+            if (!WintunWaitForPackets(Session, Reflector->SpinMicroseconds, 100) && GetLastError() != ERROR_TIMEOUT)
+                return LogLastError(L"Failed to wait for packets");
+            continue;
+        }
+        if (!IsReflectable(Packet, PacketSize))
+        {
+            WintunReleaseReceivePacket(Session, Packet);
+            continue;
+        }
+        BYTE *Reply = WintunAllocateSendPacket(Session, PacketSize);
+        if (Reply)
+        {
+            memcpy(Reply, Packet, PacketSize);
+            ReflectPacket(Reply, PacketSize);
+            WintunSendPacket(Session, Reply);
+            WriteNoFence64(&Reflector->Packets, ReadNoFence64(&Reflector->Packets) + 1);
+            WriteNoFence64(&Reflector->Bytes, ReadNoFence64(&Reflector->Bytes) + PacketSize);
+        }
+        else if (GetLastError() == ERROR_BUFFER_OVERFLOW)
+            WriteNoFence64(&Reflector->Drops, ReadNoFence64(&Reflector->Drops) + 1);
+        else
+        {
+            DWORD LastError = LogLastError(L"Packet write failed");
+            WintunReleaseReceivePacket(Session, Packet);
+            return LastError;
+        }
+        WintunReleaseReceivePacket(Session, Packet);
+    }
+    return ERROR_SUCCESS;
+}
+
+/* Keeps Window datagrams in flight, sending one more for each that comes back. */
+static DWORD WINAPI
+UdpFlow(_Inout_ LPVOID Context)
+{
+    FLOW *Flow = Context;
+    BYTE Payload[WINTUN_MAX_IP_PACKET_SIZE];
+    const int PayloadSize = (int)(Flow->PacketSize - IPV4_HEADER_SIZE - UDP_HEADER_SIZE);
+    LARGE_INTEGER Frequency, Stamp;
+    QueryPerformanceFrequency(&Frequency);
+    DWORD Outstanding = 0;
+    while (!ReadNoFence(&FlowsStopping))
+    {
+        for (; Outstanding < Flow->Window; ++Outstanding)
+        {
+            QueryPerformanceCounter(&Stamp);
+            memcpy(Payload, &Stamp.QuadPart, sizeof(Stamp.QuadPart));
+            if (send(Flow->Socket, (const char *)Payload, PayloadSize, 0) == SOCKET_ERROR)
+                return LogError(L"Failed to send datagram", WSAGetLastError());
+        }
+        int Received = recv(Flow->Socket, (char *)Payload, PayloadSize, 0);
+        if (Received == SOCKET_ERROR)
+        {
+            DWORD LastError = WSAGetLastError();
+            if (LastError != WSAETIMEDOUT)
+                return LogError(L"Failed to receive datagram", LastError);
+            /* Whatever is still in flight got dropped somewhere, so start over with a full window. */
+            if (ReadNoFence(&Measuring))
+                Flow->Lost += Outstanding;
+            Outstanding = 0;
+            continue;
+        }
+        if (Outstanding)
+            --Outstanding;
+        if (Received < (int)sizeof(Stamp.QuadPart) || !ReadNoFence(&Measuring))
+            continue;
+        LONG64 Sent;
+        memcpy(&Sent, Payload, sizeof(Sent));
+        QueryPerformanceCounter(&Stamp);
+        CountLatency(&Flow->Latency, TicksToNanoseconds(Stamp.QuadPart - Sent, Frequency.QuadPart));
+    }
+    return ERROR_SUCCESS;
+}
+
+static DWORD WINAPI
+TcpServer(_Inout_ LPVOID Context)
+{
+    FLOW *Flow = Context;
+    char Buffer[TCP_WRITE_SIZE];
+    SOCKET Socket = accept(Flow->Listener, NULL, NULL);
+    if (Socket == INVALID_SOCKET)
+        return ReadNoFence(&FlowsStopping) ? ERROR_SUCCESS : LogError(L"Failed to accept", WSAGetLastError());
+    while (recv(Socket, Buffer, sizeof(Buffer), 0) > 0)
+        ;
+    closesocket(Socket);
+    return ERROR_SUCCESS;
+}
+
+/* Writes as fast as the connection takes it. The stack decides how the stream is cut into packets. */
+static DWORD WINAPI
+TcpFlow(_Inout_ LPVOID Context)
+{
+    FLOW *Flow = Context;
+    char Buffer[TCP_WRITE_SIZE] = { 0 };
+    SOCKADDR_IN Peer = { .sin_family = AF_INET,
+                         .sin_port = htons((USHORT)(PORT_BASE + Flow->Index)),
+                         .sin_addr.s_addr = htonl(PEER_ADDRESS) };
+    if (connect(Flow->Socket, (SOCKADDR *)&Peer, sizeof(Peer)) == SOCKET_ERROR)
+        return LogError(L"Failed to connect", WSAGetLastError());
+    while (!ReadNoFence(&FlowsStopping))
+    {
+        if (send(Flow->Socket, Buffer, sizeof(Buffer), 0) == SOCKET_ERROR)
+            return LogError(L"Failed to send", WSAGetLastError());
+    }
+    shutdown(Flow->Socket, SD_SEND);
+    return ERROR_SUCCESS;
+}
+
+static DWORD
+OpenFlow(_Inout_ FLOW *Flow, _In_ BOOL Tcp)
+{
+    Flow->Socket = Flow->Listener = INVALID_SOCKET;
+    SOCKADDR_IN Local = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(LOCAL_ADDRESS) };
+    SOCKADDR_IN Peer = { .sin_family = AF_INET,
+                         .sin_port = htons((USHORT)(PORT_BASE + Flow->Index)),
+                         .sin_addr.s_addr = htonl(PEER_ADDRESS) };
+    int BufferSize = SOCKET_BUFFER_SIZE;
+    DWORD Timeout = 100;
+    if (Tcp)
+    {
+        /* Mirrored, connections to the peer end up at the listener on the same port of ours. */
+        SOCKADDR_IN Listening = { .sin_family = AF_INET, .sin_port = Peer.sin_port, .sin_addr = Local.sin_addr };
+        if ((Flow->Listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET ||
+            bind(Flow->Listener, (SOCKADDR *)&Listening, sizeof(Listening)) == SOCKET_ERROR ||
+            listen(Flow->Listener, 1) == SOCKET_ERROR ||
+            (Flow->Socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET ||
+            bind(Flow->Socket, (SOCKADDR *)&Local, sizeof(Local)) == SOCKET_ERROR)
+            return LogError(L"Failed to open TCP sockets", WSAGetLastError());
+        return ERROR_SUCCESS;
+    }
+    if ((Flow->Socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET ||
+        setsockopt(Flow->Socket, SOL_SOCKET, SO_RCVBUF, (const char *)&BufferSize, sizeof(BufferSize)) ==
+            SOCKET_ERROR ||
+        setsockopt(Flow->Socket, SOL_SOCKET, SO_SNDBUF, (const char *)&BufferSize, sizeof(BufferSize)) ==
+            SOCKET_ERROR ||
+        setsockopt(Flow->Socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&Timeout, sizeof(Timeout)) == SOCKET_ERROR ||
+        bind(Flow->Socket, (SOCKADDR *)&Local, sizeof(Local)) == SOCKET_ERROR ||
+        connect(Flow->Socket, (SOCKADDR *)&Peer, sizeof(Peer)) == SOCKET_ERROR)
+        return LogError(L"Failed to open UDP socket", WSAGetLastError());
+    return ERROR_SUCCESS;
+}
+
+static void
+CloseFlow(_Inout_ FLOW *Flow)
+{
+    if (Flow->Socket != INVALID_SOCKET)
+        closesocket(Flow->Socket);
+    if (Flow->Listener != INVALID_SOCKET)
+        closesocket(Flow->Listener);
+}
+
+static DWORD64
+SystemBusyTime(VOID)
+{
+    ULARGE_INTEGER Idle, Kernel, User;
+    if (!GetSystemTimes((FILETIME *)&Idle, (FILETIME *)&Kernel, (FILETIME *)&User))
+        return 0;
+    /* Kernel time includes idle time. */
+    return Kernel.QuadPart + User.QuadPart - Idle.QuadPart;
+}
+
+static void
+JoinThread(_In_opt_ HANDLE Thread)
+{
+    if (!Thread)
+        return;
+    WaitForSingleObject(Thread, INFINITE);
+    CloseHandle(Thread);
+}
+
+static DWORD
+RunBenchmark(
+    _In_ WINTUN_ADAPTER_HANDLE Adapter,
+    _In_ const CONFIG *Config,
+    _In_ BOOL Tcp,
+    _In_ DWORD PacketSize,
+    _In_ DWORD Capacity,
+    _In_ DWORD Threads,
+    _Out_ RESULT *Result)
+{
+    DWORD LastError = ERROR_SUCCESS, Index;
+    ZeroMemory(Result, sizeof(*Result));
+    Result->Tcp = Tcp;
+    Result->PacketSize = PacketSize;
+    Result->Capacity = Capacity;
+    Result->Threads = Threads;
+    WriteNoFence(&FlowsStopping, FALSE);
+    WriteNoFence(&ReflectorsStopping, FALSE);
+    WriteNoFence(&Measuring, FALSE);
+
+    REFLECTOR *Reflectors = calloc(Threads, sizeof(*Reflectors));
+    FLOW *Flows = calloc(Threads, sizeof(*Flows));
+    if (!Reflectors || !Flows)
+    {
+        LastError = LogError(L"Failed to allocate run", ERROR_OUTOFMEMORY);
+        goto cleanupMemory;
+    }
+    WINTUN_SESSION_HANDLE Session =
+        WintunStartSessionEx(Adapter, Capacity, Threads, WINTUN_SESSION_FLAG_SINGLE_THREADED, NUMA_NO_PREFERRED_NODE);
+    if (!Session)
+    {
+        LastError = LogLastError(L"Failed to start session");
+        goto cleanupMemory;
+    }
+    for (Index = 0; Index < Threads; ++Index)
+    {
+        Reflectors[Index].Session = WintunGetSessionQueue(Session, Index);
+        Reflectors[Index].SpinMicroseconds = Config->SpinMicroseconds;
+        Reflectors[Index].Thread = CreateThread(NULL, 0, Reflect, &Reflectors[Index], 0, NULL);
+        if (!Reflectors[Index].Thread)
+        {
+            LastError = LogLastError(L"Failed to create reflector thread");
+            goto cleanupReflectors;
+        }
+    }
+    /* Give the stack a moment to see the link come up. */
+    WaitForSingleObject(QuitEvent, 1000);
+
+    for (Index = 0; Index < Threads; ++Index)
+    {
+        FLOW *Flow = &Flows[Index];
+        Flow->Index = Index;
+        Flow->PacketSize = PacketSize;
+        Flow->Window = Config->Window;
+        if ((LastError = OpenFlow(Flow, Tcp)) != ERROR_SUCCESS)
+            goto cleanupFlows;
+        Flow->Thread = CreateThread(NULL, 0, Tcp ? TcpFlow : UdpFlow, Flow, 0, NULL);
+        if (Tcp && Flow->Thread)
+            Flow->ServerThread = CreateThread(NULL, 0, TcpServer, Flow, 0, NULL);
+        if (!Flow->Thread || (Tcp && !Flow->ServerThread))
+        {
+            LastError = LogLastError(L"Failed to create flow thread");
+            goto cleanupFlows;
+        }
+    }
+
+    WaitForSingleObject(QuitEvent, Config->WarmupSeconds * 1000);
+    DWORD64 StartPackets = 0, StartBytes = 0, StartDrops = 0, EndPackets = 0, EndBytes = 0, EndDrops = 0;
+    for (Index = 0; Index < Threads; ++Index)
+    {
+        StartPackets += ReadNoFence64(&Reflectors[Index].Packets);
+        StartBytes += ReadNoFence64(&Reflectors[Index].Bytes);
+        StartDrops += ReadNoFence64(&Reflectors[Index].Drops);
+    }
+    DWORD64 StartBusy = SystemBusyTime();
+    LARGE_INTEGER Frequency, Start, End;
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    WriteNoFence(&Measuring, TRUE);
+
+    WaitForSingleObject(QuitEvent, Config->Seconds * 1000);
+
+    WriteNoFence(&Measuring, FALSE);
+    QueryPerformanceCounter(&End);
+    DWORD64 EndBusy = SystemBusyTime();
+    for (Index = 0; Index < Threads; ++Index)
+    {
+        EndPackets += ReadNoFence64(&Reflectors[Index].Packets);
+        EndBytes += ReadNoFence64(&Reflectors[Index].Bytes);
+        EndDrops += ReadNoFence64(&Reflectors[Index].Drops);
+    }
+    Result->Seconds = (double)(End.QuadPart - Start.QuadPart) / Frequency.QuadPart;
+    Result->Packets = EndPackets - StartPackets;
+    Result->Bytes = EndBytes - StartBytes;
+    Result->ReflectorDrops = EndDrops - StartDrops;
+    if (Result->Packets)
+        Result->CpuNanosecondsPerPacket = (EndBusy - StartBusy) * 100.0 / Result->Packets;
+
+cleanupFlows:
+    WriteNoFence(&FlowsStopping, TRUE);
+    for (DWORD i = 0; i < Index; ++i)
+    {
+        JoinThread(Flows[i].Thread);
+        /* Unblocks the server if the connection never made it. */
+        if (Flows[i].Listener != INVALID_SOCKET)
+            closesocket(Flows[i].Listener);
+        Flows[i].Listener = INVALID_SOCKET;
+        JoinThread(Flows[i].ServerThread);
+        CloseFlow(&Flows[i]);
+        MergeLatency(&Result->Latency, &Flows[i].Latency);
+        Result->Lost += Flows[i].Lost;
+    }
+    if (Index < Threads)
+        CloseFlow(&Flows[Index]);
+    for (Index = 0; Index < Threads; ++Index)
+    {
+        WINTUN_SESSION_STATISTICS Statistics;
+        if (WintunGetSessionStatistics(Reflectors[Index].Session, &Statistics))
+            Result->RingOverflows += Statistics.Send.OverflowDrops;
+    }
+cleanupReflectors:
+    WriteNoFence(&ReflectorsStopping, TRUE);
+    for (DWORD i = 0; i < Index; ++i)
+        JoinThread(Reflectors[i].Thread);
+    WintunEndSession(Session);
+cleanupMemory:
+    free(Flows);
+    free(Reflectors);
+    return LastError;
+}
+
+static void
+PrintResult(_In_ const RESULT *Result)
+{
+    double Mpps = Result->Seconds ? Result->Packets / Result->Seconds / 1e6 : 0.0;
+    double Gbps = Result->Seconds ? Result->Bytes * 8 / Result->Seconds / 1e9 : 0.0;
+    wprintf(
+        L"%-4s %6u %10u %7u %9.3f %8.3f %11.0f %9.1f %9.1f %9.1f %10llu %10llu %8llu\n",
+        Result->Tcp ? L"tcp" : L"udp",
+        Result->PacketSize,
+        Result->Capacity,
+        Result->Threads,
+        Mpps,
+        Gbps,
+        Result->CpuNanosecondsPerPacket,
+        LatencyPercentile(&Result->Latency, 0.5),
+        LatencyPercentile(&Result->Latency, 0.99),
+        LatencyPercentile(&Result->Latency, 0.999),
+        Result->ReflectorDrops,
+        Result->RingOverflows,
+        Result->Lost);
+}
+
+static void
+WriteJsonResult(_In_ FILE *File, _In_ DWORD Version, _In_ const RESULT *Result)
+{
+    BOOL HasLatency = Result->Latency.Total != 0;
+    fprintf(
+        File,
+        "{\"driver_version\":\"%u.%u\",\"protocol\":\"%s\",\"packet_size\":%u,\"ring_capacity\":%u,"
+        "\"threads\":%u,\"seconds\":%.3f,\"packets\":%llu,\"bytes\":%llu,\"mpps\":%.6f,\"gbps\":%.6f,"
+        "\"cpu_ns_per_packet\":%.1f,\"latency_samples\":%llu,",
+        (Version >> 16) & 0xff,
+        (Version >> 0) & 0xff,
+        Result->Tcp ? "tcp" : "udp",
+        Result->PacketSize,
+        Result->Capacity,
+        Result->Threads,
+        Result->Seconds,
+        Result->Packets,
+        Result->Bytes,
+        Result->Seconds ? Result->Packets / Result->Seconds / 1e6 : 0.0,
+        Result->Seconds ? Result->Bytes * 8 / Result->Seconds / 1e9 : 0.0,
+        Result->CpuNanosecondsPerPacket,
+        Result->Latency.Total);
+    if (HasLatency)
+        fprintf(
+            File,
+            "\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,",
+            LatencyPercentile(&Result->Latency, 0.5),
+            LatencyPercentile(&Result->Latency, 0.99),
+            LatencyPercentile(&Result->Latency, 0.999));
+    else
+        fprintf(File, "\"p50_us\":null,\"p99_us\":null,\"p999_us\":null,");
+    fprintf(
+        File,
+        "\"reflector_drops\":%llu,\"ring_overflows\":%llu,\"lost\":%llu}\n",
+        Result->ReflectorDrops,
+        Result->RingOverflows,
+        Result->Lost);
+    fflush(File);
+}
+
+static BOOL
+ParseList(_In_z_ const WCHAR *Argument, _Out_writes_(MAX_LIST) DWORD *Values, _Out_ DWORD *Count)
+{
+    *Count = 0;
+    for (const WCHAR *Next = Argument; *Next;)
+    {
+        WCHAR *End;
+        DWORD Value = wcstoul(Next, &End, 0);
+        if (End == Next || !Value || *Count == MAX_LIST || (*End && *End != L','))
+            return FALSE;
+        Values[(*Count)++] = Value;
+        Next = *End ? End + 1 : End;
+    }
+    return *Count != 0;
+}
+
+static BOOL
+ParseArguments(_In_ int argc, _In_reads_(argc) WCHAR **argv, _Out_ CONFIG *Config)
+{
+    *Config = (CONFIG){ .Sizes = { 64, 512, 1400 },
+                        .SizeCount = 3,
+                        .Capacities = { 0x400000, 0x4000000 },
+                        .CapacityCount = 2,
+                        .Threads = { 1, 2, 4 },
+                        .ThreadCount = 3,
+                        .Seconds = 5,
+                        .WarmupSeconds = 1,
+                        .Window = 32,
+                        .SpinMicroseconds = 50 };
+    for (int i = 1; i < argc; ++i)
+    {
+        const WCHAR *Value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!_wcsicmp(argv[i], L"-tcp"))
+            Config->Tcp = TRUE;
+        else if (!Value)
+            return FALSE;
+        else if (!_wcsicmp(argv[i], L"-sizes") && ParseList(Value, Config->Sizes, &Config->SizeCount))
+            ++i;
+        else if (!_wcsicmp(argv[i], L"-capacities") && ParseList(Value, Config->Capacities, &Config->CapacityCount))
+            ++i;
+        else if (!_wcsicmp(argv[i], L"-threads") && ParseList(Value, Config->Threads, &Config->ThreadCount))
+            ++i;
+        else if (!_wcsicmp(argv[i], L"-seconds"))
+            Config->Seconds = wcstoul(argv[++i], NULL, 0);
+        else if (!_wcsicmp(argv[i], L"-warmup"))
+            Config->WarmupSeconds = wcstoul(argv[++i], NULL, 0);
+        else if (!_wcsicmp(argv[i], L"-window"))
+            Config->Window = wcstoul(argv[++i], NULL, 0);
+        else if (!_wcsicmp(argv[i], L"-spin"))
+            Config->SpinMicroseconds = wcstoul(argv[++i], NULL, 0);
+        else if (!_wcsicmp(argv[i], L"-json"))
+            Config->JsonPath = argv[++i];
+        else
+            return FALSE;
+    }
+    for (DWORD i = 0; i < Config->SizeCount; ++i)
+    {
+        if (Config->Sizes[i] < IPV4_HEADER_SIZE + UDP_HEADER_SIZE + sizeof(LONG64) ||
+            Config->Sizes[i] > WINTUN_MAX_IP_PACKET_SIZE)
+            return FALSE;
+    }
+    for (DWORD i = 0; i < Config->ThreadCount; ++i)
+    {
+        if (Config->Threads[i] > WINTUN_MAX_QUEUES)
+            return FALSE;
+    }
+    return Config->Seconds && Config->Window;
+}
+
+int __cdecl wmain(int argc, WCHAR **argv)
+{
+    CONFIG Config;
+    if (!ParseArguments(argc, argv, &Config))
+    {
+        fwprintf(
+            stderr,
+            L"Usage: %s [-sizes 64,512,1400] [-capacities 0x400000,0x4000000] [-threads 1,2,4]\n"
+            L"       [-seconds 5] [-warmup 1] [-window 32] [-spin 50] [-tcp] [-json results.jsonl]\n",
+            argv[0]);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    HMODULE Wintun = InitializeWintun();
+    if (!Wintun)
+        return LogError(L"Failed to initialize Wintun", GetLastError());
+    WintunSetLogger(ConsoleLogger);
+
+    DWORD LastError;
+    WSADATA WsaData;
+    if ((LastError = WSAStartup(MAKEWORD(2, 2), &WsaData)) != ERROR_SUCCESS)
+    {
+        LogError(L"Failed to initialize Winsock", LastError);
+        goto cleanupWintun;
+    }
+    QuitEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!QuitEvent)
+    {
+        LastError = LogError(L"Failed to create event", GetLastError());
+        goto cleanupWinsock;
+    }
+    if (!SetConsoleCtrlHandler(CtrlHandler, TRUE))
+    {
+        LastError = LogError(L"Failed to set console handler", GetLastError());
+        goto cleanupQuit;
+    }
+    FILE *Json = NULL;
+    if (Config.JsonPath && _wfopen_s(&Json, Config.JsonPath, L"w"))
+    {
+        LastError = LogError(L"Failed to open results file", ERROR_OPEN_FAILED);
+        goto cleanupCtrlHandler;
+    }
+
+    GUID BenchmarkGuid = { 0xdeadbabe, 0xcafe, 0xbeef, { 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xf0 } };
+    WINTUN_ADAPTER_HANDLE Adapter = WintunCreateAdapter(L"Benchmark", L"Benchmark", &BenchmarkGuid);
+    if (!Adapter)
+    {
+        LastError = LogLastError(L"Failed to create adapter");
+        goto cleanupJson;
+    }
+    DWORD Version = WintunGetRunningDriverVersion();
+    Log(WINTUN_LOG_INFO, L"Wintun v%u.%u loaded", (Version >> 16) & 0xff, (Version >> 0) & 0xff);
+
+    MIB_UNICASTIPADDRESS_ROW AddressRow;
+    InitializeUnicastIpAddressEntry(&AddressRow);
+    WintunGetAdapterLUID(Adapter, &AddressRow.InterfaceLuid);
+    AddressRow.Address.Ipv4.sin_family = AF_INET;
+    AddressRow.Address.Ipv4.sin_addr.S_un.S_addr = htonl(LOCAL_ADDRESS);
+    AddressRow.OnLinkPrefixLength = TUNNEL_PREFIX_LENGTH;
+    AddressRow.DadState = IpDadStatePreferred;
+    LastError = CreateUnicastIpAddressEntry(&AddressRow);
+    if (LastError != ERROR_SUCCESS && LastError != ERROR_OBJECT_ALREADY_EXISTS)
+    {
+        LogError(L"Failed to set IP address", LastError);
+        goto cleanupAdapter;
+    }
+
+    wprintf(
+        L"%-4s %6s %10s %7s %9s %8s %11s %9s %9s %9s %10s %10s %8s\n",
+        L"prot",
+        L"size",
+        L"capacity",
+        L"threads",
+        L"Mpps",
+        L"Gbps",
+        L"cpu-ns/pkt",
+        L"p50-us",
+        L"p99-us",
+        L"p99.9-us",
+        L"refl-drops",
+        L"overflows",
+        L"lost");
+    LastError = ERROR_SUCCESS;
+    for (DWORD c = 0; c < Config.CapacityCount && !HaveQuit && LastError == ERROR_SUCCESS; ++c)
+    {
+        for (DWORD t = 0; t < Config.ThreadCount && !HaveQuit && LastError == ERROR_SUCCESS; ++t)
+        {
+            /* TCP runs once per combination, at the end of the UDP sizes, as the stack picks its packet sizes. */
+            for (DWORD s = 0; s < Config.SizeCount + !!Config.Tcp && !HaveQuit; ++s)
+            {
+                RESULT Result;
+                BOOL Tcp = s == Config.SizeCount;
+                LastError = RunBenchmark(
+                    Adapter,
+                    &Config,
+                    Tcp,
+                    Tcp ? 0 : Config.Sizes[s],
+                    Config.Capacities[c],
+                    Config.Threads[t],
+                    &Result);
+                if (LastError != ERROR_SUCCESS)
+                    break;
+                if (Tcp && Result.Packets)
+                    Result.PacketSize = (DWORD)(Result.Bytes / Result.Packets);
+                PrintResult(&Result);
+                if (Json)
+                    WriteJsonResult(Json, Version, &Result);
+            }
+        }
+    }
+
+cleanupAdapter:
+    WintunCloseAdapter(Adapter);
+cleanupJson:
+    if (Json)
+        fclose(Json);
+cleanupCtrlHandler:
+    SetConsoleCtrlHandler(CtrlHandler, FALSE);
+cleanupQuit:
+    CloseHandle(QuitEvent);
+cleanupWinsock:
+    WSACleanup();
+cleanupWintun:
+    FreeLibrary(Wintun);
+    return LastError;
+}
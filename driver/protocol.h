@@ -0,0 +1,339 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* The rings and IOCTLs Wintun and its clients share. Includers provide the basic types and CTL_CODE, from the kernel
+ * or the user mode headers. */
+
+#pragma once
+
+#pragma warning(push)
+#pragma warning(disable : 4200) /* nonstandard: zero-sized array in struct/union */
+#pragma warning(disable : 4201) /* nonstandard: nameless struct/union */
+
+/* Memory alignment of packets and rings */
+#define TUN_ALIGNMENT sizeof(ULONG)
+#define TUN_ALIGN(Size) (((ULONG)(Size) + ((ULONG)TUN_ALIGNMENT - 1)) & ~((ULONG)TUN_ALIGNMENT - 1))
+#define TUN_IS_ALIGNED(Size) (!((ULONG)(Size) & ((ULONG)TUN_ALIGNMENT - 1)))
+/* Cache line size the TUN_RING_V2 layout is built around, regardless of architecture */
+#define TUN_RING_LINE_SIZE 64
+/* Calculates ring offset modulo capacity */
+#define TUN_RING_WRAP(Value, Capacity) ((Value) & (Capacity - 1))
+/* Set by clients in TUN_PACKET.Size of packets they hold, or released out of order, past the ring index they have
+ * published. Wintun never sees it. */
+#define TUN_PACKET_RELEASE 0x80000000
+
+typedef struct _TUN_PACKET
+{
+    /* Size of packet data (TUN_MAX_IP_PACKET_SIZE max, plus the prefix of rings registered with one) */
+    ULONG Size;
+
+    /* Packet data */
+    UCHAR _Field_size_bytes_(Size)
+    Data[];
+} TUN_PACKET;
+
+typedef struct _TUN_RING
+{
+    /* Byte offset of the first packet in the ring. Its value must be a multiple of TUN_ALIGNMENT and less than ring
+     * capacity. */
+    volatile ULONG Head;
+
+    /* Byte offset of the first free space in the ring. Its value must be multiple of TUN_ALIGNMENT and less than ring
+     * capacity. */
+    volatile ULONG Tail;
+
+    /* Non-zero when consumer is in alertable state. */
+    volatile LONG Alertable;
+
+    /* Ring data. Its capacity must be a power of 2 + extra TUN_MAX_PACKET_SIZE-TUN_ALIGNMENT space to
+     * eliminate need for wrapping. Rings registered with TUN_REGISTER_QUEUES need the space for a packet of its
+     * MaxPacketSize instead, and TUN_REGISTER_FLAG_MIRRORED rings none. */
+    UCHAR Data[];
+} TUN_RING;
+
+/* Same as TUN_RING, but each member is on a cache line of its own, so that the producer publishing a tail and the
+ * consumer releasing a head do not keep invalidating each other's line, nor the first packets. */
+typedef struct _TUN_RING_V2
+{
+    volatile ULONG Head;
+    UCHAR HeadLine[TUN_RING_LINE_SIZE - sizeof(ULONG)];
+
+    volatile ULONG Tail;
+    UCHAR TailLine[TUN_RING_LINE_SIZE - sizeof(ULONG)];
+
+    volatile LONG Alertable;
+    UCHAR AlertableLine[TUN_RING_LINE_SIZE - sizeof(LONG)];
+
+    UCHAR Data[];
+} TUN_RING_V2;
+
+typedef struct _TUN_REGISTER_RINGS
+{
+    struct
+    {
+        /* Size of the ring */
+        ULONG RingSize;
+
+        /* Pointer to client allocated ring, or its byte offset in the section with TUN_REGISTER_FLAG_SECTION. RingV2
+         * with TUN_REGISTER_FLAG_RING_V2. */
+        union
+        {
+            TUN_RING *Ring;
+            TUN_RING_V2 *RingV2;
+        };
+
+        /* On send: An event created by the client the Wintun signals after it moves the Tail member of the send ring.
+         * On receive: An event created by the client the client will signal when it moves the Tail member of
+         * the receive ring if receive ring is alertable. */
+        HANDLE TailMoved;
+    } Send, Receive;
+} TUN_REGISTER_RINGS;
+
+#ifdef _WIN64
+typedef struct _TUN_REGISTER_RINGS_32
+{
+    struct
+    {
+        /* Size of the ring */
+        ULONG RingSize;
+
+        /* 32-bit address of client allocated ring, or its byte offset in the section */
+        ULONG Ring;
+
+        /* On send: An event created by the client the Wintun signals after it moves the Tail member of the send ring.
+         * On receive: An event created by the client the client will signal when it moves the Tail member of
+         * the receive ring if receive ring is alertable. */
+        ULONG TailMoved;
+    } Send, Receive;
+} TUN_REGISTER_RINGS_32;
+#endif
+
+/* Packets in both rings are prefixed with TUN_PACKET_METADATA, which TUN_PACKET.Size includes. The adapter advertises
+ * TCP checksum offload and LSOv2 for as long as the rings are registered. */
+#define TUN_REGISTER_FLAG_METADATA 0x1
+/* The client sets the Alertable member of the send rings before waiting on their TailMoved events, and rechecks the
+ * tail afterwards. Wintun only signals the events while Alertable is non-zero. */
+#define TUN_REGISTER_FLAG_SEND_ALERTABLE 0x2
+/* The rings live on the NumaNode NUMA node, and the receive threads should run there too. */
+#define TUN_REGISTER_FLAG_NUMA_NODE 0x4
+/* The rings use the TUN_RING_V2 layout. RingSize includes the larger header. */
+#define TUN_REGISTER_FLAG_RING_V2 0x8
+/* The ring pairs are followed by a TUN_REGISTER_REGION, and receive rings may carry TUN_BUFFER_DESCRIPTOR packets. */
+#define TUN_REGISTER_FLAG_BUFFER_REGION 0x10
+/* The ring data is mapped twice, back to back, so RingSize is the header plus twice the capacity, and packets run on
+ * into the second mapping instead of the extra space. The data must start and end on page boundaries. */
+#define TUN_REGISTER_FLAG_MIRRORED 0x20
+/* Packets in both rings are prefixed with the ULONG64 performance counter value of when they were put in the ring,
+ * ahead of any TUN_PACKET_METADATA, and TUN_PACKET.Size includes it. It may be only TUN_ALIGNMENT aligned. */
+#define TUN_REGISTER_FLAG_TIMESTAMP 0x40
+/* The ring pairs are followed by a TUN_REGISTER_SECTION, and their rings are given as byte offsets in that section.
+ * Required to hand the rings over with TUN_IOCTL_TAKE_OVER. Not allowed with TUN_REGISTER_FLAG_BUFFER_REGION or
+ * TUN_REGISTER_FLAG_MIRRORED. */
+#define TUN_REGISTER_FLAG_SECTION 0x80
+/* The last ring pair is a priority queue, for latency sensitive packets not to wait behind bulk traffic. Chains of the
+ * stack's packets go there, instead of to the queue of their flow, when they are all marked for it, or are TCP
+ * acknowledgements that carry no data. Its receive thread runs ahead of the other queues'. Needs two queues or more. */
+#define TUN_REGISTER_FLAG_PRIORITY 0x100
+#define TUN_REGISTER_FLAGS_ALL \
+    (TUN_REGISTER_FLAG_METADATA | TUN_REGISTER_FLAG_SEND_ALERTABLE | TUN_REGISTER_FLAG_NUMA_NODE | \
+     TUN_REGISTER_FLAG_RING_V2 | TUN_REGISTER_FLAG_BUFFER_REGION | TUN_REGISTER_FLAG_MIRRORED | \
+     TUN_REGISTER_FLAG_TIMESTAMP | TUN_REGISTER_FLAG_SECTION | TUN_REGISTER_FLAG_PRIORITY)
+
+/* Set in TUN_PACKET.Size of a receive ring packet whose data, after metadata if any, is a TUN_BUFFER_DESCRIPTOR. */
+#define TUN_PACKET_SIZE_DESCRIPTOR 0x40000000
+
+/* Points at a packet the client placed in its buffer region, so that it does not need copying into the ring. */
+typedef struct _TUN_BUFFER_DESCRIPTOR
+{
+    /* Byte offset of the packet in the region */
+    ULONG Offset;
+
+    /* Size of the packet (TUN_MAX_IP_PACKET_SIZE max) */
+    ULONG Size;
+} TUN_BUFFER_DESCRIPTOR;
+
+/* Returns region packets to the client once the stack is done with them. Descriptors of a queue complete in the
+ * order the stack returns them, which is not necessarily the order they were in the ring. */
+typedef struct _TUN_COMPLETION_RING
+{
+    /* Number of offsets the client has consumed. Counts up and wraps around. */
+    volatile ULONG Head;
+    UCHAR HeadLine[TUN_RING_LINE_SIZE - sizeof(ULONG)];
+
+    /* Number of offsets Wintun has produced. Counts up and wraps around. */
+    volatile ULONG Tail;
+    UCHAR TailLine[TUN_RING_LINE_SIZE - sizeof(ULONG)];
+
+    /* Non-zero while the receive thread waits for the client to consume offsets. The client then signals the receive
+     * ring's TailMoved event once it moves Head. */
+    volatile LONG Alertable;
+    UCHAR AlertableLine[TUN_RING_LINE_SIZE - sizeof(LONG)];
+
+    /* TUN_BUFFER_DESCRIPTOR.Offset of completed packets. Their number must be a power of 2. */
+    ULONG Offsets[];
+} TUN_COMPLETION_RING;
+
+typedef struct _TUN_REGISTER_REGION
+{
+    /* Pointer to client allocated region packets are sent from */
+    ULONG64 Region;
+
+    /* Size of the region */
+    ULONG RegionSize;
+
+    /* Size of each completion ring */
+    ULONG CompletionRingSize;
+
+    /* Pointer to client allocated completion rings, one per queue and in queue order, each CompletionRingSize
+     * bytes */
+    ULONG64 CompletionRings;
+} TUN_REGISTER_REGION;
+
+typedef struct _TUN_REGISTER_SECTION
+{
+    /* Handle to the client created section the rings are in. Wintun maps it to system space itself instead of locking
+     * the client's view of it, so that the rings do not depend on the address space of the client process. */
+    ULONG64 Section;
+} TUN_REGISTER_SECTION;
+
+typedef struct _TUN_REGISTER_QUEUES
+{
+    /* Registration flags. A combination of TUN_REGISTER_FLAG_*. */
+    ULONG Flags;
+
+    /* Number of ring pairs that follow (1 to TUN_MAX_QUEUES) */
+    ULONG QueueCount;
+
+    /* NUMA node, when TUN_REGISTER_FLAG_NUMA_NODE is set */
+    ULONG NumaNode;
+
+    /* Largest TUN_PACKET.Size either ring will carry, or zero for TUN_MAX_IP_PACKET_SIZE plus the prefix of the
+     * flags. It sizes the space that follows each ring's capacity. When non-zero, it must be between the adapter MTU
+     * plus the prefix and that maximum. Must be zero with TUN_REGISTER_FLAG_METADATA, as offloaded packets exceed the
+     * MTU. Also keeps Queues at the same offset for 32-bit processes. */
+    ULONG MaxPacketSize;
+
+    /* Ring pairs. On 32-bit processes running on 64-bit Windows, these are TUN_REGISTER_RINGS_32. */
+    TUN_REGISTER_RINGS Queues[];
+} TUN_REGISTER_QUEUES;
+
+/* Register rings hosted by the client.
+ * The lpInBuffer and nInBufferSize parameters of DeviceIoControl() must point to an TUN_REGISTER_RINGS struct.
+ * Client must wait for this IOCTL to finish before adding packets to the ring. */
+#define TUN_IOCTL_REGISTER_RINGS CTL_CODE(51820U, 0x970U, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+/* Register multiple ring pairs hosted by the client.
+ * The lpInBuffer and nInBufferSize parameters of DeviceIoControl() must point to an TUN_REGISTER_QUEUES struct
+ * followed by QueueCount ring pairs. Each queue gets its own receive thread. Packets sent by the stack are distributed
+ * among the queues by flow hash.
+ * Client must wait for this IOCTL to finish before adding packets to the rings. */
+#define TUN_IOCTL_REGISTER_QUEUES CTL_CODE(51820U, 0x971U, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+#define TUN_LATENCY_BUCKETS 32
+
+typedef struct _TUN_QUEUE_STATISTICS
+{
+    struct
+    {
+        /* Largest number of bytes the ring has held */
+        ULONG64 HighWater;
+
+        /* Packets dropped because the ring was full */
+        ULONG64 OverflowDrops;
+
+        /* Packets dropped because they were too big or needed offloads not negotiated */
+        ULONG64 InvalidDrops;
+
+        /* Times TailMoved was signaled */
+        ULONG64 EventsSignaled;
+
+        /* Packets the send filter dropped */
+        ULONG64 FilterDrops;
+    } Send;
+    struct
+    {
+        /* Largest number of bytes the ring has held */
+        ULONG64 HighWater;
+
+        /* Packets dropped because they were not valid IPv4 or IPv6 */
+        ULONG64 InvalidDrops;
+
+        /* Times packets arrived while spinning on an empty ring */
+        ULONG64 SpinHits;
+
+        /* Times the receive thread went to wait on TailMoved */
+        ULONG64 Waits;
+
+        /* Times an NBL could be neither taken from the cache nor allocated */
+        ULONG64 NblAllocationFailures;
+
+        /* Times the receive thread started waiting for room in the full completion ring */
+        ULONG64 CompletionStalls;
+
+        /* With TUN_REGISTER_FLAG_TIMESTAMP, packets by the time they spent in the ring until taken off to be indicated.
+         * Bucket i counts [2^i, 2^(i+1)) nanoseconds, the first also less and the last also more. Clients passing an
+         * output buffer that ends before this member get everything else. */
+        ULONG64 Latency[TUN_LATENCY_BUCKETS];
+    } Receive;
+} TUN_QUEUE_STATISTICS;
+
+/* Retrieve statistics of one queue of the rings registered on the same file handle.
+ * The lpInBuffer and nInBufferSize parameters of DeviceIoControl() must point to the ULONG queue index, and the
+ * lpOutBuffer and nOutBufferSize parameters to an TUN_QUEUE_STATISTICS struct. Counters reset on registration. */
+#define TUN_IOCTL_GET_STATISTICS CTL_CODE(51820U, 0x972U, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define TUN_FILTER_ACTION_PASS 0
+#define TUN_FILTER_ACTION_DROP 1
+/* Matches any TUN_FILTER_RULE.Protocol. 255 is reserved by IANA, so no real packet carries it. */
+#define TUN_FILTER_ANY_PROTOCOL 0xFF
+
+typedef struct _TUN_FILTER_RULE
+{
+    /* TUN_FILTER_ACTION_* taken on packets that match */
+    UCHAR Action;
+
+    /* 4 or 6, or 0 to match both, in which case PrefixLength must be zero */
+    UCHAR IpVersion;
+
+    /* IP protocol, or TUN_FILTER_ANY_PROTOCOL. For IPv6, this is the next header of the fixed header. */
+    UCHAR Protocol;
+
+    /* Number of leading bits of Destination the destination address must have */
+    UCHAR PrefixLength;
+
+    /* Range of destination ports of TCP and UDP, or of types of ICMP and ICMPv6 (incl.) Packets of other protocols
+     * only match the full range 0 to 0xFFFF. */
+    USHORT PortMin, PortMax;
+
+    /* Destination address prefix. IPv4 addresses take the first 4 bytes. */
+    UCHAR Destination[16];
+} TUN_FILTER_RULE;
+
+typedef struct _TUN_FILTER
+{
+    /* TUN_FILTER_ACTION_* taken on packets that match no rule, or are too short to tell */
+    ULONG DefaultAction;
+
+    /* Number of rules that follow (TUN_MAX_FILTER_RULES max) */
+    ULONG RuleCount;
+
+    /* Rules, in order of precedence */
+    TUN_FILTER_RULE Rules[];
+} TUN_FILTER;
+
+/* Install a filter the packets sent by the stack go through before they take any space in the send rings. The first
+ * rule a packet matches decides. Packets dropped are completed to the stack right away.
+ * The lpInBuffer and nInBufferSize parameters of DeviceIoControl() must point to an TUN_FILTER struct followed by
+ * RuleCount rules. A filter of no rules that passes by default removes it, as does unregistering the rings. Only
+ * the file handle the rings were registered on may install a filter. */
+#define TUN_IOCTL_SET_FILTER CTL_CODE(51820U, 0x973U, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+/* Make the calling process the owner of rings registered with TUN_REGISTER_FLAG_SECTION, so that they stay registered,
+ * and the adapter connected, when the process that registered them exits. The IOCTL must be issued on the file handle
+ * the rings were registered on, duplicated into the calling process. As ever, the rings stay registered until the
+ * last handle to it is closed. Takes no buffers. */
+#define TUN_IOCTL_TAKE_OVER CTL_CODE(51820U, 0x974U, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+#pragma warning(pop)
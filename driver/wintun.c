@@ -8,6 +8,8 @@
 #include <wdmsec.h>
 #include <ndis.h>
 #include <ntstrsafe.h>
+#include <TraceLoggingProvider.h>
+#include "protocol.h"
 #include "undocumented.h"
 
 #pragma warning(disable : 4100) /* unreferenced formal parameter */
@@ -23,22 +25,45 @@
 #define TUN_VENDOR_ID 0xFFFFFF00
 #define TUN_LINK_SPEED 100000000000ULL /* 100gbps */
 
-/* Memory alignment of packets and rings */
-#define TUN_ALIGNMENT sizeof(ULONG)
-#define TUN_ALIGN(Size) (((ULONG)(Size) + ((ULONG)TUN_ALIGNMENT - 1)) & ~((ULONG)TUN_ALIGNMENT - 1))
-#define TUN_IS_ALIGNED(Size) (!((ULONG)(Size) & ((ULONG)TUN_ALIGNMENT - 1)))
 /* Maximum IP packet size */
 #define TUN_MAX_IP_PACKET_SIZE 0xFFFF
+/* Minimum MTU, as required of IPv4 hosts */
+#define TUN_MIN_MTU 576
 /* Maximum packet size */
 #define TUN_MAX_PACKET_SIZE TUN_ALIGN(sizeof(TUN_PACKET) + TUN_MAX_IP_PACKET_SIZE)
 /* Minimum ring capacity. */
 #define TUN_MIN_RING_CAPACITY 0x20000 /* 128kiB */
+/* Minimum ring capacity for packets of at most MaxPacketSize bytes. Equals TUN_MIN_RING_CAPACITY at the largest IP
+ * packets, and does not grow past it when their prefix makes them larger. */
+#define TUN_MIN_RING_CAPACITY_FOR(MaxPacketSize) min(2 * ((ULONG)(MaxPacketSize) + 1), TUN_MIN_RING_CAPACITY)
 /* Maximum ring capacity. */
 #define TUN_MAX_RING_CAPACITY 0x4000000 /* 64MiB */
-/* Calculates ring capacity */
-#define TUN_RING_CAPACITY(Size) ((Size) - sizeof(TUN_RING) - (TUN_MAX_PACKET_SIZE - TUN_ALIGNMENT))
-/* Calculates ring offset modulo capacity */
-#define TUN_RING_WRAP(Value, Capacity) ((Value) & (Capacity - 1))
+/* Calculates ring capacity, given the trailing space needed for a packet of at most MaxPacketSize bytes to not wrap */
+#define TUN_RING_CAPACITY(Size, HeaderSize, MaxPacketSize) \
+    ((Size) - (HeaderSize) - (TUN_ALIGN(sizeof(TUN_PACKET) + (MaxPacketSize)) - TUN_ALIGNMENT))
+/* Maximum number of ring pairs per adapter */
+#define TUN_MAX_QUEUES 64
+/* Maximum number of send batches copying into a ring at once, or done and waiting for an earlier one (power of 2) */
+#define TUN_SEND_SLOTS 256
+/* Default and maximum number of NBLs indicated to NDIS in one chain, which the "ReceiveChainLength" value of the
+ * adapter registry key sets */
+#define TUN_DEFAULT_RECEIVE_NBLS 256
+#define TUN_MAX_RECEIVE_NBLS 0x1000
+/* Receive NBLs preallocated per queue: enough for a ring full of packets of this size, */
+#define TUN_RECEIVE_CACHE_PACKET_SIZE 576
+/* capped at this many. The cache grows on demand beyond that. */
+#define TUN_MAX_RECEIVE_CACHE 0x1000
+/* Maximum size of a buffer region */
+#define TUN_MAX_REGION_SIZE 0x10000000 /* 256MiB */
+/* Maximum number of rules in a send filter */
+#define TUN_MAX_FILTER_RULES 256
+/* Lowest DSCP (CS5) and 802.1p user priority (voice) of packets the priority queue carries */
+#define TUN_PRIORITY_DSCP 40
+#define TUN_PRIORITY_USER_PRIORITY 5
+/* Scheduling priority of receive threads, and of the priority queue's, which runs ahead of them and of normal user
+ * threads */
+#define TUN_RECEIVE_THREAD_PRIORITY 1
+#define TUN_PRIORITY_RECEIVE_THREAD_PRIORITY 9
 
 #if REG_DWORD == REG_DWORD_BIG_ENDIAN
 #    define HTONS(x) ((USHORT)(x))
@@ -54,74 +79,135 @@
 
 #define TUN_MEMORY_TAG HTONL('wtun')
 
-typedef struct _TUN_PACKET
+/* Prefixes packet data in both rings when TUN_REGISTER_FLAG_METADATA is set. Modelled on struct virtio_net_hdr. */
+typedef struct _TUN_PACKET_METADATA
 {
-    /* Size of packet data (TUN_MAX_IP_PACKET_SIZE max) */
-    ULONG Size;
+    /* TUN_PACKET_METADATA_FLAG_* */
+    UCHAR Flags;
 
-    /* Packet data */
-    UCHAR _Field_size_bytes_(Size)
-    Data[];
-} TUN_PACKET;
+    /* TUN_PACKET_METADATA_GSO_* */
+    UCHAR GsoType;
 
-typedef struct _TUN_RING
-{
-    /* Byte offset of the first packet in the ring. Its value must be a multiple of TUN_ALIGNMENT and less than ring
-     * capacity. */
-    volatile ULONG Head;
+    /* Length of IP and TCP headers, for GSO packets */
+    USHORT HdrLen;
 
-    /* Byte offset of the first free space in the ring. Its value must be multiple of TUN_ALIGNMENT and less than ring
-     * capacity. */
-    volatile ULONG Tail;
+    /* Maximum segment payload size, for GSO packets */
+    USHORT GsoSize;
 
-    /* Non-zero when consumer is in alertable state. */
-    volatile LONG Alertable;
+    /* Offset of the data the checksum is computed over, usually the TCP header, from the start of the IP header */
+    USHORT CsumStart;
 
-    /* Ring data. Its capacity must be a power of 2 + extra TUN_MAX_PACKET_SIZE-TUN_ALIGNMENT space to
-     * eliminate need for wrapping. */
-    UCHAR Data[];
-} TUN_RING;
+    /* Offset of the checksum field from CsumStart */
+    USHORT CsumOffset;
 
-typedef struct _TUN_REGISTER_RINGS
-{
-    struct
-    {
-        /* Size of the ring */
-        ULONG RingSize;
+    /* Number of segments coalesced into a GSO packet in the receive ring, or zero to derive it from GsoSize. Zero for
+     * packets in the send ring. */
+    USHORT CoalescedSegments;
+} TUN_PACKET_METADATA;
 
-        /* Pointer to client allocated ring */
-        TUN_RING *Ring;
+/* The checksum at CsumStart + CsumOffset holds the pseudo-header sum only. For GSO packets, this sum does not include
+ * the TCP length, as segments need their own. */
+#define TUN_PACKET_METADATA_FLAG_NEEDS_CSUM 0x01
+/* The checksums of the packet have been validated. */
+#define TUN_PACKET_METADATA_FLAG_DATA_VALID 0x02
+#define TUN_PACKET_METADATA_GSO_NONE 0
+#define TUN_PACKET_METADATA_GSO_TCPV4 1
+#define TUN_PACKET_METADATA_GSO_TCPV6 4
 
-        /* On send: An event created by the client the Wintun signals after it moves the Tail member of the send ring.
-         * On receive: An event created by the client the client will signal when it moves the Tail member of
-         * the receive ring if receive ring is alertable. */
-        HANDLE TailMoved;
-    } Send, Receive;
-} TUN_REGISTER_RINGS;
+/* Maximum TCP payload of a large send: the largest IP packet, less maximum headers and the largest prefix, as offloads
+ * are advertised before the ring format is known */
+#define TUN_MAX_LSO_SIZE (TUN_MAX_IP_PACKET_SIZE - sizeof(ULONG64) - sizeof(TUN_PACKET_METADATA) - 60 - 60)
 
-#ifdef _WIN64
-typedef struct _TUN_REGISTER_RINGS_32
+/* Where the members of a ring are, whichever layout the client registered it with */
+typedef struct _TUN_RING_VIEW
 {
-    struct
+    VOID *Base;
+    volatile ULONG *Head;
+    volatile ULONG *Tail;
+    volatile LONG *Alertable;
+    UCHAR *Data;
+} TUN_RING_VIEW;
+
+typedef struct _TUN_QUEUE
+{
+    struct _TUN_CTX *Ctx;
+
+    DECLSPEC_CACHEALIGN struct
     {
-        /* Size of the ring */
-        ULONG RingSize;
-
-        /* 32-bit address of client allocated ring */
-        ULONG Ring;
-
-        /* On send: An event created by the client the Wintun signals after it moves the Tail member of the send ring.
-         * On receive: An event created by the client the client will signal when it moves the Tail member of
-         * the receive ring if receive ring is alertable. */
-        ULONG TailMoved;
-    } Send, Receive;
-} TUN_REGISTER_RINGS_32;
-#endif
+        MDL *Mdl;
+        TUN_RING_VIEW Ring;
+        ULONG Capacity;
+        KEVENT *TailMoved;
+
+        /* Sequence number of the next batch in the upper half, ring offset it goes to in the lower half. Producers
+         * reserve ring space by compare-exchange. */
+        volatile LONG64 Reservation;
+
+        /* Last head read from the ring. The actual head is only read again when this one shows too little space. */
+        volatile ULONG RingHead;
+
+        /* A batch done copying stores its sequence number in the upper half and its end offset in the lower half of
+         * slot number sequence % TUN_SEND_SLOTS. */
+        volatile LONG64 *Slots;
 
-/* Register rings hosted by the client.
- * The lpInBuffer and nInBufferSize parameters of DeviceIoControl() must point to an TUN_REGISTER_RINGS struct.
- * Client must wait for this IOCTL to finish before adding packets to the ring. */
-#define TUN_IOCTL_REGISTER_RINGS CTL_CODE(51820U, 0x970U, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+        /* The tail only moves past batches done copying, and in order. Whichever producer finds the retirement
+         * unowned does that for all of them, and everyone else leaves. */
+        DECLSPEC_CACHEALIGN struct
+        {
+            volatile LONG Owned;
+            volatile ULONG Sequence;
+        } Retire;
+    } Send;
+
+    DECLSPEC_CACHEALIGN struct
+    {
+        MDL *Mdl;
+        TUN_RING_VIEW Ring;
+        ULONG Capacity;
+        KEVENT *TailMoved;
+        HANDLE Thread;
+        KSPIN_LOCK Lock;
+        struct
+        {
+            NET_BUFFER_LIST *Head, *Tail;
+            KEVENT Empty;
+        } ActiveNbls;
+        NET_BUFFER_LIST *FreeNbls;
+        /* Set by the receive thread when it is out of NBLs, for the next one to return to wake it. */
+        BOOLEAN NblsWanted;
+        KEVENT NblsReturned;
+        struct
+        {
+            TUN_COMPLETION_RING *Ring;
+            ULONG Count;
+            ULONG Tail;
+            /* Descriptors the receive thread has taken off the ring. Counts up and wraps around. */
+            ULONG Taken;
+        } Completion;
+    } Receive;
+
+    DECLSPEC_CACHEALIGN TUN_QUEUE_STATISTICS Statistics;
+} TUN_QUEUE;
+
+/* Adapter counters of one processor. They are only ever summed up on query, so that the data path does not bounce a
+ * shared cache line between the processors the stack sends from and the receive threads run on. */
+typedef struct DECLSPEC_CACHEALIGN _TUN_CPU_STATISTICS
+{
+    LONG64 InOctets, InPackets, InErrors, InDiscards;
+    LONG64 OutOctets, OutPackets, OutErrors, OutDiscards;
+    LONG64 RscCoalescedPackets, RscCoalescedOctets, RscCoalesceEvents;
+} TUN_CPU_STATISTICS;
+
+#define TUN_SUPPORTED_STATISTICS \
+    (NDIS_STATISTICS_FLAGS_VALID_DIRECTED_FRAMES_RCV | NDIS_STATISTICS_FLAGS_VALID_MULTICAST_FRAMES_RCV | \
+     NDIS_STATISTICS_FLAGS_VALID_BROADCAST_FRAMES_RCV | NDIS_STATISTICS_FLAGS_VALID_BYTES_RCV | \
+     NDIS_STATISTICS_FLAGS_VALID_RCV_DISCARDS | NDIS_STATISTICS_FLAGS_VALID_RCV_ERROR | \
+     NDIS_STATISTICS_FLAGS_VALID_DIRECTED_FRAMES_XMIT | NDIS_STATISTICS_FLAGS_VALID_MULTICAST_FRAMES_XMIT | \
+     NDIS_STATISTICS_FLAGS_VALID_BROADCAST_FRAMES_XMIT | NDIS_STATISTICS_FLAGS_VALID_BYTES_XMIT | \
+     NDIS_STATISTICS_FLAGS_VALID_XMIT_ERROR | NDIS_STATISTICS_FLAGS_VALID_XMIT_DISCARDS | \
+     NDIS_STATISTICS_FLAGS_VALID_DIRECTED_BYTES_RCV | NDIS_STATISTICS_FLAGS_VALID_MULTICAST_BYTES_RCV | \
+     NDIS_STATISTICS_FLAGS_VALID_BROADCAST_BYTES_RCV | NDIS_STATISTICS_FLAGS_VALID_DIRECTED_BYTES_XMIT | \
+     NDIS_STATISTICS_FLAGS_VALID_MULTICAST_BYTES_XMIT | NDIS_STATISTICS_FLAGS_VALID_BROADCAST_BYTES_XMIT)
 
 typedef struct _TUN_CTX
 {
@@ -129,12 +215,18 @@ typedef struct _TUN_CTX
 
     /* Used like RCU. When we're making use of rings, we take a shared lock. When we want to register or release the
      * rings and toggle the state, we take an exclusive lock before toggling the atomic and then releasing. It's similar
-     * to setting the atomic and then calling rcu_barrier(). */
-    EX_SPIN_LOCK TransitionLock;
+     * to setting the atomic and then calling rcu_barrier().
+     * Every shared acquisition writes the lock, so keep it apart from the fields the data path only reads. */
+    DECLSPEC_CACHEALIGN EX_SPIN_LOCK TransitionLock;
 
-    NDIS_HANDLE MiniportAdapterHandle; /* This is actually a pointer to NDIS_MINIPORT_BLOCK struct. */
+    /* This is actually a pointer to NDIS_MINIPORT_BLOCK struct. */
+    DECLSPEC_CACHEALIGN NDIS_HANDLE MiniportAdapterHandle;
     DEVICE_OBJECT *FunctionalDeviceObject;
-    NDIS_STATISTICS_INFO Statistics;
+    TUN_CPU_STATISTICS *CpuStatistics;
+    ULONG CpuCount;
+    ULONG Mtu;
+    ULONG MaxReceiveNbls;
+    NDIS_OFFLOAD_ENCAPSULATION OffloadEncapsulation;
 
     struct
     {
@@ -143,41 +235,77 @@ typedef struct _TUN_CTX
         FILE_OBJECT *OwningFileObject;
         HANDLE OwningProcessId;
         KEVENT Disconnected;
-
+        ULONG Flags;
+        USHORT NumaNode;
+        ULONG QueueCount;
+        ULONG MaxPacketSize;
+        /* Allocated for each registration, QueueCount of them. */
+        TUN_QUEUE *Queues;
+        /* Capacities of all send and receive rings, which the buffer space OIDs read without the RegistrationLock */
+        ULONG SendBufferSpace, ReceiveBufferSpace;
+        /* Replaced under the exclusive TransitionLock, and read under the shared one. */
+        TUN_FILTER *Filter;
         struct
         {
             MDL *Mdl;
-            TUN_RING *Ring;
-            ULONG Capacity;
-            KEVENT *TailMoved;
-            KSPIN_LOCK Lock;
-            ULONG RingTail;
-            struct
-            {
-                NET_BUFFER_LIST *Head, *Tail;
-            } ActiveNbls;
-        } Send;
-
+            UCHAR *Data;
+            ULONG Size;
+            MDL *CompletionMdl;
+        } Region;
         struct
         {
-            MDL *Mdl;
-            TUN_RING *Ring;
-            ULONG Capacity;
-            KEVENT *TailMoved;
-            HANDLE Thread;
-            KSPIN_LOCK Lock;
-            struct
-            {
-                NET_BUFFER_LIST *Head, *Tail;
-                KEVENT Empty;
-            } ActiveNbls;
-        } Receive;
+            VOID *Object;
+            UCHAR *View;
+            SIZE_T Size;
+        } Section;
     } Device;
 
     NDIS_HANDLE NblPool;
 } TUN_CTX;
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static TUN_CPU_STATISTICS *
+TunCpuStatistics(_In_ TUN_CTX *Ctx)
+{
+    /* Below DISPATCH_LEVEL the thread may migrate before it updates the slot, so the counters are still updated
+     * atomically. That is cheap, as the cache line stays with the processor that owns it nearly all the time. */
+    return &Ctx->CpuStatistics[KeGetCurrentProcessorNumberEx(NULL)];
+}
+
+static VOID
+TunSumCpuStatistics(_In_ TUN_CTX *Ctx, _Out_ TUN_CPU_STATISTICS *Sum)
+{
+    NdisZeroMemory(Sum, sizeof(*Sum));
+    for (ULONG Index = 0; Index < Ctx->CpuCount; ++Index)
+    {
+        const TUN_CPU_STATISTICS *Cpu = &Ctx->CpuStatistics[Index];
+        Sum->InOctets += ReadNoFence64(&Cpu->InOctets);
+        Sum->InPackets += ReadNoFence64(&Cpu->InPackets);
+        Sum->InErrors += ReadNoFence64(&Cpu->InErrors);
+        Sum->InDiscards += ReadNoFence64(&Cpu->InDiscards);
+        Sum->OutOctets += ReadNoFence64(&Cpu->OutOctets);
+        Sum->OutPackets += ReadNoFence64(&Cpu->OutPackets);
+        Sum->OutErrors += ReadNoFence64(&Cpu->OutErrors);
+        Sum->OutDiscards += ReadNoFence64(&Cpu->OutDiscards);
+        Sum->RscCoalescedPackets += ReadNoFence64(&Cpu->RscCoalescedPackets);
+        Sum->RscCoalescedOctets += ReadNoFence64(&Cpu->RscCoalescedOctets);
+        Sum->RscCoalesceEvents += ReadNoFence64(&Cpu->RscCoalesceEvents);
+    }
+}
+
 static UINT NdisVersion;
+/* Shared with the DLL, so that one trace session records both sides of the rings. The GUID is the one ETW derives from
+ * the name, {4cde0898-3b76-5f71-637e-2cbc42cdd163}. Hot path events are all WINEVENT_LEVEL_VERBOSE and each of them
+ * belongs to one of the keywords below, so that tracing costs nothing until a session asks for them. */
+TRACELOGGING_DEFINE_PROVIDER(
+    TunTraceProvider,
+    "WireGuard.Wintun",
+    (0x4cde0898, 0x3b76, 0x5f71, 0x63, 0x7e, 0x2c, 0xbc, 0x42, 0xcd, 0xd1, 0x63));
+#define TUN_TRACE_KEYWORD_SEND 0x1    /* TunSendNetBufferLists batches */
+#define TUN_TRACE_KEYWORD_RECEIVE 0x2 /* Receive thread wakeups and NBL chains */
+#define TUN_TRACE_KEYWORD_RETURN 0x4  /* NBLs coming back from the stack */
+#define TUN_TRACE_KEYWORD_STATE 0x8   /* Ring registration and pause/restart transitions */
+
 static NDIS_HANDLE NdisMiniportDriverHandle;
 static DRIVER_DISPATCH *NdisDispatchDeviceControl, *NdisDispatchClose, *NdisDispatchPnp;
 static ERESOURCE TunDispatchCtxGuard, TunDispatchDeviceListLock;
@@ -216,11 +344,67 @@ TunIndicateStatus(_In_ NDIS_HANDLE MiniportAdapterHandle, _In_ NDIS_MEDIA_CONNEC
     NdisMIndicateStatusEx(MiniportAdapterHandle, &Indication);
 }
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunInitializeOffload(_Out_ NDIS_OFFLOAD *Offload, _In_ BOOLEAN Enabled)
+{
+    NdisZeroMemory(Offload, sizeof(*Offload));
+    Offload->Header.Type = NDIS_OBJECT_TYPE_OFFLOAD;
+    Offload->Header.Revision = NDIS_OFFLOAD_REVISION_3;
+    Offload->Header.Size = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_3;
+    if (!Enabled)
+        return;
+
+    /* IPv4 header checksums are left to the stack, as user mode rewrites IP headers of every segment anyway. */
+    Offload->Checksum.IPv4Transmit.Encapsulation = NDIS_ENCAPSULATION_NULL;
+    Offload->Checksum.IPv4Transmit.IpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv4Transmit.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv4Transmit.TcpChecksum = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv4Receive = Offload->Checksum.IPv4Transmit;
+    Offload->Checksum.IPv6Transmit.Encapsulation = NDIS_ENCAPSULATION_NULL;
+    Offload->Checksum.IPv6Transmit.IpExtensionHeadersSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv6Transmit.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv6Transmit.TcpChecksum = NDIS_OFFLOAD_SUPPORTED;
+    Offload->Checksum.IPv6Receive = Offload->Checksum.IPv6Transmit;
+    Offload->LsoV2.IPv4.Encapsulation = NDIS_ENCAPSULATION_NULL;
+    Offload->LsoV2.IPv4.MaxOffLoadSize = TUN_MAX_LSO_SIZE;
+    Offload->LsoV2.IPv4.MinSegmentCount = 2;
+    Offload->LsoV2.IPv6.Encapsulation = NDIS_ENCAPSULATION_NULL;
+    Offload->LsoV2.IPv6.MaxOffLoadSize = TUN_MAX_LSO_SIZE;
+    Offload->LsoV2.IPv6.MinSegmentCount = 2;
+    Offload->LsoV2.IPv6.IpExtensionHeadersSupported = NDIS_OFFLOAD_SUPPORTED;
+    Offload->LsoV2.IPv6.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    /* User mode does the coalescing, and tags super-packets in the receive ring with GSO metadata. */
+    Offload->Rsc.IPv4.Enabled = TRUE;
+    Offload->Rsc.IPv6.Enabled = TRUE;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunIndicateOffloadConfig(_In_ NDIS_HANDLE MiniportAdapterHandle, _In_ BOOLEAN Enabled)
+{
+    NDIS_OFFLOAD Offload;
+    TunInitializeOffload(&Offload, Enabled);
+
+    NDIS_STATUS_INDICATION Indication = { .Header = { .Type = NDIS_OBJECT_TYPE_STATUS_INDICATION,
+                                                      .Revision = NDIS_STATUS_INDICATION_REVISION_1,
+                                                      .Size = NDIS_SIZEOF_STATUS_INDICATION_REVISION_1 },
+                                          .SourceHandle = MiniportAdapterHandle,
+                                          .StatusCode = NDIS_STATUS_TASK_OFFLOAD_CURRENT_CONFIG,
+                                          .StatusBuffer = &Offload,
+                                          .StatusBufferSize = sizeof(Offload) };
+
+    NdisMIndicateStatusEx(MiniportAdapterHandle, &Indication);
+}
+
 /* Send: We should not modify NET_BUFFER_LIST_NEXT_NBL(Nbl) to prevent fragmented NBLs to separate.
  * Receive: NDIS may change NET_BUFFER_LIST_NEXT_NBL(Nbl) at will between the NdisMIndicateReceiveNetBufferLists() and
  * MINIPORT_RETURN_NET_BUFFER_LISTS calls. Therefore, we use our own ->Next pointer for book-keeping. */
 #define NET_BUFFER_LIST_NEXT_NBL_EX(Nbl) (NET_BUFFER_LIST_MINIPORT_RESERVED(Nbl)[1])
 
+/* Send: Non-NULL when the filter dropped the NBL, as found while measuring, so copying need not run it again. */
+#define NET_BUFFER_LIST_FILTERED(Nbl) (NET_BUFFER_LIST_MINIPORT_RESERVED(Nbl)[0])
+
 static VOID
 TunNblSetOffsetAndMarkActive(_Inout_ NET_BUFFER_LIST *Nbl, _In_ ULONG Offset)
 {
@@ -240,12 +424,401 @@ TunNblMarkCompleted(_Inout_ NET_BUFFER_LIST *Nbl)
     *(ULONG_PTR *)&NET_BUFFER_LIST_MINIPORT_RESERVED(Nbl)[0] |= 1;
 }
 
+/* Makes the NBL release ring space up to Offset rather than just past its own packet, and keeps it marked completed
+ * if it was. Only valid for the last active NBL, under the receive lock. */
+static VOID
+TunNblExtendOffset(_Inout_ NET_BUFFER_LIST *Nbl, _In_ ULONG Offset)
+{
+    ASSERT(TUN_IS_ALIGNED(Offset));
+    NET_BUFFER_LIST_MINIPORT_RESERVED(Nbl)[0] =
+        (VOID *)((ULONG_PTR)Offset | ((ULONG_PTR)(NET_BUFFER_LIST_MINIPORT_RESERVED(Nbl)[0]) & 1));
+}
+
 static BOOLEAN
 TunNblIsCompleted(_In_ NET_BUFFER_LIST *Nbl)
 {
     return (ULONG_PTR)(NET_BUFFER_LIST_MINIPORT_RESERVED(Nbl)[0]) & 1;
 }
 
+/* Receive: NET_BUFFER_MINIPORT_RESERVED of the single NET_BUFFER we allocate for each NBL remembers the queue it came
+ * from, so that MINIPORT_RETURN_NET_BUFFER_LISTS knows which ring to release it to, the partial MDL that is
+ * rebuilt for each packet the NBL carries, and the region offset plus one for packets that are in the buffer
+ * region, or zero for packets in the ring. */
+#define NET_BUFFER_LIST_QUEUE(Nbl) (NET_BUFFER_MINIPORT_RESERVED(NET_BUFFER_LIST_FIRST_NB(Nbl))[0])
+#define NET_BUFFER_LIST_MDL(Nbl) (NET_BUFFER_MINIPORT_RESERVED(NET_BUFFER_LIST_FIRST_NB(Nbl))[1])
+#define NET_BUFFER_LIST_REGION_OFFSET(Nbl) (NET_BUFFER_MINIPORT_RESERVED(NET_BUFFER_LIST_FIRST_NB(Nbl))[2])
+/* Receive: The performance counter, truncated to a pointer, of when the NBL was indicated, or zero unless a trace
+ * session asked for TUN_TRACE_KEYWORD_RETURN at the time. The difference of two truncated values is still good. */
+#define NET_BUFFER_LIST_INDICATED(Nbl) (NET_BUFFER_MINIPORT_RESERVED(NET_BUFFER_LIST_FIRST_NB(Nbl))[3])
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static NET_BUFFER_LIST *
+TunAllocateReceiveNbl(_In_ TUN_CTX *Ctx)
+{
+    /* Size the MDL for the largest packet starting at the worst page offset, so IoBuildPartialMdl() always fits. */
+    MDL *Mdl = IoAllocateMdl((VOID *)(PAGE_SIZE - 1), TUN_MAX_IP_PACKET_SIZE, FALSE, FALSE, NULL);
+    if (!Mdl)
+        return NULL;
+    NET_BUFFER_LIST *Nbl = NdisAllocateNetBufferAndNetBufferList(Ctx->NblPool, 0, 0, Mdl, 0, 0);
+    if (!Nbl)
+    {
+        IoFreeMdl(Mdl);
+        return NULL;
+    }
+    Nbl->SourceHandle = Ctx->MiniportAdapterHandle;
+    NET_BUFFER_LIST_MDL(Nbl) = Mdl;
+    return Nbl;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunFreeReceiveNbls(_In_opt_ NET_BUFFER_LIST *Nbls)
+{
+    for (NET_BUFFER_LIST *Nbl = Nbls, *NextNbl; Nbl; Nbl = NextNbl)
+    {
+        NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
+        IoFreeMdl(NET_BUFFER_LIST_MDL(Nbl));
+        NdisFreeNetBufferList(Nbl);
+    }
+}
+
+static ULONG
+TunHashBytes(_In_reads_bytes_(Size) const UCHAR *Data, _In_ ULONG Size, _In_ ULONG Hash)
+{
+    /* FNV-1a */
+    for (ULONG i = 0; i < Size; ++i)
+        Hash = (Hash ^ Data[i]) * 16777619U;
+    return Hash;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static ULONG
+TunFlowHash(_In_ NET_BUFFER *Nb)
+{
+    ULONG Hash = 2166136261U;
+    UCHAR Storage[44];
+    ULONG Size = min(NET_BUFFER_DATA_LENGTH(Nb), sizeof(Storage));
+    if (Size < 20)
+        return Hash;
+    const UCHAR *Header = NdisGetDataBuffer(Nb, Size, Storage, 1, 0);
+    if (!Header)
+        return Hash;
+
+    ULONG PortsOffset;
+    UCHAR Proto;
+    if (Header[0] >> 4 == 4)
+    {
+        Proto = Header[9];
+        Hash = TunHashBytes(Header + 12, 8, TunHashBytes(&Proto, 1, Hash)); /* Source and destination address */
+        if (Header[6] & 0x3f || Header[7]) /* Fragments carry no ports beyond the first one. */
+            return Hash;
+        PortsOffset = (Header[0] & 0xf) * 4;
+    }
+    else if (Header[0] >> 4 == 6 && Size >= 40)
+    {
+        Proto = Header[6];
+        Hash = TunHashBytes(Header + 8, 32, TunHashBytes(&Proto, 1, Hash)); /* Source and destination address */
+        PortsOffset = 40;
+    }
+    else
+        return Hash;
+    if ((Proto == 6 /* TCP */ || Proto == 17 /* UDP */) && PortsOffset + 4 <= Size)
+        Hash = TunHashBytes(Header + PortsOffset, 4, Hash);
+    return Hash;
+}
+
+/* Packets marked for expedited forwarding or network control, by DSCP or 802.1p priority, and TCP acknowledgements
+ * that neither carry data nor open or close the connection, which cannot harm their flow by overtaking it. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static BOOLEAN
+TunNblIsPriority(_In_ NET_BUFFER_LIST *Nbl)
+{
+    NDIS_NET_BUFFER_LIST_8021Q_INFO Ieee8021Q;
+    Ieee8021Q.Value = NET_BUFFER_LIST_INFO(Nbl, Ieee8021QNetBufferListInfo);
+    if (Ieee8021Q.TagHeader.UserPriority >= TUN_PRIORITY_USER_PRIORITY)
+        return TRUE;
+    NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl);
+    UCHAR Storage[80];
+    ULONG PacketSize = NET_BUFFER_DATA_LENGTH(Nb), Size = min(PacketSize, sizeof(Storage));
+    if (Size < 20)
+        return FALSE;
+    const UCHAR *Header = NdisGetDataBuffer(Nb, Size, Storage, 1, 0);
+    if (!Header)
+        return FALSE;
+
+    ULONG TcpOffset;
+    UCHAR Dscp, Proto;
+    if (Header[0] >> 4 == 4)
+    {
+        Dscp = Header[1] >> 2;
+        Proto = Header[6] & 0x3f || Header[7] ? 0 : Header[9]; /* Fragments beyond the first one carry no TCP header. */
+        TcpOffset = (Header[0] & 0xf) * 4;
+    }
+    else if (Header[0] >> 4 == 6 && Size >= 40)
+    {
+        Dscp = (UCHAR)((Header[0] & 0xf) << 2 | Header[1] >> 6);
+        Proto = Header[6];
+        TcpOffset = 40;
+    }
+    else
+        return FALSE;
+    if (Dscp >= TUN_PRIORITY_DSCP)
+        return TRUE;
+    if (Proto != 6 /* TCP */ || NET_BUFFER_NEXT_NB(Nb) || TcpOffset + 20 > Size)
+        return FALSE;
+    const UCHAR *Tcp = Header + TcpOffset;
+    /* ACK, and none of FIN, SYN or RST */
+    return (Tcp[13] & 0x17) == 0x10 && TcpOffset + (Tcp[12] >> 4) * 4 == PacketSize;
+}
+
+/* Picks the queue for a chain of NBLs. All NBLs in the chain share the queue of the first one, as we don't break up
+ * what the stack handed us in one piece. Only chains of nothing but priority NBLs go to the priority queue, so for
+ * bulk chains, a look at the first NBL usually does. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static TUN_QUEUE *
+TunSelectSendQueue(_In_ TUN_CTX *Ctx, _In_ NET_BUFFER_LIST *NetBufferLists)
+{
+    ULONG QueueCount = Ctx->Device.QueueCount;
+    if (Ctx->Device.Flags & TUN_REGISTER_FLAG_PRIORITY)
+    {
+        /* The priority queue is the last one, and takes no part in spreading flows. */
+        --QueueCount;
+        NET_BUFFER_LIST *Nbl = NetBufferLists;
+        while (Nbl && TunNblIsPriority(Nbl))
+            Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
+        if (!Nbl)
+            return &Ctx->Device.Queues[QueueCount];
+    }
+    if (QueueCount <= 1)
+        return &Ctx->Device.Queues[0];
+    ULONG Hash = NET_BUFFER_LIST_GET_HASH_VALUE(NetBufferLists);
+    if (!Hash)
+        Hash = TunFlowHash(NET_BUFFER_LIST_FIRST_NB(NetBufferLists));
+    return &Ctx->Device.Queues[Hash % QueueCount];
+}
+
+static VOID
+TunUpdateHighWater(_Inout_ ULONG64 *HighWater, _In_ ULONG Value)
+{
+    LONG64 Current = ReadNoFence64((LONG64 *)HighWater);
+    while (Value > (ULONG64)Current)
+    {
+        LONG64 Previous = InterlockedCompareExchange64((LONG64 *)HighWater, Value, Current);
+        if (Previous == Current)
+            break;
+        Current = Previous;
+    }
+}
+
+/* Converts a performance counter difference without overflowing, taking negative ones as zero. */
+static ULONG64
+TunTicksToNanoseconds(_In_ LONG64 Ticks, _In_ LONG64 Frequency)
+{
+    if (Ticks <= 0)
+        return 0;
+    return (ULONG64)(Ticks / Frequency) * 1000000000 + (ULONG64)(Ticks % Frequency) * 1000000000 / (ULONG64)Frequency;
+}
+
+/* Counts a packet into a latency histogram of TUN_LATENCY_BUCKETS. Histograms have a single writer, which is the
+ * receive thread of their queue. */
+static VOID
+TunCountLatency(_Inout_ ULONG64 *Histogram, _In_ LONG64 Ticks, _In_ LONG64 Frequency)
+{
+    ULONG64 Nanoseconds = TunTicksToNanoseconds(Ticks, Frequency);
+    ULONG Bucket = 0;
+    if (Nanoseconds)
+        _BitScanReverse(&Bucket, (ULONG)min(Nanoseconds, MAXULONG));
+    WriteNoFence64((LONG64 *)&Histogram[Bucket], ReadNoFence64((LONG64 *)&Histogram[Bucket]) + 1);
+}
+
+/* Hands a region packet back to the client. The receive thread leaves descriptors in the ring while the completion
+ * ring could not take them all, so it has room unless the client moved its head back, in which case the client loses
+ * track of its packets but cannot make us overrun the ring. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunCompleteRegionPacket(_Inout_ TUN_QUEUE *Queue, _In_ ULONG Offset)
+{
+    KLOCK_QUEUE_HANDLE LockHandle;
+    KeAcquireInStackQueuedSpinLock(&Queue->Receive.Lock, &LockHandle);
+    TUN_COMPLETION_RING *Ring = Queue->Receive.Completion.Ring;
+    ULONG Tail = Queue->Receive.Completion.Tail;
+    if (Tail - ReadULongAcquire(&Ring->Head) < Queue->Receive.Completion.Count)
+    {
+        Ring->Offsets[Tail & (Queue->Receive.Completion.Count - 1)] = Offset;
+        Queue->Receive.Completion.Tail = ++Tail;
+        WriteULongRelease(&Ring->Tail, Tail);
+    }
+    KeReleaseInStackQueuedSpinLock(&LockHandle);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunCompleteNbl(_Inout_ TUN_QUEUE *Queue, _In_ NET_BUFFER_LIST *Nbl)
+{
+    ULONG_PTR RegionOffset = (ULONG_PTR)NET_BUFFER_LIST_REGION_OFFSET(Nbl);
+    if (RegionOffset)
+        TunCompleteRegionPacket(Queue, (ULONG)(RegionOffset - 1));
+}
+
+#define TUN_SEND_SLOT(Sequence, Offset) ((LONG64)(((ULONG64)(Sequence) << 32) | (Offset)))
+#define TUN_SEND_SLOT_SEQUENCE(Slot) ((ULONG)((ULONG64)(Slot) >> 32))
+#define TUN_SEND_SLOT_OFFSET(Slot) ((ULONG)(Slot))
+
+/* Moves the send ring tail past all batches done copying that follow the last one retired, unless another producer
+ * is doing that already. Returns TRUE if the tail moved. */
+_IRQL_requires_(DISPATCH_LEVEL)
+static BOOLEAN
+TunRetireSendBatches(_Inout_ TUN_QUEUE *Queue)
+{
+    BOOLEAN TailMoved = FALSE;
+    while (!InterlockedCompareExchange(&Queue->Send.Retire.Owned, TRUE, FALSE))
+    {
+        ULONG Sequence = Queue->Send.Retire.Sequence, RingTail = 0;
+        for (;;)
+        {
+            LONG64 Slot = ReadAcquire64(&Queue->Send.Slots[Sequence % TUN_SEND_SLOTS]);
+            if (TUN_SEND_SLOT_SEQUENCE(Slot) != Sequence)
+                break;
+            RingTail = TUN_SEND_SLOT_OFFSET(Slot);
+            ++Sequence;
+        }
+        if (Sequence != Queue->Send.Retire.Sequence)
+        {
+            WriteULongRelease(Queue->Send.Ring.Tail, RingTail);
+            WriteULongRelease(&Queue->Send.Retire.Sequence, Sequence);
+            TailMoved = TRUE;
+        }
+        InterlockedExchange(&Queue->Send.Retire.Owned, FALSE);
+        /* A producer that finished after we looked may have found us still owning the retirement. */
+        if (TUN_SEND_SLOT_SEQUENCE(ReadAcquire64(&Queue->Send.Slots[Sequence % TUN_SEND_SLOTS])) != Sequence)
+            break;
+    }
+    return TailMoved;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static BOOLEAN
+TunNblRequiresOffload(_In_ NET_BUFFER_LIST *Nbl)
+{
+    NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO Lso;
+    Lso.Value = NET_BUFFER_LIST_INFO(Nbl, TcpLargeSendNetBufferListInfo);
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO Csum;
+    Csum.Value = NET_BUFFER_LIST_INFO(Nbl, TcpIpChecksumNetBufferListInfo);
+    return Lso.LsoV2Transmit.MSS || Csum.Transmit.TcpChecksum;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunFillPacketMetadata(
+    _Out_ TUN_PACKET_METADATA *Metadata,
+    _In_ NET_BUFFER_LIST *Nbl,
+    _In_reads_bytes_(PacketSize) const UCHAR *Packet,
+    _In_ ULONG PacketSize)
+{
+    NdisZeroMemory(Metadata, sizeof(*Metadata));
+    NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO Lso;
+    Lso.Value = NET_BUFFER_LIST_INFO(Nbl, TcpLargeSendNetBufferListInfo);
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO Csum;
+    Csum.Value = NET_BUFFER_LIST_INFO(Nbl, TcpIpChecksumNetBufferListInfo);
+    ULONG TcpHeaderOffset;
+    if (Lso.LsoV2Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE && Lso.LsoV2Transmit.MSS)
+    {
+        Metadata->GsoType = Lso.LsoV2Transmit.IPVersion == NDIS_TCP_LARGE_SEND_OFFLOAD_IPv4
+                                ? TUN_PACKET_METADATA_GSO_TCPV4
+                                : TUN_PACKET_METADATA_GSO_TCPV6;
+        Metadata->GsoSize = (USHORT)Lso.LsoV2Transmit.MSS;
+        TcpHeaderOffset = Lso.LsoV2Transmit.TcpHeaderOffset;
+    }
+    else if (Csum.Transmit.TcpChecksum)
+        TcpHeaderOffset = Csum.Transmit.TcpHeaderOffset;
+    else
+        return;
+    Metadata->Flags = TUN_PACKET_METADATA_FLAG_NEEDS_CSUM;
+    Metadata->CsumStart = (USHORT)TcpHeaderOffset;
+    Metadata->CsumOffset = 16; /* Offset of checksum in TCP header */
+    if (TcpHeaderOffset + 20 <= PacketSize)
+        Metadata->HdrLen = (USHORT)(TcpHeaderOffset + (Packet[TcpHeaderOffset + 12] >> 4) * 4);
+}
+
+/* Returns the number of TCP segments user mode coalesced into the packet, or 0 if the packet is not a well-formed
+ * super-packet and must be indicated as is. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static USHORT
+TunCoalescedSegments(_In_ const TUN_PACKET_METADATA *Metadata, _In_ ULONG NblFlags, _In_ UCHAR IpProto, _In_ ULONG Size)
+{
+    if (IpProto != 6 /* TCP */ || !Metadata->GsoSize || Metadata->HdrLen >= Size ||
+        !(Metadata->Flags & (TUN_PACKET_METADATA_FLAG_NEEDS_CSUM | TUN_PACKET_METADATA_FLAG_DATA_VALID)))
+        return 0;
+    if (!(Metadata->GsoType == TUN_PACKET_METADATA_GSO_TCPV4 && NblFlags & NDIS_NBL_FLAGS_IS_IPV4) &&
+        !(Metadata->GsoType == TUN_PACKET_METADATA_GSO_TCPV6 && NblFlags & NDIS_NBL_FLAGS_IS_IPV6))
+        return 0;
+    ULONG Segments = Metadata->CoalescedSegments;
+    if (!Segments)
+        Segments = (Size - Metadata->HdrLen + Metadata->GsoSize - 1) / Metadata->GsoSize;
+    return Segments >= 2 ? (USHORT)Segments : 0;
+}
+
+static BOOLEAN
+TunPrefixMatches(_In_reads_bytes_(16) const UCHAR *Address, _In_reads_bytes_(16) const UCHAR *Prefix, _In_ ULONG Length)
+{
+    ULONG Bytes = Length / 8, Bits = Length % 8;
+    if (!RtlEqualMemory(Address, Prefix, Bytes))
+        return FALSE;
+    return !Bits || !((Address[Bytes] ^ Prefix[Bytes]) & (UCHAR)(0xFF00 >> Bits));
+}
+
+/* Runs the filter on the first packet of the NBL. Packets of an NBL belong to the same flow. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static BOOLEAN
+TunFilterDrops(_In_ const TUN_FILTER *Filter, _In_ NET_BUFFER_LIST *Nbl)
+{
+    NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl);
+    /* Largest IPv4 header, and the bytes of the transport header we look at */
+    UCHAR Storage[60 + 4];
+    ULONG Size = min(NET_BUFFER_DATA_LENGTH(Nb), sizeof(Storage));
+    const UCHAR *Header = Size ? NdisGetDataBuffer(Nb, Size, Storage, 1, 0) : NULL;
+    if (!Header)
+        return Filter->DefaultAction == TUN_FILTER_ACTION_DROP;
+
+    UCHAR IpVersion = Header[0] >> 4, Protocol;
+    UCHAR Destination[16] = { 0 };
+    ULONG TransportOffset;
+    if (IpVersion == 4 && Size >= 20)
+    {
+        Protocol = Header[9];
+        NdisMoveMemory(Destination, Header + 16, 4);
+        TransportOffset = (Header[0] & 0xF) * 4;
+    }
+    else if (IpVersion == 6 && Size >= 40)
+    {
+        Protocol = Header[6];
+        NdisMoveMemory(Destination, Header + 24, 16);
+        TransportOffset = 40;
+    }
+    else
+        return Filter->DefaultAction == TUN_FILTER_ACTION_DROP;
+
+    LONG Port = -1;
+    if ((Protocol == 6 /* TCP */ || Protocol == 17 /* UDP */) && TransportOffset + 4 <= Size)
+        Port = (Header[TransportOffset + 2] << 8) | Header[TransportOffset + 3];
+    else if ((Protocol == 1 /* ICMP */ || Protocol == 58 /* ICMPv6 */) && TransportOffset + 1 <= Size)
+        Port = Header[TransportOffset];
+
+    for (ULONG Index = 0; Index < Filter->RuleCount; ++Index)
+    {
+        const TUN_FILTER_RULE *Rule = &Filter->Rules[Index];
+        if ((Rule->IpVersion && Rule->IpVersion != IpVersion) ||
+            (Rule->Protocol != TUN_FILTER_ANY_PROTOCOL && Rule->Protocol != Protocol) ||
+            !TunPrefixMatches(Destination, Rule->Destination, Rule->PrefixLength))
+            continue;
+        if ((Rule->PortMin || Rule->PortMax != 0xFFFF) && (Port < Rule->PortMin || Port > Rule->PortMax))
+            continue;
+        return Rule->Action == TUN_FILTER_ACTION_DROP;
+    }
+    return Filter->DefaultAction == TUN_FILTER_ACTION_DROP;
+}
+
 static MINIPORT_SEND_NET_BUFFER_LISTS TunSendNetBufferLists;
 _Use_decl_annotations_
 static VOID
@@ -257,121 +830,214 @@ TunSendNetBufferLists(
 {
     TUN_CTX *Ctx = (TUN_CTX *)MiniportAdapterContext;
     LONG64 SentPacketsCount = 0, SentPacketsSize = 0, ErrorPacketsCount = 0, DiscardedPacketsCount = 0;
+    LONG64 FilteredPacketsCount = 0;
+    TUN_CPU_STATISTICS *CpuStatistics;
 
-    /* Measure NBLs. */
-    ULONG PacketsCount = 0, RequiredRingSpace = 0;
+    KIRQL Irql = ExAcquireSpinLockShared(&Ctx->TransitionLock);
+    NDIS_STATUS Status;
+    if ((Status = NDIS_STATUS_PAUSED, !ReadAcquire(&Ctx->Running)) ||
+        (Status = NDIS_STATUS_MEDIA_DISCONNECTED, KeReadStateEvent(&Ctx->Device.Disconnected)))
+        goto skipNbl;
+
+    /* The ring format is fixed while the rings are registered, so measure under the same shared lock that copies. */
+    ULONG MetadataSize = Ctx->Device.Flags & TUN_REGISTER_FLAG_METADATA ? sizeof(TUN_PACKET_METADATA) : 0;
+    ULONG TimestampSize = Ctx->Device.Flags & TUN_REGISTER_FLAG_TIMESTAMP ? sizeof(ULONG64) : 0;
+    ULONG PrefixSize = TimestampSize + MetadataSize;
+    ULONG MaxPacketSize = Ctx->Device.MaxPacketSize - PrefixSize;
+
+    TUN_QUEUE *Queue = TunSelectSendQueue(Ctx, NetBufferLists);
+    const TUN_RING_VIEW *Ring = &Queue->Send.Ring;
+    ULONG RingCapacity = Queue->Send.Capacity;
+
+    /* Measure and filter NBLs. */
+    const TUN_FILTER *Filter = Ctx->Device.Filter;
+    ULONG RequiredRingSpace = 0, PacketsCount = 0;
     for (NET_BUFFER_LIST *Nbl = NetBufferLists; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
     {
+        BOOLEAN Filtered = Filter && TunFilterDrops(Filter, Nbl);
+        NET_BUFFER_LIST_FILTERED(Nbl) = (VOID *)Filtered;
+        BOOLEAN Unsupported = !MetadataSize && TunNblRequiresOffload(Nbl);
         for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
         {
             PacketsCount++;
+            if (Filtered)
+            {
+                FilteredPacketsCount++;
+                continue;
+            }
             UINT PacketSize = NET_BUFFER_DATA_LENGTH(Nb);
-            if (PacketSize > TUN_MAX_IP_PACKET_SIZE)
+            if (Unsupported || PacketSize > MaxPacketSize)
                 continue; /* The same condition holds down below, where we `goto skipPacket`. */
-            RequiredRingSpace += TUN_ALIGN(sizeof(TUN_PACKET) + PacketSize);
+            RequiredRingSpace += TUN_ALIGN(sizeof(TUN_PACKET) + PrefixSize + PacketSize);
         }
     }
+    /* Dropped on purpose, which is no error of the stack's. */
+    if (Status = NDIS_STATUS_SUCCESS, FilteredPacketsCount == PacketsCount)
+        goto cleanupFiltered;
+
+    /* Allocate space for packets in the ring, and a sequence number that orders this batch among the others. */
+    LONG64 Reservation = ReadNoFence64(&Queue->Send.Reservation);
+    ULONG Sequence, RingTail, RingEnd, RingSpace = 0;
+    for (;;)
+    {
+        Sequence = TUN_SEND_SLOT_SEQUENCE(Reservation);
+        RingTail = TUN_SEND_SLOT_OFFSET(Reservation);
+        ASSERT(RingTail < RingCapacity);
+        if (Status = NDIS_STATUS_BUFFER_OVERFLOW,
+            Sequence - ReadULongNoFence(&Queue->Send.Retire.Sequence) >= TUN_SEND_SLOTS)
+            goto cleanupOverflow;
+
+        ULONG RingHead = ReadULongNoFence(&Queue->Send.RingHead);
+        RingSpace = TUN_RING_WRAP(RingHead - RingTail - TUN_ALIGNMENT, RingCapacity);
+        if (RingSpace < RequiredRingSpace)
+        {
+            RingHead = ReadULongAcquire(Ring->Head);
+            if (Status = NDIS_STATUS_ADAPTER_NOT_READY, RingHead >= RingCapacity)
+                goto cleanupFiltered;
+            WriteULongNoFence(&Queue->Send.RingHead, RingHead);
+            RingSpace = TUN_RING_WRAP(RingHead - RingTail - TUN_ALIGNMENT, RingCapacity);
+            /* The ring getting this full is when the high water mark matters, and the head is fresh. */
+            TunUpdateHighWater(&Queue->Statistics.Send.HighWater, TUN_RING_WRAP(RingTail - RingHead, RingCapacity));
+            if (Status = NDIS_STATUS_BUFFER_OVERFLOW, RingSpace < RequiredRingSpace)
+                goto cleanupOverflow;
+        }
 
-    KIRQL Irql = ExAcquireSpinLockShared(&Ctx->TransitionLock);
-    NDIS_STATUS Status;
-    if ((Status = NDIS_STATUS_PAUSED, !ReadAcquire(&Ctx->Running)) ||
-        (Status = NDIS_STATUS_MEDIA_DISCONNECTED, KeReadStateEvent(&Ctx->Device.Disconnected)))
-        goto skipNbl;
-
-    TUN_RING *Ring = Ctx->Device.Send.Ring;
-    ULONG RingCapacity = Ctx->Device.Send.Capacity;
-
-    /* Allocate space for packets in the ring. */
-    ULONG RingHead = ReadULongAcquire(&Ring->Head);
-    if (Status = NDIS_STATUS_ADAPTER_NOT_READY, RingHead >= RingCapacity)
-        goto skipNbl;
-
-    KLOCK_QUEUE_HANDLE LockHandle;
-    KeAcquireInStackQueuedSpinLock(&Ctx->Device.Send.Lock, &LockHandle);
-
-    ULONG RingTail = Ctx->Device.Send.RingTail;
-    ASSERT(RingTail < RingCapacity);
-
-    ULONG RingSpace = TUN_RING_WRAP(RingHead - RingTail - TUN_ALIGNMENT, RingCapacity);
-    if (Status = NDIS_STATUS_BUFFER_OVERFLOW, RingSpace < RequiredRingSpace)
-        goto cleanupKeReleaseInStackQueuedSpinLock;
-
-    Ctx->Device.Send.RingTail = TUN_RING_WRAP(RingTail + RequiredRingSpace, RingCapacity);
-    TunNblSetOffsetAndMarkActive(NetBufferLists, Ctx->Device.Send.RingTail);
-    *(Ctx->Device.Send.ActiveNbls.Head ? &NET_BUFFER_LIST_NEXT_NBL_EX(Ctx->Device.Send.ActiveNbls.Tail)
-                                       : &Ctx->Device.Send.ActiveNbls.Head) = NetBufferLists;
-    Ctx->Device.Send.ActiveNbls.Tail = NetBufferLists;
-
-    KeReleaseInStackQueuedSpinLock(&LockHandle);
+        RingEnd = TUN_RING_WRAP(RingTail + RequiredRingSpace, RingCapacity);
+        LONG64 Previous = InterlockedCompareExchange64(
+            &Queue->Send.Reservation, TUN_SEND_SLOT(Sequence + 1, RingEnd), Reservation);
+        if (Previous == Reservation)
+            break;
+        Reservation = Previous;
+    }
 
     /* Copy packets. */
+    LONG64 Timestamp = TimestampSize ? KeQueryPerformanceCounter(NULL).QuadPart : 0;
     for (NET_BUFFER_LIST *Nbl = NetBufferLists; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
     {
+        BOOLEAN Filtered = !!NET_BUFFER_LIST_FILTERED(Nbl);
+        if (Filtered)
+            NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_SUCCESS;
+        BOOLEAN Unsupported = !MetadataSize && TunNblRequiresOffload(Nbl);
         for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
         {
+            if (Filtered)
+                continue;
             UINT PacketSize = NET_BUFFER_DATA_LENGTH(Nb);
-            if (Status = NDIS_STATUS_INVALID_LENGTH, PacketSize > TUN_MAX_IP_PACKET_SIZE)
+            if (Status = NDIS_STATUS_NOT_SUPPORTED, Unsupported)
+                goto skipPacket;
+            if (Status = NDIS_STATUS_INVALID_LENGTH, PacketSize > MaxPacketSize)
                 goto skipPacket;
 
             TUN_PACKET *Packet = (TUN_PACKET *)(Ring->Data + RingTail);
-            Packet->Size = PacketSize;
-            void *NbData = NdisGetDataBuffer(Nb, PacketSize, Packet->Data, 1, 0);
+            Packet->Size = PrefixSize + PacketSize;
+            UCHAR *PacketData = Packet->Data + PrefixSize;
+            void *NbData = NdisGetDataBuffer(Nb, PacketSize, PacketData, 1, 0);
             if (!NbData)
             {
                 /* The space for the packet has already been allocated in the ring. Write a zero-packet rather than
                  * fixing the gap in the ring. */
-                NdisZeroMemory(Packet->Data, PacketSize);
+                NdisZeroMemory(Packet->Data, PrefixSize + PacketSize);
                 DiscardedPacketsCount++;
                 NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_FAILURE;
             }
             else
             {
-                if (NbData != Packet->Data)
-                    NdisMoveMemory(Packet->Data, NbData, PacketSize);
+                if (NbData != PacketData)
+                    NdisMoveMemory(PacketData, NbData, PacketSize);
+                if (TimestampSize)
+                    *(LONG64 UNALIGNED *)Packet->Data = Timestamp;
+                if (MetadataSize)
+                    TunFillPacketMetadata(
+                        (TUN_PACKET_METADATA *)(Packet->Data + TimestampSize), Nbl, PacketData, PacketSize);
                 SentPacketsCount++;
                 SentPacketsSize += PacketSize;
             }
 
-            RingTail = TUN_RING_WRAP(RingTail + TUN_ALIGN(sizeof(TUN_PACKET) + PacketSize), RingCapacity);
+            RingTail =
+                TUN_RING_WRAP(RingTail + TUN_ALIGN(sizeof(TUN_PACKET) + PrefixSize + PacketSize), RingCapacity);
             continue;
 
         skipPacket:
             ErrorPacketsCount++;
             NET_BUFFER_LIST_STATUS(Nbl) = Status;
         }
+
+        NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO Lso;
+        Lso.Value = NET_BUFFER_LIST_INFO(Nbl, TcpLargeSendNetBufferListInfo);
+        if (MetadataSize && Lso.LsoV2Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE && Lso.LsoV2Transmit.MSS)
+        {
+            Lso.Value = NULL;
+            Lso.LsoV2TransmitComplete.Type = NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE;
+            NET_BUFFER_LIST_INFO(Nbl, TcpLargeSendNetBufferListInfo) = Lso.Value;
+        }
     }
-    ASSERT(RingTail == TunNblGetOffset(NetBufferLists));
-    TunNblMarkCompleted(NetBufferLists);
+    ASSERT(RingTail == RingEnd);
 
     /* Adjust the ring tail. */
-    KeAcquireInStackQueuedSpinLock(&Ctx->Device.Send.Lock, &LockHandle);
-    while (Ctx->Device.Send.ActiveNbls.Head && TunNblIsCompleted(Ctx->Device.Send.ActiveNbls.Head))
+    WriteRelease64(&Queue->Send.Slots[Sequence % TUN_SEND_SLOTS], TUN_SEND_SLOT(Sequence, RingEnd));
+    if (TunRetireSendBatches(Queue))
     {
-        NET_BUFFER_LIST *CompletedNbl = Ctx->Device.Send.ActiveNbls.Head;
-        Ctx->Device.Send.ActiveNbls.Head = NET_BUFFER_LIST_NEXT_NBL_EX(CompletedNbl);
-        WriteULongRelease(&Ring->Tail, TunNblGetOffset(CompletedNbl));
-        KeSetEvent(Ctx->Device.Send.TailMoved, IO_NETWORK_INCREMENT, FALSE);
-        NdisMSendNetBufferListsComplete(
-            Ctx->MiniportAdapterHandle, CompletedNbl, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
+        /* Order the tail store before the Alertable load, against the client's store to Alertable and tail load. */
+        KeMemoryBarrier();
+        if (!(Ctx->Device.Flags & TUN_REGISTER_FLAG_SEND_ALERTABLE) || ReadNoFence(Ring->Alertable))
+        {
+            KeSetEvent(Queue->Send.TailMoved, IO_NETWORK_INCREMENT, FALSE);
+            InterlockedIncrementNoFence64((LONG64 *)&Queue->Statistics.Send.EventsSignaled);
+        }
     }
-    KeReleaseInStackQueuedSpinLock(&LockHandle);
     ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
+    /* The packets are in the ring already, so there is no need to wait for the tail to move past them. */
+    NdisMSendNetBufferListsComplete(Ctx->MiniportAdapterHandle, NetBufferLists, 0);
+    TraceLoggingWrite(
+        TunTraceProvider,
+        "Send",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingKeyword(TUN_TRACE_KEYWORD_SEND),
+        TraceLoggingPointer(Ctx, "Adapter"),
+        TraceLoggingUInt32((ULONG)(Queue - Ctx->Device.Queues), "Queue"),
+        TraceLoggingUInt32(PacketsCount, "Packets"),
+        TraceLoggingUInt32(RequiredRingSpace, "Bytes"),
+        TraceLoggingUInt32(RingSpace - RequiredRingSpace, "RingSpaceLeft"));
+    if (ErrorPacketsCount)
+        InterlockedAddNoFence64((LONG64 *)&Queue->Statistics.Send.InvalidDrops, ErrorPacketsCount);
+    if (FilteredPacketsCount)
+        InterlockedAddNoFence64((LONG64 *)&Queue->Statistics.Send.FilterDrops, FilteredPacketsCount);
+    DiscardedPacketsCount += FilteredPacketsCount;
     goto updateStatistics;
 
-cleanupKeReleaseInStackQueuedSpinLock:
-    KeReleaseInStackQueuedSpinLock(&LockHandle);
+cleanupOverflow:
+    InterlockedAddNoFence64((LONG64 *)&Queue->Statistics.Send.OverflowDrops, PacketsCount - FilteredPacketsCount);
+    TraceLoggingWrite(
+        TunTraceProvider,
+        "SendOverflow",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingKeyword(TUN_TRACE_KEYWORD_SEND),
+        TraceLoggingPointer(Ctx, "Adapter"),
+        TraceLoggingUInt32((ULONG)(Queue - Ctx->Device.Queues), "Queue"),
+        TraceLoggingUInt32(PacketsCount - FilteredPacketsCount, "Packets"),
+        TraceLoggingUInt32(RequiredRingSpace, "Bytes"),
+        TraceLoggingUInt32(RingSpace, "RingSpace"));
+cleanupFiltered:
+    if (FilteredPacketsCount)
+        InterlockedAddNoFence64((LONG64 *)&Queue->Statistics.Send.FilterDrops, FilteredPacketsCount);
 skipNbl:
+    /* Filtered NBLs were dropped on purpose, whatever became of the rest. Their marks are only valid once the NBLs have
+     * been measured, which a non-zero FilteredPacketsCount implies. */
     for (NET_BUFFER_LIST *Nbl = NetBufferLists; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
-        NET_BUFFER_LIST_STATUS(Nbl) = Status;
-    DiscardedPacketsCount += PacketsCount;
+    {
+        NET_BUFFER_LIST_STATUS(Nbl) =
+            FilteredPacketsCount && NET_BUFFER_LIST_FILTERED(Nbl) ? NDIS_STATUS_SUCCESS : Status;
+        for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
+            DiscardedPacketsCount++;
+    }
     ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
     NdisMSendNetBufferListsComplete(Ctx->MiniportAdapterHandle, NetBufferLists, 0);
 updateStatistics:
-    InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifHCOutOctets, SentPacketsSize);
-    InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifHCOutUcastOctets, SentPacketsSize);
-    InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifHCOutUcastPkts, SentPacketsCount);
-    InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifOutErrors, ErrorPacketsCount);
-    InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifOutDiscards, DiscardedPacketsCount);
+    CpuStatistics = TunCpuStatistics(Ctx);
+    InterlockedAddNoFence64(&CpuStatistics->OutOctets, SentPacketsSize);
+    InterlockedAddNoFence64(&CpuStatistics->OutPackets, SentPacketsCount);
+    InterlockedAddNoFence64(&CpuStatistics->OutErrors, ErrorPacketsCount);
+    InterlockedAddNoFence64(&CpuStatistics->OutDiscards, DiscardedPacketsCount);
 }
 
 static MINIPORT_CANCEL_SEND TunCancelSend;
@@ -387,13 +1053,22 @@ static VOID
 TunReturnNetBufferLists(NDIS_HANDLE MiniportAdapterContext, PNET_BUFFER_LIST NetBufferLists, ULONG ReturnFlags)
 {
     TUN_CTX *Ctx = (TUN_CTX *)MiniportAdapterContext;
-    TUN_RING *Ring = Ctx->Device.Receive.Ring;
 
     LONG64 ReceivedPacketsCount = 0, ReceivedPacketsSize = 0, ErrorPacketsCount = 0;
+    LARGE_INTEGER Frequency = { 0 };
+    ULONG_PTR Now = 0, MaxHeldTicks = 0;
     for (NET_BUFFER_LIST *Nbl = NetBufferLists, *NextNbl; Nbl; Nbl = NextNbl)
     {
         NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
 
+        ULONG_PTR Indicated = (ULONG_PTR)NET_BUFFER_LIST_INDICATED(Nbl);
+        if (Indicated)
+        {
+            if (!Now)
+                Now = (ULONG_PTR)KeQueryPerformanceCounter(&Frequency).QuadPart;
+            MaxHeldTicks = max(MaxHeldTicks, Now - Indicated);
+        }
+
         if (NT_SUCCESS(NET_BUFFER_LIST_STATUS(Nbl)))
         {
             ReceivedPacketsCount++;
@@ -402,73 +1077,128 @@ TunReturnNetBufferLists(NDIS_HANDLE MiniportAdapterContext, PNET_BUFFER_LIST Net
         else
             ErrorPacketsCount++;
 
+        TUN_QUEUE *Queue = NET_BUFFER_LIST_QUEUE(Nbl);
+        /* The stack may have mapped the partial MDL. Undo that before the NBL goes back to the cache. */
+        MmPrepareMdlForReuse(NET_BUFFER_LIST_MDL(Nbl));
+        TunCompleteNbl(Queue, Nbl);
+
+        /* The mark and the ring head move under the lock, as the receive thread extends the last active NBL's offset
+         * and writes the ring head itself when it skips packets. */
+        KLOCK_QUEUE_HANDLE LockHandle;
+        KeAcquireInStackQueuedSpinLock(&Queue->Receive.Lock, &LockHandle);
         TunNblMarkCompleted(Nbl);
-        for (;;)
+        NET_BUFFER_LIST *CompletedNbl = Queue->Receive.ActiveNbls.Head;
+        if (CompletedNbl && TunNblIsCompleted(CompletedNbl))
         {
-            KLOCK_QUEUE_HANDLE LockHandle;
-            KeAcquireInStackQueuedSpinLock(&Ctx->Device.Receive.Lock, &LockHandle);
-            NET_BUFFER_LIST *CompletedNbl = Ctx->Device.Receive.ActiveNbls.Head;
-            if (!CompletedNbl || !TunNblIsCompleted(CompletedNbl))
+            ULONG CompletedOffset;
+            do
             {
-                KeReleaseInStackQueuedSpinLock(&LockHandle);
-                break;
-            }
-            Ctx->Device.Receive.ActiveNbls.Head = NET_BUFFER_LIST_NEXT_NBL_EX(CompletedNbl);
-            if (!Ctx->Device.Receive.ActiveNbls.Head)
-                KeSetEvent(&Ctx->Device.Receive.ActiveNbls.Empty, IO_NO_INCREMENT, FALSE);
-            KeReleaseInStackQueuedSpinLock(&LockHandle);
-            WriteULongRelease(&Ring->Head, TunNblGetOffset(CompletedNbl));
-            const MDL *TargetMdl = Ctx->Device.Receive.Mdl;
-            for (MDL *Mdl = NET_BUFFER_FIRST_MDL(NET_BUFFER_LIST_FIRST_NB(CompletedNbl)); Mdl; Mdl = Mdl->Next)
+                CompletedOffset = TunNblGetOffset(CompletedNbl);
+                Queue->Receive.ActiveNbls.Head = NET_BUFFER_LIST_NEXT_NBL_EX(CompletedNbl);
+                NET_BUFFER_LIST_NEXT_NBL(CompletedNbl) = Queue->Receive.FreeNbls;
+                Queue->Receive.FreeNbls = CompletedNbl;
+                CompletedNbl = Queue->Receive.ActiveNbls.Head;
+            } while (CompletedNbl && TunNblIsCompleted(CompletedNbl));
+            if (!Queue->Receive.ActiveNbls.Head)
+                KeSetEvent(&Queue->Receive.ActiveNbls.Empty, IO_NO_INCREMENT, FALSE);
+            if (Queue->Receive.NblsWanted)
             {
-                if (MmGetMdlVirtualAddress(Mdl) < MmGetMdlVirtualAddress(TargetMdl) ||
-                    (UCHAR *)MmGetMdlVirtualAddress(Mdl) + MmGetMdlByteCount(Mdl) >
-                        (UCHAR *)MmGetMdlVirtualAddress(TargetMdl) + MmGetMdlByteCount(TargetMdl))
-                    continue;
-                IoFreeMdl(Mdl);
-                break;
+                Queue->Receive.NblsWanted = FALSE;
+                KeSetEvent(&Queue->Receive.NblsReturned, IO_NO_INCREMENT, FALSE);
             }
-            NdisFreeNetBufferList(CompletedNbl);
+            WriteULongRelease(Queue->Receive.Ring.Head, CompletedOffset);
         }
+        KeReleaseInStackQueuedSpinLock(&LockHandle);
     }
 
-    InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifHCInOctets, ReceivedPacketsSize);
-    InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifHCInUcastOctets, ReceivedPacketsSize);
-    InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifHCInUcastPkts, ReceivedPacketsCount);
-    InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifInErrors, ErrorPacketsCount);
+    TUN_CPU_STATISTICS *CpuStatistics = TunCpuStatistics(Ctx);
+    InterlockedAddNoFence64(&CpuStatistics->InOctets, ReceivedPacketsSize);
+    InterlockedAddNoFence64(&CpuStatistics->InPackets, ReceivedPacketsCount);
+    InterlockedAddNoFence64(&CpuStatistics->InErrors, ErrorPacketsCount);
+    if (Now)
+        TraceLoggingWrite(
+            TunTraceProvider,
+            "Return",
+            TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+            TraceLoggingKeyword(TUN_TRACE_KEYWORD_RETURN),
+            TraceLoggingPointer(Ctx, "Adapter"),
+            TraceLoggingUInt64(ReceivedPacketsCount + ErrorPacketsCount, "Nbls"),
+            TraceLoggingUInt64(TunTicksToNanoseconds(MaxHeldTicks, Frequency.QuadPart), "MaxHeldNs"));
 }
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
 _Function_class_(KSTART_ROUTINE)
 static VOID
-TunProcessReceiveData(_Inout_ TUN_CTX *Ctx)
+TunProcessReceiveData(_Inout_ TUN_QUEUE *Queue)
 {
-    KeSetPriorityThread(KeGetCurrentThread(), 1);
-
-    TUN_RING *Ring = Ctx->Device.Receive.Ring;
-    ULONG RingCapacity = Ctx->Device.Receive.Capacity;
+    TUN_CTX *Ctx = Queue->Ctx;
+    KeSetPriorityThread(
+        KeGetCurrentThread(),
+        Ctx->Device.Flags & TUN_REGISTER_FLAG_PRIORITY && Queue == &Ctx->Device.Queues[Ctx->Device.QueueCount - 1]
+            ? TUN_PRIORITY_RECEIVE_THREAD_PRIORITY
+            : TUN_RECEIVE_THREAD_PRIORITY);
+
+    GROUP_AFFINITY Affinity, PreviousAffinity;
+    BOOLEAN Affinitized = FALSE;
+    if (Ctx->Device.Flags & TUN_REGISTER_FLAG_NUMA_NODE)
+    {
+        /* Keep ring access and the NBLs we indicate on the node the client allocated the rings on. */
+        KeQueryNodeActiveAffinity(Ctx->Device.NumaNode, &Affinity, NULL);
+        if (Affinity.Mask)
+        {
+            KeSetSystemGroupAffinityThread(&Affinity, &PreviousAffinity);
+            Affinitized = TRUE;
+        }
+    }
+    const TUN_RING_VIEW *Ring = &Queue->Receive.Ring;
+    ULONG RingCapacity = Queue->Receive.Capacity;
+    ULONG MetadataSize = Ctx->Device.Flags & TUN_REGISTER_FLAG_METADATA ? sizeof(TUN_PACKET_METADATA) : 0;
+    ULONG TimestampSize = Ctx->Device.Flags & TUN_REGISTER_FLAG_TIMESTAMP ? sizeof(ULONG64) : 0;
+    ULONG PrefixSize = TimestampSize + MetadataSize;
+    ULONG MaxPacketSize = Ctx->Device.MaxPacketSize;
+    BOOLEAN HasRegion = !!(Ctx->Device.Flags & TUN_REGISTER_FLAG_BUFFER_REGION);
     LARGE_INTEGER Frequency;
     KeQueryPerformanceCounter(&Frequency);
     ULONG64 SpinMax = Frequency.QuadPart / 1000 / 10; /* 1/10 ms */
-    VOID *Events[] = { &Ctx->Device.Disconnected, Ctx->Device.Receive.TailMoved };
-    ASSERT(RTL_NUMBER_OF(Events) <= THREAD_WAIT_OBJECTS);
+    VOID *Events[] = { &Ctx->Device.Disconnected, Queue->Receive.TailMoved };
+    VOID *ReturnEvents[] = { &Ctx->Device.Disconnected, &Queue->Receive.NblsReturned };
+    ASSERT(RTL_NUMBER_OF(Events) <= THREAD_WAIT_OBJECTS && RTL_NUMBER_OF(ReturnEvents) <= THREAD_WAIT_OBJECTS);
 
-    ULONG RingHead = ReadULongAcquire(&Ring->Head);
+    /* NBLs taken from the queue's cache, private to this thread. */
+    NET_BUFFER_LIST *CachedNbls = NULL;
+    /* Whether the completion ring was found full, so a stall only counts once however long it lasts. */
+    BOOLEAN CompletionStalled = FALSE;
+
+    ULONG RingHead = ReadULongAcquire(Ring->Head);
     if (RingHead >= RingCapacity)
         goto cleanup;
 
     while (!KeReadStateEvent(&Ctx->Device.Disconnected))
     {
         /* Get next packet from the ring. */
-        ULONG RingTail = ReadULongAcquire(&Ring->Tail);
+        ULONG RingTail = ReadULongAcquire(Ring->Tail);
         if (RingHead == RingTail)
         {
             LARGE_INTEGER SpinStart = KeQueryPerformanceCounter(NULL);
             for (;;)
             {
-                RingTail = ReadULongAcquire(&Ring->Tail);
+                RingTail = ReadULongAcquire(Ring->Tail);
                 if (RingTail != RingHead)
+                {
+                    InterlockedIncrementNoFence64((LONG64 *)&Queue->Statistics.Receive.SpinHits);
+                    TraceLoggingWrite(
+                        TunTraceProvider,
+                        "ReceiveSpinHit",
+                        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                        TraceLoggingKeyword(TUN_TRACE_KEYWORD_RECEIVE),
+                        TraceLoggingPointer(Ctx, "Adapter"),
+                        TraceLoggingUInt32((ULONG)(Queue - Ctx->Device.Queues), "Queue"),
+                        TraceLoggingUInt64(
+                            TunTicksToNanoseconds(
+                                KeQueryPerformanceCounter(NULL).QuadPart - SpinStart.QuadPart, Frequency.QuadPart),
+                            "SpunNs"));
                     break;
+                }
                 if (KeReadStateEvent(&Ctx->Device.Disconnected))
                     break;
                 LARGE_INTEGER SpinNow = KeQueryPerformanceCounter(NULL);
@@ -478,112 +1208,743 @@ TunProcessReceiveData(_Inout_ TUN_CTX *Ctx)
             }
             if (RingHead == RingTail)
             {
-                WriteRelease(&Ring->Alertable, TRUE);
-                RingTail = ReadULongAcquire(&Ring->Tail);
+                WriteRelease(Ring->Alertable, TRUE);
+                RingTail = ReadULongAcquire(Ring->Tail);
                 if (RingHead == RingTail)
                 {
+                    InterlockedIncrementNoFence64((LONG64 *)&Queue->Statistics.Receive.Waits);
+                    LONG64 WaitStart =
+                        TraceLoggingProviderEnabled(TunTraceProvider, WINEVENT_LEVEL_VERBOSE, TUN_TRACE_KEYWORD_RECEIVE)
+                            ? KeQueryPerformanceCounter(NULL).QuadPart
+                            : 0;
                     KeWaitForMultipleObjects(
                         RTL_NUMBER_OF(Events), Events, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
-                    WriteRelease(&Ring->Alertable, FALSE);
+                    WriteRelease(Ring->Alertable, FALSE);
+                    if (WaitStart)
+                        TraceLoggingWrite(
+                            TunTraceProvider,
+                            "ReceiveWait",
+                            TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                            TraceLoggingKeyword(TUN_TRACE_KEYWORD_RECEIVE),
+                            TraceLoggingPointer(Ctx, "Adapter"),
+                            TraceLoggingUInt32((ULONG)(Queue - Ctx->Device.Queues), "Queue"),
+                            TraceLoggingUInt64(
+                                TunTicksToNanoseconds(
+                                    KeQueryPerformanceCounter(NULL).QuadPart - WaitStart, Frequency.QuadPart),
+                                "WaitedNs"));
                     continue;
                 }
-                WriteRelease(&Ring->Alertable, FALSE);
-                KeClearEvent(Ctx->Device.Receive.TailMoved);
+                WriteRelease(Ring->Alertable, FALSE);
+                KeClearEvent(Queue->Receive.TailMoved);
             }
         }
         if (RingTail >= RingCapacity)
             break;
+        TunUpdateHighWater(&Queue->Statistics.Receive.HighWater, TUN_RING_WRAP(RingTail - RingHead, RingCapacity));
+
+        /* Drain the ring up to the tail into a chain of NBLs sharing the same ether type. */
+        NET_BUFFER_LIST *NblHead = NULL, *NblTail = NULL;
+        ULONG NblCount = 0, RscSegments = 0, RscOctets = 0, RscEvents = 0;
+        USHORT NblChainProto = 0;
+        BOOLEAN SkipPacket = FALSE, ChainDiscarded = FALSE, RingCorrupt = FALSE;
+        /* The chain is indicated right after it is drained, so one reading of the counter does for all of it. */
+        LONG64 Now = TimestampSize ? KeQueryPerformanceCounter(NULL).QuadPart : 0;
+        while (RingHead != RingTail && NblCount < Ctx->MaxReceiveNbls)
+        {
+            ULONG RingContent = TUN_RING_WRAP(RingTail - RingHead, RingCapacity);
+            if (RingContent < sizeof(TUN_PACKET))
+            {
+                RingCorrupt = TRUE;
+                break;
+            }
 
-        ULONG RingContent = TUN_RING_WRAP(RingTail - RingHead, RingCapacity);
-        if (RingContent < sizeof(TUN_PACKET))
-            break;
+            TUN_PACKET *Packet = (TUN_PACKET *)(Ring->Data + RingHead);
+            ULONG PacketSize = *(volatile ULONG *)&Packet->Size;
+            BOOLEAN InRegion = HasRegion && (PacketSize & TUN_PACKET_SIZE_DESCRIPTOR);
+            if (InRegion)
+            {
+                PacketSize &= ~TUN_PACKET_SIZE_DESCRIPTOR;
+                /* Each descriptor taken completes once, so the completion ring has room for all of them as long as the
+                 * client has consumed all but Count. Otherwise, leave the packet for when the client catches up. */
+                TUN_COMPLETION_RING *CompletionRing = Queue->Receive.Completion.Ring;
+                if (Queue->Receive.Completion.Taken - ReadULongAcquire(&CompletionRing->Head) >=
+                    Queue->Receive.Completion.Count)
+                {
+                    if (!CompletionStalled)
+                    {
+                        InterlockedIncrementNoFence64((LONG64 *)&Queue->Statistics.Receive.CompletionStalls);
+                        CompletionStalled = TRUE;
+                    }
+                    if (NblHead)
+                        break;
+                    /* Have the client wake us once it consumes completions, and look again in case it did already. */
+                    InterlockedExchange(&CompletionRing->Alertable, TRUE);
+                    if (Queue->Receive.Completion.Taken - ReadULongAcquire(&CompletionRing->Head) >=
+                        Queue->Receive.Completion.Count)
+                        KeWaitForMultipleObjects(
+                            RTL_NUMBER_OF(Events), Events, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
+                    WriteRelease(&CompletionRing->Alertable, FALSE);
+                    if (KeReadStateEvent(&Ctx->Device.Disconnected))
+                        break;
+                    continue;
+                }
+                CompletionStalled = FALSE;
+            }
+            if (PacketSize > MaxPacketSize)
+            {
+                RingCorrupt = TRUE;
+                break;
+            }
 
-        TUN_PACKET *Packet = (TUN_PACKET *)(Ring->Data + RingHead);
-        ULONG PacketSize = *(volatile ULONG *)&Packet->Size;
-        if (PacketSize > TUN_MAX_IP_PACKET_SIZE)
-            break;
+            ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + PacketSize);
+            if (AlignedPacketSize > RingContent)
+            {
+                RingCorrupt = TRUE;
+                break;
+            }
 
-        ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + PacketSize);
-        if (AlignedPacketSize > RingContent)
-            break;
+            const TUN_PACKET_METADATA *Metadata =
+                MetadataSize ? (const TUN_PACKET_METADATA *)(Packet->Data + TimestampSize) : NULL;
+            UCHAR *PacketData = Packet->Data + PrefixSize;
+            ULONG DataSize = PacketSize >= PrefixSize ? PacketSize - PrefixSize : 0;
+            ULONG RegionOffset = 0;
+            if (InRegion)
+            {
+                if (DataSize != sizeof(TUN_BUFFER_DESCRIPTOR))
+                {
+                    RingCorrupt = TRUE;
+                    break;
+                }
+                const TUN_BUFFER_DESCRIPTOR *Descriptor = (const TUN_BUFFER_DESCRIPTOR *)PacketData;
+                RegionOffset = ReadULongNoFence((volatile ULONG *)&Descriptor->Offset);
+                DataSize = ReadULongNoFence((volatile ULONG *)&Descriptor->Size);
+                /* Out of bounds descriptors are dropped like malformed packets, and still complete. */
+                if (DataSize > TUN_MAX_IP_PACKET_SIZE || DataSize > Ctx->Device.Region.Size ||
+                    RegionOffset > Ctx->Device.Region.Size - DataSize)
+                    DataSize = 0;
+                else
+                    PacketData = Ctx->Device.Region.Data + RegionOffset;
+            }
 
-        RingHead = TUN_RING_WRAP(RingHead + AlignedPacketSize, RingCapacity);
+            ULONG NblFlags;
+            USHORT NblProto;
+            UCHAR IpProto;
+            if (DataSize >= 20 && PacketData[0] >> 4 == 4)
+            {
+                NblFlags = NDIS_NBL_FLAGS_IS_IPV4;
+                NblProto = HTONS(NDIS_ETH_TYPE_IPV4);
+                IpProto = PacketData[9];
+            }
+            else if (DataSize >= 40 && PacketData[0] >> 4 == 6)
+            {
+                NblFlags = NDIS_NBL_FLAGS_IS_IPV6;
+                NblProto = HTONS(NDIS_ETH_TYPE_IPV6);
+                IpProto = PacketData[6];
+            }
+            else
+            {
+                InterlockedIncrementNoFence64((LONG64 *)&Queue->Statistics.Receive.InvalidDrops);
+                if (InRegion)
+                {
+                    ++Queue->Receive.Completion.Taken;
+                    TunCompleteRegionPacket(Queue, RegionOffset);
+                }
+                RingHead = TUN_RING_WRAP(RingHead + AlignedPacketSize, RingCapacity);
+                SkipPacket = TRUE;
+                break;
+            }
+            /* NDIS_RECEIVE_FLAGS_SINGLE_ETHER_TYPE applies to the whole chain. Leave the packet for the next one. */
+            if (NblHead && NblProto != NblChainProto)
+                break;
 
-        ULONG NblFlags;
-        USHORT NblProto;
-        if (PacketSize >= 20 && Packet->Data[0] >> 4 == 4)
+            if (!CachedNbls)
+            {
+                KLOCK_QUEUE_HANDLE LockHandle;
+                KeAcquireInStackQueuedSpinLock(&Queue->Receive.Lock, &LockHandle);
+                CachedNbls = Queue->Receive.FreeNbls;
+                Queue->Receive.FreeNbls = NULL;
+                KeReleaseInStackQueuedSpinLock(&LockHandle);
+            }
+            NET_BUFFER_LIST *Nbl = CachedNbls;
+            if (!Nbl && !(Nbl = TunAllocateReceiveNbl(Ctx)))
+            {
+                InterlockedIncrementNoFence64((LONG64 *)&Queue->Statistics.Receive.NblAllocationFailures);
+                /* Indicate what we have, or wait for the next NBL in flight to return to the cache, and retry. Drop
+                 * the packet only when there is nothing to wait for. */
+                if (NblHead)
+                    break;
+                KLOCK_QUEUE_HANDLE LockHandle;
+                KeAcquireInStackQueuedSpinLock(&Queue->Receive.Lock, &LockHandle);
+                BOOLEAN Retry = !!Queue->Receive.FreeNbls, Wait = !Retry && Queue->Receive.ActiveNbls.Head;
+                Queue->Receive.NblsWanted = Wait;
+                KeReleaseInStackQueuedSpinLock(&LockHandle);
+                if (Wait)
+                {
+                    KeWaitForMultipleObjects(
+                        RTL_NUMBER_OF(ReturnEvents), ReturnEvents, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
+                    if (KeReadStateEvent(&Ctx->Device.Disconnected))
+                        break;
+                }
+                if (Retry || Wait)
+                    continue;
+                if (InRegion)
+                {
+                    ++Queue->Receive.Completion.Taken;
+                    TunCompleteRegionPacket(Queue, RegionOffset);
+                }
+                RingHead = TUN_RING_WRAP(RingHead + AlignedPacketSize, RingCapacity);
+                SkipPacket = TRUE;
+                break;
+            }
+            CachedNbls = NET_BUFFER_LIST_NEXT_NBL(Nbl);
+            NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
+
+            MDL *SourceMdl = Queue->Receive.Mdl;
+            VOID *PacketAddr;
+            if (InRegion)
+            {
+                ++Queue->Receive.Completion.Taken;
+                SourceMdl = Ctx->Device.Region.Mdl;
+                PacketAddr = (UCHAR *)MmGetMdlVirtualAddress(SourceMdl) + RegionOffset;
+                NET_BUFFER_LIST_REGION_OFFSET(Nbl) = (VOID *)((ULONG_PTR)RegionOffset + 1);
+            }
+            else
+            {
+                PacketAddr = (UCHAR *)MmGetMdlVirtualAddress(SourceMdl) + (ULONG)(PacketData - (UCHAR *)Ring->Base);
+                NET_BUFFER_LIST_REGION_OFFSET(Nbl) = NULL;
+            }
+            MDL *Mdl = NET_BUFFER_LIST_MDL(Nbl);
+            IoBuildPartialMdl(SourceMdl, Mdl, PacketAddr, DataSize);
+            NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl);
+            NET_BUFFER_FIRST_MDL(Nb) = NET_BUFFER_CURRENT_MDL(Nb) = Mdl;
+            NET_BUFFER_DATA_OFFSET(Nb) = NET_BUFFER_CURRENT_MDL_OFFSET(Nb) = 0;
+            NET_BUFFER_DATA_LENGTH(Nb) = DataSize;
+            RingHead = TUN_RING_WRAP(RingHead + AlignedPacketSize, RingCapacity);
+            NET_BUFFER_LIST_NBL_FLAGS(Nbl) = NblFlags;
+            NET_BUFFER_LIST_INFO(Nbl, NetBufferListFrameType) = (PVOID)NblProto;
+            NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO Csum = { .Value = NULL };
+            if (Metadata &&
+                Metadata->Flags & (TUN_PACKET_METADATA_FLAG_NEEDS_CSUM | TUN_PACKET_METADATA_FLAG_DATA_VALID) &&
+                IpProto == 6 /* TCP */)
+                Csum.Receive.TcpChecksumSucceeded = TRUE;
+            NDIS_RSC_NBL_INFO Rsc = { .Value = NULL };
+            if (Metadata && Metadata->GsoType != TUN_PACKET_METADATA_GSO_NONE &&
+                (Rsc.Info.CoalescedSegCount = TunCoalescedSegments(Metadata, NblFlags, IpProto, DataSize)) != 0)
+            {
+                /* The stack only accepts coalesced packets with all checksums validated. */
+                Csum.Receive.IpChecksumSucceeded = !!(NblFlags & NDIS_NBL_FLAGS_IS_IPV4);
+                RscSegments += Rsc.Info.CoalescedSegCount;
+                RscOctets += DataSize;
+                RscEvents++;
+            }
+            NET_BUFFER_LIST_INFO(Nbl, TcpIpChecksumNetBufferListInfo) = Csum.Value;
+            NET_BUFFER_LIST_INFO(Nbl, TcpRecvSegCoalesceInfo) = Rsc.Value;
+            NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_SUCCESS;
+            NET_BUFFER_LIST_QUEUE(Nbl) = Queue;
+            TunNblSetOffsetAndMarkActive(Nbl, RingHead);
+            if (TimestampSize)
+                TunCountLatency(
+                    Queue->Statistics.Receive.Latency,
+                    Now - *(const LONG64 UNALIGNED *)Packet->Data,
+                    Frequency.QuadPart);
+
+            *(NblHead ? &NET_BUFFER_LIST_NEXT_NBL(NblTail) : &NblHead) = Nbl;
+            NblTail = Nbl;
+            NblChainProto = NblProto;
+            NblCount++;
+        }
+
+        if (NblHead)
         {
-            NblFlags = NDIS_NBL_FLAGS_IS_IPV4;
-            NblProto = HTONS(NDIS_ETH_TYPE_IPV4);
+            KIRQL Irql = ExAcquireSpinLockShared(&Ctx->TransitionLock);
+            if (!ReadAcquire(&Ctx->Running))
+                goto cleanupNbls;
+
+            /* The NEXT_NBL links belong to NDIS once indicated, so the active list is linked through NEXT_NBL_EX. */
+            VOID *Indicated =
+                TraceLoggingProviderEnabled(TunTraceProvider, WINEVENT_LEVEL_VERBOSE, TUN_TRACE_KEYWORD_RETURN)
+                    ? (VOID *)(ULONG_PTR)KeQueryPerformanceCounter(NULL).QuadPart
+                    : NULL;
+            for (NET_BUFFER_LIST *Nbl = NblHead; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+            {
+                NET_BUFFER_LIST_NEXT_NBL_EX(Nbl) = NET_BUFFER_LIST_NEXT_NBL(Nbl);
+                NET_BUFFER_LIST_INDICATED(Nbl) = Indicated;
+            }
+
+            KLOCK_QUEUE_HANDLE LockHandle;
+            KeAcquireInStackQueuedSpinLock(&Queue->Receive.Lock, &LockHandle);
+            if (Queue->Receive.ActiveNbls.Head)
+                NET_BUFFER_LIST_NEXT_NBL_EX(Queue->Receive.ActiveNbls.Tail) = NblHead;
+            else
+            {
+                KeClearEvent(&Queue->Receive.ActiveNbls.Empty);
+                Queue->Receive.ActiveNbls.Head = NblHead;
+            }
+            Queue->Receive.ActiveNbls.Tail = NblTail;
+            KeReleaseInStackQueuedSpinLock(&LockHandle);
+
+            NdisMIndicateReceiveNetBufferLists(
+                Ctx->MiniportAdapterHandle,
+                NblHead,
+                NDIS_DEFAULT_PORT_NUMBER,
+                NblCount,
+                NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL | NDIS_RECEIVE_FLAGS_SINGLE_ETHER_TYPE);
+
+            ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
+            if (RscEvents)
+            {
+                TUN_CPU_STATISTICS *CpuStatistics = TunCpuStatistics(Ctx);
+                InterlockedAddNoFence64(&CpuStatistics->RscCoalescedPackets, RscSegments);
+                InterlockedAddNoFence64(&CpuStatistics->RscCoalescedOctets, RscOctets);
+                InterlockedAddNoFence64(&CpuStatistics->RscCoalesceEvents, RscEvents);
+            }
+            goto nextChain;
+
+        cleanupNbls:
+            ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
+            for (NET_BUFFER_LIST *Nbl = NblHead; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+                TunCompleteNbl(Queue, Nbl);
+            NET_BUFFER_LIST_NEXT_NBL(NblTail) = CachedNbls;
+            CachedNbls = NblHead;
+            InterlockedAddNoFence64(&TunCpuStatistics(Ctx)->InDiscards, NblCount);
+            ChainDiscarded = TRUE;
         }
-        else if (PacketSize >= 40 && Packet->Data[0] >> 4 == 6)
+    nextChain:
+        TraceLoggingWrite(
+            TunTraceProvider,
+            "ReceiveChain",
+            TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+            TraceLoggingKeyword(TUN_TRACE_KEYWORD_RECEIVE),
+            TraceLoggingPointer(Ctx, "Adapter"),
+            TraceLoggingUInt32((ULONG)(Queue - Ctx->Device.Queues), "Queue"),
+            TraceLoggingUInt32(NblCount, "Nbls"),
+            TraceLoggingBoolean(ChainDiscarded, "Discarded"),
+            TraceLoggingBoolean(SkipPacket, "Skipped"),
+            TraceLoggingBoolean(RingCorrupt, "RingCorrupt"));
+        if (RingCorrupt)
+            break;
+        if (SkipPacket)
+            InterlockedIncrementNoFence64(&TunCpuStatistics(Ctx)->InDiscards);
+        if (SkipPacket || ChainDiscarded)
         {
-            NblFlags = NDIS_NBL_FLAGS_IS_IPV6;
-            NblProto = HTONS(NDIS_ETH_TYPE_IPV6);
+            /* Nothing we indicated covers the ring space we skipped. Leave a tombstone in the last active NBL, so that
+             * it releases the space along with its own once everything before it is back, or release the space right
+             * away if nothing is in flight. Either way the ring head moves in order and nobody waits. */
+            KLOCK_QUEUE_HANDLE LockHandle;
+            KeAcquireInStackQueuedSpinLock(&Queue->Receive.Lock, &LockHandle);
+            if (Queue->Receive.ActiveNbls.Head)
+                TunNblExtendOffset(Queue->Receive.ActiveNbls.Tail, RingHead);
+            else
+                WriteULongRelease(Ring->Head, RingHead);
+            KeReleaseInStackQueuedSpinLock(&LockHandle);
         }
-        else
-            goto skipNbl;
-
-        VOID *PacketAddr =
-            (UCHAR *)MmGetMdlVirtualAddress(Ctx->Device.Receive.Mdl) + (ULONG)(Packet->Data - (UCHAR *)Ring);
-        MDL *Mdl = IoAllocateMdl(PacketAddr, PacketSize, FALSE, FALSE, NULL);
-        if (!Mdl)
-            goto skipNbl;
-        IoBuildPartialMdl(Ctx->Device.Receive.Mdl, Mdl, PacketAddr, PacketSize);
-        NET_BUFFER_LIST *Nbl = NdisAllocateNetBufferAndNetBufferList(Ctx->NblPool, 0, 0, Mdl, 0, PacketSize);
-        if (!Nbl)
-            goto cleanupMdl;
-        Nbl->SourceHandle = Ctx->MiniportAdapterHandle;
-        NdisSetNblFlag(Nbl, NblFlags);
-        NET_BUFFER_LIST_INFO(Nbl, NetBufferListFrameType) = (PVOID)NblProto;
-        NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_SUCCESS;
-        TunNblSetOffsetAndMarkActive(Nbl, RingHead);
+    }
+
+    /* Wait for all NBLs to return: 1. To prevent race between proceeding and invalidating ring head. 2. To have
+     * TunDispatchUnregisterBuffers() implicitly wait before releasing ring MDL used by NBL(s). */
+    KeWaitForSingleObject(&Queue->Receive.ActiveNbls.Empty, Executive, KernelMode, FALSE, NULL);
+cleanup:
+    if (CachedNbls)
+    {
+        KLOCK_QUEUE_HANDLE LockHandle;
+        KeAcquireInStackQueuedSpinLock(&Queue->Receive.Lock, &LockHandle);
+        NET_BUFFER_LIST *LastNbl = CachedNbls;
+        while (NET_BUFFER_LIST_NEXT_NBL(LastNbl))
+            LastNbl = NET_BUFFER_LIST_NEXT_NBL(LastNbl);
+        NET_BUFFER_LIST_NEXT_NBL(LastNbl) = Queue->Receive.FreeNbls;
+        Queue->Receive.FreeNbls = CachedNbls;
+        KeReleaseInStackQueuedSpinLock(&LockHandle);
+    }
+    WriteULongRelease(Ring->Head, MAXULONG);
+    if (Affinitized)
+        KeRevertToUserGroupAffinityThread(&PreviousAffinity);
+}
+
+#define IS_POW2(x) ((x) && !((x) & ((x)-1)))
+
+static VOID
+TunMapRing(_Out_ TUN_RING_VIEW *View, _In_ VOID *Base, _In_ ULONG Flags)
+{
+    View->Base = Base;
+    if (Flags & TUN_REGISTER_FLAG_RING_V2)
+    {
+        TUN_RING_V2 *Ring = Base;
+        View->Head = &Ring->Head;
+        View->Tail = &Ring->Tail;
+        View->Alertable = &Ring->Alertable;
+        View->Data = Ring->Data;
+    }
+    else
+    {
+        TUN_RING *Ring = Base;
+        View->Head = &Ring->Head;
+        View->Tail = &Ring->Tail;
+        View->Alertable = &Ring->Alertable;
+        View->Data = Ring->Data;
+    }
+}
+
+static ULONG
+TunRingCapacity(_In_ ULONG RingSize, _In_ ULONG HeaderSize, _In_ ULONG MaxPacketSize, _In_ ULONG Flags)
+{
+    if (!(Flags & TUN_REGISTER_FLAG_MIRRORED))
+        return TUN_RING_CAPACITY(RingSize, HeaderSize, MaxPacketSize);
+    ULONG Capacity = (RingSize - HeaderSize) / 2;
+    /* Zero fails the capacity checks, like the size of a ring that does not split evenly should. */
+    return HeaderSize + Capacity * 2 == RingSize ? Capacity : 0;
+}
+
+/* The client cannot be trusted to have mirrored the data, but it only takes comparing the physical pages of the halves
+ * to know. Once locked, the system mapping of the ring is mirrored just the same. */
+static BOOLEAN
+TunRingIsMirrored(_In_ MDL *Mdl, _In_ ULONG HeaderSize, _In_ ULONG Capacity)
+{
+    ULONG DataOffset = MmGetMdlByteOffset(Mdl) + HeaderSize;
+    if ((DataOffset & (PAGE_SIZE - 1)) || (Capacity & (PAGE_SIZE - 1)))
+        return FALSE;
+    const PFN_NUMBER *Pages = MmGetMdlPfnArray(Mdl) + DataOffset / PAGE_SIZE;
+    SIZE_T PagesSize = Capacity / PAGE_SIZE * sizeof(PFN_NUMBER);
+    return RtlCompareMemory(Pages, Pages + Capacity / PAGE_SIZE, PagesSize) == PagesSize;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunRegisterQueue(
+    _Inout_ TUN_QUEUE *Queue,
+    _In_ const TUN_REGISTER_RINGS *Rrb,
+    _In_ ULONG Flags,
+    _In_ ULONG MaxPacketSize,
+    _In_ KPROCESSOR_MODE RequestorMode)
+{
+    NTSTATUS Status;
+
+    /* Rings in a section are in its system space view already, and RequestorMode only applies to the handles then. */
+    KPROCESSOR_MODE BufferMode = Flags & TUN_REGISTER_FLAG_SECTION ? KernelMode : RequestorMode;
+    NdisZeroMemory(&Queue->Statistics, sizeof(Queue->Statistics));
+    ULONG HeaderSize = Flags & TUN_REGISTER_FLAG_RING_V2 ? sizeof(TUN_RING_V2) : sizeof(TUN_RING);
+    ULONG MinCapacity = TUN_MIN_RING_CAPACITY_FOR(MaxPacketSize);
+    Queue->Send.Capacity = TunRingCapacity(Rrb->Send.RingSize, HeaderSize, MaxPacketSize, Flags);
+    if (Status = STATUS_INVALID_PARAMETER,
+        (Queue->Send.Capacity < MinCapacity || Queue->Send.Capacity > TUN_MAX_RING_CAPACITY ||
+         !IS_POW2(Queue->Send.Capacity) || !Rrb->Send.TailMoved || !Rrb->Send.Ring))
+        return Status;
+
+    if (!NT_SUCCESS(
+            Status = ObReferenceObjectByHandle(
+                Rrb->Send.TailMoved,
+                /* We will not wait on send ring tail moved event. */
+                EVENT_MODIFY_STATE,
+                *ExEventObjectType,
+                RequestorMode,
+                &Queue->Send.TailMoved,
+                NULL)))
+        return Status;
+
+    Queue->Send.Mdl = IoAllocateMdl(Rrb->Send.Ring, Rrb->Send.RingSize, FALSE, FALSE, NULL);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Queue->Send.Mdl)
+        goto cleanupSendTailMoved;
+    try
+    {
+        Status = STATUS_INVALID_USER_BUFFER;
+        MmProbeAndLockPages(Queue->Send.Mdl, BufferMode, IoWriteAccess);
+    }
+    except(EXCEPTION_EXECUTE_HANDLER) { goto cleanupSendMdl; }
+    if (Status = STATUS_INVALID_PARAMETER,
+        (Flags & TUN_REGISTER_FLAG_MIRRORED) && !TunRingIsMirrored(Queue->Send.Mdl, HeaderSize, Queue->Send.Capacity))
+        goto cleanupSendUnlockPages;
+
+    VOID *Ring = MmGetSystemAddressForMdlSafe(Queue->Send.Mdl, NormalPagePriority | MdlMappingNoExecute);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ring)
+        goto cleanupSendUnlockPages;
+    TunMapRing(&Queue->Send.Ring, Ring, Flags);
+
+    ULONG RingTail = ReadULongAcquire(Queue->Send.Ring.Tail);
+    Queue->Send.RingHead = ReadULongAcquire(Queue->Send.Ring.Head);
+    if (Status = STATUS_INVALID_PARAMETER,
+        RingTail >= Queue->Send.Capacity || Queue->Send.RingHead >= Queue->Send.Capacity)
+        goto cleanupSendUnlockPages;
+    Queue->Send.Reservation = TUN_SEND_SLOT(0, RingTail);
+    Queue->Send.Retire.Owned = FALSE;
+    Queue->Send.Retire.Sequence = 0;
+
+    Queue->Send.Slots = ExAllocatePoolZero(NonPagedPool, sizeof(*Queue->Send.Slots) * TUN_SEND_SLOTS, TUN_MEMORY_TAG);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Queue->Send.Slots)
+        goto cleanupSendUnlockPages;
+    /* Make every slot look retired a round ago. */
+    for (ULONG i = 0; i < TUN_SEND_SLOTS; ++i)
+        Queue->Send.Slots[i] = TUN_SEND_SLOT(i - TUN_SEND_SLOTS, 0);
+
+    Queue->Receive.Capacity = TunRingCapacity(Rrb->Receive.RingSize, HeaderSize, MaxPacketSize, Flags);
+    if (Status = STATUS_INVALID_PARAMETER,
+        (Queue->Receive.Capacity < MinCapacity || Queue->Receive.Capacity > TUN_MAX_RING_CAPACITY ||
+         !IS_POW2(Queue->Receive.Capacity) || !Rrb->Receive.TailMoved || !Rrb->Receive.Ring))
+        goto cleanupSendSlots;
+
+    if (!NT_SUCCESS(
+            Status = ObReferenceObjectByHandle(
+                Rrb->Receive.TailMoved,
+                /* We need to clear receive ring TailMoved event on transition to non-alertable state. */
+                SYNCHRONIZE | EVENT_MODIFY_STATE,
+                *ExEventObjectType,
+                RequestorMode,
+                &Queue->Receive.TailMoved,
+                NULL)))
+        goto cleanupSendSlots;
+
+    Queue->Receive.Mdl = IoAllocateMdl(Rrb->Receive.Ring, Rrb->Receive.RingSize, FALSE, FALSE, NULL);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Queue->Receive.Mdl)
+        goto cleanupReceiveTailMoved;
+    try
+    {
+        Status = STATUS_INVALID_USER_BUFFER;
+        MmProbeAndLockPages(Queue->Receive.Mdl, BufferMode, IoWriteAccess);
+    }
+    except(EXCEPTION_EXECUTE_HANDLER) { goto cleanupReceiveMdl; }
+    if (Status = STATUS_INVALID_PARAMETER,
+        (Flags & TUN_REGISTER_FLAG_MIRRORED) &&
+            !TunRingIsMirrored(Queue->Receive.Mdl, HeaderSize, Queue->Receive.Capacity))
+        goto cleanupReceiveUnlockPages;
+
+    Ring = MmGetSystemAddressForMdlSafe(Queue->Receive.Mdl, NormalPagePriority | MdlMappingNoExecute);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ring)
+        goto cleanupReceiveUnlockPages;
+    TunMapRing(&Queue->Receive.Ring, Ring, Flags);
+
+    ULONG CacheSize =
+        min(Queue->Receive.Capacity / TUN_ALIGN(sizeof(TUN_PACKET) + TUN_RECEIVE_CACHE_PACKET_SIZE),
+            TUN_MAX_RECEIVE_CACHE);
+    for (ULONG i = 0; i < CacheSize; ++i)
+    {
+        NET_BUFFER_LIST *Nbl = TunAllocateReceiveNbl(Queue->Ctx);
+        if (Status = STATUS_INSUFFICIENT_RESOURCES, !Nbl)
+            goto cleanupReceiveNbls;
+        NET_BUFFER_LIST_NEXT_NBL(Nbl) = Queue->Receive.FreeNbls;
+        Queue->Receive.FreeNbls = Nbl;
+    }
+
+    return STATUS_SUCCESS;
+
+cleanupReceiveNbls:
+    TunFreeReceiveNbls(Queue->Receive.FreeNbls);
+    Queue->Receive.FreeNbls = NULL;
+cleanupReceiveUnlockPages:
+    MmUnlockPages(Queue->Receive.Mdl);
+cleanupReceiveMdl:
+    IoFreeMdl(Queue->Receive.Mdl);
+cleanupReceiveTailMoved:
+    ObDereferenceObject(Queue->Receive.TailMoved);
+cleanupSendSlots:
+    ExFreePoolWithTag((VOID *)Queue->Send.Slots, TUN_MEMORY_TAG);
+cleanupSendUnlockPages:
+    MmUnlockPages(Queue->Send.Mdl);
+cleanupSendMdl:
+    IoFreeMdl(Queue->Send.Mdl);
+cleanupSendTailMoved:
+    ObDereferenceObject(Queue->Send.TailMoved);
+    return Status;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+TunUnregisterQueue(_Inout_ TUN_QUEUE *Queue)
+{
+    TunFreeReceiveNbls(Queue->Receive.FreeNbls);
+    Queue->Receive.FreeNbls = NULL;
+    MmUnlockPages(Queue->Receive.Mdl);
+    IoFreeMdl(Queue->Receive.Mdl);
+    ObDereferenceObject(Queue->Receive.TailMoved);
+    ExFreePoolWithTag((VOID *)Queue->Send.Slots, TUN_MEMORY_TAG);
+    MmUnlockPages(Queue->Send.Mdl);
+    IoFreeMdl(Queue->Send.Mdl);
+    ObDereferenceObject(Queue->Send.TailMoved);
+}
+
+/* Queues are allocated for each registration, as most only use a few of them. Allocations of a page or more are page
+ * aligned, which keeps their members cache aligned. */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunAllocateQueues(_Inout_ TUN_CTX *Ctx, _In_ ULONG QueueCount)
+{
+    TUN_QUEUE *Queues =
+        ExAllocatePoolZero(NonPagedPool, ROUND_TO_PAGES((SIZE_T)QueueCount * sizeof(TUN_QUEUE)), TUN_MEMORY_TAG);
+    if (!Queues)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    for (ULONG Index = 0; Index < QueueCount; ++Index)
+    {
+        TUN_QUEUE *Queue = &Queues[Index];
+        Queue->Ctx = Ctx;
+        KeInitializeSpinLock(&Queue->Receive.Lock);
+        KeInitializeEvent(&Queue->Receive.ActiveNbls.Empty, NotificationEvent, TRUE);
+        KeInitializeEvent(&Queue->Receive.NblsReturned, SynchronizationEvent, FALSE);
+    }
+    Ctx->Device.Queues = Queues;
+    return STATUS_SUCCESS;
+}
+
+/* Only once the receive threads are joined, which waited for their NBLs to return, and nothing sends to the queues. */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+TunFreeQueues(_Inout_ TUN_CTX *Ctx)
+{
+    ExFreePoolWithTag(Ctx->Device.Queues, TUN_MEMORY_TAG);
+    Ctx->Device.Queues = NULL;
+    Ctx->Device.QueueCount = 0;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunRegisterRegion(
+    _Inout_ TUN_CTX *Ctx,
+    _In_ const TUN_REGISTER_REGION *Rrb,
+    _In_ ULONG QueueCount,
+    _In_ KPROCESSOR_MODE RequestorMode)
+{
+    NTSTATUS Status;
+
+    ULONG CompletionCount = Rrb->CompletionRingSize > sizeof(TUN_COMPLETION_RING)
+                                ? (Rrb->CompletionRingSize - sizeof(TUN_COMPLETION_RING)) / sizeof(ULONG)
+                                : 0;
+    /* There can never be more region packets outstanding than a receive ring holds descriptors, which is a bit less
+     * than one per 8 bytes of the largest ring. */
+    if (Status = STATUS_INVALID_PARAMETER,
+        (!Rrb->Region || (ULONG_PTR)Rrb->Region != Rrb->Region || !Rrb->RegionSize ||
+         Rrb->RegionSize > TUN_MAX_REGION_SIZE || !Rrb->CompletionRings ||
+         (ULONG_PTR)Rrb->CompletionRings != Rrb->CompletionRings || !TUN_IS_ALIGNED(Rrb->CompletionRings) ||
+         !IS_POW2(CompletionCount) ||
+         CompletionCount > TUN_MAX_RING_CAPACITY / 8 ||
+         Rrb->CompletionRingSize != sizeof(TUN_COMPLETION_RING) + CompletionCount * sizeof(ULONG)))
+        return Status;
+
+    Ctx->Device.Region.Mdl = IoAllocateMdl((VOID *)(ULONG_PTR)Rrb->Region, Rrb->RegionSize, FALSE, FALSE, NULL);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ctx->Device.Region.Mdl)
+        return Status;
+    try
+    {
+        Status = STATUS_INVALID_USER_BUFFER;
+        MmProbeAndLockPages(Ctx->Device.Region.Mdl, RequestorMode, IoWriteAccess);
+    }
+    except(EXCEPTION_EXECUTE_HANDLER) { goto cleanupRegionMdl; }
+
+    Ctx->Device.Region.Data =
+        MmGetSystemAddressForMdlSafe(Ctx->Device.Region.Mdl, NormalPagePriority | MdlMappingNoExecute);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ctx->Device.Region.Data)
+        goto cleanupRegionUnlockPages;
+    Ctx->Device.Region.Size = Rrb->RegionSize;
+
+    Ctx->Device.Region.CompletionMdl = IoAllocateMdl(
+        (VOID *)(ULONG_PTR)Rrb->CompletionRings, QueueCount * Rrb->CompletionRingSize, FALSE, FALSE, NULL);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ctx->Device.Region.CompletionMdl)
+        goto cleanupRegionUnlockPages;
+    try
+    {
+        Status = STATUS_INVALID_USER_BUFFER;
+        MmProbeAndLockPages(Ctx->Device.Region.CompletionMdl, RequestorMode, IoWriteAccess);
+    }
+    except(EXCEPTION_EXECUTE_HANDLER) { goto cleanupCompletionMdl; }
+
+    UCHAR *CompletionRings =
+        MmGetSystemAddressForMdlSafe(Ctx->Device.Region.CompletionMdl, NormalPagePriority | MdlMappingNoExecute);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !CompletionRings)
+        goto cleanupCompletionUnlockPages;
+    for (ULONG Index = 0; Index < QueueCount; ++Index)
+    {
+        TUN_QUEUE *Queue = &Ctx->Device.Queues[Index];
+        Queue->Receive.Completion.Ring =
+            (TUN_COMPLETION_RING *)(CompletionRings + (SIZE_T)Index * Rrb->CompletionRingSize);
+        Queue->Receive.Completion.Count = CompletionCount;
+        Queue->Receive.Completion.Tail = Queue->Receive.Completion.Taken =
+            ReadULongAcquire(&Queue->Receive.Completion.Ring->Tail);
+    }
+    return STATUS_SUCCESS;
+
+cleanupCompletionUnlockPages:
+    MmUnlockPages(Ctx->Device.Region.CompletionMdl);
+cleanupCompletionMdl:
+    IoFreeMdl(Ctx->Device.Region.CompletionMdl);
+cleanupRegionUnlockPages:
+    MmUnlockPages(Ctx->Device.Region.Mdl);
+cleanupRegionMdl:
+    IoFreeMdl(Ctx->Device.Region.Mdl);
+    return Status;
+}
 
-        KIRQL Irql = ExAcquireSpinLockShared(&Ctx->TransitionLock);
-        if (!ReadAcquire(&Ctx->Running))
-            goto cleanupNbl;
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+TunUnregisterRegion(_Inout_ TUN_CTX *Ctx)
+{
+    MmUnlockPages(Ctx->Device.Region.CompletionMdl);
+    IoFreeMdl(Ctx->Device.Region.CompletionMdl);
+    MmUnlockPages(Ctx->Device.Region.Mdl);
+    IoFreeMdl(Ctx->Device.Region.Mdl);
+}
 
-        KLOCK_QUEUE_HANDLE LockHandle;
-        KeAcquireInStackQueuedSpinLock(&Ctx->Device.Receive.Lock, &LockHandle);
-        if (Ctx->Device.Receive.ActiveNbls.Head)
-            NET_BUFFER_LIST_NEXT_NBL_EX(Ctx->Device.Receive.ActiveNbls.Tail) = Nbl;
-        else
-        {
-            KeClearEvent(&Ctx->Device.Receive.ActiveNbls.Empty);
-            Ctx->Device.Receive.ActiveNbls.Head = Nbl;
-        }
-        Ctx->Device.Receive.ActiveNbls.Tail = Nbl;
-        KeReleaseInStackQueuedSpinLock(&LockHandle);
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunRegisterSection(_Inout_ TUN_CTX *Ctx, _In_ const TUN_REGISTER_SECTION *Rsb, _In_ KPROCESSOR_MODE RequestorMode)
+{
+    NTSTATUS Status;
 
-        NdisMIndicateReceiveNetBufferLists(
-            Ctx->MiniportAdapterHandle,
-            Nbl,
-            NDIS_DEFAULT_PORT_NUMBER,
-            1,
-            NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL | NDIS_RECEIVE_FLAGS_SINGLE_ETHER_TYPE);
+    if (Status = STATUS_INVALID_PARAMETER, !Rsb->Section || (ULONG_PTR)Rsb->Section != Rsb->Section)
+        return Status;
+    if (!NT_SUCCESS(
+            Status = ObReferenceObjectByHandle(
+                (HANDLE)(ULONG_PTR)Rsb->Section,
+                SECTION_MAP_READ | SECTION_MAP_WRITE,
+                *MmSectionObjectType,
+                RequestorMode,
+                &Ctx->Device.Section.Object,
+                NULL)))
+        return Status;
+    Ctx->Device.Section.View = NULL;
+    Ctx->Device.Section.Size = 0;
+    if (!NT_SUCCESS(
+            Status = MmMapViewInSystemSpace(
+                Ctx->Device.Section.Object, (VOID **)&Ctx->Device.Section.View, &Ctx->Device.Section.Size)))
+        goto cleanupSection;
+    return STATUS_SUCCESS;
 
-        ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
-        continue;
+cleanupSection:
+    ObDereferenceObject(Ctx->Device.Section.Object);
+    return Status;
+}
 
-    cleanupNbl:
-        ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
-        NdisFreeNetBufferList(Nbl);
-    cleanupMdl:
-        IoFreeMdl(Mdl);
-    skipNbl:
-        InterlockedIncrementNoFence64((LONG64 *)&Ctx->Statistics.ifInDiscards);
-        KeWaitForSingleObject(&Ctx->Device.Receive.ActiveNbls.Empty, Executive, KernelMode, FALSE, NULL);
-        WriteULongRelease(&Ring->Head, RingHead);
-    }
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+TunUnregisterSection(_Inout_ TUN_CTX *Ctx)
+{
+    MmUnmapViewInSystemSpace(Ctx->Device.Section.View);
+    ObDereferenceObject(Ctx->Device.Section.Object);
+}
 
-    /* Wait for all NBLs to return: 1. To prevent race between proceeding and invalidating ring head. 2. To have
-     * TunDispatchUnregisterBuffers() implicitly wait before releasing ring MDL used by NBL(s). */
-    KeWaitForSingleObject(&Ctx->Device.Receive.ActiveNbls.Empty, Executive, KernelMode, FALSE, NULL);
-cleanup:
-    WriteULongRelease(&Ring->Head, MAXULONG);
+/* Returns where the ring registered at Offset is in the system space view of the section, or NULL for TunRegisterQueue
+ * to reject it when it does not fit. */
+static TUN_RING *
+TunSectionRing(_In_ const TUN_CTX *Ctx, _In_ const TUN_RING *Offset, _In_ ULONG RingSize)
+{
+    ULONG_PTR RingOffset = (ULONG_PTR)Offset;
+    if (!TUN_IS_ALIGNED(RingOffset) || RingOffset > Ctx->Device.Section.Size ||
+        RingSize > Ctx->Device.Section.Size - RingOffset)
+        return NULL;
+    return (TUN_RING *)(Ctx->Device.Section.View + RingOffset);
 }
 
-#define IS_POW2(x) ((x) && !((x) & ((x)-1)))
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+TunJoinReceiveThread(_Inout_ TUN_QUEUE *Queue)
+{
+    PKTHREAD ThreadObject;
+    if (NT_SUCCESS(
+            ObReferenceObjectByHandle(Queue->Receive.Thread, SYNCHRONIZE, NULL, KernelMode, &ThreadObject, NULL)))
+    {
+        KeWaitForSingleObject(ThreadObject, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(ThreadObject);
+    }
+    ZwClose(Queue->Receive.Thread);
+}
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
 _Must_inspect_result_
@@ -600,104 +1961,132 @@ TunRegisterBuffers(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
         goto cleanupMutex;
     Ctx->Device.OwningFileObject = Stack->FileObject;
 
-    TUN_REGISTER_RINGS Rrb;
-    if (Stack->Parameters.DeviceIoControl.InputBufferLength == sizeof(Rrb))
-        NdisMoveMemory(&Rrb, Irp->AssociatedIrp.SystemBuffer, sizeof(Rrb));
-#ifdef _WIN64
-    else if (
-        IoIs32bitProcess(Irp) && Stack->Parameters.DeviceIoControl.InputBufferLength == sizeof(TUN_REGISTER_RINGS_32))
-    {
-        TUN_REGISTER_RINGS_32 *Rrb32 = Irp->AssociatedIrp.SystemBuffer;
-        Rrb.Send.RingSize = Rrb32->Send.RingSize;
-        Rrb.Send.Ring = (TUN_RING *)Rrb32->Send.Ring;
-        Rrb.Send.TailMoved = (HANDLE)Rrb32->Send.TailMoved;
-        Rrb.Receive.RingSize = Rrb32->Receive.RingSize;
-        Rrb.Receive.Ring = (TUN_RING *)Rrb32->Receive.Ring;
-        Rrb.Receive.TailMoved = (HANDLE)Rrb32->Receive.TailMoved;
-    }
-#endif
-    else
+    ULONG InputBufferLength = Stack->Parameters.DeviceIoControl.InputBufferLength;
+    const UCHAR *Rings = Irp->AssociatedIrp.SystemBuffer;
+    ULONG Flags = 0, QueueCount = 1, MaxPacketSize = TUN_MAX_IP_PACKET_SIZE;
+    if (Stack->Parameters.DeviceIoControl.IoControlCode == TUN_IOCTL_REGISTER_QUEUES)
     {
-        Status = STATUS_INVALID_PARAMETER;
-        goto cleanupResetOwner;
+        const TUN_REGISTER_QUEUES *Rqb = Irp->AssociatedIrp.SystemBuffer;
+        if (Status = STATUS_INVALID_PARAMETER,
+            InputBufferLength < sizeof(TUN_REGISTER_QUEUES) || (Rqb->Flags & ~TUN_REGISTER_FLAGS_ALL) ||
+                !Rqb->QueueCount || Rqb->QueueCount > TUN_MAX_QUEUES ||
+                (Rqb->Flags & TUN_REGISTER_FLAG_PRIORITY && Rqb->QueueCount < 2) ||
+                (Rqb->Flags & TUN_REGISTER_FLAG_NUMA_NODE && Rqb->NumaNode > KeQueryHighestNodeNumber()))
+            goto cleanupResetOwner;
+        /* The prefix comes on top of the IP packet, so that it takes nothing off the MTU we advertise. */
+        ULONG PrefixSize = (Rqb->Flags & TUN_REGISTER_FLAG_TIMESTAMP ? sizeof(ULONG64) : 0) +
+                           (Rqb->Flags & TUN_REGISTER_FLAG_METADATA ? sizeof(TUN_PACKET_METADATA) : 0);
+        MaxPacketSize = TUN_MAX_IP_PACKET_SIZE + PrefixSize;
+        if (Rqb->MaxPacketSize)
+        {
+            if (Status = STATUS_INVALID_PARAMETER,
+                (Rqb->Flags & TUN_REGISTER_FLAG_METADATA) || Rqb->MaxPacketSize < Ctx->Mtu + PrefixSize ||
+                    Rqb->MaxPacketSize > MaxPacketSize)
+                goto cleanupResetOwner;
+            MaxPacketSize = Rqb->MaxPacketSize;
+        }
+        Flags = Rqb->Flags;
+        Ctx->Device.NumaNode = (USHORT)Rqb->NumaNode;
+        QueueCount = Rqb->QueueCount;
+        Rings = (const UCHAR *)Rqb->Queues;
+        InputBufferLength -= FIELD_OFFSET(TUN_REGISTER_QUEUES, Queues);
+        if (Flags & TUN_REGISTER_FLAG_BUFFER_REGION)
+        {
+            if (Status = STATUS_INVALID_PARAMETER, InputBufferLength < sizeof(TUN_REGISTER_REGION))
+                goto cleanupResetOwner;
+            InputBufferLength -= sizeof(TUN_REGISTER_REGION);
+        }
+        if (Flags & TUN_REGISTER_FLAG_SECTION)
+        {
+            if (Status = STATUS_INVALID_PARAMETER,
+                (Flags & (TUN_REGISTER_FLAG_BUFFER_REGION | TUN_REGISTER_FLAG_MIRRORED)) ||
+                    InputBufferLength < sizeof(TUN_REGISTER_SECTION))
+                goto cleanupResetOwner;
+            InputBufferLength -= sizeof(TUN_REGISTER_SECTION);
+        }
     }
 
-    Ctx->Device.Send.Capacity = TUN_RING_CAPACITY(Rrb.Send.RingSize);
-    if (Status = STATUS_INVALID_PARAMETER,
-        (Ctx->Device.Send.Capacity < TUN_MIN_RING_CAPACITY || Ctx->Device.Send.Capacity > TUN_MAX_RING_CAPACITY ||
-         !IS_POW2(Ctx->Device.Send.Capacity) || !Rrb.Send.TailMoved || !Rrb.Send.Ring))
+    ULONG RingsSize = sizeof(TUN_REGISTER_RINGS);
+#ifdef _WIN64
+    if (IoIs32bitProcess(Irp) && InputBufferLength == QueueCount * sizeof(TUN_REGISTER_RINGS_32))
+        RingsSize = sizeof(TUN_REGISTER_RINGS_32);
+#endif
+    if (Status = STATUS_INVALID_PARAMETER, InputBufferLength != QueueCount * RingsSize)
         goto cleanupResetOwner;
-
-    if (!NT_SUCCESS(
-            Status = ObReferenceObjectByHandle(
-                Rrb.Send.TailMoved,
-                /* We will not wait on send ring tail moved event. */
-                EVENT_MODIFY_STATE,
-                *ExEventObjectType,
-                Irp->RequestorMode,
-                &Ctx->Device.Send.TailMoved,
-                NULL)))
+    if (!NT_SUCCESS(Status = TunAllocateQueues(Ctx, QueueCount)))
         goto cleanupResetOwner;
 
-    Ctx->Device.Send.Mdl = IoAllocateMdl(Rrb.Send.Ring, Rrb.Send.RingSize, FALSE, FALSE, NULL);
-    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ctx->Device.Send.Mdl)
-        goto cleanupSendTailMoved;
-    try
+    if (Flags & TUN_REGISTER_FLAG_BUFFER_REGION)
     {
-        Status = STATUS_INVALID_USER_BUFFER;
-        MmProbeAndLockPages(Ctx->Device.Send.Mdl, Irp->RequestorMode, IoWriteAccess);
+        TUN_REGISTER_REGION Rrb;
+        NdisMoveMemory(&Rrb, Rings + InputBufferLength, sizeof(Rrb));
+        if (!NT_SUCCESS(Status = TunRegisterRegion(Ctx, &Rrb, QueueCount, Irp->RequestorMode)))
+            goto cleanupQueueArray;
     }
-    except(EXCEPTION_EXECUTE_HANDLER) { goto cleanupSendMdl; }
-
-    Ctx->Device.Send.Ring =
-        MmGetSystemAddressForMdlSafe(Ctx->Device.Send.Mdl, NormalPagePriority | MdlMappingNoExecute);
-    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ctx->Device.Send.Ring)
-        goto cleanupSendUnlockPages;
-
-    Ctx->Device.Send.RingTail = ReadULongAcquire(&Ctx->Device.Send.Ring->Tail);
-    if (Status = STATUS_INVALID_PARAMETER, Ctx->Device.Send.RingTail >= Ctx->Device.Send.Capacity)
-        goto cleanupSendUnlockPages;
-
-    Ctx->Device.Receive.Capacity = TUN_RING_CAPACITY(Rrb.Receive.RingSize);
-    if (Status = STATUS_INVALID_PARAMETER,
-        (Ctx->Device.Receive.Capacity < TUN_MIN_RING_CAPACITY || Ctx->Device.Receive.Capacity > TUN_MAX_RING_CAPACITY ||
-         !IS_POW2(Ctx->Device.Receive.Capacity) || !Rrb.Receive.TailMoved || !Rrb.Receive.Ring))
-        goto cleanupSendUnlockPages;
-
-    if (!NT_SUCCESS(
-            Status = ObReferenceObjectByHandle(
-                Rrb.Receive.TailMoved,
-                /* We need to clear receive ring TailMoved event on transition to non-alertable state. */
-                SYNCHRONIZE | EVENT_MODIFY_STATE,
-                *ExEventObjectType,
-                Irp->RequestorMode,
-                &Ctx->Device.Receive.TailMoved,
-                NULL)))
-        goto cleanupSendUnlockPages;
-
-    Ctx->Device.Receive.Mdl = IoAllocateMdl(Rrb.Receive.Ring, Rrb.Receive.RingSize, FALSE, FALSE, NULL);
-    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ctx->Device.Receive.Mdl)
-        goto cleanupReceiveTailMoved;
-    try
+    if (Flags & TUN_REGISTER_FLAG_SECTION)
     {
-        Status = STATUS_INVALID_USER_BUFFER;
-        MmProbeAndLockPages(Ctx->Device.Receive.Mdl, Irp->RequestorMode, IoWriteAccess);
+        TUN_REGISTER_SECTION Rsb;
+        NdisMoveMemory(&Rsb, Rings + InputBufferLength, sizeof(Rsb));
+        if (!NT_SUCCESS(Status = TunRegisterSection(Ctx, &Rsb, Irp->RequestorMode)))
+            goto cleanupQueueArray;
     }
-    except(EXCEPTION_EXECUTE_HANDLER) { goto cleanupReceiveMdl; }
 
-    Ctx->Device.Receive.Ring =
-        MmGetSystemAddressForMdlSafe(Ctx->Device.Receive.Mdl, NormalPagePriority | MdlMappingNoExecute);
-    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ctx->Device.Receive.Ring)
-        goto cleanupReceiveUnlockPages;
+    ULONG Index;
+    for (Index = 0; Index < QueueCount; ++Index)
+    {
+        TUN_REGISTER_RINGS Rrb;
+#ifdef _WIN64
+        if (RingsSize == sizeof(TUN_REGISTER_RINGS_32))
+        {
+            const TUN_REGISTER_RINGS_32 *Rrb32 = (const TUN_REGISTER_RINGS_32 *)Rings + Index;
+            Rrb.Send.RingSize = Rrb32->Send.RingSize;
+            Rrb.Send.Ring = (TUN_RING *)Rrb32->Send.Ring;
+            Rrb.Send.TailMoved = (HANDLE)Rrb32->Send.TailMoved;
+            Rrb.Receive.RingSize = Rrb32->Receive.RingSize;
+            Rrb.Receive.Ring = (TUN_RING *)Rrb32->Receive.Ring;
+            Rrb.Receive.TailMoved = (HANDLE)Rrb32->Receive.TailMoved;
+        }
+        else
+#endif
+            NdisMoveMemory(&Rrb, (const TUN_REGISTER_RINGS *)Rings + Index, sizeof(Rrb));
+        if (Flags & TUN_REGISTER_FLAG_SECTION)
+        {
+            Rrb.Send.Ring = TunSectionRing(Ctx, Rrb.Send.Ring, Rrb.Send.RingSize);
+            Rrb.Receive.Ring = TunSectionRing(Ctx, Rrb.Receive.Ring, Rrb.Receive.RingSize);
+        }
+        if (!NT_SUCCESS(
+                Status = TunRegisterQueue(&Ctx->Device.Queues[Index], &Rrb, Flags, MaxPacketSize, Irp->RequestorMode)))
+            goto cleanupQueues;
+    }
+    Ctx->Device.Flags = Flags;
+    Ctx->Device.QueueCount = QueueCount;
+    Ctx->Device.MaxPacketSize = MaxPacketSize;
 
     KeClearEvent(&Ctx->Device.Disconnected);
 
     OBJECT_ATTRIBUTES ObjectAttributes;
     InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
-    if (Status = NDIS_STATUS_FAILURE,
-        !NT_SUCCESS(PsCreateSystemThread(
-            &Ctx->Device.Receive.Thread, THREAD_ALL_ACCESS, &ObjectAttributes, NULL, NULL, TunProcessReceiveData, Ctx)))
-        goto cleanupFlagsConnected;
+    for (Index = 0; Index < QueueCount; ++Index)
+    {
+        if (Status = NDIS_STATUS_FAILURE,
+            !NT_SUCCESS(PsCreateSystemThread(
+                &Ctx->Device.Queues[Index].Receive.Thread,
+                THREAD_ALL_ACCESS,
+                &ObjectAttributes,
+                NULL,
+                NULL,
+                TunProcessReceiveData,
+                &Ctx->Device.Queues[Index])))
+            goto cleanupFlagsConnected;
+    }
+    ULONG SendBufferSpace = 0, ReceiveBufferSpace = 0;
+    for (Index = 0; Index < QueueCount; ++Index)
+    {
+        SendBufferSpace += Ctx->Device.Queues[Index].Send.Capacity;
+        ReceiveBufferSpace += Ctx->Device.Queues[Index].Receive.Capacity;
+    }
+    WriteULongNoFence(&Ctx->Device.SendBufferSpace, SendBufferSpace);
+    WriteULongNoFence(&Ctx->Device.ReceiveBufferSpace, ReceiveBufferSpace);
 
     Ctx->Device.OwningProcessId = PsGetCurrentProcessId();
     InitializeListHead(&Ctx->Device.Entry);
@@ -705,7 +2094,22 @@ TunRegisterBuffers(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
     InsertTailList(&TunDispatchDeviceList, &Ctx->Device.Entry);
     ExReleaseResourceLite(&TunDispatchDeviceListLock);
 
+    TraceLoggingWrite(
+        TunTraceProvider,
+        "Register",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(TUN_TRACE_KEYWORD_STATE),
+        TraceLoggingPointer(Ctx, "Adapter"),
+        TraceLoggingUInt32(QueueCount, "Queues"),
+        TraceLoggingHexUInt32(Flags, "Flags"),
+        TraceLoggingUInt32(Ctx->Device.Queues[0].Send.Capacity, "SendCapacity"),
+        TraceLoggingUInt32(Ctx->Device.Queues[0].Receive.Capacity, "ReceiveCapacity"),
+        TraceLoggingUInt32(MaxPacketSize, "MaxPacketSize"),
+        TraceLoggingUInt32((ULONG)(ULONG_PTR)Ctx->Device.OwningProcessId, "ProcessId"));
+
     ExReleaseResourceLite(&Ctx->Device.RegistrationLock);
+    if (Flags & TUN_REGISTER_FLAG_METADATA)
+        TunIndicateOffloadConfig(Ctx->MiniportAdapterHandle, TRUE);
     TunIndicateStatus(Ctx->MiniportAdapterHandle, MediaConnectStateConnected);
     return STATUS_SUCCESS;
 
@@ -714,18 +2118,18 @@ cleanupFlagsConnected:
     ExReleaseSpinLockExclusive(
         &Ctx->TransitionLock,
         ExAcquireSpinLockExclusive(&Ctx->TransitionLock)); /* Ensure above change is visible to all readers. */
-cleanupReceiveUnlockPages:
-    MmUnlockPages(Ctx->Device.Receive.Mdl);
-cleanupReceiveMdl:
-    IoFreeMdl(Ctx->Device.Receive.Mdl);
-cleanupReceiveTailMoved:
-    ObDereferenceObject(Ctx->Device.Receive.TailMoved);
-cleanupSendUnlockPages:
-    MmUnlockPages(Ctx->Device.Send.Mdl);
-cleanupSendMdl:
-    IoFreeMdl(Ctx->Device.Send.Mdl);
-cleanupSendTailMoved:
-    ObDereferenceObject(Ctx->Device.Send.TailMoved);
+    for (ULONG i = 0; i < Index; ++i)
+        TunJoinReceiveThread(&Ctx->Device.Queues[i]);
+    Index = QueueCount;
+cleanupQueues:
+    while (Index--)
+        TunUnregisterQueue(&Ctx->Device.Queues[Index]);
+    if (Flags & TUN_REGISTER_FLAG_SECTION)
+        TunUnregisterSection(Ctx);
+    if (Flags & TUN_REGISTER_FLAG_BUFFER_REGION)
+        TunUnregisterRegion(Ctx);
+cleanupQueueArray:
+    TunFreeQueues(Ctx);
 cleanupResetOwner:
     Ctx->Device.OwningFileObject = NULL;
 cleanupMutex:
@@ -733,6 +2137,126 @@ cleanupMutex:
     return Status;
 }
 
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunQueryStatistics(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
+{
+    NTSTATUS Status;
+    IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
+    if (Status = STATUS_INVALID_PARAMETER, Stack->Parameters.DeviceIoControl.InputBufferLength != sizeof(ULONG))
+        return Status;
+    ULONG OutputSize = min(Stack->Parameters.DeviceIoControl.OutputBufferLength, sizeof(TUN_QUEUE_STATISTICS));
+    if (Status = STATUS_BUFFER_TOO_SMALL, OutputSize < FIELD_OFFSET(TUN_QUEUE_STATISTICS, Receive.Latency))
+        return Status;
+    ULONG Index = *(const ULONG *)Irp->AssociatedIrp.SystemBuffer;
+
+    ExAcquireResourceSharedLite(&Ctx->Device.RegistrationLock, TRUE);
+    if (Status = STATUS_INVALID_HANDLE, Ctx->Device.OwningFileObject != Stack->FileObject)
+        goto cleanupMutex;
+    if (Status = STATUS_INVALID_PARAMETER, Index >= Ctx->Device.QueueCount)
+        goto cleanupMutex;
+    /* Counters are updated on the fly, so read them one by one. */
+    const LONG64 *Counters = (const LONG64 *)&Ctx->Device.Queues[Index].Statistics;
+    LONG64 *Output = Irp->AssociatedIrp.SystemBuffer;
+    ULONG CounterCount = OutputSize / sizeof(LONG64);
+    for (ULONG i = 0; i < CounterCount; ++i)
+        Output[i] = ReadNoFence64(&Counters[i]);
+    Irp->IoStatus.Information = CounterCount * sizeof(LONG64);
+    Status = STATUS_SUCCESS;
+
+cleanupMutex:
+    ExReleaseResourceLite(&Ctx->Device.RegistrationLock);
+    return Status;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunSetFilter(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
+{
+    NTSTATUS Status;
+    IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG InputBufferLength = Stack->Parameters.DeviceIoControl.InputBufferLength;
+    const TUN_FILTER *Input = Irp->AssociatedIrp.SystemBuffer;
+    if (Status = STATUS_INVALID_PARAMETER,
+        InputBufferLength < sizeof(TUN_FILTER) || Input->RuleCount > TUN_MAX_FILTER_RULES ||
+            InputBufferLength != sizeof(TUN_FILTER) + Input->RuleCount * sizeof(TUN_FILTER_RULE) ||
+            (Input->DefaultAction != TUN_FILTER_ACTION_PASS && Input->DefaultAction != TUN_FILTER_ACTION_DROP))
+        return Status;
+    for (ULONG Index = 0; Index < Input->RuleCount; ++Index)
+    {
+        const TUN_FILTER_RULE *Rule = &Input->Rules[Index];
+        ULONG MaxPrefixLength = Rule->IpVersion == 4 ? 32 : Rule->IpVersion == 6 ? 128 : 0;
+        if (Status = STATUS_INVALID_PARAMETER,
+            (Rule->Action != TUN_FILTER_ACTION_PASS && Rule->Action != TUN_FILTER_ACTION_DROP) ||
+                (Rule->IpVersion && Rule->IpVersion != 4 && Rule->IpVersion != 6) ||
+                Rule->PrefixLength > MaxPrefixLength || Rule->PortMin > Rule->PortMax)
+            return Status;
+    }
+
+    TUN_FILTER *Filter = NULL;
+    if (Input->RuleCount || Input->DefaultAction != TUN_FILTER_ACTION_PASS)
+    {
+        Filter = ExAllocatePoolUninitialized(NonPagedPool, InputBufferLength, TUN_MEMORY_TAG);
+        if (Status = STATUS_INSUFFICIENT_RESOURCES, !Filter)
+            return Status;
+        NdisMoveMemory(Filter, Input, InputBufferLength);
+    }
+
+    ExAcquireResourceExclusiveLite(&Ctx->Device.RegistrationLock, TRUE);
+    if (Status = STATUS_INVALID_HANDLE, Ctx->Device.OwningFileObject != Stack->FileObject)
+        goto cleanupMutex;
+    KIRQL Irql = ExAcquireSpinLockExclusive(&Ctx->TransitionLock);
+    TUN_FILTER *OldFilter = Ctx->Device.Filter;
+    Ctx->Device.Filter = Filter;
+    ExReleaseSpinLockExclusive(&Ctx->TransitionLock, Irql);
+    Filter = OldFilter;
+    Status = STATUS_SUCCESS;
+
+cleanupMutex:
+    ExReleaseResourceLite(&Ctx->Device.RegistrationLock);
+    if (Filter)
+        ExFreePoolWithTag(Filter, TUN_MEMORY_TAG);
+    return Status;
+}
+
+/* Once the successor owns the rings, the predecessor exiting is only a handle to the file object closing, which
+ * neither TunProcessNotification nor TunDispatchClose act on. */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunTakeOver(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
+{
+    NTSTATUS Status;
+    IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
+
+    ExAcquireResourceExclusiveLite(&Ctx->Device.RegistrationLock, TRUE);
+    if (Status = STATUS_INVALID_HANDLE, Ctx->Device.OwningFileObject != Stack->FileObject)
+        goto cleanupMutex;
+    /* Pages locked in the predecessor's address space would have to be unlocked before it goes away. */
+    if (Status = STATUS_NOT_SUPPORTED, !(Ctx->Device.Flags & TUN_REGISTER_FLAG_SECTION))
+        goto cleanupMutex;
+    HANDLE PreviousProcessId = Ctx->Device.OwningProcessId;
+    /* TunProcessNotification looks owners up under the device list lock only. */
+    ExAcquireResourceExclusiveLite(&TunDispatchDeviceListLock, TRUE);
+    Ctx->Device.OwningProcessId = PsGetCurrentProcessId();
+    ExReleaseResourceLite(&TunDispatchDeviceListLock);
+    TraceLoggingWrite(
+        TunTraceProvider,
+        "TakeOver",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(TUN_TRACE_KEYWORD_STATE),
+        TraceLoggingPointer(Ctx, "Adapter"),
+        TraceLoggingUInt32((ULONG)(ULONG_PTR)PreviousProcessId, "PreviousProcessId"),
+        TraceLoggingUInt32((ULONG)(ULONG_PTR)Ctx->Device.OwningProcessId, "ProcessId"));
+    Status = STATUS_SUCCESS;
+
+cleanupMutex:
+    ExReleaseResourceLite(&Ctx->Device.RegistrationLock);
+    return Status;
+}
+
 #define TUN_FORCE_UNREGISTRATION ((FILE_OBJECT *)-1)
 _IRQL_requires_max_(PASSIVE_LEVEL)
 static VOID
@@ -753,32 +2277,44 @@ TunUnregisterBuffers(_Inout_ TUN_CTX *Ctx, _In_ FILE_OBJECT *Owner)
     ExReleaseResourceLite(&TunDispatchDeviceListLock);
 
     TunIndicateStatus(Ctx->MiniportAdapterHandle, MediaConnectStateDisconnected);
+    if (Ctx->Device.Flags & TUN_REGISTER_FLAG_METADATA)
+        TunIndicateOffloadConfig(Ctx->MiniportAdapterHandle, FALSE);
 
     KeSetEvent(&Ctx->Device.Disconnected, IO_NO_INCREMENT, FALSE);
     ExReleaseSpinLockExclusive(
         &Ctx->TransitionLock,
         ExAcquireSpinLockExclusive(&Ctx->TransitionLock)); /* Ensure above change is visible to all readers. */
 
-    PKTHREAD ThreadObject;
-    if (NT_SUCCESS(
-            ObReferenceObjectByHandle(Ctx->Device.Receive.Thread, SYNCHRONIZE, NULL, KernelMode, &ThreadObject, NULL)))
+    if (Ctx->Device.Filter)
     {
-        KeWaitForSingleObject(ThreadObject, Executive, KernelMode, FALSE, NULL);
-        ObDereferenceObject(ThreadObject);
+        ExFreePoolWithTag(Ctx->Device.Filter, TUN_MEMORY_TAG);
+        Ctx->Device.Filter = NULL;
     }
-    ZwClose(Ctx->Device.Receive.Thread);
-
-    WriteULongRelease(&Ctx->Device.Send.Ring->Tail, MAXULONG);
-    KeSetEvent(Ctx->Device.Send.TailMoved, IO_NO_INCREMENT, FALSE);
-
-    MmUnlockPages(Ctx->Device.Receive.Mdl);
-    IoFreeMdl(Ctx->Device.Receive.Mdl);
-    ObDereferenceObject(Ctx->Device.Receive.TailMoved);
-    MmUnlockPages(Ctx->Device.Send.Mdl);
-    IoFreeMdl(Ctx->Device.Send.Mdl);
-    ObDereferenceObject(Ctx->Device.Send.TailMoved);
+    WriteULongNoFence(&Ctx->Device.SendBufferSpace, 0);
+    WriteULongNoFence(&Ctx->Device.ReceiveBufferSpace, 0);
+    for (ULONG Index = 0; Index < Ctx->Device.QueueCount; ++Index)
+    {
+        TUN_QUEUE *Queue = &Ctx->Device.Queues[Index];
+        TunJoinReceiveThread(Queue);
+        WriteULongRelease(Queue->Send.Ring.Tail, MAXULONG);
+        KeSetEvent(Queue->Send.TailMoved, IO_NO_INCREMENT, FALSE);
+        TunUnregisterQueue(Queue);
+    }
+    /* The receive threads have waited for every NBL to return, so nothing maps the region anymore. */
+    if (Ctx->Device.Flags & TUN_REGISTER_FLAG_BUFFER_REGION)
+        TunUnregisterRegion(Ctx);
+    if (Ctx->Device.Flags & TUN_REGISTER_FLAG_SECTION)
+        TunUnregisterSection(Ctx);
+    TunFreeQueues(Ctx);
 
     ExReleaseResourceLite(&Ctx->Device.RegistrationLock);
+    TraceLoggingWrite(
+        TunTraceProvider,
+        "Unregister",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(TUN_TRACE_KEYWORD_STATE),
+        TraceLoggingPointer(Ctx, "Adapter"),
+        TraceLoggingBoolean(Owner == TUN_FORCE_UNREGISTRATION, "Forced"));
 }
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
@@ -812,9 +2348,15 @@ static NTSTATUS
 TunDispatchDeviceControl(DEVICE_OBJECT *DeviceObject, IRP *Irp)
 {
     IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
-    if (Stack->Parameters.DeviceIoControl.IoControlCode != TUN_IOCTL_REGISTER_RINGS)
+    if (Stack->Parameters.DeviceIoControl.IoControlCode != TUN_IOCTL_REGISTER_RINGS &&
+        Stack->Parameters.DeviceIoControl.IoControlCode != TUN_IOCTL_REGISTER_QUEUES &&
+        Stack->Parameters.DeviceIoControl.IoControlCode != TUN_IOCTL_GET_STATISTICS &&
+        Stack->Parameters.DeviceIoControl.IoControlCode != TUN_IOCTL_SET_FILTER &&
+        Stack->Parameters.DeviceIoControl.IoControlCode != TUN_IOCTL_TAKE_OVER)
         return NdisDispatchDeviceControl(DeviceObject, Irp);
 
+    Irp->IoStatus.Information = 0;
+
     SECURITY_SUBJECT_CONTEXT SubjectContext;
     SeCaptureSubjectContext(&SubjectContext);
     NTSTATUS Status;
@@ -835,7 +2377,8 @@ TunDispatchDeviceControl(DEVICE_OBJECT *DeviceObject, IRP *Irp)
         goto cleanup;
     switch (Stack->Parameters.DeviceIoControl.IoControlCode)
     {
-    case TUN_IOCTL_REGISTER_RINGS: {
+    case TUN_IOCTL_REGISTER_RINGS:
+    case TUN_IOCTL_REGISTER_QUEUES: {
         KeEnterCriticalRegion();
         ExAcquireResourceSharedLite(&TunDispatchCtxGuard, TRUE);
 #pragma warning(suppress : 28175)
@@ -847,10 +2390,45 @@ TunDispatchDeviceControl(DEVICE_OBJECT *DeviceObject, IRP *Irp)
         KeLeaveCriticalRegion();
         break;
     }
+    case TUN_IOCTL_GET_STATISTICS: {
+        KeEnterCriticalRegion();
+        ExAcquireResourceSharedLite(&TunDispatchCtxGuard, TRUE);
+#pragma warning(suppress : 28175)
+        TUN_CTX *Ctx = DeviceObject->Reserved;
+        Status = NDIS_STATUS_ADAPTER_NOT_READY;
+        if (Ctx)
+            Status = TunQueryStatistics(Ctx, Irp);
+        ExReleaseResourceLite(&TunDispatchCtxGuard);
+        KeLeaveCriticalRegion();
+        break;
+    }
+    case TUN_IOCTL_SET_FILTER: {
+        KeEnterCriticalRegion();
+        ExAcquireResourceSharedLite(&TunDispatchCtxGuard, TRUE);
+#pragma warning(suppress : 28175)
+        TUN_CTX *Ctx = DeviceObject->Reserved;
+        Status = NDIS_STATUS_ADAPTER_NOT_READY;
+        if (Ctx)
+            Status = TunSetFilter(Ctx, Irp);
+        ExReleaseResourceLite(&TunDispatchCtxGuard);
+        KeLeaveCriticalRegion();
+        break;
+    }
+    case TUN_IOCTL_TAKE_OVER: {
+        KeEnterCriticalRegion();
+        ExAcquireResourceSharedLite(&TunDispatchCtxGuard, TRUE);
+#pragma warning(suppress : 28175)
+        TUN_CTX *Ctx = DeviceObject->Reserved;
+        Status = NDIS_STATUS_ADAPTER_NOT_READY;
+        if (Ctx)
+            Status = TunTakeOver(Ctx, Irp);
+        ExReleaseResourceLite(&TunDispatchCtxGuard);
+        KeLeaveCriticalRegion();
+        break;
+    }
     }
 cleanup:
     Irp->IoStatus.Status = Status;
-    Irp->IoStatus.Information = 0;
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
     return Status;
 }
@@ -954,6 +2532,12 @@ TunRestart(NDIS_HANDLE MiniportAdapterContext, PNDIS_MINIPORT_RESTART_PARAMETERS
 {
     TUN_CTX *Ctx = (TUN_CTX *)MiniportAdapterContext;
     WriteRelease(&Ctx->Running, TRUE);
+    TraceLoggingWrite(
+        TunTraceProvider,
+        "Restart",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(TUN_TRACE_KEYWORD_STATE),
+        TraceLoggingPointer(Ctx, "Adapter"));
     return NDIS_STATUS_SUCCESS;
 }
 
@@ -969,8 +2553,20 @@ TunPause(NDIS_HANDLE MiniportAdapterContext, PNDIS_MINIPORT_PAUSE_PARAMETERS Min
         &Ctx->TransitionLock,
         ExAcquireSpinLockExclusive(&Ctx->TransitionLock)); /* Ensure above change is visible to all readers. */
 
-    KeWaitForSingleObject(&Ctx->Device.Receive.ActiveNbls.Empty, Executive, KernelMode, FALSE, NULL);
+    /* The queues go with the registration, which only ends once their NBLs are back, so hold it off meanwhile. */
+    KeEnterCriticalRegion();
+    ExAcquireResourceSharedLite(&Ctx->Device.RegistrationLock, TRUE);
+    for (ULONG Index = 0; Index < Ctx->Device.QueueCount; ++Index)
+        KeWaitForSingleObject(&Ctx->Device.Queues[Index].Receive.ActiveNbls.Empty, Executive, KernelMode, FALSE, NULL);
+    ExReleaseResourceLite(&Ctx->Device.RegistrationLock);
+    KeLeaveCriticalRegion();
 
+    TraceLoggingWrite(
+        TunTraceProvider,
+        "Pause",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(TUN_TRACE_KEYWORD_STATE),
+        TraceLoggingPointer(Ctx, "Adapter"));
     return NDIS_STATUS_SUCCESS;
 }
 
@@ -981,6 +2577,47 @@ TunDevicePnPEventNotify(NDIS_HANDLE MiniportAdapterContext, PNET_DEVICE_PNP_EVEN
 {
 }
 
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static ULONG
+TunReadConfigurationInteger(
+    _In_ NDIS_HANDLE ConfigHandle,
+    _In_ NDIS_STRING *Keyword,
+    _In_ ULONG Default,
+    _In_ ULONG Minimum,
+    _In_ ULONG Maximum)
+{
+    NDIS_STATUS Status;
+    NDIS_CONFIGURATION_PARAMETER *Param;
+    NdisReadConfiguration(&Status, &Param, ConfigHandle, Keyword, NdisParameterInteger);
+    if (Status != NDIS_STATUS_SUCCESS || Param->ParameterType != NdisParameterInteger)
+        return Default;
+    return min(max(Param->ParameterData.IntegerData, Minimum), Maximum);
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+TunReadConfiguration(_Inout_ TUN_CTX *Ctx)
+{
+    Ctx->Mtu = TUN_MAX_IP_PACKET_SIZE;
+    Ctx->MaxReceiveNbls = TUN_DEFAULT_RECEIVE_NBLS;
+    NDIS_CONFIGURATION_OBJECT ConfigObject = {
+        .Header = { .Type = NDIS_OBJECT_TYPE_CONFIGURATION_OBJECT,
+                    .Revision = NDIS_CONFIGURATION_OBJECT_REVISION_1,
+                    .Size = NDIS_SIZEOF_CONFIGURATION_OBJECT_REVISION_1 },
+        .NdisHandle = Ctx->MiniportAdapterHandle
+    };
+    NDIS_HANDLE ConfigHandle;
+    if (NdisOpenConfigurationEx(&ConfigObject, &ConfigHandle) != NDIS_STATUS_SUCCESS)
+        return;
+    NDIS_STRING MtuKeyword = NDIS_STRING_CONST("MTU");
+    Ctx->Mtu = TunReadConfigurationInteger(
+        ConfigHandle, &MtuKeyword, TUN_MAX_IP_PACKET_SIZE, TUN_MIN_MTU, TUN_MAX_IP_PACKET_SIZE);
+    NDIS_STRING ChainKeyword = NDIS_STRING_CONST("ReceiveChainLength");
+    Ctx->MaxReceiveNbls =
+        TunReadConfigurationInteger(ConfigHandle, &ChainKeyword, TUN_DEFAULT_RECEIVE_NBLS, 1, TUN_MAX_RECEIVE_NBLS);
+    NdisCloseConfiguration(ConfigHandle);
+}
+
 static MINIPORT_INITIALIZE TunInitializeEx;
 _Use_decl_annotations_
 static NDIS_STATUS
@@ -1002,6 +2639,7 @@ TunInitializeEx(
         return NDIS_STATUS_FAILURE;
 
     Ctx->MiniportAdapterHandle = MiniportAdapterHandle;
+    TunReadConfiguration(Ctx);
 
     NdisMGetDeviceProperty(MiniportAdapterHandle, NULL, &Ctx->FunctionalDeviceObject, NULL, NULL, NULL);
     if (Status = NDIS_STATUS_FAILURE, !Ctx->FunctionalDeviceObject)
@@ -1017,25 +2655,19 @@ TunInitializeEx(
 #pragma warning(suppress : 28175)
     Ctx->FunctionalDeviceObject->Reserved = Ctx;
 
-    Ctx->Statistics.Header.Type = NDIS_OBJECT_TYPE_DEFAULT;
-    Ctx->Statistics.Header.Revision = NDIS_STATISTICS_INFO_REVISION_1;
-    Ctx->Statistics.Header.Size = NDIS_SIZEOF_STATISTICS_INFO_REVISION_1;
-    Ctx->Statistics.SupportedStatistics =
-        NDIS_STATISTICS_FLAGS_VALID_DIRECTED_FRAMES_RCV | NDIS_STATISTICS_FLAGS_VALID_MULTICAST_FRAMES_RCV |
-        NDIS_STATISTICS_FLAGS_VALID_BROADCAST_FRAMES_RCV | NDIS_STATISTICS_FLAGS_VALID_BYTES_RCV |
-        NDIS_STATISTICS_FLAGS_VALID_RCV_DISCARDS | NDIS_STATISTICS_FLAGS_VALID_RCV_ERROR |
-        NDIS_STATISTICS_FLAGS_VALID_DIRECTED_FRAMES_XMIT | NDIS_STATISTICS_FLAGS_VALID_MULTICAST_FRAMES_XMIT |
-        NDIS_STATISTICS_FLAGS_VALID_BROADCAST_FRAMES_XMIT | NDIS_STATISTICS_FLAGS_VALID_BYTES_XMIT |
-        NDIS_STATISTICS_FLAGS_VALID_XMIT_ERROR | NDIS_STATISTICS_FLAGS_VALID_XMIT_DISCARDS |
-        NDIS_STATISTICS_FLAGS_VALID_DIRECTED_BYTES_RCV | NDIS_STATISTICS_FLAGS_VALID_MULTICAST_BYTES_RCV |
-        NDIS_STATISTICS_FLAGS_VALID_BROADCAST_BYTES_RCV | NDIS_STATISTICS_FLAGS_VALID_DIRECTED_BYTES_XMIT |
-        NDIS_STATISTICS_FLAGS_VALID_MULTICAST_BYTES_XMIT | NDIS_STATISTICS_FLAGS_VALID_BROADCAST_BYTES_XMIT;
     KeInitializeEvent(&Ctx->Device.Disconnected, NotificationEvent, TRUE);
-    KeInitializeSpinLock(&Ctx->Device.Send.Lock);
-    KeInitializeSpinLock(&Ctx->Device.Receive.Lock);
-    KeInitializeEvent(&Ctx->Device.Receive.ActiveNbls.Empty, NotificationEvent, TRUE);
     ExInitializeResourceLite(&Ctx->Device.RegistrationLock);
 
+    /* Processors may be added at runtime, so have a slot for every one there can be. Allocations of a page or more are
+     * page aligned, which keeps each slot on its own cache line. */
+    Ctx->CpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+/* Leaking memory 'Ctx->CpuStatistics'. Note: 'Ctx->CpuStatistics' is freed in TunHaltEx or on failure. */
+#pragma warning(suppress : 6014)
+    Ctx->CpuStatistics = ExAllocatePoolZero(
+        NonPagedPool, ROUND_TO_PAGES((SIZE_T)Ctx->CpuCount * sizeof(*Ctx->CpuStatistics)), TUN_MEMORY_TAG);
+    if (Status = NDIS_STATUS_RESOURCES, !Ctx->CpuStatistics)
+        goto cleanupFreeCtx;
+
     NET_BUFFER_LIST_POOL_PARAMETERS NblPoolParameters = {
         .Header = { .Type = NDIS_OBJECT_TYPE_DEFAULT,
                     .Revision = NET_BUFFER_LIST_POOL_PARAMETERS_REVISION_1,
@@ -1048,7 +2680,7 @@ TunInitializeEx(
 #pragma warning(suppress : 6014)
     Ctx->NblPool = NdisAllocateNetBufferListPool(MiniportAdapterHandle, &NblPoolParameters);
     if (Status = NDIS_STATUS_FAILURE, !Ctx->NblPool)
-        goto cleanupFreeCtx;
+        goto cleanupFreeCpuStatistics;
 
     NDIS_MINIPORT_ADAPTER_REGISTRATION_ATTRIBUTES AdapterRegistrationAttributes = {
         .Header = { .Type = NDIS_OBJECT_TYPE_MINIPORT_ADAPTER_REGISTRATION_ATTRIBUTES,
@@ -1093,21 +2725,24 @@ TunInitializeEx(
                                         OID_GEN_INTERRUPT_MODERATION,
                                         OID_GEN_LINK_PARAMETERS,
                                         OID_PNP_SET_POWER,
-                                        OID_PNP_QUERY_POWER };
+                                        OID_PNP_QUERY_POWER,
+                                        OID_OFFLOAD_ENCAPSULATION,
+                                        OID_TCP_OFFLOAD_PARAMETERS,
+                                        OID_TCP_RSC_STATISTICS };
     NDIS_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES AdapterGeneralAttributes = {
         .Header = { .Type = NDIS_OBJECT_TYPE_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES,
                     .Revision = NDIS_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES_REVISION_2,
                     .Size = NDIS_SIZEOF_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES_REVISION_2 },
         .MediaType = NdisMediumIP,
         .PhysicalMediumType = NdisPhysicalMediumUnspecified,
-        .MtuSize = TUN_MAX_IP_PACKET_SIZE,
+        .MtuSize = Ctx->Mtu,
         .MaxXmitLinkSpeed = TUN_LINK_SPEED,
         .MaxRcvLinkSpeed = TUN_LINK_SPEED,
         .RcvLinkSpeed = TUN_LINK_SPEED,
         .XmitLinkSpeed = TUN_LINK_SPEED,
         .MediaConnectState = MediaConnectStateDisconnected,
         .MediaDuplexState = MediaDuplexStateFull,
-        .LookaheadSize = TUN_MAX_IP_PACKET_SIZE,
+        .LookaheadSize = Ctx->Mtu,
         .MacOptions =
             NDIS_MAC_OPTION_TRANSFERS_NOT_PEND | NDIS_MAC_OPTION_COPY_LOOKAHEAD_DATA | NDIS_MAC_OPTION_NO_LOOPBACK,
         .SupportedPacketFilters = NDIS_PACKET_TYPE_DIRECTED | NDIS_PACKET_TYPE_ALL_MULTICAST |
@@ -1118,7 +2753,7 @@ TunInitializeEx(
         .ConnectionType = NET_IF_CONNECTION_DEDICATED,
         .IfType = IF_TYPE_PROP_VIRTUAL,
         .IfConnectorPresent = FALSE,
-        .SupportedStatistics = Ctx->Statistics.SupportedStatistics,
+        .SupportedStatistics = TUN_SUPPORTED_STATISTICS,
         .SupportedPauseFunctions = NdisPauseFunctionsUnsupported,
         .AutoNegotiationFlags =
             NDIS_LINK_STATE_XMIT_LINK_SPEED_AUTO_NEGOTIATED | NDIS_LINK_STATE_RCV_LINK_SPEED_AUTO_NEGOTIATED |
@@ -1132,10 +2767,28 @@ TunInitializeEx(
             MiniportAdapterHandle, (PNDIS_MINIPORT_ADAPTER_ATTRIBUTES)&AdapterGeneralAttributes)))
         goto cleanupFreeNblPool;
 
+    /* Offloads are only enabled while a client that understands TUN_PACKET_METADATA has the rings registered. */
+    NDIS_OFFLOAD DefaultOffload, HardwareOffload;
+    TunInitializeOffload(&DefaultOffload, FALSE);
+    TunInitializeOffload(&HardwareOffload, TRUE);
+    NDIS_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES AdapterOffloadAttributes = {
+        .Header = { .Type = NDIS_OBJECT_TYPE_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES,
+                    .Revision = NDIS_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES_REVISION_1,
+                    .Size = NDIS_SIZEOF_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES_REVISION_1 },
+        .DefaultOffloadConfiguration = &DefaultOffload,
+        .HardwareOffloadCapabilities = &HardwareOffload
+    };
+    if (Status = NDIS_STATUS_FAILURE,
+        !NT_SUCCESS(NdisMSetMiniportAttributes(
+            MiniportAdapterHandle, (PNDIS_MINIPORT_ADAPTER_ATTRIBUTES)&AdapterOffloadAttributes)))
+        goto cleanupFreeNblPool;
+
     return NDIS_STATUS_SUCCESS;
 
 cleanupFreeNblPool:
     NdisFreeNetBufferListPool(Ctx->NblPool);
+cleanupFreeCpuStatistics:
+    ExFreePoolWithTag(Ctx->CpuStatistics, TUN_MEMORY_TAG);
 cleanupFreeCtx:
     ExFreePoolWithTag(Ctx, TUN_MEMORY_TAG);
     return Status;
@@ -1164,6 +2817,7 @@ TunHaltEx(NDIS_HANDLE MiniportAdapterContext, NDIS_HALT_ACTION HaltAction)
     ExReleaseResourceLite(&TunDispatchCtxGuard);
     KeLeaveCriticalRegion();
     ExDeleteResourceLite(&Ctx->Device.RegistrationLock);
+    ExFreePoolWithTag(Ctx->CpuStatistics, TUN_MEMORY_TAG);
     ExFreePoolWithTag(Ctx, TUN_MEMORY_TAG);
 }
 
@@ -1247,13 +2901,16 @@ TunOidQuery(_Inout_ TUN_CTX *Ctx, _Inout_ NDIS_OID_REQUEST *OidRequest)
     case OID_GEN_MAXIMUM_TOTAL_SIZE:
     case OID_GEN_TRANSMIT_BLOCK_SIZE:
     case OID_GEN_RECEIVE_BLOCK_SIZE:
-        return TunOidQueryWrite(OidRequest, TUN_MAX_IP_PACKET_SIZE);
+        return TunOidQueryWrite(OidRequest, Ctx->Mtu);
 
     case OID_GEN_TRANSMIT_BUFFER_SPACE:
-        return TunOidQueryWrite(OidRequest, TUN_MAX_RING_CAPACITY);
-
-    case OID_GEN_RECEIVE_BUFFER_SPACE:
-        return TunOidQueryWrite(OidRequest, TUN_MAX_RING_CAPACITY);
+    case OID_GEN_RECEIVE_BUFFER_SPACE: {
+        /* The queues may go at any time without the RegistrationLock, so the sums are kept apart from them. */
+        BOOLEAN Transmit = OidRequest->DATA.QUERY_INFORMATION.Oid == OID_GEN_TRANSMIT_BUFFER_SPACE;
+        return TunOidQueryWrite(
+            OidRequest,
+            ReadULongNoFence(Transmit ? &Ctx->Device.SendBufferSpace : &Ctx->Device.ReceiveBufferSpace));
+    }
 
     case OID_GEN_VENDOR_ID:
         return TunOidQueryWrite(OidRequest, HTONL(TUN_VENDOR_ID));
@@ -1264,22 +2921,37 @@ TunOidQuery(_Inout_ TUN_CTX *Ctx, _Inout_ NDIS_OID_REQUEST *OidRequest)
     case OID_GEN_VENDOR_DRIVER_VERSION:
         return TunOidQueryWrite(OidRequest, (WINTUN_VERSION_MAJ << 16) | WINTUN_VERSION_MIN);
 
-    case OID_GEN_XMIT_OK:
-        return TunOidQueryWrite32or64(
-            OidRequest,
-            ReadNoFence64((LONG64 *)&Ctx->Statistics.ifHCOutUcastPkts) +
-                ReadNoFence64((LONG64 *)&Ctx->Statistics.ifHCOutMulticastPkts) +
-                ReadNoFence64((LONG64 *)&Ctx->Statistics.ifHCOutBroadcastPkts));
+    case OID_GEN_XMIT_OK: {
+        TUN_CPU_STATISTICS Sum;
+        TunSumCpuStatistics(Ctx, &Sum);
+        return TunOidQueryWrite32or64(OidRequest, Sum.OutPackets);
+    }
 
-    case OID_GEN_RCV_OK:
-        return TunOidQueryWrite32or64(
-            OidRequest,
-            ReadNoFence64((LONG64 *)&Ctx->Statistics.ifHCInUcastPkts) +
-                ReadNoFence64((LONG64 *)&Ctx->Statistics.ifHCInMulticastPkts) +
-                ReadNoFence64((LONG64 *)&Ctx->Statistics.ifHCInBroadcastPkts));
+    case OID_GEN_RCV_OK: {
+        TUN_CPU_STATISTICS Sum;
+        TunSumCpuStatistics(Ctx, &Sum);
+        return TunOidQueryWrite32or64(OidRequest, Sum.InPackets);
+    }
 
-    case OID_GEN_STATISTICS:
-        return TunOidQueryWriteBuf(OidRequest, &Ctx->Statistics, (ULONG)sizeof(Ctx->Statistics));
+    case OID_GEN_STATISTICS: {
+        TUN_CPU_STATISTICS Sum;
+        TunSumCpuStatistics(Ctx, &Sum);
+        NDIS_STATISTICS_INFO Statistics = { .Header = { .Type = NDIS_OBJECT_TYPE_DEFAULT,
+                                                        .Revision = NDIS_STATISTICS_INFO_REVISION_1,
+                                                        .Size = NDIS_SIZEOF_STATISTICS_INFO_REVISION_1 },
+                                            .SupportedStatistics = TUN_SUPPORTED_STATISTICS,
+                                            .ifInDiscards = Sum.InDiscards,
+                                            .ifInErrors = Sum.InErrors,
+                                            .ifHCInOctets = Sum.InOctets,
+                                            .ifHCInUcastPkts = Sum.InPackets,
+                                            .ifHCOutOctets = Sum.OutOctets,
+                                            .ifHCOutUcastPkts = Sum.OutPackets,
+                                            .ifOutErrors = Sum.OutErrors,
+                                            .ifOutDiscards = Sum.OutDiscards,
+                                            .ifHCInUcastOctets = Sum.InOctets,
+                                            .ifHCOutUcastOctets = Sum.OutOctets };
+        return TunOidQueryWriteBuf(OidRequest, &Statistics, (ULONG)sizeof(Statistics));
+    }
 
     case OID_GEN_INTERRUPT_MODERATION: {
         static const NDIS_INTERRUPT_MODERATION_PARAMETERS InterruptParameters = {
@@ -1294,6 +2966,21 @@ TunOidQuery(_Inout_ TUN_CTX *Ctx, _Inout_ NDIS_OID_REQUEST *OidRequest)
     case OID_PNP_QUERY_POWER:
         OidRequest->DATA.QUERY_INFORMATION.BytesNeeded = OidRequest->DATA.QUERY_INFORMATION.BytesWritten = 0;
         return NDIS_STATUS_SUCCESS;
+
+    case OID_OFFLOAD_ENCAPSULATION:
+        return TunOidQueryWriteBuf(OidRequest, &Ctx->OffloadEncapsulation, (ULONG)sizeof(Ctx->OffloadEncapsulation));
+
+    case OID_TCP_RSC_STATISTICS: {
+        TUN_CPU_STATISTICS Sum;
+        TunSumCpuStatistics(Ctx, &Sum);
+        NDIS_RSC_STATISTICS_INFO RscStatistics = { .Header = { .Type = NDIS_OBJECT_TYPE_DEFAULT,
+                                                               .Revision = NDIS_RSC_STATISTICS_REVISION_1,
+                                                               .Size = NDIS_SIZEOF_RSC_STATISTICS_REVISION_1 },
+                                                   .CoalescedPkts = Sum.RscCoalescedPackets,
+                                                   .CoalescedOctets = Sum.RscCoalescedOctets,
+                                                   .CoalesceEvents = Sum.RscCoalesceEvents };
+        return TunOidQueryWriteBuf(OidRequest, &RscStatistics, (ULONG)sizeof(RscStatistics));
+    }
     }
 
     OidRequest->DATA.QUERY_INFORMATION.BytesWritten = 0;
@@ -1327,6 +3014,24 @@ TunOidSet(_Inout_ TUN_CTX *Ctx, _Inout_ NDIS_OID_REQUEST *OidRequest)
     case OID_GEN_INTERRUPT_MODERATION:
         return NDIS_STATUS_INVALID_DATA;
 
+    case OID_OFFLOAD_ENCAPSULATION:
+        if (OidRequest->DATA.SET_INFORMATION.InformationBufferLength < NDIS_SIZEOF_OFFLOAD_ENCAPSULATION_REVISION_1)
+        {
+            OidRequest->DATA.SET_INFORMATION.BytesNeeded = NDIS_SIZEOF_OFFLOAD_ENCAPSULATION_REVISION_1;
+            return NDIS_STATUS_INVALID_LENGTH;
+        }
+        NdisMoveMemory(
+            &Ctx->OffloadEncapsulation,
+            OidRequest->DATA.SET_INFORMATION.InformationBuffer,
+            NDIS_SIZEOF_OFFLOAD_ENCAPSULATION_REVISION_1);
+        OidRequest->DATA.SET_INFORMATION.BytesRead = NDIS_SIZEOF_OFFLOAD_ENCAPSULATION_REVISION_1;
+        return NDIS_STATUS_SUCCESS;
+
+    case OID_TCP_OFFLOAD_PARAMETERS:
+        /* The offload configuration follows ring registration. See TunIndicateOffloadConfig(). */
+        OidRequest->DATA.SET_INFORMATION.BytesRead = OidRequest->DATA.SET_INFORMATION.InformationBufferLength;
+        return NDIS_STATUS_SUCCESS;
+
     case OID_PNP_SET_POWER:
         if (OidRequest->DATA.SET_INFORMATION.InformationBufferLength != sizeof(NDIS_DEVICE_POWER_STATE))
         {
@@ -1416,6 +3121,7 @@ TunUnload(PDRIVER_OBJECT DriverObject)
     NdisMDeregisterMiniportDriver(NdisMiniportDriverHandle);
     ExDeleteResourceLite(&TunDispatchCtxGuard);
     ExDeleteResourceLite(&TunDispatchDeviceListLock);
+    TraceLoggingUnregister(TunTraceProvider);
 }
 
 DRIVER_INITIALIZE DriverEntry;
@@ -1436,6 +3142,8 @@ DriverEntry(DRIVER_OBJECT *DriverObject, UNICODE_STRING *RegistryPath)
     if (NdisVersion > NDIS_MINIPORT_VERSION_MAX)
         NdisVersion = NDIS_MINIPORT_VERSION_MAX;
 
+    /* Tracing is optional, so failing to register the provider leaves it disabled. */
+    TraceLoggingRegister(TunTraceProvider);
     ExInitializeResourceLite(&TunDispatchCtxGuard);
     ExInitializeResourceLite(&TunDispatchDeviceListLock);
 
@@ -1493,5 +3201,6 @@ cleanupNotifier:
 cleanupResources:
     ExDeleteResourceLite(&TunDispatchCtxGuard);
     ExDeleteResourceLite(&TunDispatchDeviceListLock);
+    TraceLoggingUnregister(TunTraceProvider);
     return Status;
 }
@@ -0,0 +1,442 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Microbenchmarks of the ring code of wintun.dll, with the simulator standing in for the driver, so that changes to
+ * api/session.c can be measured without installing anything. Each scenario starts a session, has worker threads
+ * receive or send as fast as they can for a while, and reports the rate. The simulator checks the order of the packets
+ * it consumes, as do the receive workers, so that any scenario also verifies the ring protocol; mistakes are reported
+ * as errors and make the exit code nonzero.
+ *
+ * Scenarios without "contended" in the name run one worker per queue, with as many queues as threads. The contended
+ * ones run all threads on a single queue, taking the session locks. */
+
+#include "simulator.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Linked in from api/session.c rather than imported from wintun.dll. */
+WINTUN_START_SESSION_EX_FUNC WintunStartSessionEx;
+WINTUN_END_SESSION_FUNC WintunEndSession;
+WINTUN_GET_SESSION_QUEUE_FUNC WintunGetSessionQueue;
+WINTUN_GET_SESSION_STATISTICS_FUNC WintunGetSessionStatistics;
+WINTUN_WAIT_FOR_PACKETS_FUNC WintunWaitForPackets;
+WINTUN_RECEIVE_PACKETS_FUNC WintunReceivePackets;
+WINTUN_RELEASE_RECEIVE_PACKET_FUNC WintunReleaseReceivePacket;
+WINTUN_RELEASE_RECEIVE_PACKETS_FUNC WintunReleaseReceivePackets;
+WINTUN_ALLOCATE_SEND_PACKETS_FUNC WintunAllocateSendPackets;
+WINTUN_SEND_PACKET_FUNC WintunSendPacket;
+WINTUN_SEND_PACKETS_FUNC WintunSendPackets;
+
+#define MAX_BATCH 256
+
+typedef struct _SCENARIO
+{
+    const WCHAR *Name;
+    BOOL Receive;   /* Workers receive packets the simulator produces */
+    BOOL Send;      /* Workers send packets the simulator consumes */
+    BOOL Batched;   /* Workers use the configured batch size rather than one packet at a time */
+    BOOL Reverse;   /* Workers release or send each batch one packet at a time, last one first */
+    BOOL Contended; /* All workers share one queue */
+    BOOL Wrap;      /* Rings of the minimum capacity and packets of an odd size, for a wrap every few dozen packets */
+} SCENARIO;
+
+static const SCENARIO Scenarios[] = {
+    { L"receive", .Receive = TRUE },
+    { L"receive-batch", .Receive = TRUE, .Batched = TRUE },
+    { L"receive-reverse", .Receive = TRUE, .Batched = TRUE, .Reverse = TRUE },
+    { L"receive-contended", .Receive = TRUE, .Contended = TRUE },
+    { L"send", .Send = TRUE },
+    { L"send-batch", .Send = TRUE, .Batched = TRUE },
+    { L"send-reverse", .Send = TRUE, .Batched = TRUE, .Reverse = TRUE },
+    { L"send-contended", .Send = TRUE, .Contended = TRUE },
+    { L"wrap", .Receive = TRUE, .Send = TRUE, .Batched = TRUE, .Wrap = TRUE },
+};
+
+typedef struct _CONFIG
+{
+    DWORD PacketSize;
+    DWORD Capacity;
+    DWORD Threads;
+    DWORD Batch;
+    DWORD Flags;
+    DWORD Mtu;
+    DWORD Seconds;
+    DWORD SpinMicroseconds;
+    const WCHAR *Scenario;
+    const WCHAR *JsonPath;
+} CONFIG;
+
+typedef struct _RESULT
+{
+    DWORD PacketSize;
+    DWORD Capacity;
+    DWORD Batch;
+    double Seconds;
+    DWORD64 Packets;
+    DWORD64 Errors;
+    WINTUN_SESSION_STATISTICS Statistics;
+} RESULT;
+
+typedef struct DECLSPEC_CACHEALIGN _WORKER
+{
+    WINTUN_SESSION_HANDLE Session;
+    DWORD Index;
+    DWORD PacketSize;
+    DWORD Batch;
+    BOOL Reverse;
+    BOOL CheckOrder;
+    DWORD SpinMicroseconds;
+    HANDLE Thread;
+    volatile LONG64 Packets;
+    DWORD64 OutOfOrder;
+    DWORD Error;
+} WORKER;
+
+static volatile LONG Stopping;
+static const BYTE Template[WINTUN_MAX_IP_PACKET_SIZE];
+
+static DWORD WINAPI
+Receive(_Inout_ VOID *Context)
+{
+    WORKER *Worker = Context;
+    BYTE *Packets[MAX_BATCH];
+    DWORD PacketSizes[MAX_BATCH];
+    DWORD64 Expected = 0;
+    while (!ReadNoFence(&Stopping))
+    {
+        DWORD Count = WintunReceivePackets(Worker->Session, Packets, PacketSizes, Worker->Batch);
+        if (!Count)
+        {
+            if (GetLastError() != ERROR_NO_MORE_ITEMS)
+                return Worker->Error = LOG_LAST_ERROR(L"Failed to receive packets");
+            if (!WintunWaitForPackets(Worker->Session, Worker->SpinMicroseconds, 100) &&
+                GetLastError() != ERROR_TIMEOUT)
+                return Worker->Error = LOG_LAST_ERROR(L"Failed to wait for packets");
+            continue;
+        }
+        for (DWORD i = 0; Worker->CheckOrder && i < Count; ++i)
+        {
+            DWORD64 Sequence;
+            memcpy(&Sequence, Packets[i], sizeof(Sequence));
+            if (Sequence != Expected)
+                ++Worker->OutOfOrder;
+            Expected = Sequence + 1;
+        }
+        if (Worker->Reverse)
+        {
+            for (DWORD i = Count; i-- > 0;)
+                WintunReleaseReceivePacket(Worker->Session, Packets[i]);
+        }
+        else
+            WintunReleaseReceivePackets(Worker->Session, Packets, Count);
+        WriteNoFence64(&Worker->Packets, ReadNoFence64(&Worker->Packets) + Count);
+    }
+    return ERROR_SUCCESS;
+}
+
+static DWORD WINAPI
+Send(_Inout_ VOID *Context)
+{
+    WORKER *Worker = Context;
+    BYTE *Packets[MAX_BATCH];
+    DWORD PacketSizes[MAX_BATCH];
+    for (DWORD i = 0; i < Worker->Batch; ++i)
+        PacketSizes[i] = Worker->PacketSize;
+    DWORD64 Number = 0;
+    while (!ReadNoFence(&Stopping))
+    {
+        DWORD Count = WintunAllocateSendPackets(Worker->Session, Packets, PacketSizes, Worker->Batch);
+        if (!Count)
+        {
+            if (GetLastError() != ERROR_BUFFER_OVERFLOW)
+                return Worker->Error = LOG_LAST_ERROR(L"Failed to allocate packets");
+            YieldProcessor();
+            continue;
+        }
+        for (DWORD i = 0; i < Count; ++i)
+        {
+            const DWORD64 Sequence = SIMULATOR_SEQUENCE(Worker->Index, Number++);
+            memcpy(Packets[i], Template, Worker->PacketSize);
+            memcpy(Packets[i], &Sequence, sizeof(Sequence));
+        }
+        if (Worker->Reverse)
+        {
+            for (DWORD i = Count; i-- > 0;)
+                WintunSendPacket(Worker->Session, Packets[i]);
+        }
+        else
+            WintunSendPackets(Worker->Session, Packets, Count);
+        WriteNoFence64(&Worker->Packets, ReadNoFence64(&Worker->Packets) + Count);
+    }
+    return ERROR_SUCCESS;
+}
+
+static DWORD64
+CountPackets(_In_reads_(Count) WORKER *Workers, _In_ DWORD Count)
+{
+    DWORD64 Packets = 0;
+    for (DWORD i = 0; i < Count; ++i)
+        Packets += ReadNoFence64(&Workers[i].Packets);
+    return Packets;
+}
+
+static DWORD
+RunScenario(_In_ const CONFIG *Config, _In_ const SCENARIO *Scenario, _Out_ RESULT *Result)
+{
+    DWORD LastError = ERROR_SUCCESS;
+    const DWORD QueueCount = Scenario->Contended ? 1 : Config->Threads;
+    const DWORD Flags = Scenario->Contended ? Config->Flags & ~WINTUN_SESSION_FLAG_SINGLE_THREADED : Config->Flags;
+    ZeroMemory(Result, sizeof(*Result));
+    Result->PacketSize = Scenario->Wrap ? Config->PacketSize | 1 : Config->PacketSize;
+    Result->Capacity = Scenario->Wrap ? WINTUN_MIN_RING_CAPACITY : Config->Capacity;
+    Result->Batch = Scenario->Batched ? Config->Batch : 1;
+    WriteNoFence(&Stopping, FALSE);
+
+    WORKER *Workers = calloc(Config->Threads * 2, sizeof(*Workers));
+    if (!Workers)
+    {
+        LastError = LOG_ERROR(ERROR_OUTOFMEMORY, L"Failed to allocate workers");
+        goto cleanup;
+    }
+    WINTUN_SESSION_HANDLE Session =
+        WintunStartSessionEx(SimulatorAdapter(), Result->Capacity, QueueCount, Flags, NUMA_NO_PREFERRED_NODE);
+    if (!Session)
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to start session");
+        goto cleanupWorkers;
+    }
+    const SIMULATOR_PEER Peer = { .PacketSize = Scenario->Receive ? Result->PacketSize : 0,
+                                  .Consume = Scenario->Send,
+                                  .SpinMicroseconds = Config->SpinMicroseconds };
+    if (!SimulatorStartPeer(&Peer))
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to start simulator");
+        goto cleanupSession;
+    }
+    DWORD WorkerCount = 0;
+    for (DWORD Thread = 0; Thread < Config->Threads; ++Thread)
+    {
+        for (DWORD Direction = 0; Direction < 2; ++Direction)
+        {
+            if (!(Direction ? Scenario->Send : Scenario->Receive))
+                continue;
+            WORKER *Worker = &Workers[WorkerCount];
+            Worker->Session = WintunGetSessionQueue(Session, Scenario->Contended ? 0 : Thread);
+            Worker->Index = Thread;
+            Worker->PacketSize = Result->PacketSize;
+            Worker->Batch = Result->Batch;
+            Worker->Reverse = Scenario->Reverse;
+            Worker->CheckOrder = !Scenario->Contended;
+            Worker->SpinMicroseconds = Config->SpinMicroseconds;
+            Worker->Thread = CreateThread(NULL, 0, Direction ? Send : Receive, Worker, 0, NULL);
+            if (!Worker->Thread)
+            {
+                LastError = LOG_LAST_ERROR(L"Failed to create worker thread");
+                goto cleanupThreads;
+            }
+            ++WorkerCount;
+        }
+    }
+
+    /* Let the rings fill up once before measuring. */
+    Sleep(100);
+    LARGE_INTEGER Frequency, Start, End;
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    const DWORD64 StartPackets = CountPackets(Workers, WorkerCount);
+    Sleep(Config->Seconds * 1000);
+    const DWORD64 EndPackets = CountPackets(Workers, WorkerCount);
+    QueryPerformanceCounter(&End);
+    Result->Seconds = (double)(End.QuadPart - Start.QuadPart) / Frequency.QuadPart;
+    Result->Packets = EndPackets - StartPackets;
+
+cleanupThreads:
+    WriteNoFence(&Stopping, TRUE);
+    for (DWORD i = 0; i < WorkerCount; ++i)
+    {
+        WaitForSingleObject(Workers[i].Thread, INFINITE);
+        CloseHandle(Workers[i].Thread);
+        Result->Errors += Workers[i].OutOfOrder + (Workers[i].Error != ERROR_SUCCESS);
+    }
+    SimulatorStopPeer();
+    SIMULATOR_COUNTERS Counters;
+    SimulatorGetCounters(&Counters);
+    Result->Errors += Counters.InvalidPackets + Counters.OutOfOrder;
+    for (DWORD Index = 0; Index < QueueCount; ++Index)
+    {
+        WINTUN_SESSION_STATISTICS Statistics;
+        if (!WintunGetSessionStatistics(WintunGetSessionQueue(Session, Index), &Statistics))
+            continue;
+        Result->Statistics.Send.HighWater = max(Result->Statistics.Send.HighWater, Statistics.Send.HighWater);
+        Result->Statistics.Send.OverflowDrops += Statistics.Send.OverflowDrops;
+        Result->Statistics.Send.EventsSignaled += Statistics.Send.EventsSignaled;
+        Result->Statistics.Receive.HighWater = max(Result->Statistics.Receive.HighWater, Statistics.Receive.HighWater);
+        Result->Statistics.Receive.SpinHits += Statistics.Receive.SpinHits;
+        Result->Statistics.Receive.Waits += Statistics.Receive.Waits;
+        Result->Statistics.Receive.EventsSignaled += Statistics.Receive.EventsSignaled;
+    }
+cleanupSession:
+    WintunEndSession(Session);
+cleanupWorkers:
+    free(Workers);
+cleanup:
+    return LastError;
+}
+
+static VOID
+PrintResult(_In_ const SCENARIO *Scenario, _In_ const CONFIG *Config, _In_ const RESULT *Result)
+{
+    const double Mpps = Result->Seconds ? Result->Packets / Result->Seconds / 1e6 : 0.0;
+    wprintf(
+        L"%-18s %6u %10u %7u %5u %9.3f %9.1f %10llu %10llu %10llu %6llu\n",
+        Scenario->Name,
+        Result->PacketSize,
+        Result->Capacity,
+        Config->Threads,
+        Result->Batch,
+        Mpps,
+        Mpps ? 1e3 / Mpps : 0.0,
+        Result->Statistics.Send.OverflowDrops,
+        Result->Statistics.Send.EventsSignaled,
+        Result->Statistics.Receive.EventsSignaled,
+        Result->Errors);
+}
+
+static VOID
+WriteJsonResult(_In_ FILE *File, _In_ const SCENARIO *Scenario, _In_ const CONFIG *Config, _In_ const RESULT *Result)
+{
+    fwprintf(
+        File,
+        L"{\"scenario\":\"%s\",\"packet_size\":%u,\"ring_capacity\":%u,\"threads\":%u,\"batch\":%u,\"flags\":%u,"
+        L"\"seconds\":%.3f,\"packets\":%llu,\"mpps\":%.6f,\"send_ring_full\":%llu,\"send_events\":%llu,"
+        L"\"receive_events\":%llu,\"receive_spin_hits\":%llu,\"receive_waits\":%llu,\"errors\":%llu}\n",
+        Scenario->Name,
+        Result->PacketSize,
+        Result->Capacity,
+        Config->Threads,
+        Result->Batch,
+        Config->Flags,
+        Result->Seconds,
+        Result->Packets,
+        Result->Seconds ? Result->Packets / Result->Seconds / 1e6 : 0.0,
+        Result->Statistics.Send.OverflowDrops,
+        Result->Statistics.Send.EventsSignaled,
+        Result->Statistics.Receive.EventsSignaled,
+        Result->Statistics.Receive.SpinHits,
+        Result->Statistics.Receive.Waits,
+        Result->Errors);
+    fflush(File);
+}
+
+static BOOL
+ParseArguments(_In_ int argc, _In_reads_(argc) WCHAR **argv, _Out_ CONFIG *Config)
+{
+    *Config = (CONFIG){ .PacketSize = 64,
+                        .Capacity = 0x400000,
+                        .Threads = 1,
+                        .Batch = 32,
+                        .Mtu = 1500,
+                        .Seconds = 2,
+                        .SpinMicroseconds = 50 };
+    for (int i = 1; i < argc; ++i)
+    {
+        const WCHAR *Value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!_wcsicmp(argv[i], L"-single-threaded"))
+            Config->Flags |= WINTUN_SESSION_FLAG_SINGLE_THREADED;
+        else if (!_wcsicmp(argv[i], L"-mirrored"))
+            Config->Flags |= WINTUN_SESSION_FLAG_MIRRORED_RINGS;
+        else if (!_wcsicmp(argv[i], L"-timestamps"))
+            Config->Flags |= WINTUN_SESSION_FLAG_TIMESTAMPS;
+        else if (!_wcsicmp(argv[i], L"-metadata"))
+            Config->Flags |= WINTUN_SESSION_FLAG_METADATA;
+        else if (!Value)
+            return FALSE;
+        else if (!_wcsicmp(argv[i], L"-size"))
+            Config->PacketSize = wcstoul(argv[++i], NULL, 0);
+        else if (!_wcsicmp(argv[i], L"-capacity"))
+            Config->Capacity = wcstoul(argv[++i], NULL, 0);
+        else if (!_wcsicmp(argv[i], L"-threads"))
+            Config->Threads = wcstoul(argv[++i], NULL, 0);
+        else if (!_wcsicmp(argv[i], L"-batch"))
+            Config->Batch = wcstoul(argv[++i], NULL, 0);
+        else if (!_wcsicmp(argv[i], L"-mtu"))
+            Config->Mtu = wcstoul(argv[++i], NULL, 0);
+        else if (!_wcsicmp(argv[i], L"-seconds"))
+            Config->Seconds = wcstoul(argv[++i], NULL, 0);
+        else if (!_wcsicmp(argv[i], L"-spin"))
+            Config->SpinMicroseconds = wcstoul(argv[++i], NULL, 0);
+        else if (!_wcsicmp(argv[i], L"-scenario"))
+            Config->Scenario = argv[++i];
+        else if (!_wcsicmp(argv[i], L"-json"))
+            Config->JsonPath = argv[++i];
+        else
+            return FALSE;
+    }
+    /* Packets carry a sequence number, and odd-sized ones for the wrap scenario must still fit the MTU. */
+    return Config->PacketSize >= sizeof(DWORD64) && (Config->PacketSize | 1) <= Config->Mtu &&
+           Config->Mtu <= WINTUN_MAX_IP_PACKET_SIZE && Config->Threads && Config->Threads <= SIMULATOR_MAX_THREADS &&
+           Config->Threads <= WINTUN_MAX_QUEUES && Config->Batch && Config->Batch <= MAX_BATCH && Config->Seconds;
+}
+
+int __cdecl wmain(int argc, WCHAR **argv)
+{
+    CONFIG Config;
+    if (!ParseArguments(argc, argv, &Config))
+    {
+        fwprintf(
+            stderr,
+            L"Usage: %s [-scenario name] [-size 64] [-capacity 0x400000] [-threads 1] [-batch 32] [-mtu 1500]\n"
+            L"       [-seconds 2] [-spin 50] [-single-threaded] [-mirrored] [-timestamps] [-metadata]\n"
+            L"       [-json results.jsonl]\n",
+            argv[0]);
+        return ERROR_INVALID_PARAMETER;
+    }
+    SimulatorInitialize(Config.Mtu);
+    TraceLoggingRegister(TraceProvider);
+
+    DWORD LastError = ERROR_SUCCESS;
+    FILE *Json = NULL;
+    if (Config.JsonPath && _wfopen_s(&Json, Config.JsonPath, L"w"))
+    {
+        LastError = LOG_ERROR(ERROR_OPEN_FAILED, L"Failed to open results file");
+        goto cleanup;
+    }
+    wprintf(
+        L"%-18s %6s %10s %7s %5s %9s %9s %10s %10s %10s %6s\n",
+        L"scenario",
+        L"size",
+        L"capacity",
+        L"threads",
+        L"batch",
+        L"Mpps",
+        L"ns/pkt",
+        L"ring-full",
+        L"send-evts",
+        L"recv-evts",
+        L"errors");
+    BOOL Ran = FALSE, Failed = FALSE;
+    for (DWORD i = 0; i < _countof(Scenarios) && LastError == ERROR_SUCCESS; ++i)
+    {
+        if (Config.Scenario && _wcsicmp(Config.Scenario, Scenarios[i].Name))
+            continue;
+        RESULT Result;
+        if ((LastError = RunScenario(&Config, &Scenarios[i], &Result)) != ERROR_SUCCESS)
+            break;
+        PrintResult(&Scenarios[i], &Config, &Result);
+        if (Json)
+            WriteJsonResult(Json, &Scenarios[i], &Config, &Result);
+        Ran = TRUE;
+        Failed |= Result.Errors != 0;
+    }
+    if (LastError == ERROR_SUCCESS && !Ran)
+        LastError = LOG_ERROR(ERROR_NOT_FOUND, L"No such scenario");
+    else if (LastError == ERROR_SUCCESS && Failed)
+        LastError = LOG_ERROR(ERROR_INVALID_DATA, L"Ring protocol errors detected");
+    if (Json)
+        fclose(Json);
+cleanup:
+    TraceLoggingUnregister(TraceProvider);
+    return LastError;
+}
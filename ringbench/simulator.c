@@ -0,0 +1,465 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Plays the driver's part of the ring protocol in-process: a producer thread per queue fills the send ring the way
+ * TunSendNetBufferLists does, and a consumer thread per queue drains the receive ring the way TunProcessReceiveData
+ * does, waiting on TailMoved with the Alertable handshake once the ring has been empty for a while. */
+
+#include "simulator.h"
+#include <stdio.h>
+
+/* Packets the producer puts into a ring before moving its tail, like an NBL chain of the stack. */
+#define SIMULATOR_SEND_BATCH 32
+
+/* Each thread only writes to its own half. Counters are read once the threads are gone, or racily for statistics. */
+typedef struct _SIMULATOR_QUEUE
+{
+    DECLSPEC_CACHEALIGN struct
+    {
+        TUN_RING_V2 *Ring;
+        ULONG Capacity;
+        HANDLE TailMoved;
+        HANDLE Thread;
+        DWORD64 Produced;
+        DWORD64 RingFull;
+        DWORD64 HighWater;
+        DWORD64 EventsSignaled;
+    } Send;
+    DECLSPEC_CACHEALIGN struct
+    {
+        TUN_RING_V2 *Ring;
+        ULONG Capacity;
+        HANDLE TailMoved;
+        HANDLE Thread;
+        DWORD64 Consumed;
+        DWORD64 InvalidPackets;
+        DWORD64 OutOfOrder;
+        DWORD64 HighWater;
+        DWORD64 SpinHits;
+        DWORD64 Waits;
+        DWORD64 NextSequence[SIMULATOR_MAX_THREADS];
+    } Receive;
+} SIMULATOR_QUEUE;
+
+static struct
+{
+    WINTUN_ADAPTER Adapter;
+    DWORD Mtu;
+    HANDLE Device;
+    ULONG Flags;
+    ULONG QueueCount;
+    ULONG PrefixSize;
+    ULONG MaxPacketSize;
+    SIMULATOR_PEER Peer;
+    volatile LONG Stopping;
+    SIMULATOR_QUEUE *Queues;
+} Simulator;
+
+/* The globals of wintun.dll session.c uses, normally set up by DllMain and logger.c. */
+HANDLE ModuleHeap;
+SECURITY_ATTRIBUTES SecurityAttributes = { .nLength = sizeof(SECURITY_ATTRIBUTES) };
+TRACELOGGING_DEFINE_PROVIDER(
+    TraceProvider,
+    "WireGuard.Wintun",
+    (0x4cde0898, 0x3b76, 0x5f71, 0x63, 0x7e, 0x2c, 0xbc, 0x42, 0xcd, 0xd1, 0x63));
+
+_Use_decl_annotations_
+DWORD
+LoggerLogV(WINTUN_LOGGER_LEVEL Level, LPCWSTR Format, va_list Args)
+{
+    DWORD LastError = GetLastError();
+    fwprintf(stderr, L"[%c] ", Level == WINTUN_LOG_ERR ? L'!' : Level == WINTUN_LOG_WARN ? L'-' : L'+');
+    vfwprintf(stderr, Format, Args);
+    fwprintf(stderr, L"\n");
+    SetLastError(LastError);
+    return LastError;
+}
+
+_Use_decl_annotations_
+DWORD
+LoggerErrorV(DWORD Error, LPCWSTR Format, va_list Args)
+{
+    fwprintf(stderr, L"[!] ");
+    vfwprintf(stderr, Format, Args);
+    fwprintf(stderr, L" (Code 0x%08X)\n", Error);
+    SetLastError(Error);
+    return Error;
+}
+
+_Use_decl_annotations_
+VOID WINAPI
+WintunGetAdapterLUID(WINTUN_ADAPTER *Adapter, NET_LUID *Luid)
+{
+    UNREFERENCED_PARAMETER(Adapter);
+    Luid->Value = 0;
+}
+
+_Use_decl_annotations_
+DWORD WINAPI
+SimulatorGetIfEntry2(MIB_IF_ROW2 *Row)
+{
+    Row->Mtu = Simulator.Mtu;
+    return NO_ERROR;
+}
+
+_Use_decl_annotations_
+VOID
+SimulatorInitialize(DWORD Mtu)
+{
+    ModuleHeap = GetProcessHeap();
+    Simulator.Mtu = Mtu;
+}
+
+WINTUN_ADAPTER *
+SimulatorAdapter(VOID)
+{
+    return &Simulator.Adapter;
+}
+
+static VOID
+UpdateHighWater(_Inout_ DWORD64 *HighWater, _In_ ULONG Content)
+{
+    if (Content > *HighWater)
+        *HighWater = Content;
+}
+
+/* Keeps the send ring as full as the client lets it be. Where the driver would drop packets on a full ring, the
+ * producer waits for room instead, so that every packet reaches the client in sequence. */
+static DWORD WINAPI
+Produce(_Inout_ VOID *Context)
+{
+    SIMULATOR_QUEUE *Queue = Context;
+    TUN_RING_V2 *Ring = Queue->Send.Ring;
+    const ULONG Capacity = Queue->Send.Capacity;
+    const ULONG PacketSize = Simulator.PrefixSize + Simulator.Peer.PacketSize;
+    const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + PacketSize);
+    /* Packets get copied out of an NBL by the driver, so they get copied out of a template here. */
+    BYTE Template[WINTUN_MAX_IP_PACKET_SIZE] = { 0 };
+    ULONG Tail = 0;
+    DWORD64 Sequence = 0;
+    while (!ReadNoFence(&Simulator.Stopping))
+    {
+        const ULONG Head = ReadULongAcquire(&Ring->Head);
+        if (Head >= Capacity)
+            break;
+        ULONG Space = TUN_RING_WRAP(Head - Tail - TUN_ALIGNMENT, Capacity);
+        if (Space < AlignedPacketSize)
+        {
+            ++Queue->Send.RingFull;
+            YieldProcessor();
+            continue;
+        }
+        LARGE_INTEGER Now = { 0 };
+        if (Simulator.Flags & TUN_REGISTER_FLAG_TIMESTAMP)
+            QueryPerformanceCounter(&Now);
+        for (ULONG Count = 0; Count < SIMULATOR_SEND_BATCH && Space >= AlignedPacketSize; ++Count)
+        {
+            TUN_PACKET *Packet = (TUN_PACKET *)&Ring->Data[Tail];
+            Packet->Size = PacketSize;
+            ZeroMemory(Packet->Data, Simulator.PrefixSize);
+            if (Simulator.Flags & TUN_REGISTER_FLAG_TIMESTAMP)
+                memcpy(Packet->Data, &Now.QuadPart, sizeof(Now.QuadPart));
+            BYTE *Payload = Packet->Data + Simulator.PrefixSize;
+            memcpy(Payload, Template, Simulator.Peer.PacketSize);
+            if (Simulator.Peer.PacketSize >= sizeof(Sequence))
+                memcpy(Payload, &Sequence, sizeof(Sequence));
+            ++Sequence;
+            Tail = TUN_RING_WRAP(Tail + AlignedPacketSize, Capacity);
+            Space -= AlignedPacketSize;
+            ++Queue->Send.Produced;
+        }
+        UpdateHighWater(&Queue->Send.HighWater, TUN_RING_WRAP(Tail - Head, Capacity));
+        WriteULongRelease(&Ring->Tail, Tail);
+        /* Order the tail store before the Alertable load, against the client's store to Alertable and tail load. */
+        MemoryBarrier();
+        if (ReadNoFence(&Ring->Alertable))
+        {
+            SetEvent(Queue->Send.TailMoved);
+            ++Queue->Send.EventsSignaled;
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+/* Returns whether the packet is one the client may hand to the driver, and checks its sequence number. */
+static BOOL
+ConsumePacket(_Inout_ SIMULATOR_QUEUE *Queue, _In_ const TUN_PACKET *Packet, _In_ ULONG Content)
+{
+    if (Content < sizeof(TUN_PACKET) || (Packet->Size & (TUN_PACKET_RELEASE | TUN_PACKET_SIZE_DESCRIPTOR)) ||
+        Packet->Size > Simulator.MaxPacketSize || Packet->Size < Simulator.PrefixSize ||
+        TUN_ALIGN(sizeof(TUN_PACKET) + Packet->Size) > Content)
+        return FALSE;
+    const ULONG PayloadSize = Packet->Size - Simulator.PrefixSize;
+    if (PayloadSize >= sizeof(DWORD64))
+    {
+        DWORD64 Sequence;
+        memcpy(&Sequence, Packet->Data + Simulator.PrefixSize, sizeof(Sequence));
+        const DWORD Thread = SIMULATOR_SEQUENCE_THREAD(Sequence);
+        const DWORD64 Number = SIMULATOR_SEQUENCE_NUMBER(Sequence);
+        if (Thread >= SIMULATOR_MAX_THREADS || Number != Queue->Receive.NextSequence[Thread])
+            ++Queue->Receive.OutOfOrder;
+        if (Thread < SIMULATOR_MAX_THREADS)
+            Queue->Receive.NextSequence[Thread] = Number + 1;
+    }
+    ++Queue->Receive.Consumed;
+    return TRUE;
+}
+
+static DWORD WINAPI
+Consume(_Inout_ VOID *Context)
+{
+    SIMULATOR_QUEUE *Queue = Context;
+    TUN_RING_V2 *Ring = Queue->Receive.Ring;
+    const ULONG Capacity = Queue->Receive.Capacity;
+    LARGE_INTEGER Frequency;
+    QueryPerformanceFrequency(&Frequency);
+    const ULONG64 SpinMax = (ULONG64)Frequency.QuadPart * Simulator.Peer.SpinMicroseconds / 1000000;
+    ULONG Head = 0;
+    while (!ReadNoFence(&Simulator.Stopping))
+    {
+        ULONG Tail = ReadULongAcquire(&Ring->Tail);
+        if (Head == Tail)
+        {
+            LARGE_INTEGER SpinStart, SpinNow;
+            QueryPerformanceCounter(&SpinStart);
+            for (;;)
+            {
+                YieldProcessor();
+                Tail = ReadULongAcquire(&Ring->Tail);
+                if (Head != Tail)
+                {
+                    ++Queue->Receive.SpinHits;
+                    break;
+                }
+                QueryPerformanceCounter(&SpinNow);
+                if ((ULONG64)(SpinNow.QuadPart - SpinStart.QuadPart) >= SpinMax)
+                    break;
+            }
+            if (Head == Tail)
+            {
+                WriteRelease(&Ring->Alertable, TRUE);
+                Tail = ReadULongAcquire(&Ring->Tail);
+                if (Head == Tail)
+                {
+                    ++Queue->Receive.Waits;
+                    /* Times out to notice the simulator stopping. */
+                    WaitForSingleObject(Queue->Receive.TailMoved, 100);
+                    WriteRelease(&Ring->Alertable, FALSE);
+                    continue;
+                }
+                WriteRelease(&Ring->Alertable, FALSE);
+                ResetEvent(Queue->Receive.TailMoved);
+            }
+        }
+        if (Tail >= Capacity)
+            break;
+        UpdateHighWater(&Queue->Receive.HighWater, TUN_RING_WRAP(Tail - Head, Capacity));
+        while (Head != Tail)
+        {
+            const TUN_PACKET *Packet = (const TUN_PACKET *)&Ring->Data[Head];
+            if (!ConsumePacket(Queue, Packet, TUN_RING_WRAP(Tail - Head, Capacity)))
+            {
+                /* The driver gives up on a corrupt ring, and so does the simulator. */
+                ++Queue->Receive.InvalidPackets;
+                return ERROR_INVALID_DATA;
+            }
+            Head = TUN_RING_WRAP(Head + TUN_ALIGN(sizeof(TUN_PACKET) + Packet->Size), Capacity);
+        }
+        WriteULongRelease(&Ring->Head, Head);
+    }
+    return ERROR_SUCCESS;
+}
+
+_Use_decl_annotations_
+HANDLE WINAPI
+SimulatorOpenDeviceObject(const WINTUN_ADAPTER *Adapter)
+{
+    UNREFERENCED_PARAMETER(Adapter);
+    /* Any handle does, as long as session.c can close it. */
+    return CreateEventW(NULL, TRUE, FALSE, NULL);
+}
+
+static ULONG
+RingCapacity(_In_ ULONG RingSize)
+{
+    if (Simulator.Flags & TUN_REGISTER_FLAG_MIRRORED)
+        return (RingSize - sizeof(TUN_RING_V2)) / 2;
+    return RingSize - sizeof(TUN_RING_V2) - (TUN_ALIGN(sizeof(TUN_PACKET) + Simulator.MaxPacketSize) - TUN_ALIGNMENT);
+}
+
+static BOOL
+IsValidCapacity(_In_ ULONG Capacity)
+{
+    return !(Capacity & (Capacity - 1)) &&
+           Capacity >= min(2 * (Simulator.MaxPacketSize + 1), WINTUN_MIN_RING_CAPACITY) &&
+           Capacity <= WINTUN_MAX_RING_CAPACITY;
+}
+
+static DWORD
+RegisterQueues(_In_ HANDLE Device, _In_reads_bytes_(Size) const TUN_REGISTER_QUEUES *Rqb, _In_ DWORD Size)
+{
+    if (Size < sizeof(*Rqb) || !Rqb->QueueCount || Rqb->QueueCount > WINTUN_MAX_QUEUES ||
+        Size < sizeof(*Rqb) + sizeof(TUN_REGISTER_RINGS) * Rqb->QueueCount || !(Rqb->Flags & TUN_REGISTER_FLAG_RING_V2))
+        return ERROR_INVALID_PARAMETER;
+    /* Buffer regions need the region mapped and completion rings served, which the simulator does not do. */
+    if (Rqb->Flags & TUN_REGISTER_FLAG_BUFFER_REGION)
+        return ERROR_NOT_SUPPORTED;
+    if (Simulator.Queues && Simulator.Device != Device)
+        return ERROR_ALREADY_INITIALIZED;
+    SIMULATOR_QUEUE *Queues = VirtualAlloc(
+        NULL, sizeof(SIMULATOR_QUEUE) * Rqb->QueueCount, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!Queues)
+        return GetLastError();
+    Simulator.Flags = Rqb->Flags;
+    Simulator.PrefixSize = (Rqb->Flags & TUN_REGISTER_FLAG_TIMESTAMP ? sizeof(LONG64) : 0) +
+                           (Rqb->Flags & TUN_REGISTER_FLAG_METADATA ? sizeof(WINTUN_PACKET_METADATA) : 0);
+    Simulator.MaxPacketSize =
+        Rqb->MaxPacketSize ? Rqb->MaxPacketSize : WINTUN_MAX_IP_PACKET_SIZE + Simulator.PrefixSize;
+    for (ULONG Index = 0; Index < Rqb->QueueCount; ++Index)
+    {
+        const TUN_REGISTER_RINGS *Rrb = &Rqb->Queues[Index];
+        Queues[Index].Send.Ring = Rrb->Send.RingV2;
+        Queues[Index].Send.Capacity = RingCapacity(Rrb->Send.RingSize);
+        Queues[Index].Send.TailMoved = Rrb->Send.TailMoved;
+        Queues[Index].Receive.Ring = Rrb->Receive.RingV2;
+        Queues[Index].Receive.Capacity = RingCapacity(Rrb->Receive.RingSize);
+        Queues[Index].Receive.TailMoved = Rrb->Receive.TailMoved;
+        /* As the driver checks them, for the ring arithmetic to work at all. */
+        if (!IsValidCapacity(Queues[Index].Send.Capacity) || !IsValidCapacity(Queues[Index].Receive.Capacity))
+        {
+            VirtualFree(Queues, 0, MEM_RELEASE);
+            return ERROR_INVALID_PARAMETER;
+        }
+    }
+    if (Simulator.Queues)
+        VirtualFree(Simulator.Queues, 0, MEM_RELEASE);
+    Simulator.Device = Device;
+    Simulator.QueueCount = Rqb->QueueCount;
+    Simulator.Queues = Queues;
+    return ERROR_SUCCESS;
+}
+
+static DWORD
+GetStatistics(
+    _In_reads_bytes_(InSize) const ULONG *QueueIndex,
+    _In_ DWORD InSize,
+    _Out_writes_bytes_(OutSize) TUN_QUEUE_STATISTICS *Statistics,
+    _In_ DWORD OutSize)
+{
+    if (InSize < sizeof(*QueueIndex) || OutSize < sizeof(*Statistics) || !Simulator.Queues ||
+        *QueueIndex >= Simulator.QueueCount)
+        return ERROR_INVALID_PARAMETER;
+    const SIMULATOR_QUEUE *Queue = &Simulator.Queues[*QueueIndex];
+    ZeroMemory(Statistics, sizeof(*Statistics));
+    Statistics->Send.HighWater = Queue->Send.HighWater;
+    Statistics->Send.OverflowDrops = Queue->Send.RingFull;
+    Statistics->Send.EventsSignaled = Queue->Send.EventsSignaled;
+    Statistics->Receive.HighWater = Queue->Receive.HighWater;
+    Statistics->Receive.InvalidDrops = Queue->Receive.InvalidPackets;
+    Statistics->Receive.SpinHits = Queue->Receive.SpinHits;
+    Statistics->Receive.Waits = Queue->Receive.Waits;
+    return ERROR_SUCCESS;
+}
+
+_Use_decl_annotations_
+BOOL WINAPI
+SimulatorDeviceIoControl(
+    HANDLE Device,
+    DWORD IoControlCode,
+    VOID *InBuffer,
+    DWORD InBufferSize,
+    VOID *OutBuffer,
+    DWORD OutBufferSize,
+    DWORD *BytesReturned,
+    OVERLAPPED *Overlapped)
+{
+    DWORD LastError;
+    if (BytesReturned)
+        *BytesReturned = 0;
+    if (Overlapped)
+        LastError = ERROR_NOT_SUPPORTED;
+    else if (IoControlCode == TUN_IOCTL_REGISTER_QUEUES)
+        LastError = RegisterQueues(Device, InBuffer, InBufferSize);
+    else if (IoControlCode == TUN_IOCTL_GET_STATISTICS)
+    {
+        LastError = GetStatistics(InBuffer, InBufferSize, OutBuffer, OutBufferSize);
+        if (LastError == ERROR_SUCCESS && BytesReturned)
+            *BytesReturned = sizeof(TUN_QUEUE_STATISTICS);
+    }
+    else
+        LastError = ERROR_INVALID_FUNCTION;
+    return RET_ERROR(TRUE, LastError);
+}
+
+_Use_decl_annotations_
+BOOL
+SimulatorStartPeer(const SIMULATOR_PEER *Peer)
+{
+    DWORD LastError;
+    if (!Simulator.Queues || Peer->PacketSize > Simulator.MaxPacketSize - Simulator.PrefixSize)
+    {
+        LastError = ERROR_INVALID_PARAMETER;
+        goto cleanup;
+    }
+    Simulator.Peer = *Peer;
+    WriteNoFence(&Simulator.Stopping, FALSE);
+    for (ULONG Index = 0; Index < Simulator.QueueCount; ++Index)
+    {
+        SIMULATOR_QUEUE *Queue = &Simulator.Queues[Index];
+        if ((Peer->PacketSize && !(Queue->Send.Thread = CreateThread(NULL, 0, Produce, Queue, 0, NULL))) ||
+            (Peer->Consume && !(Queue->Receive.Thread = CreateThread(NULL, 0, Consume, Queue, 0, NULL))))
+        {
+            LastError = GetLastError();
+            goto cleanupThreads;
+        }
+    }
+    return TRUE;
+cleanupThreads:
+    SimulatorStopPeer();
+cleanup:
+    SetLastError(LastError);
+    return FALSE;
+}
+
+static VOID
+JoinThread(_Inout_ HANDLE *Thread)
+{
+    if (!*Thread)
+        return;
+    WaitForSingleObject(*Thread, INFINITE);
+    CloseHandle(*Thread);
+    *Thread = NULL;
+}
+
+VOID
+SimulatorStopPeer(VOID)
+{
+    if (!Simulator.Queues)
+        return;
+    WriteNoFence(&Simulator.Stopping, TRUE);
+    for (ULONG Index = 0; Index < Simulator.QueueCount; ++Index)
+    {
+        SIMULATOR_QUEUE *Queue = &Simulator.Queues[Index];
+        SetEvent(Queue->Receive.TailMoved);
+        JoinThread(&Queue->Send.Thread);
+        JoinThread(&Queue->Receive.Thread);
+    }
+}
+
+_Use_decl_annotations_
+VOID
+SimulatorGetCounters(SIMULATOR_COUNTERS *Counters)
+{
+    ZeroMemory(Counters, sizeof(*Counters));
+    for (ULONG Index = 0; Simulator.Queues && Index < Simulator.QueueCount; ++Index)
+    {
+        const SIMULATOR_QUEUE *Queue = &Simulator.Queues[Index];
+        Counters->Produced += Queue->Send.Produced;
+        Counters->Consumed += Queue->Receive.Consumed;
+        Counters->SendRingFull += Queue->Send.RingFull;
+        Counters->InvalidPackets += Queue->Receive.InvalidPackets;
+        Counters->OutOfOrder += Queue->Receive.OutOfOrder;
+    }
+}
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Force-included into api/session.c, which then talks to the simulator instead of the driver. Everything
+ * session.c includes is included first, so that only the code of session.c itself sees the names redirected. */
+
+#pragma once
+
+#include "adapter.h"
+#include "logger.h"
+#include "main.h"
+#include "wintun.h"
+#include <Windows.h>
+#include <winternl.h>
+#include <devioctl.h>
+#include <iphlpapi.h>
+#include "protocol.h"
+
+/**
+ * Largest number of threads a simulated receive ring tells apart when checking the order of packets.
+ */
+#define SIMULATOR_MAX_THREADS 64
+
+/**
+ * Packets the simulator produces and the ones it expects start with a sequence number: the lower 48 bits count the
+ * packets of a thread, and the upper 16 bits are the thread's index.
+ */
+#define SIMULATOR_SEQUENCE(Thread, Number) (((DWORD64)(Thread) << 48) | ((DWORD64)(Number) & ((1ULL << 48) - 1)))
+#define SIMULATOR_SEQUENCE_THREAD(Sequence) ((DWORD)((Sequence) >> 48))
+#define SIMULATOR_SEQUENCE_NUMBER(Sequence) ((Sequence) & ((1ULL << 48) - 1))
+
+/**
+ * What the simulated driver does with the rings of the session registered last.
+ */
+typedef struct _SIMULATOR_PEER
+{
+    DWORD PacketSize;       /**< Size of the packets to keep the send rings filled with, or 0 to leave them empty */
+    BOOL Consume;           /**< Whether to drain the receive rings */
+    DWORD SpinMicroseconds; /**< Time to spin on an empty receive ring before waiting on it, like the driver does */
+} SIMULATOR_PEER;
+
+/**
+ * Simulator counters, summed over all queues.
+ */
+typedef struct _SIMULATOR_COUNTERS
+{
+    DWORD64 Produced;       /**< Packets put into the send rings */
+    DWORD64 Consumed;       /**< Packets taken out of the receive rings */
+    DWORD64 SendRingFull;   /**< Times a send ring had no room, where the driver would have dropped */
+    DWORD64 InvalidPackets; /**< Receive ring packets that did not parse, which stop the queue */
+    DWORD64 OutOfOrder;     /**< Receive ring packets whose sequence number was not the next of their thread */
+} SIMULATOR_COUNTERS;
+
+/**
+ * Sets up the globals of wintun.dll session.c relies on, and the MTU the simulated adapter reports.
+ */
+VOID
+SimulatorInitialize(_In_ DWORD Mtu);
+
+/**
+ * Returns the adapter to start sessions on.
+ */
+WINTUN_ADAPTER *
+SimulatorAdapter(VOID);
+
+/**
+ * Starts the simulated driver threads on the rings of the session registered last.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError.
+ */
+_Return_type_success_(return != FALSE)
+BOOL
+SimulatorStartPeer(_In_ const SIMULATOR_PEER *Peer);
+
+/**
+ * Stops the simulated driver threads. Must be called before the session ends.
+ */
+VOID
+SimulatorStopPeer(VOID);
+
+/**
+ * Retrieves the counters of the session registered last.
+ */
+VOID
+SimulatorGetCounters(_Out_ SIMULATOR_COUNTERS *Counters);
+
+_Return_type_success_(return != INVALID_HANDLE_VALUE)
+HANDLE WINAPI
+SimulatorOpenDeviceObject(_In_ const WINTUN_ADAPTER *Adapter);
+
+_Success_(return != FALSE)
+BOOL WINAPI
+SimulatorDeviceIoControl(
+    _In_ HANDLE Device,
+    _In_ DWORD IoControlCode,
+    _In_reads_bytes_opt_(InBufferSize) VOID *InBuffer,
+    _In_ DWORD InBufferSize,
+    _Out_writes_bytes_to_opt_(OutBufferSize, *BytesReturned) VOID *OutBuffer,
+    _In_ DWORD OutBufferSize,
+    _Out_opt_ DWORD *BytesReturned,
+    _Inout_opt_ OVERLAPPED *Overlapped);
+
+DWORD WINAPI
+SimulatorGetIfEntry2(_Inout_ MIB_IF_ROW2 *Row);
+
+#ifdef SIMULATOR_REDIRECT
+#    define AdapterOpenDeviceObject SimulatorOpenDeviceObject
+#    define DeviceIoControl SimulatorDeviceIoControl
+#    define GetIfEntry2 SimulatorGetIfEntry2
+#endif